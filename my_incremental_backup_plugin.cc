@@ -21,6 +21,29 @@
 #include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+/* io_uring is driven through raw system calls; older headers build the threaded engine only */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define BACKUP_HAVE_IO_URING 1
+#endif
+#endif
 
 /* MySQL plugin structures */
 struct st_mysql_plugin {
@@ -50,8 +73,553 @@ typedef struct {
   int (*validate_backup)(void *ctx, const char *backup_dir, const char *backup_name);
   void *(*create_context)(void);
   void (*destroy_context)(void *ctx);
+  int (*set_option)(void *ctx, const char *name, const char *value);
 } st_mysql_incremental_backup_descriptor;
 
+/* One file of the data directory */
+typedef struct {
+  char *path; /* relative to the data directory */
+  long long size;
+  long long mtime; /* nanoseconds */
+  mode_t mode;
+} BackupFile;
+
+/* Files found in the data directory */
+typedef struct {
+  BackupFile *files;
+  int count;
+  int size;
+} BackupFileList;
+
+/* Page state of one data file, as of one backup */
+typedef struct {
+  char *path;
+  long long size;
+  long long mtime; /* nanoseconds */
+  unsigned int page_count;
+  unsigned int flags;       /* BACKUP_PAGE_MAP_* */
+  unsigned long long *lsns; /* page LSN, 0 for pages without one */
+  unsigned int *crcs;       /* CRC32C of each page */
+  unsigned char *changed;   /* bit set: page stored in this backup */
+  int tablespace;           /* named like an InnoDB tablespace, not stored */
+  long long space_id;       /* space id of its pages, -1 until one is seen; not stored */
+} PageMapFile;
+
+/* Page state of a whole backup, sorted by path */
+typedef struct {
+  PageMapFile *files;
+  int count;
+  int size;
+} PageMap;
+
+/* Checksums of one block of a file version, as rsync matches them */
+typedef struct {
+  unsigned int weak;        /* rolling checksum */
+  unsigned char strong[8];  /* leading bytes of the SHA-256 */
+} SignatureBlock;
+
+/* Block signature of one file version */
+typedef struct {
+  long long size;
+  unsigned int count;       /* whole blocks of the file */
+  unsigned int filled;      /* blocks hashed so far */
+  SignatureBlock *blocks;   /* allocated by the first block hashed */
+  int invalid;              /* InnoDB pages seen, or no memory: not saved */
+} Signature;
+
+/* Where one file's signature sits in a signature file */
+typedef struct {
+  char *path;
+  long long offset;
+} SignatureEntry;
+
+/* Signatures saved by one backup, sorted by path */
+typedef struct {
+  SignatureEntry *entries;
+  int count;
+  int size;
+  FILE *fp;
+} SignatureIndex;
+
+/* A block of the parent's signature, ordered by weak checksum for lookup */
+typedef struct {
+  unsigned int weak;
+  unsigned int block;
+} RsyncMatch;
+
+/* One checksummed range of a stored file */
+typedef struct {
+  long long offset;
+  unsigned int length;
+  unsigned int crc; /* CRC32C */
+} ManifestBlock;
+
+/* A file stored in the backup and the Merkle leaf over its blocks */
+typedef struct {
+  char *path; /* relative to the backup */
+  long long size;
+  ManifestBlock *blocks;
+  int block_count;
+  int block_size;
+  unsigned char leaf[SHA256_DIGEST_LENGTH];
+} ManifestFile;
+
+/* Block checksums of a whole backup, sorted by path once saved */
+typedef struct {
+  ManifestFile *files;
+  int count;
+  int size;
+} Manifest;
+
+/* Counters of the last backup run */
+typedef struct {
+  long long bytes;
+  int files;
+  int cloned_files;
+  int unchanged_files;
+  long long scanned_pages;
+  long long changed_pages;
+  long long chunks;
+  long long new_chunks;
+  long long chunk_bytes;
+  long long hole_bytes; /* left in holes: neither read nor stored */
+  int rsync_files;
+  long long rsync_copied_bytes; /* taken from the parent's copy by rsync deltas */
+} BackupStats;
+
+/* Random access to a frame file */
+typedef struct {
+  int fd;
+  int frame_count;
+  unsigned int *raw_lengths;
+  unsigned int *stored_lengths; /* shares the raw_lengths allocation */
+  long long *raw_offsets;       /* frame_count + 1 entries */
+  long long *stored_offsets;    /* shares the raw_offsets allocation */
+  long long raw_size;
+  unsigned char *raw;           /* last decompressed frame */
+  unsigned char *stored;
+  int cached_frame;
+  z_stream stream;
+  int stream_ready;
+} FrameReader;
+
+/* Progress of one file of a backup, as far as a checkpoint made it durable */
+typedef struct {
+  int mode;                  /* BACKUP_JOB_* */
+  int done;
+  unsigned int blocks;       /* pipeline blocks stored */
+  long long stored;          /* bytes of the stored file */
+  PageMapFile *entry;        /* live page state */
+  ManifestFile *checksums;   /* live block checksums, NULL for none */
+  unsigned int *frame_raw;   /* live seek table */
+  unsigned int *frame_stored;
+  int frame_count;
+  unsigned int saved_pages;  /* already in the checkpoint file */
+  int saved_done;
+  int saved_frames;
+  int saved_blocks;          /* of the checksums */
+  PageMapFile pages;         /* loaded from the checkpoint, until restored */
+  ManifestFile sums;
+  unsigned int *loaded_raw;
+  unsigned int *loaded_stored;
+} CheckpointFile;
+
+/* Journal of the durable progress of one backup, replayed to resume it */
+typedef struct {
+  int fd;                    /* -1 without checkpoints */
+  int interval;              /* seconds between checkpoints */
+  long long last_ns;
+  int level;
+  int layout;                /* BACKUP_CHECKPOINT_* flags */
+  long long backup_time;
+  char parent[1024];
+  char full[1024];
+  const BackupFileList *list;
+  CheckpointFile *files;     /* parallel to the list */
+  BackupStats stats;         /* as of the last checkpoint */
+  BackupStats *live;         /* counters of the run */
+  FILE *chunk_manifest;
+  long long chunk_length;
+  int resumed;               /* files done before the restart */
+} Checkpoint;
+
+/* One file to move through the pipeline */
+typedef struct {
+  char *src;
+  char *dst;
+  const BackupFile *file;
+  const PageMapFile *parent; /* parent page state, NULL for full copies */
+  PageMapFile *entry;        /* page state to fill */
+  int mode;                  /* BACKUP_JOB_* */
+  int compressed;            /* stored as frames in <dst> with the .z suffix */
+  long long first_seq;       /* sequence number of the first block */
+  int block_count;
+  int out_fd;                /* writer only */
+  unsigned int *frame_raw;   /* seek table, writer only */
+  unsigned int *frame_stored;
+  int frame_count;
+  long long stored;          /* bytes written to dst */
+  ManifestFile *checksums;   /* block checksums of dst, NULL for chunked files */
+  unsigned int first_block;  /* blocks already stored by an interrupted run */
+  CheckpointFile *progress;  /* NULL without checkpoints */
+  Signature *signature;      /* filled by the compress stage, NULL if the file gets none */
+} BackupJob;
+
+/* A content-defined chunk inside a block */
+typedef struct {
+  unsigned int offset;
+  unsigned int length;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  unsigned int stored_offset; /* in the block's zdata when compressed, else in out */
+  unsigned int stored_length;
+  int flags;                  /* BACKUP_FRAME_* */
+} BackupChunk;
+
+/* A recycled buffer holding one block of a file */
+typedef struct {
+  long long seq;
+  int job;
+  unsigned int index; /* block number within the file */
+  long long offset;
+  unsigned char *data;
+  size_t length;      /* bytes read */
+  unsigned char *out; /* bytes to store */
+  size_t out_length;
+  size_t raw_length;  /* bytes to store before compression */
+  int frame_flags;    /* BACKUP_FRAME_* */
+  unsigned char *zdata;
+  unsigned int crc;   /* CRC32C of the stored bytes */
+  BackupChunk *chunks;
+  int chunk_count;
+  long long scanned_pages; /* counted by the writer, in block order */
+  long long changed_pages;
+  unsigned long long holes; /* bit i set: page i lies in a hole of the source */
+  long long hole_bytes;
+  int io_pending;           /* io_uring reads in flight */
+  int io_short;             /* an io_uring read came back short or failed */
+  int io_writes;            /* io_uring writes in flight */
+  unsigned int header[4];   /* frame header written through io_uring */
+} BackupBlock;
+
+/* Bounded FIFO of blocks between two stages */
+typedef struct {
+  BackupBlock **items;
+  int capacity;
+  int head;
+  int count;
+  int producers; /* threads still able to push */
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} BlockQueue;
+
+/* Throughput counters of one pipeline stage */
+typedef struct {
+  int threads;
+  long long bytes;
+  long long busy_ns; /* summed over the stage's threads */
+  long long wait_ns;
+  long long wall_ns;
+} PipelineStage;
+
+/* Token bucket of one I/O resource */
+typedef struct {
+  double rate;     /* tokens per second, 0 for no limit */
+  double ceiling;  /* configured rate, 0 for none */
+  double floor;    /* adaptive mode never goes below this */
+  double tokens;   /* negative while callers sleep off a debt */
+  double taken;    /* since the last adaptive sample */
+  long long last_ns;
+} TokenBucket;
+
+/* I/O limits of one backup, shared by all its threads */
+typedef struct {
+  pthread_mutex_t mutex;
+  TokenBucket buckets[4]; /* BACKUP_THROTTLE_* */
+  int active;
+  int adaptive;
+  double max_latency;     /* ms per request */
+  double max_queue;       /* requests in flight */
+  dev_t device;           /* holding the data directory, 0 if unknown */
+  unsigned long long counters[3];
+  long long sample_ns;
+  long long wait_ns;      /* summed over threads */
+  long long backoffs;
+} Throttle;
+
+/* A data file read around the page cache */
+typedef struct {
+  const char *path;
+  int fd;
+  int direct;              /* fd was opened with O_DIRECT */
+  int drop;                /* drop the pages a read brings into the cache */
+  unsigned char *resident; /* pages cached before the read, mincore() format */
+  size_t resident_size;
+} SourceFile;
+
+/* An io_uring instance and its mapped rings */
+typedef struct {
+  int fd;                 /* -1 when not set up */
+  unsigned int entries;   /* submission slots */
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  void *sqes;
+  void *cqes;
+  void *sq_ring;
+  void *cq_ring;          /* sq_ring itself on kernels with a single mapping */
+  size_t sq_size;
+  size_t cq_size;
+  size_t sqes_size;
+  unsigned int queued;    /* not yet submitted */
+  unsigned int inflight;  /* submitted, not yet reaped */
+  int fixed;              /* the block buffers are registered */
+} IoRing;
+
+/* One file in a stream archive */
+typedef struct {
+  char *path;        /* relative to the backup directory */
+  long long offset;  /* of the entry header */
+  long long length;  /* content bytes, zero runs included */
+  long long mtime;   /* nanoseconds, 0 to leave it alone */
+  unsigned int mode;
+  unsigned int crc;  /* CRC32C of the stored records, zero runs left out */
+} StreamEntry;
+
+/* A stream archive being written, or the index of one being read */
+typedef struct {
+  int fd;
+  char path[4096];     /* empty for standard output */
+  const char *root;    /* backup directory entry paths are relative to */
+  long long offset;    /* bytes written */
+  StreamEntry *entries;
+  int count;
+  int size;
+} BackupStream;
+
+/* Shared state of one pipeline run */
+typedef struct {
+  BackupJob *jobs;
+  int job_count;
+  long long block_total;
+  long long next_seq; /* next block to read, claimed atomically */
+  BlockQueue free_blocks;
+  BlockQueue compress_queue;
+  BlockQueue checksum_queue;
+  BlockQueue write_queue;
+  BackupBlock **window; /* blocks waiting for their turn at the writer */
+  int depth;
+  volatile int failed;
+  BackupStats *stats;
+  FILE *chunk_manifest;  /* NULL without deduplication */
+  const char *chunk_dir;
+  int level;             /* zlib level, 0 stores frames uncompressed */
+  PipelineStage *stages;
+  Throttle *throttle;
+  int direct;            /* read around the page cache */
+  Checkpoint *checkpoint;
+  FILE *signatures;      /* signature file of the backup */
+  BackupBlock *blocks;   /* the buffer pool, registered with the rings */
+  int uring;             /* reads and writes go through the rings below */
+  IoRing read_ring;
+  IoRing write_ring;
+  BackupBlock *held;     /* block the writer is on; it recycles that one itself */
+  BackupStream *stream;  /* files are appended to this archive instead of written, or NULL */
+} BackupPipeline;
+
+/* One block or chunk to check */
+typedef struct {
+  int file;                             /* manifest entry, -1 for a chunk */
+  int block;
+  char chunk[2 * SHA256_DIGEST_LENGTH + 1];
+} ValidateTask;
+
+/* Shared state of one validation run */
+typedef struct {
+  const char *backup_path;
+  const char *chunk_dir;
+  const Manifest *manifest;
+  ValidateTask *tasks;
+  long long task_count;
+  long long next; /* next task, claimed atomically */
+  long long failed;
+} ValidateRun;
+
+/* Chunks of one file in a deduplicated backup */
+typedef struct {
+  char *path;
+  int count;
+  long long *offsets; /* raw offset of each chunk, count + 1 entries */
+  char *hashes;       /* count hex hashes of 2 * SHA256_DIGEST_LENGTH + 1 bytes */
+} ChunkedFile;
+
+/* Chunk lists of a deduplicated backup, sorted by path */
+typedef struct {
+  ChunkedFile *files;
+  int count;
+  int size;
+} ChunkIndex;
+
+/* One backup of a restore chain */
+typedef struct {
+  char *name;
+  PageMap map;
+  ChunkIndex chunks; /* empty unless the backup is deduplicated */
+  int dedup;
+} RestoreLink;
+
+/* The stored copy of one file in one backup of the chain */
+typedef struct {
+  int file;                  /* batch file */
+  char *path;                /* stored file, NULL for chunks */
+  int compressed;
+  int delta;                 /* pages are compacted in change order */
+  const ChunkedFile *chunked;
+} RestoreSource;
+
+/* A run of pages copied from one source */
+typedef struct {
+  int source;
+  long long offset;        /* in the restored file */
+  long long source_offset; /* raw offset in the stored file */
+  unsigned int length;
+} RestoreTask;
+
+/* Shared state of one batch of restore writers */
+typedef struct {
+  const char *target;
+  const char *chunk_dir;
+  const PageMapFile **files; /* restored state of each batch file */
+  int file_count;
+  RestoreSource *sources;
+  int source_count;
+  int source_size;
+  RestoreTask *tasks;
+  long long task_count;
+  long long task_size;
+  long long next; /* next task, claimed atomically */
+  long long failed;
+  int threads;    /* writers */
+  int depth;      /* nesting of rsync base rebuilds */
+} RestoreRun;
+
+/* The catalog record of one backup */
+typedef struct {
+  char *name;
+  long long backup_time;
+  int level;
+  char *parent; /* NULL for a full backup */
+  long long size;
+  char status[16];
+  long long offset; /* of the newest record of the backup in the catalog */
+} CatalogEntry;
+
+/* Every backup of a backup directory, oldest first */
+typedef struct {
+  CatalogEntry *entries;
+  int count;
+  int size;
+} Catalog;
+
+/* GTIDs of one source server seen in a binlog */
+typedef struct {
+  unsigned char sid[16];
+  long long first;
+  long long last;
+} BinlogGtidRange;
+
+/* Walk over the events of a binlog, fed one buffer at a time */
+typedef struct {
+  long long next;          /* offset of the next event */
+  unsigned char head[44];  /* event header and GTID body, may span buffers */
+  int have;
+  long long first_time;
+  long long last_time;
+  BinlogGtidRange gtids[16];
+  int gtid_count;
+  long long start_time;    /* replay window */
+  long long stop_time;
+  long long start;         /* first transaction at or after start_time, -1 if none */
+  long long stop;          /* first transaction after stop_time, -1 if none */
+  int malformed;
+} BinlogScan;
+
+/* One archived binlog */
+typedef struct {
+  char *name;
+  long long first_time;
+  long long last_time;
+  long long size;
+  unsigned int crc;
+  char *gtids;
+} BinlogSegment;
+
+/* Archived binlogs, in binlog order */
+typedef struct {
+  BinlogSegment *segments;
+  int count;
+  int size;
+} BinlogArchive;
+
+/* Background binlog archiver */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  int stop;
+  char *binlog_index; /* binlog index file of the server */
+  char *archive_dir;  /* <backup_dir>/binlog */
+  int level;
+} BinlogArchiver;
+
+/* Paths removed by a pool of threads */
+typedef struct {
+  char **paths;
+  long long count;
+  long long size;
+  long long next; /* next path, claimed atomically */
+  long long failed;
+} UnlinkRun;
+
+/* Background pass collecting unreferenced chunks */
+typedef struct {
+  pthread_t thread;
+  char *backup_dir;
+  int threads;
+} ChunkCollector;
+
+/* Paths changed since a backup, sorted; a path ending in '/' stands for its whole subtree */
+typedef struct {
+  char **paths;
+  int count;
+  int size;
+} DirtySet;
+
+/* Background tracker of the data files written between backups */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int stop;
+  int notify;         /* inotify descriptor */
+  int wake[2];        /* pipe waking the thread for a stop */
+  char *datadir;      /* as the backups name it */
+  char *real_datadir; /* resolved, as /proc/self/fd shows it */
+  char *backup_dir;
+  char **watches;     /* watched directory by watch descriptor, relative to the data directory */
+  int watch_size;
+  DirtySet dirty;     /* changed since the base backup started */
+  DirtySet taken;     /* handed to the running backup */
+  char base[1024];    /* backup the sets are relative to, "" for none */
+  char pending[1024]; /* backup holding the taken set */
+  int lost;           /* events were lost: the sets say nothing until the next backup */
+  int ready;          /* every directory is watched */
+  int saved;          /* the state file matches the sets */
+} DirtyTracker;
+
 /* Backup context structure */
 typedef struct {
   char *backup_dir;
@@ -61,6 +629,39 @@ typedef struct {
   int backup_level;
   char *backup_metadata;
   size_t metadata_size;
+  char *datadir;
+  char *parent_backup_name;
+  int read_threads;     /* 0 copies serially, one file at a time */
+  int compress_threads;
+  int checksum_threads;
+  int queue_depth;      /* block buffers in flight */
+  int dedup;            /* full backups go to the shared chunk store */
+  int compression_level;
+  char *restore_dir;    /* restore target, the data directory if unset */
+  char *restore_file;   /* restore only this file */
+  int validate_mode;    /* BACKUP_VALIDATE_* */
+  int validate_sample;  /* percent of blocks read by a sample check */
+  char *validate_file;  /* validate only this file */
+  char *binlog_index;   /* binlog index file, <datadir>/binlog.index if unset */
+  BinlogArchiver *archiver;
+  long long restore_time; /* replay binlogs up to this time, 0 for none */
+  int io_limits[4];       /* MB/s or IOPS per BACKUP_THROTTLE_*, 0 for none */
+  int throttle_adaptive;  /* back off while the data device is congested */
+  int throttle_latency;   /* ms per request that counts as congested */
+  int throttle_queue;     /* requests in flight that count as congested */
+  Throttle throttle;
+  int direct_io;          /* read data files around the page cache */
+  int io_uring;           /* pipeline I/O through io_uring when the kernel has it */
+  int io_uring_used;      /* the last pipeline ran on io_uring */
+  int checkpoint_interval; /* seconds between checkpoints, 0 for none */
+  int retain_fulls;       /* full backups kept with their chains, 0 for no limit */
+  int retain_days;        /* backups younger than this are kept, 0 for no limit */
+  int retain_monthly;     /* months whose newest backup is kept, 0 for none */
+  ChunkCollector *collector;
+  DirtyTracker *tracker;
+  char *stream;           /* "-" streams backups to stdout, a directory gets <name>.kbs; NULL for none */
+  BackupStream *output;   /* stream archive of the running backup */
+  BackupStats stats;
 } BackupContext;
 
 /* Plugin type definitions */
@@ -73,6 +674,174 @@ typedef struct {
 #define BACKUP_LOG_DIR "logs"
 #define BACKUP_LEVEL_FULL 0
 #define BACKUP_LEVEL_INCREMENTAL 1
+#define BACKUP_DEFAULT_DATADIR "/var/lib/mysql"
+#define BACKUP_COPY_CHUNK (1024LL * 1024 * 1024) /* per copy_file_range/sendfile call */
+#define BACKUP_PAGE_MAP_FILE "page_map"
+#define BACKUP_PAGE_MAP_MAGIC 0x4d50424bU /* "KBPM" */
+#define BACKUP_PAGE_MAP_VERSION 2
+#define BACKUP_PAGE_MAP_RSYNC 1          /* flag: stored as <file>.rdelta */
+#define BACKUP_DELTA_SUFFIX ".delta"
+#define BACKUP_PAGE_SIZE 16384           /* InnoDB default page size */
+#define BACKUP_PAGE_NUMBER_OFFSET 4      /* FIL_PAGE_OFFSET, big-endian */
+#define BACKUP_PAGE_LSN_OFFSET 16        /* FIL_PAGE_LSN, big-endian */
+#define BACKUP_PAGE_SPACE_OFFSET 34      /* FIL_PAGE_SPACE_ID, big-endian */
+#define BACKUP_PAGE_TRAILER_OFFSET 4     /* low 32 bits of the LSN, from the page end */
+#define BACKUP_SCAN_PAGES 64             /* pages per read while scanning */
+#define BACKUP_BLOCK_SIZE (BACKUP_SCAN_PAGES * BACKUP_PAGE_SIZE) /* pipeline block */
+#define BACKUP_MANIFEST_FILE "manifest"
+#define BACKUP_VALIDATION_LOG "validation.log"
+#define BACKUP_PIPELINE_LOG "pipeline.log"
+
+/* Pipeline stages and their defaults */
+#define BACKUP_STAGE_READ 0
+#define BACKUP_STAGE_COMPRESS 1
+#define BACKUP_STAGE_CHECKSUM 2
+#define BACKUP_STAGE_WRITE 3
+#define BACKUP_STAGE_COUNT 4
+#define BACKUP_DEFAULT_READ_THREADS 4
+#define BACKUP_DEFAULT_COMPRESS_THREADS 4
+#define BACKUP_DEFAULT_CHECKSUM_THREADS 2
+#define BACKUP_DEFAULT_QUEUE_DEPTH 32
+#define BACKUP_MAX_THREADS 64
+#define BACKUP_MAX_QUEUE_DEPTH 1024
+
+/* Pipeline job kinds */
+#define BACKUP_JOB_COPY 0  /* store the whole file */
+#define BACKUP_JOB_DELTA 1 /* store changed pages in <file>.delta */
+#define BACKUP_JOB_SCAN 2  /* file already cloned, only record page state */
+#define BACKUP_JOB_CHUNK 3 /* store the file as chunks in the chunk store */
+#define BACKUP_JOB_RSYNC 4 /* stored as <file>.rdelta before the pipeline ran */
+
+/* Content-defined chunking (FastCDC) */
+#define BACKUP_CHUNK_DIR "chunks"
+#define BACKUP_CHUNK_MANIFEST "chunk_manifest"
+#define BACKUP_CHUNK_MIN (16 * 1024)
+#define BACKUP_CHUNK_AVG (64 * 1024)
+#define BACKUP_CHUNK_MAX (256 * 1024)
+#define BACKUP_CHUNK_MASK_S_BITS 18 /* before the average size: cuts are rarer */
+#define BACKUP_CHUNK_MASK_L_BITS 14 /* after it: cuts are likelier */
+#define BACKUP_MAX_BLOCK_CHUNKS (BACKUP_BLOCK_SIZE / BACKUP_CHUNK_MIN + 1)
+
+/* Seekable frame format: frames of at most one block, then a seek table */
+#define BACKUP_COMPRESSED_SUFFIX ".z"
+#define BACKUP_FRAME_MAGIC 0x465a4b42U /* "BKZF" */
+#define BACKUP_SEEK_MAGIC 0x535a4b42U  /* "BKZS" */
+#define BACKUP_FRAME_HEADER_SIZE 16    /* magic, raw length, stored length, flags */
+#define BACKUP_FRAME_STORED 0
+#define BACKUP_FRAME_DEFLATE 1
+#define BACKUP_FRAME_ZERO 2            /* raw bytes all zero, nothing stored */
+#define BACKUP_DEFAULT_COMPRESSION_LEVEL 1
+
+/* Backup catalog */
+#define BACKUP_CATALOG_FILE "catalog"
+#define BACKUP_CATALOG_INDEX "catalog.idx"
+#define BACKUP_CATALOG_MAGIC 0x4943424bU /* "KBCI" */
+#define BACKUP_CATALOG_VERSION 1
+#define BACKUP_CATALOG_MAX (1 << 24)     /* backups in one catalog */
+
+/* Restore */
+#define BACKUP_MAX_CHAIN 4096       /* backups in one restore chain */
+#define BACKUP_RESTORE_BATCH 65536 /* tasks planned before the writers run */
+
+/* Validation modes */
+#define BACKUP_VALIDATE_FULL 0   /* read every block and chunk */
+#define BACKUP_VALIDATE_ROOT 1   /* recompute the Merkle root from the manifest only */
+#define BACKUP_VALIDATE_SAMPLE 2 /* read a random share of the blocks */
+#define BACKUP_DEFAULT_VALIDATE_SAMPLE 5
+
+/* Binlog archive, in <backup_dir>/binlog */
+#define BACKUP_BINLOG_DIR "binlog"
+#define BACKUP_BINLOG_ARCHIVE_INDEX "index"
+#define BACKUP_BINLOG_ARCHIVE_LOG "archive.log"
+#define BACKUP_BINLOG_LOCK "archive.lock"
+#define BACKUP_BINLOG_DEFAULT_INDEX "binlog.index" /* in the data directory */
+#define BACKUP_BINLOG_REPLAY_DIR "#binlog_replay"  /* '#' keeps MySQL from taking it for a schema */
+#define BACKUP_BINLOG_REPLAY_LIST "replay.list"
+#define BACKUP_BINLOG_INTERVAL 5                  /* seconds between archiver passes */
+#define BACKUP_BINLOG_MAGIC "\xfe" "bin"
+#define BACKUP_BINLOG_HEADER_SIZE 19              /* common event header */
+#define BACKUP_BINLOG_GTID_SIZE 44                /* header, flags, SID and GNO */
+#define BACKUP_BINLOG_GTID_EVENT 33
+#define BACKUP_BINLOG_ANONYMOUS_GTID_EVENT 34
+#define BACKUP_BINLOG_MAX_SIDS 16
+
+/* I/O throttling */
+#define BACKUP_THROTTLE_READ_BYTES 0
+#define BACKUP_THROTTLE_READ_OPS 1
+#define BACKUP_THROTTLE_WRITE_BYTES 2
+#define BACKUP_THROTTLE_WRITE_OPS 3
+#define BACKUP_THROTTLE_BUCKETS 4
+#define BACKUP_THROTTLE_BURST 0.1             /* seconds of tokens a bucket can save up */
+#define BACKUP_THROTTLE_SAMPLE_NS 100000000LL /* adaptive mode samples the device every 100ms */
+#define BACKUP_DEFAULT_THROTTLE_LATENCY 20    /* ms */
+#define BACKUP_DEFAULT_THROTTLE_QUEUE 8
+#define BACKUP_DISKSTATS "/proc/diskstats"
+
+/* Checkpoints */
+#define BACKUP_CHECKPOINT_FILE "checkpoint"
+#define BACKUP_CHECKPOINT_MAGIC 0x4b43424bU /* "KBCK" */
+#define BACKUP_CHECKPOINT_VERSION 3
+#define BACKUP_CHECKPOINT_HEADER 1       /* record: level, layout, parent and file list */
+#define BACKUP_CHECKPOINT_PROGRESS 2     /* record: counters and progress since the last one */
+#define BACKUP_CHECKPOINT_COMPRESSED 1   /* layout: files stored as frames */
+#define BACKUP_CHECKPOINT_DEDUP 2        /* layout: files stored in the chunk store */
+#define BACKUP_CHECKPOINT_SERIAL 4       /* layout: files copied whole, no pipeline */
+#define BACKUP_DEFAULT_CHECKPOINT_INTERVAL 60 /* seconds */
+
+/* Retention and garbage collection */
+#define BACKUP_CLEANUP_LOG "cleanup.log"
+#define BACKUP_CHUNK_LOCK "chunks.lock"  /* shared by deduplicated backups, exclusive for collection */
+#define BACKUP_TRASH_PREFIX ".trash."    /* backup being removed; hidden from catalog rebuilds */
+#define BACKUP_MAX_RETAIN 100000
+
+/* Dirty file tracking */
+#define BACKUP_DIRTY_FILE "dirty"     /* base backup and changed paths, kept by the tracker */
+#define BACKUP_DIRTY_INTERVAL 1000    /* ms between saves of the tracker state */
+#define BACKUP_DIRTY_EVENTS \
+  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* rsync deltas */
+#define BACKUP_SIGNATURE_FILE "signature"
+#define BACKUP_SIGNATURE_MAGIC 0x4753424bU /* "KBSG" */
+#define BACKUP_SIGNATURE_VERSION 1
+#define BACKUP_RSYNC_SUFFIX ".rdelta"
+#define BACKUP_RSYNC_MAGIC 0x4452424bU     /* "KBRD" */
+#define BACKUP_RSYNC_VERSION 1
+#define BACKUP_RSYNC_BLOCK 4096            /* signature block */
+#define BACKUP_RSYNC_MIN_SIZE (4LL * 1024 * 1024)
+#define BACKUP_RSYNC_LITERAL 0             /* record: bytes follow */
+#define BACKUP_RSYNC_COPY 1                /* record: bytes of the parent's copy */
+#define BACKUP_RSYNC_MAX_COPY (1U << 30)     /* bytes of one record */
+#define BACKUP_RSYNC_FILTER_BITS (1U << 20)  /* weak checksum filter of the encoder */
+#define BACKUP_RSYNC_FILTER(weak) (((weak) ^ ((weak) >> 12)) & (BACKUP_RSYNC_FILTER_BITS - 1))
+
+/* Page cache bypass */
+#define BACKUP_DIRECT_ALIGN 4096 /* O_DIRECT buffer, offset and length alignment */
+
+/* io_uring engine */
+#define BACKUP_URING_READ_DEPTH 2  /* read ring slots per block buffer */
+#define BACKUP_URING_WRITE_DEPTH 2 /* write ring slots per block buffer: frame header and data */
+
+/* Stream archives */
+#define BACKUP_STREAM_SUFFIX ".kbs"
+#define BACKUP_STREAM_MAGIC 0x5342424B   /* "KBBS" */
+#define BACKUP_STREAM_ENTRY 0x4553424B   /* "KBSE" */
+#define BACKUP_STREAM_TRAILER 0x5453424B /* "KBST" */
+#define BACKUP_STREAM_VERSION 1
+#define BACKUP_STREAM_ZERO 1              /* record flag: that many zero bytes, not stored */
+#define BACKUP_STREAM_MAX_RECORD (1 << 30)
+#define BACKUP_STREAM_COPY (1 << 20)      /* read size when adding a file from disk */
+#define BACKUP_STREAM_INDEX_RECORD 36     /* offset, length, mtime, mode, crc, path length */
+#define BACKUP_STREAM_TRAILER_SIZE 24     /* index offset, entry count, index crc, version, magic */
+
+/* Data copy methods, best first */
+#define BACKUP_COPY_CLONE 0
+#define BACKUP_COPY_RANGE 1
+#define BACKUP_COPY_SENDFILE 2
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 
 /**
   @brief Create backup context.
@@ -93,10 +862,53 @@ static void *backup_create_context(void) {
   ctx->backup_level = BACKUP_LEVEL_FULL;
   ctx->backup_metadata = NULL;
   ctx->metadata_size = 0;
+  ctx->datadir = strdup(BACKUP_DEFAULT_DATADIR);
+  ctx->parent_backup_name = NULL;
+  ctx->read_threads = BACKUP_DEFAULT_READ_THREADS;
+  ctx->compress_threads = BACKUP_DEFAULT_COMPRESS_THREADS;
+  ctx->checksum_threads = BACKUP_DEFAULT_CHECKSUM_THREADS;
+  ctx->queue_depth = BACKUP_DEFAULT_QUEUE_DEPTH;
+  ctx->dedup = 0;
+  ctx->compression_level = BACKUP_DEFAULT_COMPRESSION_LEVEL;
+  ctx->restore_dir = NULL;
+  ctx->restore_file = NULL;
+  ctx->validate_mode = BACKUP_VALIDATE_FULL;
+  ctx->validate_sample = BACKUP_DEFAULT_VALIDATE_SAMPLE;
+  ctx->validate_file = NULL;
+  ctx->binlog_index = NULL;
+  ctx->archiver = NULL;
+  ctx->restore_time = 0;
+  memset(ctx->io_limits, 0, sizeof(ctx->io_limits));
+  ctx->throttle_adaptive = 0;
+  ctx->throttle_latency = BACKUP_DEFAULT_THROTTLE_LATENCY;
+  ctx->throttle_queue = BACKUP_DEFAULT_THROTTLE_QUEUE;
+  memset(&ctx->throttle, 0, sizeof(ctx->throttle));
+  pthread_mutex_init(&ctx->throttle.mutex, NULL);
+  ctx->direct_io = 1;
+  ctx->io_uring = 0;
+  ctx->io_uring_used = 0;
+  ctx->checkpoint_interval = BACKUP_DEFAULT_CHECKPOINT_INTERVAL;
+  ctx->retain_fulls = 0;
+  ctx->retain_days = 0;
+  ctx->retain_monthly = 0;
+  ctx->collector = NULL;
+  ctx->tracker = NULL;
+  ctx->stream = NULL;
+  ctx->output = NULL;
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  if (!ctx->datadir) {
+    pthread_mutex_destroy(&ctx->throttle.mutex);
+    free(ctx);
+    return NULL;
+  }
 
   return ctx;
 }
 
+static void binlog_archiver_stop(BackupContext *backup_ctx);
+static void chunk_collector_wait(BackupContext *backup_ctx);
+static void dirty_tracker_stop(BackupContext *backup_ctx);
+
 /**
   @brief Destroy backup context.
 
@@ -106,6 +918,9 @@ static void backup_destroy_context(void *ctx) {
   if (ctx) {
     BackupContext *backup_ctx = (BackupContext *)ctx;
     
+    binlog_archiver_stop(backup_ctx);
+    chunk_collector_wait(backup_ctx);
+    dirty_tracker_stop(backup_ctx);
     if (backup_ctx->backup_dir) {
       free(backup_ctx->backup_dir);
     }
@@ -118,6 +933,18 @@ static void backup_destroy_context(void *ctx) {
     if (backup_ctx->backup_metadata) {
       free(backup_ctx->backup_metadata);
     }
+    if (backup_ctx->datadir) {
+      free(backup_ctx->datadir);
+    }
+    if (backup_ctx->parent_backup_name) {
+      free(backup_ctx->parent_backup_name);
+    }
+    free(backup_ctx->restore_dir);
+    free(backup_ctx->restore_file);
+    free(backup_ctx->validate_file);
+    free(backup_ctx->binlog_index);
+    free(backup_ctx->stream);
+    pthread_mutex_destroy(&backup_ctx->throttle.mutex);
     
     free(backup_ctx);
   }
@@ -136,26 +963,9514 @@ static int create_directory(const char *path) {
     return 1;
   }
 
-  char *p = dir;
-  while (*p) {
-    if (*p == '/') {
-      *p = '\0';
-      if (*dir != '\0' && mkdir(dir, 0755) != 0 && errno != EEXIST) {
-        free(dir);
-        return 1;
-      }
-      *p = '/';
+  char *p = dir;
+  while (*p) {
+    if (*p == '/') {
+      *p = '\0';
+      if (*dir != '\0' && mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        free(dir);
+        return 1;
+      }
+      *p = '/';
+    }
+    p++;
+  }
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    free(dir);
+    return 1;
+  }
+
+  free(dir);
+  return 0;
+}
+
+/**
+  @brief Free a file list.
+
+  @param [in] list File list.
+*/
+static void file_list_free(BackupFileList *list) {
+  int i;
+
+  for (i = 0; i < list->count; i++) {
+    free(list->files[i].path);
+  }
+  free(list->files);
+  list->files = NULL;
+  list->count = 0;
+  list->size = 0;
+}
+
+/**
+  @brief Compare files by path, for a stable backup order.
+*/
+static int file_compare(const void *a, const void *b) {
+  return strcmp(((const BackupFile *)a)->path, ((const BackupFile *)b)->path);
+}
+
+/**
+  @brief Append a file to a file list.
+
+  @param [in,out] list  File list.
+  @param [in]     path  Path relative to the data directory.
+  @param [in]     size  Size.
+  @param [in]     mtime Modification time in nanoseconds.
+  @param [in]     mode  Permission bits, 0 if unknown.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int file_list_add(BackupFileList *list, const char *path, long long size, long long mtime, mode_t mode) {
+  BackupFile *file;
+
+  if (list->count == list->size) {
+    int grown_size = list->size ? list->size * 2 : 256;
+    BackupFile *grown = (BackupFile *)realloc(list->files, grown_size * sizeof(BackupFile));
+    if (!grown) {
+      return 1;
+    }
+    list->files = grown;
+    list->size = grown_size;
+  }
+  file = &list->files[list->count];
+  file->path = strdup(path);
+  file->size = size;
+  file->mtime = mtime;
+  file->mode = mode;
+  if (!file->path) {
+    return 1;
+  }
+  list->count++;
+  return 0;
+}
+
+/**
+  @brief Collect the regular files below a directory.
+
+  Sockets, pipes and symlinks (mysql.sock, pid files linked elsewhere)
+  are skipped.
+
+  @param [in]     root Data directory.
+  @param [in]     rel  Subdirectory relative to root, "" for root itself.
+  @param [in,out] list File list.
+
+  @retval 0 success, 1 failure.
+*/
+static int file_list_collect(const char *root, const char *rel, BackupFileList *list) {
+  char path[4096];
+  DIR *dir;
+  struct dirent *entry;
+  int ret = 0;
+
+  snprintf(path, sizeof(path), "%s%s%s", root, *rel ? "/" : "", rel);
+  dir = opendir(path);
+  if (!dir) {
+    return 1;
+  }
+
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    char child[4096];
+    char full[4096];
+    struct stat st;
+
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", entry->d_name) >= (int)sizeof(child) ||
+        snprintf(full, sizeof(full), "%s/%s", root, child) >= (int)sizeof(full)) {
+      ret = 1;
+      break;
+    }
+    if (lstat(full, &st) != 0) {
+      /* Dropped tables vanish while we walk */
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      ret = file_list_collect(root, child, list);
+    } else if (S_ISREG(st.st_mode)) {
+      ret = file_list_add(list, child, (long long)st.st_size,
+                          (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, st.st_mode & 07777);
+    }
+  }
+  closedir(dir);
+
+  if (ret == 0 && !*rel) {
+    qsort(list->files, list->count, sizeof(BackupFile), file_compare);
+  }
+  return ret;
+}
+
+/**
+  @brief Create the parent directories of a file.
+
+  @param [in] path File path.
+
+  @retval 0 success, 1 failure.
+*/
+static int create_parent_directory(const char *path) {
+  char dir[4096];
+  char *slash;
+
+  if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir)) {
+    return 1;
+  }
+  slash = strrchr(dir, '/');
+  if (!slash || slash == dir) {
+    return 0;
+  }
+  *slash = '\0';
+  return create_directory(dir);
+}
+
+/**
+  @brief Monotonic clock in nanoseconds.
+*/
+static long long clock_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+  @brief Set up the I/O limits of one backup from the context options.
+
+  Byte limits are in MB/s and operation limits in IOPS.  Adaptive mode
+  watches the device holding the data directory.
+
+  @param [in,out] backup_ctx Backup context.
+*/
+static void throttle_reset(BackupContext *backup_ctx) {
+  Throttle *throttle = &backup_ctx->throttle;
+  struct stat st;
+  int i;
+
+  memset(throttle->buckets, 0, sizeof(throttle->buckets));
+  throttle->active = backup_ctx->throttle_adaptive;
+  for (i = 0; i < BACKUP_THROTTLE_BUCKETS; i++) {
+    TokenBucket *bucket = &throttle->buckets[i];
+    double unit = i == BACKUP_THROTTLE_READ_BYTES || i == BACKUP_THROTTLE_WRITE_BYTES ? 1048576.0 : 1.0;
+
+    bucket->ceiling = backup_ctx->io_limits[i] * unit;
+    bucket->floor = (i == BACKUP_THROTTLE_READ_OPS || i == BACKUP_THROTTLE_WRITE_OPS ? 10 : 1) * unit;
+    bucket->rate = bucket->ceiling;
+    bucket->last_ns = clock_ns();
+    if (bucket->ceiling > 0) {
+      throttle->active = 1;
+    }
+  }
+  throttle->adaptive = backup_ctx->throttle_adaptive;
+  throttle->max_latency = backup_ctx->throttle_latency;
+  throttle->max_queue = backup_ctx->throttle_queue;
+  throttle->sample_ns = 0;
+  throttle->wait_ns = 0;
+  throttle->backoffs = 0;
+  throttle->device = 0;
+  if (throttle->adaptive && stat(backup_ctx->datadir, &st) == 0) {
+    throttle->device = st.st_dev;
+  }
+}
+
+/**
+  @brief Read the counters of the throttled device from /proc/diskstats.
+
+  @param [in]  throttle Throttle.
+  @param [out] counters Completed requests, milliseconds spent on them,
+                        and milliseconds weighted by requests in flight.
+
+  @retval 0 success, 1 device not listed.
+*/
+static int throttle_read_diskstats(const Throttle *throttle, unsigned long long *counters) {
+  char line[512];
+  FILE *fp = fopen(BACKUP_DISKSTATS, "r");
+  int ret = 1;
+
+  if (!fp) {
+    return 1;
+  }
+  while (ret != 0 && fgets(line, sizeof(line), fp)) {
+    unsigned int major_number, minor_number;
+    unsigned long long reads, read_ms, writes, write_ms, queue_ms;
+
+    if (sscanf(line, "%u %u %*s %llu %*u %*u %llu %llu %*u %*u %llu %*u %*u %llu", &major_number, &minor_number,
+               &reads, &read_ms, &writes, &write_ms, &queue_ms) == 7 &&
+        makedev(major_number, minor_number) == throttle->device) {
+      counters[0] = reads + writes;
+      counters[1] = read_ms + write_ms;
+      counters[2] = queue_ms;
+      ret = 0;
+    }
+  }
+  fclose(fp);
+  return ret;
+}
+
+/**
+  @brief Adaptive mode: adjust the rates to the congestion of the device.
+
+  Every BACKUP_THROTTLE_SAMPLE_NS the average request latency and queue
+  depth since the last sample are compared with their thresholds.  A
+  congested device halves every rate in use, starting an unlimited one
+  from the throughput just observed; otherwise rates grow back by a
+  tenth of their ceiling, and an uncapped rate that no longer holds the
+  backup back is lifted again.  Called with the mutex held.
+
+  @param [in,out] throttle Throttle.
+  @param [in]     now      Current time.
+*/
+static void throttle_sample(Throttle *throttle, long long now) {
+  unsigned long long counters[3];
+  double elapsed = (now - throttle->sample_ns) / 1e9;
+  int i;
+
+  if (throttle->device == 0 || throttle_read_diskstats(throttle, counters) != 0) {
+    throttle->sample_ns = now;
+    return;
+  }
+  if (throttle->sample_ns > 0 && elapsed > 0) {
+    unsigned long long requests = counters[0] - throttle->counters[0];
+    double latency = requests ? (double)(counters[1] - throttle->counters[1]) / requests : 0.0;
+    double queue = (counters[2] - throttle->counters[2]) / (elapsed * 1000.0);
+    int congested = latency > throttle->max_latency || queue > throttle->max_queue;
+
+    throttle->backoffs += congested;
+    for (i = 0; i < BACKUP_THROTTLE_BUCKETS; i++) {
+      TokenBucket *bucket = &throttle->buckets[i];
+      double observed = bucket->taken / elapsed;
+
+      if (congested && (bucket->rate > 0 || observed > 0)) {
+        bucket->rate = (bucket->rate > 0 ? bucket->rate : observed) / 2;
+        bucket->rate = bucket->rate < bucket->floor ? bucket->floor : bucket->rate;
+      } else if (!congested && bucket->rate > 0) {
+        bucket->rate += (bucket->ceiling > 0 ? bucket->ceiling : bucket->rate) / 10;
+        if (bucket->ceiling > 0 && bucket->rate > bucket->ceiling) {
+          bucket->rate = bucket->ceiling;
+        } else if (bucket->ceiling == 0 && bucket->rate > 2 * observed + bucket->floor) {
+          bucket->rate = 0;
+        }
+      }
+      bucket->taken = 0;
+    }
+  }
+  memcpy(throttle->counters, counters, sizeof(counters));
+  throttle->sample_ns = now;
+}
+
+/**
+  @brief Take tokens from a bucket.
+
+  Tokens may go negative: the caller then owes the debt and sleeps it
+  off, so concurrent threads queue up behind each other at the rate.
+
+  @param [in,out] bucket Bucket.
+  @param [in]     amount Bytes or operations.
+  @param [in]     now    Current time.
+
+  @retval Nanoseconds to sleep.
+*/
+static long long bucket_take(TokenBucket *bucket, double amount, long long now) {
+  bucket->taken += amount;
+  if (bucket->rate <= 0) {
+    bucket->last_ns = now;
+    bucket->tokens = 0;
+    return 0;
+  }
+  bucket->tokens += bucket->rate * (now - bucket->last_ns) / 1e9;
+  if (bucket->tokens > bucket->rate * BACKUP_THROTTLE_BURST) {
+    bucket->tokens = bucket->rate * BACKUP_THROTTLE_BURST;
+  }
+  bucket->last_ns = now;
+  bucket->tokens -= amount;
+  return bucket->tokens < 0 ? (long long)(-bucket->tokens / bucket->rate * 1e9) : 0;
+}
+
+/**
+  @brief Wait until an I/O fits within the limits.
+
+  @param [in,out] throttle Throttle, or NULL for none.
+  @param [in]     write    1 for a write, 0 for a read.
+  @param [in]     bytes    Bytes transferred.
+  @param [in]     ops      Requests issued.
+*/
+static void throttle_wait(Throttle *throttle, int write, long long bytes, int ops) {
+  struct timespec delay;
+  long long now;
+  long long sleep_ns;
+  long long ops_ns;
+
+  if (!throttle || !throttle->active) {
+    return;
+  }
+  pthread_mutex_lock(&throttle->mutex);
+  now = clock_ns();
+  if (throttle->adaptive && now - throttle->sample_ns >= BACKUP_THROTTLE_SAMPLE_NS) {
+    throttle_sample(throttle, now);
+  }
+  sleep_ns = bucket_take(&throttle->buckets[write ? BACKUP_THROTTLE_WRITE_BYTES : BACKUP_THROTTLE_READ_BYTES],
+                         (double)bytes, now);
+  ops_ns = bucket_take(&throttle->buckets[write ? BACKUP_THROTTLE_WRITE_OPS : BACKUP_THROTTLE_READ_OPS], ops, now);
+  sleep_ns = ops_ns > sleep_ns ? ops_ns : sleep_ns;
+  throttle->wait_ns += sleep_ns;
+  pthread_mutex_unlock(&throttle->mutex);
+
+  if (sleep_ns > 0) {
+    delay.tv_sec = (time_t)(sleep_ns / 1000000000LL);
+    delay.tv_nsec = (long)(sleep_ns % 1000000000LL);
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+      /* Resume after a signal */
+    }
+  }
+}
+
+/**
+  @brief Note which pages of a range are in the page cache.
+
+  The range is mapped without being touched, so nothing is read in.
+  When the mapping fails every page counts as cached and none is dropped.
+
+  @param [in,out] source Open data file.
+  @param [in]     offset Range start.
+  @param [in]     length Range length.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int source_snapshot(SourceFile *source, long long offset, size_t length) {
+  long page = sysconf(_SC_PAGESIZE);
+  long long start = offset - offset % page;
+  size_t span = (size_t)(offset - start) + length;
+  size_t pages = (span + page - 1) / page;
+  void *map;
+
+  if (!source->drop || length == 0) {
+    return 0;
+  }
+  if (pages > source->resident_size) {
+    unsigned char *resident = (unsigned char *)realloc(source->resident, pages);
+    if (!resident) {
+      return 1;
+    }
+    source->resident = resident;
+    source->resident_size = pages;
+  }
+  map = mmap(NULL, span, PROT_READ, MAP_SHARED, source->fd, start);
+  if (map == MAP_FAILED || mincore(map, span, source->resident) != 0) {
+    memset(source->resident, 1, pages);
+  }
+  if (map != MAP_FAILED) {
+    munmap(map, span);
+  }
+  return 0;
+}
+
+/**
+  @brief Drop the pages of a range that were not cached at the snapshot.
+
+  Pages the server had cached stay; pages only the backup read go.
+
+  @param [in] source Data file, snapshot taken over the same range.
+  @param [in] offset Range start.
+  @param [in] length Range length.
+*/
+static void source_drop(const SourceFile *source, long long offset, size_t length) {
+  long page = sysconf(_SC_PAGESIZE);
+  long long start = offset - offset % page;
+  size_t pages = ((size_t)(offset - start) + length + page - 1) / page;
+  size_t i = 0;
+
+  if (!source->drop || length == 0) {
+    return;
+  }
+  while (i < pages) {
+    size_t run = i;
+    while (run < pages && !(source->resident[run] & 1)) {
+      run++;
+    }
+    if (run > i) {
+      posix_fadvise(source->fd, start + (long long)i * page, (off_t)(run - i) * page, POSIX_FADV_DONTNEED);
+    }
+    i = run + 1;
+  }
+}
+
+/**
+  @brief Open a data file for reading around the page cache.
+
+  Filesystems without O_DIRECT (tmpfs among them) fall back to buffered
+  reads whose pages are dropped again.
+
+  @param [out] source File to fill.
+  @param [in]  path   Path, kept for a buffered reopen.
+  @param [in]  direct 1 to try O_DIRECT.
+  @param [in]  drop   1 to drop what buffered reads bring into the cache.
+
+  @retval 0 success, 1 failure with errno set.
+*/
+static int source_open(SourceFile *source, const char *path, int direct, int drop) {
+  memset(source, 0, sizeof(*source));
+  source->path = path;
+  source->drop = drop;
+  source->fd = direct ? open(path, O_RDONLY | O_DIRECT) : -1;
+  if (source->fd >= 0) {
+    source->direct = 1;
+    return 0;
+  }
+  if (direct && errno != EINVAL) {
+    return 1;
+  }
+  source->fd = open(path, O_RDONLY);
+  return source->fd < 0 ? 1 : 0;
+}
+
+/**
+  @brief Close a data file.
+
+  @param [in] source File.
+*/
+static void source_close(SourceFile *source) {
+  if (source->fd >= 0) {
+    close(source->fd);
+  }
+  free(source->resident);
+  source->fd = -1;
+  source->resident = NULL;
+  source->resident_size = 0;
+}
+
+/**
+  @brief Read a range of a data file.
+
+  Direct reads ask for whole aligned sectors and stop at the first short
+  one, which is the end of the file.  A filesystem that rejects a direct
+  read gets the file reopened buffered.
+
+  @param [in,out] source File.
+  @param [out]    buffer Buffer aligned to BACKUP_DIRECT_ALIGN, with room
+                         for length rounded up to it.
+  @param [in]     length Bytes wanted.
+  @param [in]     offset Range start, aligned to BACKUP_DIRECT_ALIGN.
+
+  @retval Bytes read, short at the end of the file; -1 on failure.
+*/
+static ssize_t source_read(SourceFile *source, unsigned char *buffer, size_t length, long long offset) {
+  size_t done = 0;
+
+  if (!source->direct && source_snapshot(source, offset, length) != 0) {
+    return -1;
+  }
+  while (done < length) {
+    size_t want = length - done;
+    ssize_t n;
+
+    if (source->direct) {
+      want = (want + BACKUP_DIRECT_ALIGN - 1) / BACKUP_DIRECT_ALIGN * BACKUP_DIRECT_ALIGN;
+    }
+    n = pread(source->fd, buffer + done, want, offset + (long long)done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EINVAL && source->direct) {
+      int fd = open(source->path, O_RDONLY);
+      if (fd < 0) {
+        return -1;
+      }
+      close(source->fd);
+      source->fd = fd;
+      source->direct = 0;
+      /* Direct reads left the cache alone, so the snapshot can cover the whole range */
+      if (source_snapshot(source, offset, length) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    done += (size_t)n;
+    if (n == 0 || (source->direct && (size_t)n < want)) {
+      break;
+    }
+  }
+  if (!source->direct) {
+    source_drop(source, offset, length);
+  }
+  return (ssize_t)(done < length ? done : length);
+}
+
+/**
+  @brief Find the pages of a range that lie wholly in holes.
+
+  SEEK_DATA and SEEK_HOLE find the allocated extents.  Filesystems that
+  do not report holes look fully allocated.
+
+  @param [in]  source File.
+  @param [in]  length Bytes wanted, at most BACKUP_SCAN_PAGES pages.
+  @param [in]  offset Range start, page aligned.
+  @param [out] holes  Bit i set: page i of the range lies in a hole.
+
+  @retval Bytes of the range within the file, short if it ends in the range.
+*/
+static size_t source_holes(const SourceFile *source, size_t length, long long offset, unsigned long long *holes) {
+  unsigned int pages = (unsigned int)((length + BACKUP_PAGE_SIZE - 1) / BACKUP_PAGE_SIZE);
+  long long end = offset + (long long)length;
+  long long eof = end;
+  long long pos = offset;
+  unsigned int page;
+
+  *holes = 0;
+  while (pos < end) {
+    long long data = lseek(source->fd, pos, SEEK_DATA);
+    long long hole;
+
+    if (data < 0 && errno != ENXIO) {
+      break;
+    }
+    if (data < 0) {
+      /* No data from pos on: the rest is a hole, or the file shrank */
+      eof = lseek(source->fd, 0, SEEK_END);
+      data = end;
+    } else if (data > end) {
+      data = end;
+    }
+    for (page = (unsigned int)((pos - offset + BACKUP_PAGE_SIZE - 1) / BACKUP_PAGE_SIZE); page < pages; page++) {
+      long long page_end = (long long)(page + 1) * BACKUP_PAGE_SIZE;
+      if ((page_end < (long long)length ? page_end : (long long)length) > data - offset) {
+        break;
+      }
+      *holes |= 1ULL << page;
+    }
+    if (data >= end) {
+      break;
+    }
+    hole = lseek(source->fd, data, SEEK_HOLE);
+    pos = hole > data ? hole : end;
+  }
+  if (eof < end) {
+    return eof > offset ? (size_t)(eof - offset) : 0;
+  }
+  return length;
+}
+
+/**
+  @brief Read a range of a data file, skipping its holes.
+
+  Pages lying wholly in a hole are zero-filled and flagged instead of
+  read, so a sparse tablespace costs reads only for its allocated bytes.
+
+  @param [in,out] source   File.
+  @param [out]    buffer   Buffer as for source_read.
+  @param [in]     length   Bytes wanted, at most BACKUP_SCAN_PAGES pages.
+  @param [in]     offset   Range start, page aligned.
+  @param [out]    holes    Bit i set: page i of the range lies in a hole.
+  @param [in]     throttle I/O limits, charged for the bytes read only.
+
+  @retval Bytes read or zero-filled, short at the end of the file; -1 on failure.
+*/
+static ssize_t source_read_sparse(SourceFile *source, unsigned char *buffer, size_t length, long long offset,
+                                  unsigned long long *holes, Throttle *throttle) {
+  unsigned int pages = (unsigned int)((length + BACKUP_PAGE_SIZE - 1) / BACKUP_PAGE_SIZE);
+  size_t within = source_holes(source, length, offset, holes);
+  unsigned int page = 0;
+
+  while (page < pages) {
+    size_t from = (size_t)page * BACKUP_PAGE_SIZE;
+    unsigned int run = page;
+    size_t run_length;
+    ssize_t n;
+
+    if ((*holes >> page) & 1) {
+      memset(buffer + from, 0, length - from < BACKUP_PAGE_SIZE ? length - from : BACKUP_PAGE_SIZE);
+      page++;
+      continue;
+    }
+    while (run < pages && !((*holes >> run) & 1)) {
+      run++;
+    }
+    run_length = ((size_t)run * BACKUP_PAGE_SIZE < length ? (size_t)run * BACKUP_PAGE_SIZE : length) - from;
+    throttle_wait(throttle, 0, (long long)run_length, 1);
+    n = source_read(source, buffer + from, run_length, offset + (long long)from);
+    if (n < 0) {
+      return -1;
+    }
+    if ((size_t)n < run_length) {
+      return (ssize_t)(from + (size_t)n);
+    }
+    page = run;
+  }
+  return (ssize_t)within;
+}
+
+/**
+  @brief Count the bytes of a range that lie in flagged pages.
+
+  @param [in] holes  Bit i set: page i is a hole.
+  @param [in] length Range length, at most BACKUP_SCAN_PAGES pages.
+
+  @retval Bytes.
+*/
+static long long hole_length(unsigned long long holes, size_t length) {
+  long long bytes = 0;
+  size_t pos;
+
+  for (pos = 0; pos < length; pos += BACKUP_PAGE_SIZE) {
+    if ((holes >> (pos / BACKUP_PAGE_SIZE)) & 1) {
+      bytes += (long long)(length - pos < BACKUP_PAGE_SIZE ? length - pos : BACKUP_PAGE_SIZE);
+    }
+  }
+  return bytes;
+}
+
+/**
+  @brief Copy a byte range without passing it through user space.
+
+  Tries copy_file_range, which lets the filesystem share extents or
+  offload the copy, then sendfile.  Both keep the data in the kernel.
+
+  @param [in]     in       Source descriptor.
+  @param [in]     out      Destination descriptor.
+  @param [in]     offset   Range start, same in both files.
+  @param [in]     length   Range length.
+  @param [in,out] method   Copy method; downgraded when a method is unsupported.
+  @param [in]     throttle I/O limits, or NULL.
+  @param [in,out] source   Source file whose new pages are dropped, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int copy_range(int in, int out, long long offset, long long length, int *method, Throttle *throttle,
+                      SourceFile *source) {
+  long long step = throttle && throttle->active ? BACKUP_BLOCK_SIZE : BACKUP_COPY_CHUNK;
+  long long done = 0;
+
+  while (done < length && *method == BACKUP_COPY_RANGE) {
+    loff_t in_off = offset + done;
+    loff_t out_off = offset + done;
+    size_t chunk = length - done > step ? (size_t)step : (size_t)(length - done);
+    ssize_t n;
+
+    throttle_wait(throttle, 0, (long long)chunk, 1);
+    throttle_wait(throttle, 1, (long long)chunk, 1);
+    if (source && source_snapshot(source, offset + done, chunk) != 0) {
+      return 1;
+    }
+    n = copy_file_range(in, &in_off, out, &out_off, chunk, 0);
+    if (source) {
+      source_drop(source, offset + done, chunk);
+    }
+
+    if (n > 0) {
+      done += n;
+    } else if (n == 0) {
+      /* Source shrank under us */
+      return 0;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) {
+      *method = BACKUP_COPY_SENDFILE;
+    } else {
+      return 1;
+    }
+  }
+
+  while (done < length) {
+    off_t in_off = offset + done;
+    size_t chunk = length - done > step ? (size_t)step : (size_t)(length - done);
+    ssize_t n;
+
+    throttle_wait(throttle, 0, (long long)chunk, 1);
+    throttle_wait(throttle, 1, (long long)chunk, 1);
+    if (lseek(out, offset + done, SEEK_SET) < 0 || (source && source_snapshot(source, offset + done, chunk) != 0)) {
+      return 1;
+    }
+    n = sendfile(out, in, &in_off, chunk);
+    if (source) {
+      source_drop(source, offset + done, chunk);
+    }
+    if (n > 0) {
+      done += n;
+    } else if (n == 0) {
+      return 0;
+    } else if (errno != EINTR) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+  @brief Copy the allocated extents of a byte range, leaving its holes.
+
+  The destination must already be sized, or be extended afterwards, so
+  the skipped ranges read back as zeros.  Filesystems that do not report
+  holes are copied whole.
+
+  @param [in]     in       Source descriptor.
+  @param [in]     out      Destination descriptor.
+  @param [in]     offset   Range start, same in both files.
+  @param [in]     length   Range length.
+  @param [in,out] method   Copy method, as for copy_range.
+  @param [in]     throttle I/O limits, or NULL.
+  @param [in,out] source   Source file whose new pages are dropped, or NULL.
+  @param [out]    copied   Bytes copied, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int copy_sparse_range(int in, int out, long long offset, long long length, int *method, Throttle *throttle,
+                             SourceFile *source, long long *copied) {
+  long long end = offset + length;
+  long long pos = offset;
+
+  if (copied) {
+    *copied = 0;
+  }
+  while (pos < end) {
+    long long data = lseek(in, pos, SEEK_DATA);
+    long long hole;
+
+    if (data < 0 && errno == ENXIO) {
+      break;
+    }
+    if (data < 0) {
+      data = pos;
+      hole = end;
+    } else {
+      hole = lseek(in, data, SEEK_HOLE);
+      if (hole <= data || hole > end) {
+        hole = end;
+      }
+    }
+    if (data >= end) {
+      break;
+    }
+    if (copy_range(in, out, data, hole - data, method, throttle, source) != 0) {
+      return 1;
+    }
+    if (copied) {
+      *copied += hole - data;
+    }
+    pos = hole;
+  }
+  return 0;
+}
+
+/**
+  @brief Share the extents of a data file with its backup copy.
+
+  @param [in] src  Source path.
+  @param [in] dst  Destination path.
+  @param [in] file File description.
+
+  @retval 0 cloned, 1 not cloned (the pipeline copies it instead).
+*/
+static int clone_data_file(const char *src, const char *dst, const BackupFile *file) {
+  struct timespec times[2];
+  int in, out;
+  int ret = 1;
+
+  if (create_parent_directory(dst) != 0) {
+    return 1;
+  }
+  in = open(src, O_RDONLY);
+  if (in < 0) {
+    return 1;
+  }
+  out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, file->mode ? file->mode : 0640);
+  if (out >= 0) {
+    if (ioctl(out, FICLONE, in) == 0) {
+      times[0].tv_sec = times[1].tv_sec = (time_t)(file->mtime / 1000000000LL);
+      times[0].tv_nsec = times[1].tv_nsec = (long)(file->mtime % 1000000000LL);
+      futimens(out, times);
+      ret = 0;
+    }
+    if (close(out) != 0) {
+      ret = 1;
+    }
+  }
+  close(in);
+  return ret;
+}
+
+/**
+  @brief Write a whole buffer.
+
+  @param [in] fd     Descriptor.
+  @param [in] data   Data.
+  @param [in] length Data length.
+
+  @retval 0 success, 1 failure.
+*/
+static int write_all(int fd, const unsigned char *data, size_t length) {
+  while (length > 0) {
+    ssize_t n = write(fd, data, length);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 1;
+    }
+    data += n;
+    length -= (size_t)n;
+  }
+  return 0;
+}
+
+/**
+  @brief Write a whole buffer at an offset.
+
+  @param [in] fd     Output descriptor.
+  @param [in] data   Data.
+  @param [in] length Data length.
+  @param [in] offset File offset.
+
+  @retval 0 success, 1 failure.
+*/
+static int pwrite_all(int fd, const unsigned char *data, size_t length, long long offset) {
+  while (length > 0) {
+    ssize_t n = pwrite(fd, data, length, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 1;
+    }
+    data += n;
+    length -= (size_t)n;
+    offset += n;
+  }
+  return 0;
+}
+
+/**
+  @brief Find the all-zero pages of a buffer.
+
+  @param [in] data   Data.
+  @param [in] length Data length, at most BACKUP_SCAN_PAGES pages.
+
+  @retval Bit i set: page i is all zeros.
+*/
+static unsigned long long zero_pages(const unsigned char *data, size_t length) {
+  unsigned long long zero = 0;
+  size_t pos;
+  int page = 0;
+
+  for (pos = 0; pos < length; pos += BACKUP_PAGE_SIZE, page++) {
+    size_t n = length - pos < BACKUP_PAGE_SIZE ? length - pos : BACKUP_PAGE_SIZE;
+    if (data[pos] == 0 && memcmp(data + pos, data + pos + 1, n - 1) == 0) {
+      zero |= 1ULL << page;
+    }
+  }
+  return zero;
+}
+
+/**
+  @brief Write a buffer at an offset, leaving holes for flagged pages.
+
+  Skipped pages must read back as zeros: the file is sized afterwards or
+  was sized, empty, before.
+
+  @param [in] fd     Descriptor.
+  @param [in] data   Data.
+  @param [in] length Data length, at most BACKUP_SCAN_PAGES pages.
+  @param [in] offset File offset.
+  @param [in] holes  Bit i set: skip page i.
+
+  @retval 0 success, 1 failure.
+*/
+static int pwrite_sparse(int fd, const unsigned char *data, size_t length, long long offset,
+                         unsigned long long holes) {
+  size_t pos = 0;
+
+  while (pos < length) {
+    size_t page = pos / BACKUP_PAGE_SIZE;
+    size_t end = pos;
+
+    if ((holes >> page) & 1) {
+      pos += BACKUP_PAGE_SIZE;
+      continue;
+    }
+    while (end < length && !((holes >> (end / BACKUP_PAGE_SIZE)) & 1)) {
+      end += BACKUP_PAGE_SIZE;
+    }
+    if (end > length) {
+      end = length;
+    }
+    if (pwrite_all(fd, data + pos, end - pos, offset + (long long)pos) != 0) {
+      return 1;
+    }
+    pos = end;
+  }
+  return 0;
+}
+
+static unsigned int crc32c_table[256];
+static int crc32c_hardware;
+
+/**
+  @brief Build the CRC32C (Castagnoli) lookup table and detect SSE4.2.
+*/
+static void crc32c_build(void) {
+  unsigned int i, j;
+
+  for (i = 0; i < 256; i++) {
+    unsigned int crc = i;
+    for (j = 0; j < 8; j++) {
+      crc = (crc >> 1) ^ (0x82f63b78U & (0U - (crc & 1)));
+    }
+    crc32c_table[i] = crc;
+  }
+#if defined(__x86_64__)
+  crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/**
+  @brief Set up CRC32C once per process; the archiver thread may race a backup.
+*/
+static void crc32c_init(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  pthread_once(&once, crc32c_build);
+}
+
+#if defined(__x86_64__)
+/**
+  @brief CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time.
+
+  @param [in] crc    Running checksum, pre-inverted.
+  @param [in] data   Data.
+  @param [in] length Data length.
+
+  @retval Running checksum.
+*/
+__attribute__((target("sse4.2"))) static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *data,
+                                                                   size_t length) {
+  unsigned long long crc64 = crc;
+
+  while (length >= 8) {
+    unsigned long long word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+  crc = (unsigned int)crc64;
+  while (length-- > 0) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+#endif
+
+/**
+  @brief CRC32C of a buffer, optionally continuing an earlier checksum.
+
+  @param [in] crc    Checksum of the preceding bytes, 0 to start.
+  @param [in] data   Data.
+  @param [in] length Data length.
+
+  @retval Checksum.
+*/
+static unsigned int crc32c(unsigned int crc, const unsigned char *data, size_t length) {
+  size_t i;
+
+  crc ^= 0xffffffffU;
+#if defined(__x86_64__)
+  if (crc32c_hardware) {
+    return crc32c_sse42(crc, data, length) ^ 0xffffffffU;
+  }
+#endif
+  for (i = 0; i < length; i++) {
+    crc = crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffffU;
+}
+
+static unsigned long long gear_table[256];
+static unsigned long long gear_table_shifted[256];
+static unsigned long long chunk_mask_s;
+static unsigned long long chunk_mask_l;
+
+/**
+  @brief Build the gear table and FastCDC masks.
+
+  The table comes from a fixed seed so that chunk boundaries, and
+  therefore deduplication, are stable across runs and hosts.  Mask bits
+  are spread below bit 62 so the shifted masks of the two-byte step stay
+  inside the word.
+*/
+static void chunker_init(void) {
+  unsigned long long seed = 0x6a09e667f3bcc908ULL;
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear_table[i] = z ^ (z >> 31);
+    gear_table_shifted[i] = gear_table[i] << 1;
+  }
+  chunk_mask_s = 0;
+  for (i = 0; i < BACKUP_CHUNK_MASK_S_BITS; i++) {
+    chunk_mask_s |= 1ULL << (61 - 3 * i);
+  }
+  chunk_mask_l = 0;
+  for (i = 0; i < BACKUP_CHUNK_MASK_L_BITS; i++) {
+    chunk_mask_l |= 1ULL << (61 - 4 * i);
+  }
+}
+
+/**
+  @brief Find the next FastCDC cut point.
+
+  The first BACKUP_CHUNK_MIN bytes are skipped, the stricter mask applies
+  up to the average size and the looser one after it (normalized
+  chunking).  The gear hash rolls two bytes per step: the first byte uses
+  the pre-shifted table and is tested against the shifted mask, which
+  halves the shifts and keeps the loop free of data-dependent branches
+  other than the cut test.
+
+  @param [in] data   Data.
+  @param [in] length Bytes available.
+
+  @retval Length of the next chunk.
+*/
+static size_t chunk_cut(const unsigned char *data, size_t length) {
+  unsigned long long mask_s_shifted = chunk_mask_s << 1;
+  unsigned long long mask_l_shifted = chunk_mask_l << 1;
+  unsigned long long hash = 0;
+  size_t limit = length < BACKUP_CHUNK_MAX ? length : BACKUP_CHUNK_MAX;
+  size_t normal = limit < BACKUP_CHUNK_AVG ? limit : BACKUP_CHUNK_AVG;
+  size_t i = BACKUP_CHUNK_MIN;
+
+  if (length <= BACKUP_CHUNK_MIN) {
+    return length;
+  }
+  for (; i + 1 < normal; i += 2) {
+    hash = (hash << 2) + gear_table_shifted[data[i]];
+    if (!(hash & mask_s_shifted)) {
+      return i + 1;
+    }
+    hash += gear_table[data[i + 1]];
+    if (!(hash & chunk_mask_s)) {
+      return i + 2;
+    }
+  }
+  for (; i + 1 < limit; i += 2) {
+    hash = (hash << 2) + gear_table_shifted[data[i]];
+    if (!(hash & mask_l_shifted)) {
+      return i + 1;
+    }
+    hash += gear_table[data[i + 1]];
+    if (!(hash & chunk_mask_l)) {
+      return i + 2;
+    }
+  }
+  return limit;
+}
+
+/**
+  @brief Split a block into chunks and hash them.
+
+  Blocks are chunked independently so that the compress pool can work on
+  them in parallel; a block edge is always a cut.  Data files are updated
+  in place and grow at the end, so block edges stay aligned with content.
+
+  @param [in,out] block Block with its stored bytes in out.
+*/
+static void chunk_block(BackupBlock *block) {
+  size_t pos = 0;
+
+  block->chunk_count = 0;
+  while (pos < block->out_length && block->chunk_count < BACKUP_MAX_BLOCK_CHUNKS) {
+    BackupChunk *chunk = &block->chunks[block->chunk_count++];
+    size_t length = chunk_cut(block->out + pos, block->out_length - pos);
+
+    chunk->offset = (unsigned int)pos;
+    chunk->length = (unsigned int)length;
+    SHA256(block->out + pos, length, chunk->hash);
+    pos += length;
+  }
+}
+
+/**
+  @brief Format a chunk hash as hex.
+
+  @param [in]  hash Chunk hash.
+  @param [out] hex  Buffer of 2 * SHA256_DIGEST_LENGTH + 1 bytes.
+*/
+static void chunk_hex(const unsigned char *hash, char *hex) {
+  static const char digits[] = "0123456789abcdef";
+  int i;
+
+  for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+    hex[2 * i] = digits[hash[i] >> 4];
+    hex[2 * i + 1] = digits[hash[i] & 15];
+  }
+  hex[2 * SHA256_DIGEST_LENGTH] = '\0';
+}
+
+/**
+  @brief Compress one frame.
+
+  @param [in]  stream     Deflate stream of the calling thread.
+  @param [in]  data       Raw bytes.
+  @param [in]  length     Raw length.
+  @param [out] out        Compressed bytes.
+  @param [in]  capacity   Size of out.
+  @param [out] out_length Compressed length.
+
+  @retval BACKUP_FRAME_DEFLATE when compression helped, else BACKUP_FRAME_STORED.
+*/
+static int frame_compress(z_stream *stream, const unsigned char *data, size_t length, unsigned char *out,
+                          size_t capacity, size_t *out_length) {
+  if (deflateReset(stream) != Z_OK) {
+    return BACKUP_FRAME_STORED;
+  }
+  stream->next_in = (Bytef *)data;
+  stream->avail_in = (uInt)length;
+  stream->next_out = out;
+  stream->avail_out = (uInt)capacity;
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out >= length) {
+    return BACKUP_FRAME_STORED;
+  }
+  *out_length = stream->total_out;
+  return BACKUP_FRAME_DEFLATE;
+}
+
+/**
+  @brief Fill the header of one frame.
+
+  @param [out] header        Header, BACKUP_FRAME_HEADER_SIZE bytes.
+  @param [in]  raw_length    Length before compression.
+  @param [in]  stored_length Stored length.
+  @param [in]  flags         BACKUP_FRAME_*.
+*/
+static void frame_header(unsigned int *header, unsigned int raw_length, unsigned int stored_length, int flags) {
+  header[0] = BACKUP_FRAME_MAGIC;
+  header[1] = raw_length;
+  header[2] = stored_length;
+  header[3] = (unsigned int)flags;
+}
+
+/**
+  @brief Write one frame.
+
+  @param [in] fd            Output descriptor.
+  @param [in] data          Stored bytes.
+  @param [in] raw_length    Length before compression.
+  @param [in] stored_length Stored length.
+  @param [in] flags         BACKUP_FRAME_*.
+
+  @retval 0 success, 1 failure.
+*/
+static int frame_write(int fd, const unsigned char *data, unsigned int raw_length, unsigned int stored_length,
+                       int flags) {
+  unsigned int header[4];
+
+  frame_header(header, raw_length, stored_length, flags);
+  return write_all(fd, (const unsigned char *)header, sizeof(header)) != 0 ||
+         write_all(fd, data, stored_length) != 0;
+}
+
+/**
+  @brief Build the seek table that ends a frame file.
+
+  @param [in]  raw    Raw length of each frame.
+  @param [in]  stored Stored length of each frame.
+  @param [in]  count  Number of frames.
+  @param [out] length Table length in bytes.
+
+  @retval Table to free, or NULL on failure.
+*/
+static unsigned int *frame_seek_table(const unsigned int *raw, const unsigned int *stored, int count,
+                                      size_t *length) {
+  unsigned int *table = (unsigned int *)malloc(((size_t)count * 2 + 2) * sizeof(unsigned int));
+  int i;
+
+  *length = ((size_t)count * 2 + 2) * sizeof(unsigned int);
+  if (!table) {
+    return NULL;
+  }
+  for (i = 0; i < count; i++) {
+    table[2 * i] = raw[i];
+    table[2 * i + 1] = stored[i];
+  }
+  table[2 * count] = (unsigned int)count;
+  table[2 * count + 1] = BACKUP_SEEK_MAGIC;
+  return table;
+}
+
+/**
+  @brief Write the seek table that ends a frame file.
+
+  Layout: raw and stored length of every frame, then the frame count
+  and BACKUP_SEEK_MAGIC, so readers find the table from the file end.
+
+  @param [in]  fd     Output descriptor.
+  @param [in]  raw    Raw length of each frame.
+  @param [in]  stored Stored length of each frame.
+  @param [in]  count  Number of frames.
+  @param [out] crc    CRC32C of the table, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int frame_write_seek_table(int fd, const unsigned int *raw, const unsigned int *stored, int count,
+                                  unsigned int *crc) {
+  size_t length;
+  unsigned int *table = frame_seek_table(raw, stored, count, &length);
+  int ret;
+
+  if (!table) {
+    return 1;
+  }
+  ret = write_all(fd, (const unsigned char *)table, length);
+  if (crc) {
+    *crc = crc32c(0, (const unsigned char *)table, length);
+  }
+  free(table);
+  return ret;
+}
+
+/**
+  @brief Close a frame reader.
+
+  @param [in] reader Reader.
+*/
+static void frame_reader_close(FrameReader *reader) {
+  if (reader->fd >= 0) {
+    close(reader->fd);
+  }
+  if (reader->stream_ready) {
+    inflateEnd(&reader->stream);
+  }
+  free(reader->raw_lengths);
+  free(reader->raw_offsets);
+  free(reader->raw);
+  free(reader->stored);
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = -1;
+}
+
+/**
+  @brief Open a frame file for random access.
+
+  @param [out] reader Reader.
+  @param [in]  path   Frame file path.
+
+  @retval 0 success, 1 missing or malformed file.
+*/
+static int frame_reader_open(FrameReader *reader, const char *path) {
+  unsigned int footer[2];
+  unsigned int *table;
+  long long stored_offset = 0;
+  long long raw_offset = 0;
+  struct stat st;
+  int i;
+
+  memset(reader, 0, sizeof(*reader));
+  reader->cached_frame = -1;
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd < 0) {
+    return 1;
+  }
+  if (fstat(reader->fd, &st) != 0 || st.st_size < (off_t)sizeof(footer) ||
+      pread(reader->fd, footer, sizeof(footer), st.st_size - sizeof(footer)) != (ssize_t)sizeof(footer) ||
+      footer[1] != BACKUP_SEEK_MAGIC ||
+      (long long)footer[0] * 8 + (long long)sizeof(footer) > (long long)st.st_size) {
+    close(reader->fd);
+    reader->fd = -1;
+    return 1;
+  }
+
+  reader->frame_count = (int)footer[0];
+  reader->raw_lengths = (unsigned int *)malloc((reader->frame_count + 1) * 2 * sizeof(unsigned int));
+  reader->raw_offsets = (long long *)malloc((reader->frame_count + 1) * 2 * sizeof(long long));
+  reader->raw = (unsigned char *)malloc(BACKUP_BLOCK_SIZE);
+  reader->stored = (unsigned char *)malloc(compressBound(BACKUP_BLOCK_SIZE));
+  if (!reader->raw_lengths || !reader->raw_offsets || !reader->raw || !reader->stored ||
+      inflateInit2(&reader->stream, -15) != Z_OK) {
+    frame_reader_close(reader);
+    return 1;
+  }
+  reader->stream_ready = 1;
+  reader->stored_lengths = reader->raw_lengths + reader->frame_count + 1;
+  reader->stored_offsets = reader->raw_offsets + reader->frame_count + 1;
+  table = (unsigned int *)malloc((size_t)reader->frame_count * 8 + 1);
+  if (!table || (reader->frame_count > 0 &&
+                 pread(reader->fd, table, (size_t)reader->frame_count * 8,
+                       st.st_size - sizeof(footer) - (off_t)reader->frame_count * 8) !=
+                     (ssize_t)reader->frame_count * 8)) {
+    free(table);
+    frame_reader_close(reader);
+    return 1;
+  }
+  for (i = 0; i < reader->frame_count; i++) {
+    const unsigned int *entry = table + 2 * i;
+    if (entry[0] > BACKUP_BLOCK_SIZE || entry[1] > compressBound(BACKUP_BLOCK_SIZE)) {
+      free(table);
+      frame_reader_close(reader);
+      return 1;
+    }
+    reader->raw_lengths[i] = entry[0];
+    reader->stored_lengths[i] = entry[1];
+    reader->raw_offsets[i] = raw_offset;
+    reader->stored_offsets[i] = stored_offset;
+    raw_offset += entry[0];
+    stored_offset += BACKUP_FRAME_HEADER_SIZE + entry[1];
+  }
+  free(table);
+  reader->raw_offsets[reader->frame_count] = raw_offset;
+  reader->raw_size = raw_offset;
+  return 0;
+}
+
+/**
+  @brief Load and decompress one frame into the reader's buffer.
+
+  @param [in] reader Reader.
+  @param [in] frame  Frame number.
+
+  @retval 0 success, 1 malformed frame.
+*/
+static int frame_reader_load(FrameReader *reader, int frame) {
+  unsigned int header[4];
+  unsigned int stored = reader->stored_lengths[frame];
+  unsigned int raw = reader->raw_lengths[frame];
+  off_t offset = reader->stored_offsets[frame];
+
+  if (reader->cached_frame == frame) {
+    return 0;
+  }
+  reader->cached_frame = -1;
+  if (pread(reader->fd, header, sizeof(header), offset) != (ssize_t)sizeof(header) ||
+      header[0] != BACKUP_FRAME_MAGIC || header[1] != raw || header[2] != stored) {
+    return 1;
+  }
+  if (header[3] == BACKUP_FRAME_STORED) {
+    if (stored != raw || pread(reader->fd, reader->raw, raw, offset + sizeof(header)) != (ssize_t)raw) {
+      return 1;
+    }
+  } else if (header[3] == BACKUP_FRAME_ZERO) {
+    if (stored != 0) {
+      return 1;
+    }
+    memset(reader->raw, 0, raw);
+  } else {
+    if (pread(reader->fd, reader->stored, stored, offset + sizeof(header)) != (ssize_t)stored ||
+        inflateReset(&reader->stream) != Z_OK) {
+      return 1;
+    }
+    reader->stream.next_in = reader->stored;
+    reader->stream.avail_in = stored;
+    reader->stream.next_out = reader->raw;
+    reader->stream.avail_out = raw;
+    if (inflate(&reader->stream, Z_FINISH) != Z_STREAM_END || reader->stream.total_out != raw) {
+      return 1;
+    }
+  }
+  reader->cached_frame = frame;
+  return 0;
+}
+
+/**
+  @brief Read raw bytes at any offset, decompressing only the frames involved.
+
+  @param [in]  reader Reader.
+  @param [in]  offset Raw offset.
+  @param [out] buffer Destination.
+  @param [in]  length Bytes wanted.
+
+  @retval Bytes read, or -1 on a malformed frame.
+*/
+static long long frame_reader_read(FrameReader *reader, long long offset, unsigned char *buffer, size_t length) {
+  size_t done = 0;
+  int low = 0;
+  int high = reader->frame_count - 1;
+
+  /* Last frame starting at or before offset */
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (reader->raw_offsets[mid] <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  while (done < length && offset + (long long)done < reader->raw_size && low < reader->frame_count) {
+    long long position = offset + (long long)done;
+    size_t skip;
+    size_t count;
+
+    if (position >= reader->raw_offsets[low + 1]) {
+      low++;
+      continue;
+    }
+    if (frame_reader_load(reader, low) != 0) {
+      return -1;
+    }
+    skip = (size_t)(position - reader->raw_offsets[low]);
+    count = reader->raw_lengths[low] - skip;
+    if (count > length - done) {
+      count = length - done;
+    }
+    memcpy(buffer + done, reader->raw + skip, count);
+    done += count;
+  }
+  return (long long)done;
+}
+
+/**
+  @brief Append bytes to a stream archive.
+
+  @param [in,out] stream Stream archive.
+  @param [in]     data   Data.
+  @param [in]     length Data length.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_write(BackupStream *stream, const void *data, size_t length) {
+  if (write_all(stream->fd, (const unsigned char *)data, length) != 0) {
+    return 1;
+  }
+  stream->offset += (long long)length;
+  return 0;
+}
+
+/**
+  @brief Start a stream archive.
+
+  An archive is written front to back and never seeked, so it can go to
+  a pipe: a header, then one entry per file, then an index of the
+  entries and a fixed-size trailer that locates the index.  An entry is
+  a header and the file's path, then records of stored bytes or of zero
+  runs, then an empty record.
+
+  @param [out] stream Stream archive.
+  @param [in]  path   Archive file, or NULL for standard output.
+  @param [in]  root   Backup directory; entry paths are relative to it.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_open(BackupStream *stream, const char *path, const char *root) {
+  unsigned int header[2] = {BACKUP_STREAM_MAGIC, BACKUP_STREAM_VERSION};
+
+  memset(stream, 0, sizeof(*stream));
+  stream->root = root;
+  stream->fd = STDOUT_FILENO;
+  if (path) {
+    snprintf(stream->path, sizeof(stream->path), "%s", path);
+    stream->fd = create_parent_directory(path) == 0 ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640) : -1;
+    if (stream->fd < 0) {
+      return 1;
+    }
+  }
+  return stream_write(stream, header, sizeof(header));
+}
+
+/**
+  @brief Start the entry of a file.
+
+  @param [in,out] stream Stream archive.
+  @param [in]     path   File path in the backup directory.
+  @param [in]     mode   Permission bits.
+  @param [in]     mtime  Modification time in nanoseconds, 0 to leave it alone.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_begin(BackupStream *stream, const char *path, unsigned int mode, long long mtime) {
+  size_t root = strlen(stream->root);
+  unsigned int header[4];
+  StreamEntry *entry;
+
+  if (strncmp(path, stream->root, root) == 0 && path[root] == '/') {
+    path += root + 1;
+  }
+  if (stream->count == stream->size) {
+    int size = stream->size ? stream->size * 2 : 64;
+    StreamEntry *entries = (StreamEntry *)realloc(stream->entries, size * sizeof(StreamEntry));
+    if (!entries) {
+      return 1;
+    }
+    stream->entries = entries;
+    stream->size = size;
+  }
+  entry = &stream->entries[stream->count];
+  memset(entry, 0, sizeof(*entry));
+  entry->path = strdup(path);
+  if (!entry->path) {
+    return 1;
+  }
+  entry->offset = stream->offset;
+  entry->mtime = mtime;
+  entry->mode = mode & 07777;
+  stream->count++;
+  header[0] = BACKUP_STREAM_ENTRY;
+  header[1] = (unsigned int)strlen(path);
+  header[2] = entry->mode;
+  header[3] = 0;
+  return stream_write(stream, header, sizeof(header)) != 0 || stream_write(stream, path, header[1]) != 0;
+}
+
+/**
+  @brief Append stored bytes to the current entry.
+
+  @param [in,out] stream Stream archive.
+  @param [in]     data   Data.
+  @param [in]     length Data length.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_put(BackupStream *stream, const unsigned char *data, size_t length) {
+  StreamEntry *entry = &stream->entries[stream->count - 1];
+
+  while (length > 0) {
+    unsigned int record[2];
+    size_t n = length < BACKUP_STREAM_MAX_RECORD ? length : BACKUP_STREAM_MAX_RECORD;
+
+    record[0] = (unsigned int)n;
+    record[1] = 0;
+    if (stream_write(stream, record, sizeof(record)) != 0 || stream_write(stream, data, n) != 0) {
+      return 1;
+    }
+    entry->crc = crc32c(entry->crc, data, n);
+    entry->length += (long long)n;
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/**
+  @brief Append a run of zeros to the current entry; nothing is stored.
+
+  @param [in,out] stream Stream archive.
+  @param [in]     length Run length.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_put_zeros(BackupStream *stream, long long length) {
+  StreamEntry *entry = &stream->entries[stream->count - 1];
+
+  while (length > 0) {
+    unsigned int record[2];
+    long long n = length < BACKUP_STREAM_MAX_RECORD ? length : BACKUP_STREAM_MAX_RECORD;
+
+    record[0] = (unsigned int)n;
+    record[1] = BACKUP_STREAM_ZERO;
+    if (stream_write(stream, record, sizeof(record)) != 0) {
+      return 1;
+    }
+    entry->length += n;
+    length -= n;
+  }
+  return 0;
+}
+
+/**
+  @brief Append a buffer to the current entry, flagged pages as zero runs.
+
+  As pwrite_sparse(), so extraction leaves holes where the source had them.
+
+  @param [in,out] stream Stream archive.
+  @param [in]     data   Data.
+  @param [in]     length Data length, at most BACKUP_SCAN_PAGES pages.
+  @param [in]     holes  Bit i set: page i is a hole.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_put_sparse(BackupStream *stream, const unsigned char *data, size_t length,
+                             unsigned long long holes) {
+  size_t pos = 0;
+
+  while (pos < length) {
+    int hole = (holes >> (pos / BACKUP_PAGE_SIZE)) & 1;
+    size_t end = pos;
+
+    while (end < length && (int)((holes >> (end / BACKUP_PAGE_SIZE)) & 1) == hole) {
+      end += BACKUP_PAGE_SIZE;
+    }
+    if (end > length) {
+      end = length;
+    }
+    if ((hole ? stream_put_zeros(stream, (long long)(end - pos)) : stream_put(stream, data + pos, end - pos)) != 0) {
+      return 1;
+    }
+    pos = end;
+  }
+  return 0;
+}
+
+/**
+  @brief End the current entry.
+
+  @param [in,out] stream Stream archive.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_end(BackupStream *stream) {
+  unsigned int record[2] = {0, 0};
+
+  return stream_write(stream, record, sizeof(record));
+}
+
+/**
+  @brief Append a file of the backup directory as one entry.
+
+  Holes become zero runs.
+
+  @param [in,out] stream Stream archive.
+  @param [in]     path   File path.
+  @param [in]     st     File status.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_add_file(BackupStream *stream, const char *path, const struct stat *st) {
+  unsigned char *buffer = (unsigned char *)malloc(BACKUP_STREAM_COPY);
+  long long size = (long long)st->st_size;
+  long long pos = 0;
+  int fd = open(path, O_RDONLY);
+  int ret = 0;
+
+  if (!buffer || fd < 0 ||
+      stream_begin(stream, path, st->st_mode, (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec) !=
+          0) {
+    ret = 1;
+  }
+  while (ret == 0 && pos < size) {
+    long long data = lseek(fd, pos, SEEK_DATA);
+    long long hole;
+
+    if (data < 0 && errno == ENXIO) {
+      data = size;
+    } else if (data < 0) {
+      data = pos;
+    }
+    hole = data < size ? lseek(fd, data, SEEK_HOLE) : size;
+    if (hole <= data || hole > size) {
+      hole = size;
+    }
+    ret = stream_put_zeros(stream, data - pos);
+    for (pos = data; ret == 0 && pos < hole;) {
+      size_t n = hole - pos < BACKUP_STREAM_COPY ? (size_t)(hole - pos) : BACKUP_STREAM_COPY;
+      if (pread(fd, buffer, n, pos) != (ssize_t)n || stream_put(stream, buffer, n) != 0) {
+        ret = 1;
+      }
+      pos += (long long)n;
+    }
+  }
+  if (ret == 0) {
+    ret = stream_end(stream);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(buffer);
+  return ret;
+}
+
+/**
+  @brief Append every regular file under a directory.
+
+  @param [in,out] stream Stream archive.
+  @param [in]     path   Directory.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_add_tree(BackupStream *stream, const char *path) {
+  struct dirent *entry;
+  DIR *dir = opendir(path);
+  int ret = 0;
+
+  if (!dir) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    char child[4096];
+    struct stat st;
+
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child) ||
+        lstat(child, &st) != 0) {
+      ret = 1;
+    } else if (S_ISDIR(st.st_mode)) {
+      ret = stream_add_tree(stream, child);
+    } else if (S_ISREG(st.st_mode)) {
+      ret = stream_add_file(stream, child, &st);
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+/**
+  @brief Write the index and trailer that end a stream archive.
+
+  Index records hold each entry's offset, length, modification time,
+  mode, CRC32C and path; the trailer holds the index offset, entry
+  count, index CRC32C, version and BACKUP_STREAM_TRAILER, so readers
+  find the index from the archive end.
+
+  @param [in,out] stream Stream archive.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_finish(BackupStream *stream) {
+  unsigned char trailer[BACKUP_STREAM_TRAILER_SIZE];
+  long long index_offset = stream->offset;
+  unsigned char *index;
+  unsigned int words[4];
+  size_t length = 0;
+  size_t pos = 0;
+  int ret;
+  int i;
+
+  for (i = 0; i < stream->count; i++) {
+    length += BACKUP_STREAM_INDEX_RECORD + strlen(stream->entries[i].path);
+  }
+  index = (unsigned char *)calloc(length ? length : 1, 1);
+  if (!index) {
+    return 1;
+  }
+  for (i = 0; i < stream->count; i++) {
+    const StreamEntry *entry = &stream->entries[i];
+    unsigned int fields[3] = {entry->mode, entry->crc, (unsigned int)strlen(entry->path)};
+
+    memcpy(index + pos, &entry->offset, 8);
+    memcpy(index + pos + 8, &entry->length, 8);
+    memcpy(index + pos + 16, &entry->mtime, 8);
+    memcpy(index + pos + 24, fields, sizeof(fields));
+    memcpy(index + pos + BACKUP_STREAM_INDEX_RECORD, entry->path, fields[2]);
+    pos += BACKUP_STREAM_INDEX_RECORD + fields[2];
+  }
+  words[0] = (unsigned int)stream->count;
+  words[1] = crc32c(0, index, length);
+  words[2] = BACKUP_STREAM_VERSION;
+  words[3] = BACKUP_STREAM_TRAILER;
+  memcpy(trailer, &index_offset, 8);
+  memcpy(trailer + 8, words, sizeof(words));
+  ret = stream_write(stream, index, length) != 0 || stream_write(stream, trailer, sizeof(trailer)) != 0;
+  free(index);
+  /* Standard output is the caller's to close */
+  if (stream->path[0]) {
+    if (ret == 0 && fsync(stream->fd) != 0) {
+      ret = 1;
+    }
+    if (close(stream->fd) != 0) {
+      ret = 1;
+    }
+    stream->fd = -1;
+  }
+  return ret;
+}
+
+/**
+  @brief Free a stream archive, closing its file.
+
+  @param [in,out] stream Stream archive.
+*/
+static void stream_free(BackupStream *stream) {
+  int i;
+
+  if (stream->path[0] && stream->fd >= 0) {
+    close(stream->fd);
+  }
+  for (i = 0; i < stream->count; i++) {
+    free(stream->entries[i].path);
+  }
+  free(stream->entries);
+  stream->entries = NULL;
+  stream->count = stream->size = 0;
+  stream->fd = -1;
+}
+
+/**
+  @brief Open a stream archive and load its index.
+
+  @param [in]  path   Archive file.
+  @param [out] stream Stream archive, its descriptor open for reading.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_load(const char *path, BackupStream *stream) {
+  unsigned char trailer[BACKUP_STREAM_TRAILER_SIZE];
+  unsigned char *index = NULL;
+  long long index_offset;
+  unsigned int words[4];
+  struct stat st;
+  size_t length;
+  size_t pos = 0;
+  int ret = 0;
+  int i;
+
+  memset(stream, 0, sizeof(*stream));
+  snprintf(stream->path, sizeof(stream->path), "%s", path);
+  stream->root = "";
+  stream->fd = open(path, O_RDONLY);
+  if (stream->fd < 0 || fstat(stream->fd, &st) != 0 || st.st_size < 8 + BACKUP_STREAM_TRAILER_SIZE ||
+      pread(stream->fd, trailer, sizeof(trailer), st.st_size - BACKUP_STREAM_TRAILER_SIZE) != (ssize_t)sizeof(trailer)) {
+    stream_free(stream);
+    return 1;
+  }
+  memcpy(&index_offset, trailer, 8);
+  memcpy(words, trailer + 8, sizeof(words));
+  /* A truncated archive, from an interrupted backup, has no trailer */
+  if (words[3] != BACKUP_STREAM_TRAILER || words[2] != BACKUP_STREAM_VERSION || index_offset < 8 ||
+      index_offset > st.st_size - BACKUP_STREAM_TRAILER_SIZE) {
+    stream_free(stream);
+    return 1;
+  }
+  length = (size_t)(st.st_size - BACKUP_STREAM_TRAILER_SIZE - index_offset);
+  index = (unsigned char *)malloc(length ? length : 1);
+  stream->entries = (StreamEntry *)calloc(words[0] ? words[0] : 1, sizeof(StreamEntry));
+  stream->size = (int)words[0];
+  if (!index || !stream->entries || pread(stream->fd, index, length, index_offset) != (ssize_t)length ||
+      crc32c(0, index, length) != words[1]) {
+    ret = 1;
+  }
+  for (i = 0; ret == 0 && i < (int)words[0]; i++) {
+    StreamEntry *entry = &stream->entries[i];
+    unsigned int fields[3];
+
+    if (length - pos < BACKUP_STREAM_INDEX_RECORD) {
+      ret = 1;
+      break;
+    }
+    memcpy(&entry->offset, index + pos, 8);
+    memcpy(&entry->length, index + pos + 8, 8);
+    memcpy(&entry->mtime, index + pos + 16, 8);
+    memcpy(fields, index + pos + 24, sizeof(fields));
+    pos += BACKUP_STREAM_INDEX_RECORD;
+    if (length - pos < fields[2] || (entry->path = (char *)malloc(fields[2] + 1)) == NULL) {
+      ret = 1;
+      break;
+    }
+    memcpy(entry->path, index + pos, fields[2]);
+    entry->path[fields[2]] = '\0';
+    entry->mode = fields[0];
+    entry->crc = fields[1];
+    stream->count++;
+    pos += fields[2];
+  }
+  free(index);
+  if (ret != 0) {
+    stream_free(stream);
+  }
+  return ret;
+}
+
+/**
+  @brief Extract one entry of a loaded stream archive.
+
+  Zero runs are skipped, leaving holes; the length and CRC32C of the
+  entry are checked against the index.
+
+  @param [in] stream Stream archive, loaded.
+  @param [in] entry  Entry.
+  @param [in] dst    Output file, created or replaced.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_extract_entry(const BackupStream *stream, const StreamEntry *entry, const char *dst) {
+  unsigned char *buffer = (unsigned char *)malloc(BACKUP_STREAM_COPY);
+  size_t path_length = strlen(entry->path);
+  long long pos = entry->offset + 16 + (long long)path_length;
+  long long written = 0;
+  unsigned int header[4];
+  unsigned int crc = 0;
+  int fd = -1;
+  int ret = 0;
+
+  if (!buffer || pread(stream->fd, header, sizeof(header), entry->offset) != (ssize_t)sizeof(header) ||
+      header[0] != BACKUP_STREAM_ENTRY || header[1] != path_length || create_parent_directory(dst) != 0 ||
+      (fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, entry->mode ? entry->mode : 0640)) < 0) {
+    ret = 1;
+  }
+  while (ret == 0) {
+    unsigned int record[2];
+    long long done = 0;
+
+    if (pread(stream->fd, record, sizeof(record), pos) != (ssize_t)sizeof(record)) {
+      ret = 1;
+      break;
+    }
+    pos += (long long)sizeof(record);
+    if (record[0] == 0 && record[1] == 0) {
+      break;
+    }
+    if (record[1] == BACKUP_STREAM_ZERO) {
+      written += record[0];
+      continue;
+    }
+    while (ret == 0 && done < record[0]) {
+      size_t n = record[0] - done < BACKUP_STREAM_COPY ? (size_t)(record[0] - done) : BACKUP_STREAM_COPY;
+      if (pread(stream->fd, buffer, n, pos) != (ssize_t)n || pwrite_all(fd, buffer, n, written) != 0) {
+        ret = 1;
+      }
+      crc = crc32c(crc, buffer, n);
+      pos += (long long)n;
+      written += (long long)n;
+      done += (long long)n;
+    }
+  }
+  if (ret == 0 && (written != entry->length || crc != entry->crc || ftruncate(fd, written) != 0)) {
+    ret = 1;
+  }
+  if (ret == 0 && entry->mtime) {
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = (time_t)(entry->mtime / 1000000000LL);
+    times[0].tv_nsec = times[1].tv_nsec = (long)(entry->mtime % 1000000000LL);
+    futimens(fd, times);
+  }
+  if (fd >= 0 && close(fd) != 0) {
+    ret = 1;
+  }
+  free(buffer);
+  return ret;
+}
+
+/**
+  @brief Whether a stored name is a data file, or the given name itself.
+
+  A data file is stored under data/, with the suffixes of how it was
+  stored.
+
+  @param [in] name Stored name, relative to the backup directory.
+  @param [in] only Data file path, or stored name.
+
+  @retval 1 match, 0 none.
+*/
+static int stored_name_matches(const char *name, const char *only) {
+  size_t length = strlen(only);
+  const char *rest = name + sizeof(BACKUP_DATA_DIR) + length;
+
+  return strcmp(name, only) == 0 ||
+         (strncmp(name, BACKUP_DATA_DIR "/", sizeof(BACKUP_DATA_DIR)) == 0 &&
+          strlen(name) >= sizeof(BACKUP_DATA_DIR) + length && strncmp(name + sizeof(BACKUP_DATA_DIR), only, length) == 0 &&
+          (*rest == '\0' || strcmp(rest, BACKUP_DELTA_SUFFIX) == 0 || strcmp(rest, BACKUP_COMPRESSED_SUFFIX) == 0 ||
+           strcmp(rest, BACKUP_DELTA_SUFFIX BACKUP_COMPRESSED_SUFFIX) == 0 || strcmp(rest, BACKUP_RSYNC_SUFFIX) == 0));
+}
+
+/**
+  @brief Bring back the data files of a streamed backup from its archive.
+
+  A backup written to a stream keeps its metadata, manifest and maps in
+  the backup directory but not its data/ directory.  The data entries
+  are extracted there, only those of one file when a file is given; the
+  index locates them, so nothing else is read.
+
+  @param [in]  archive Archive file.
+  @param [in]  path    Backup path, <backup_dir>/<name>.
+  @param [in]  only    Data file to extract, or NULL for all.
+  @param [out] staged  Set to 1 if data/ was extracted and is to be removed.
+
+  @retval 0 success, 1 failure.
+*/
+static int stream_stage(const char *archive, const char *path, const char *only, int *staged) {
+  BackupStream stream;
+  char dst[8192];
+  int ret = 0;
+  int i;
+
+  *staged = 0;
+  if (stream_load(archive, &stream) != 0) {
+    return 1;
+  }
+  *staged = 1;
+  for (i = 0; ret == 0 && i < stream.count; i++) {
+    const char *name = stream.entries[i].path;
+
+    if (strncmp(name, BACKUP_DATA_DIR "/", sizeof(BACKUP_DATA_DIR)) != 0 || (only && !stored_name_matches(name, only))) {
+      continue;
+    }
+    /* Entry paths come from the archive: never let one leave the backup directory */
+    if (strstr(name, "/../") || strcmp(name + strlen(name) - 3, "/..") == 0 ||
+        snprintf(dst, sizeof(dst), "%s/%s", path, name) >= (int)sizeof(dst)) {
+      ret = 1;
+    } else {
+      ret = stream_extract_entry(&stream, &stream.entries[i], dst);
+    }
+  }
+  stream_free(&stream);
+  return ret;
+}
+
+/**
+  @brief Put a chunk into the store unless it is already there.
+
+  Chunks live in <backup_dir>/chunks/<first two hex digits>/<hash>.  New
+  chunks are written to a temporary name and renamed, so a crash never
+  leaves a truncated chunk under its final name.
+
+  Each chunk is a frame file with a single frame.
+
+  @param [in]  chunk_dir Chunk store directory.
+  @param [in]  hex       Chunk hash.
+  @param [in]  chunk     Chunk description.
+  @param [in]  data      Stored chunk bytes.
+  @param [out] stored    Bytes written, 0 if the chunk was already there.
+
+  @retval 0 success, 1 failure.
+*/
+static int chunk_store_put(const char *chunk_dir, const char *hex, const BackupChunk *chunk,
+                           const unsigned char *data, long long *stored) {
+  char path[4096];
+  char temp[sizeof(path) + 8];
+  int fd;
+  int ret;
+
+  *stored = 0;
+  snprintf(path, sizeof(path), "%s/%.2s/%s", chunk_dir, hex, hex);
+  if (access(path, F_OK) == 0) {
+    return 0;
+  }
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+  if (fd < 0 && errno == ENOENT) {
+    if (create_parent_directory(temp) != 0) {
+      return 1;
+    }
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+  }
+  if (fd < 0) {
+    return 1;
+  }
+  ret = frame_write(fd, data, chunk->length, chunk->stored_length, chunk->flags) ||
+        frame_write_seek_table(fd, &chunk->length, &chunk->stored_length, 1, NULL);
+  if (close(fd) != 0 || ret != 0 || rename(temp, path) != 0) {
+    unlink(temp);
+    return 1;
+  }
+  *stored = BACKUP_FRAME_HEADER_SIZE + chunk->stored_length + 16;
+  return 0;
+}
+
+/**
+  @brief Free the page arrays of one file entry.
+
+  @param [in] entry Page map entry.
+*/
+static void page_map_file_free(PageMapFile *entry) {
+  free(entry->path);
+  free(entry->lsns);
+  free(entry->crcs);
+  free(entry->changed);
+  memset(entry, 0, sizeof(*entry));
+}
+
+/**
+  @brief Free a page map.
+
+  @param [in] map Page map.
+*/
+static void page_map_free(PageMap *map) {
+  int i;
+
+  for (i = 0; i < map->count; i++) {
+    page_map_file_free(&map->files[i]);
+  }
+  free(map->files);
+  map->files = NULL;
+  map->count = 0;
+  map->size = 0;
+}
+
+/**
+  @brief Tell whether a file is an InnoDB tablespace by its name.
+
+  @param [in] path Relative path of the file.
+
+  @retval 1 .ibd or .ibu file, system or undo tablespace; 0 otherwise.
+*/
+static int backup_is_tablespace(const char *path) {
+  const char *name = strrchr(path, '/');
+  size_t len;
+
+  name = name ? name + 1 : path;
+  len = strlen(name);
+  if (len > 4 && (strcmp(name + len - 4, ".ibd") == 0 || strcmp(name + len - 4, ".ibu") == 0)) {
+    return 1;
+  }
+  return strncmp(name, "ibdata", 6) == 0 || strncmp(name, "undo", 4) == 0;
+}
+
+/**
+  @brief Allocate the page arrays of one file entry.
+
+  @param [out] entry      Page map entry.
+  @param [in]  file       Data file.
+
+  @retval 0 success, 1 failure.
+*/
+static int page_map_file_alloc(PageMapFile *entry, const BackupFile *file) {
+  unsigned int pages = (unsigned int)((file->size + BACKUP_PAGE_SIZE - 1) / BACKUP_PAGE_SIZE);
+
+  memset(entry, 0, sizeof(*entry));
+  entry->path = strdup(file->path);
+  entry->size = file->size;
+  entry->mtime = file->mtime;
+  entry->page_count = pages;
+  entry->tablespace = backup_is_tablespace(file->path);
+  entry->space_id = -1;
+  entry->lsns = (unsigned long long *)calloc(pages ? pages : 1, sizeof(unsigned long long));
+  entry->crcs = (unsigned int *)calloc(pages ? pages : 1, sizeof(unsigned int));
+  entry->changed = (unsigned char *)calloc(pages / 8 + 1, 1);
+  if (!entry->path || !entry->lsns || !entry->crcs || !entry->changed) {
+    page_map_file_free(entry);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  @brief Find a file in a page map.
+
+  @param [in] map  Page map, sorted by path.
+  @param [in] path Relative path.
+
+  @retval Entry, or NULL if the file is not in the map.
+*/
+static const PageMapFile *page_map_find(const PageMap *map, const char *path) {
+  int low = 0;
+  int high = map->count - 1;
+
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    int cmp = strcmp(map->files[mid].path, path);
+    if (cmp == 0) {
+      return &map->files[mid];
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return NULL;
+}
+
+/**
+  @brief Save a page map.
+
+  Layout: magic, version, file count, then per file the path, size,
+  mtime, flags, page count, LSN and CRC arrays and the change bitmap.
+  Version 1 maps, without flags, still load.
+
+  @param [in] path Map file path.
+  @param [in] map  Page map.
+
+  @retval 0 success, 1 failure.
+*/
+static int page_map_save(const char *path, const PageMap *map) {
+  unsigned int header[3] = {BACKUP_PAGE_MAP_MAGIC, BACKUP_PAGE_MAP_VERSION, (unsigned int)map->count};
+  FILE *fp = fopen(path, "wb");
+  int ok;
+  int i;
+
+  if (!fp) {
+    return 1;
+  }
+  ok = fwrite(header, sizeof(header), 1, fp) == 1;
+  for (i = 0; ok && i < map->count; i++) {
+    const PageMapFile *entry = &map->files[i];
+    unsigned int path_len = (unsigned int)strlen(entry->path);
+
+    ok = fwrite(&path_len, sizeof(path_len), 1, fp) == 1 &&
+         fwrite(entry->path, 1, path_len, fp) == path_len &&
+         fwrite(&entry->size, sizeof(entry->size), 1, fp) == 1 &&
+         fwrite(&entry->mtime, sizeof(entry->mtime), 1, fp) == 1 &&
+         fwrite(&entry->flags, sizeof(entry->flags), 1, fp) == 1 &&
+         fwrite(&entry->page_count, sizeof(entry->page_count), 1, fp) == 1 &&
+         fwrite(entry->lsns, sizeof(unsigned long long), entry->page_count, fp) == entry->page_count &&
+         fwrite(entry->crcs, sizeof(unsigned int), entry->page_count, fp) == entry->page_count &&
+         fwrite(entry->changed, 1, entry->page_count / 8 + 1, fp) == entry->page_count / 8 + 1;
+  }
+  if (fclose(fp) != 0) {
+    ok = 0;
+  }
+  return ok ? 0 : 1;
+}
+
+/**
+  @brief Load a page map.
+
+  @param [in]  path Map file path.
+  @param [out] map  Page map.
+
+  @retval 0 success, 1 failure.
+*/
+static int page_map_load(const char *path, PageMap *map) {
+  unsigned int header[3];
+  FILE *fp = fopen(path, "rb");
+  int ok;
+
+  memset(map, 0, sizeof(*map));
+  if (!fp) {
+    return 1;
+  }
+  ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == BACKUP_PAGE_MAP_MAGIC &&
+       header[1] >= 1 && header[1] <= BACKUP_PAGE_MAP_VERSION;
+  if (ok && header[2] > 0) {
+    map->files = (PageMapFile *)calloc(header[2], sizeof(PageMapFile));
+    map->size = (int)header[2];
+    ok = map->files != NULL;
+  }
+  while (ok && map->count < (int)header[2]) {
+    PageMapFile *entry = &map->files[map->count];
+    BackupFile file;
+    unsigned int path_len;
+    unsigned int flags = 0;
+    unsigned int pages;
+    char name[4096];
+
+    ok = fread(&path_len, sizeof(path_len), 1, fp) == 1 && path_len < sizeof(name) &&
+         fread(name, 1, path_len, fp) == path_len &&
+         fread(&file.size, sizeof(file.size), 1, fp) == 1 &&
+         fread(&file.mtime, sizeof(file.mtime), 1, fp) == 1 &&
+         (header[1] < 2 || fread(&flags, sizeof(flags), 1, fp) == 1) &&
+         fread(&pages, sizeof(pages), 1, fp) == 1;
+    if (!ok) {
+      break;
+    }
+    name[path_len] = '\0';
+    file.path = name;
+    file.mode = 0;
+    if (pages != (unsigned long long)(file.size + BACKUP_PAGE_SIZE - 1) / BACKUP_PAGE_SIZE ||
+        page_map_file_alloc(entry, &file) != 0) {
+      ok = 0;
+      break;
+    }
+    entry->flags = flags;
+    map->count++;
+    ok = fread(entry->lsns, sizeof(unsigned long long), pages, fp) == pages &&
+         fread(entry->crcs, sizeof(unsigned int), pages, fp) == pages &&
+         fread(entry->changed, 1, pages / 8 + 1, fp) == pages / 8 + 1;
+  }
+  fclose(fp);
+
+  if (!ok) {
+    page_map_free(map);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  @brief LSN of an InnoDB page.
+
+  Only pages of a tablespace file have one.  Such a page repeats the low
+  32 bits of its LSN in the trailer, holds its own page number, and
+  carries the space id shared by all pages of the file; the first page
+  that passes the other checks fixes the file's space id.  Text or padded
+  rows that happen to repeat bytes 20..23 at the page end fail these
+  checks and are compared by checksum instead.
+
+  @param [in]     data   Page data.
+  @param [in]     length Page length, short for the last page of a file.
+  @param [in]     page   Page number.
+  @param [in,out] entry  Page state of the file.
+
+  @retval LSN, or 0 for data without one.
+*/
+static unsigned long long page_lsn(const unsigned char *data, size_t length, unsigned int page, PageMapFile *entry) {
+  unsigned long long lsn = 0;
+  unsigned int trailer = 0;
+  unsigned int number = 0;
+  unsigned int space = 0;
+  long long known;
+  int i;
+
+  if (!entry->tablespace || length != BACKUP_PAGE_SIZE) {
+    return 0;
+  }
+  for (i = 0; i < 8; i++) {
+    lsn = (lsn << 8) | data[BACKUP_PAGE_LSN_OFFSET + i];
+  }
+  for (i = 0; i < 4; i++) {
+    trailer = (trailer << 8) | data[BACKUP_PAGE_SIZE - BACKUP_PAGE_TRAILER_OFFSET + i];
+    number = (number << 8) | data[BACKUP_PAGE_NUMBER_OFFSET + i];
+    space = (space << 8) | data[BACKUP_PAGE_SPACE_OFFSET + i];
+  }
+  if (lsn == 0 || trailer != (unsigned int)lsn || number != page) {
+    return 0;
+  }
+  known = __sync_val_compare_and_swap(&entry->space_id, -1LL, (long long)space);
+  return known == -1 || known == (long long)space ? lsn : 0;
+}
+
+/**
+  @brief Record the state of one page and tell whether it changed.
+
+  Every write of an InnoDB page bumps its LSN.  A tablespace page whose
+  LSN, as page_lsn() accepts it, equals the parent's is therefore taken
+  as unchanged without checksumming it; other pages, including all pages
+  of non-InnoDB files, are compared by CRC32C.  Pages of different 64-page blocks touch disjoint bitmap bytes,
+  so blocks of one file may be tracked concurrently.
+
+  @param [in]     data    Page data.
+  @param [in]     length  Page length, short for the last page of a file.
+  @param [in]     page    Page number.
+  @param [in]     parent  Parent state of the file, or NULL for a new file.
+  @param [in,out] entry   Page state to fill.
+  @param [in,out] stats   Backup counters.
+
+  @retval 1 changed, 0 unchanged.
+*/
+static int track_page(const unsigned char *data, size_t length, unsigned int page, const PageMapFile *parent,
+                      PageMapFile *entry, BackupStats *stats) {
+  int known = parent && page < parent->page_count;
+  unsigned long long lsn = page_lsn(data, length, page, entry);
+  int changed;
+
+  entry->lsns[page] = lsn;
+  if (known && lsn != 0 && lsn == parent->lsns[page] &&
+      (long long)(page + 1) * BACKUP_PAGE_SIZE <= parent->size) {
+    entry->crcs[page] = parent->crcs[page];
+    changed = 0;
+  } else {
+    entry->crcs[page] = crc32c(0, data, length);
+    changed = !known || entry->crcs[page] != parent->crcs[page] || lsn != parent->lsns[page];
+  }
+
+  __sync_fetch_and_add(&stats->scanned_pages, 1);
+  if (changed) {
+    entry->changed[page / 8] |= (unsigned char)(1 << (page % 8));
+    __sync_fetch_and_add(&stats->changed_pages, 1);
+  }
+  return changed;
+}
+
+/**
+  @brief rsync checksum of a block: byte sum and position-weighted sum, 16 bits each.
+
+  @param [in] data   Block.
+  @param [in] length Block length.
+  @param [out] a     Byte sum, to roll.
+  @param [out] b     Weighted sum, to roll.
+
+  @retval Checksum.
+*/
+static unsigned int rsync_weak(const unsigned char *data, size_t length, unsigned int *a, unsigned int *b) {
+  size_t i;
+
+  *a = 0;
+  *b = 0;
+  for (i = 0; i < length; i++) {
+    *a += data[i];
+    *b += (unsigned int)(length - i) * data[i];
+  }
+  return (*a & 0xffff) | (*b << 16);
+}
+
+/**
+  @brief Strong checksum of a block: the leading bytes of its SHA-256.
+
+  @param [in]  data   Block.
+  @param [in]  length Block length.
+  @param [out] strong Checksum, sizeof(SignatureBlock::strong) bytes.
+*/
+static void rsync_strong(const unsigned char *data, size_t length, unsigned char *strong) {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+
+  SHA256(data, length, hash);
+  memcpy(strong, hash, sizeof(((SignatureBlock *)0)->strong));
+}
+
+/**
+  @brief Start the signature of a file about to be read.
+
+  Only large files that are no tablespaces get one: InnoDB pages are
+  tracked by LSN, and small files are cheaper to store as page deltas.
+  The file name decides, as text or fixed-width rows can look like
+  InnoDB pages.
+
+  @param [out] signature Signature.
+  @param [in]  file      File description.
+
+  @retval 1 the file is signed, 0 it is not.
+*/
+static int signature_init(Signature *signature, const BackupFile *file) {
+  memset(signature, 0, sizeof(*signature));
+  signature->size = file->size;
+  signature->count = (unsigned int)(file->size / BACKUP_RSYNC_BLOCK);
+  signature->invalid = file->size < BACKUP_RSYNC_MIN_SIZE || backup_is_tablespace(file->path);
+  return !signature->invalid;
+}
+
+/**
+  @brief Free the blocks of a signature.
+
+  @param [in] signature Signature, may be NULL.
+*/
+static void signature_free(Signature *signature) {
+  if (signature) {
+    free(signature->blocks);
+    signature->blocks = NULL;
+  }
+}
+
+/**
+  @brief Hash the whole signature blocks of bytes read from a file.
+
+  Readers of different parts of one file may call this concurrently: the
+  first allocates the block array, and each fills its own blocks.
+
+  @param [in,out] signature Signature of the file.
+  @param [in]     data      Bytes read.
+  @param [in]     length    Bytes read.
+  @param [in]     offset    File offset of the bytes, a multiple of BACKUP_RSYNC_BLOCK.
+*/
+static void signature_blocks(Signature *signature, const unsigned char *data, size_t length, long long offset) {
+  SignatureBlock *blocks = signature->blocks;
+  unsigned int hashed = 0;
+  unsigned int a, b;
+  size_t pos;
+
+  if (signature->invalid) {
+    return;
+  }
+  if (!blocks) {
+    blocks = (SignatureBlock *)calloc(signature->count ? signature->count : 1, sizeof(SignatureBlock));
+    if (!blocks) {
+      signature->invalid = 1;
+      return;
+    }
+    if (!__sync_bool_compare_and_swap(&signature->blocks, NULL, blocks)) {
+      free(blocks);
+      blocks = signature->blocks;
+    }
+  }
+  for (pos = 0; pos + BACKUP_RSYNC_BLOCK <= length; pos += BACKUP_RSYNC_BLOCK) {
+    unsigned long long index = (unsigned long long)(offset + (long long)pos) / BACKUP_RSYNC_BLOCK;
+
+    if (index < signature->count) {
+      blocks[index].weak = rsync_weak(data + pos, BACKUP_RSYNC_BLOCK, &a, &b);
+      rsync_strong(data + pos, BACKUP_RSYNC_BLOCK, blocks[index].strong);
+      hashed++;
+    }
+  }
+  __sync_fetch_and_add(&signature->filled, hashed);
+}
+
+/**
+  @brief Append the signature of a file to a signature file.
+
+  Signatures missing blocks, from a file that shrank while it was read,
+  are left out.
+
+  @param [in] fp        Signature file.
+  @param [in] path      Relative path of the file.
+  @param [in] signature Signature.
+
+  @retval 0 success, 1 failure.
+*/
+static int signature_write(FILE *fp, const char *path, const Signature *signature) {
+  unsigned int path_len = (unsigned int)strlen(path);
+
+  if (signature->invalid || !signature->blocks || signature->filled != signature->count) {
+    return 0;
+  }
+  return fwrite(&path_len, sizeof(path_len), 1, fp) == 1 && fwrite(path, 1, path_len, fp) == path_len &&
+                 fwrite(&signature->size, sizeof(signature->size), 1, fp) == 1 &&
+                 fwrite(&signature->count, sizeof(signature->count), 1, fp) == 1 &&
+                 fwrite(signature->blocks, sizeof(SignatureBlock), signature->count, fp) == signature->count
+             ? 0
+             : 1;
+}
+
+/**
+  @brief Create the signature file of a backup.
+
+  Layout: magic, version and block size, then per file the path, size,
+  block count and blocks, in no particular order.
+
+  @param [in] path Signature file path.
+
+  @retval File, or NULL on failure.
+*/
+static FILE *signature_create(const char *path) {
+  unsigned int header[3] = {BACKUP_SIGNATURE_MAGIC, BACKUP_SIGNATURE_VERSION, BACKUP_RSYNC_BLOCK};
+  FILE *fp = fopen(path, "wb");
+
+  if (fp && fwrite(header, sizeof(header), 1, fp) != 1) {
+    fclose(fp);
+    return NULL;
+  }
+  return fp;
+}
+
+/**
+  @brief Free a signature index and close its file.
+
+  @param [in] index Signature index.
+*/
+static void signature_index_free(SignatureIndex *index) {
+  int i;
+
+  for (i = 0; i < index->count; i++) {
+    free(index->entries[i].path);
+  }
+  free(index->entries);
+  if (index->fp) {
+    fclose(index->fp);
+  }
+  memset(index, 0, sizeof(*index));
+}
+
+/**
+  @brief Order signature index entries by path.
+*/
+static int signature_entry_compare(const void *a, const void *b) {
+  return strcmp(((const SignatureEntry *)a)->path, ((const SignatureEntry *)b)->path);
+}
+
+/**
+  @brief Index the signature file of a backup.
+
+  Only paths and offsets are kept; blocks are read when a file needs them.
+
+  @param [in]  path  Signature file path.
+  @param [out] index Signature index, empty on failure.
+
+  @retval 0 success, 1 failure.
+*/
+static int signature_index_load(const char *path, SignatureIndex *index) {
+  unsigned int header[3];
+  int ok;
+
+  memset(index, 0, sizeof(*index));
+  index->fp = fopen(path, "rb");
+  if (!index->fp) {
+    return 1;
+  }
+  ok = fread(header, sizeof(header), 1, index->fp) == 1 && header[0] == BACKUP_SIGNATURE_MAGIC &&
+       header[1] == BACKUP_SIGNATURE_VERSION && header[2] == BACKUP_RSYNC_BLOCK;
+  while (ok) {
+    long long offset = ftello(index->fp);
+    unsigned int path_len;
+    unsigned int count;
+    long long size;
+    char name[4096];
+
+    if (fread(&path_len, sizeof(path_len), 1, index->fp) != 1) {
+      break;
+    }
+    ok = path_len < sizeof(name) && fread(name, 1, path_len, index->fp) == path_len &&
+         fread(&size, sizeof(size), 1, index->fp) == 1 && fread(&count, sizeof(count), 1, index->fp) == 1 &&
+         fseeko(index->fp, (off_t)count * sizeof(SignatureBlock), SEEK_CUR) == 0;
+    if (ok && index->count == index->size) {
+      int grow = index->size ? index->size * 2 : 64;
+      SignatureEntry *entries = (SignatureEntry *)realloc(index->entries, grow * sizeof(SignatureEntry));
+      ok = entries != NULL;
+      if (ok) {
+        index->entries = entries;
+        index->size = grow;
+      }
+    }
+    if (ok) {
+      name[path_len] = '\0';
+      index->entries[index->count].path = strdup(name);
+      index->entries[index->count].offset = offset;
+      ok = index->entries[index->count].path != NULL;
+      index->count += ok;
+    }
+  }
+  if (!ok) {
+    signature_index_free(index);
+    return 1;
+  }
+  qsort(index->entries, index->count, sizeof(SignatureEntry), signature_entry_compare);
+  return 0;
+}
+
+/**
+  @brief Read the signature of one file from an indexed signature file.
+
+  @param [in]  index     Signature index.
+  @param [in]  path      Relative path of the file.
+  @param [out] signature Signature, to free with signature_free().
+
+  @retval 0 success, 1 the file has no signature.
+*/
+static int signature_read(const SignatureIndex *index, const char *path, Signature *signature) {
+  SignatureEntry key;
+  const SignatureEntry *found;
+  unsigned int path_len;
+
+  memset(signature, 0, sizeof(*signature));
+  key.path = (char *)path;
+  found = index->count > 0 ? (const SignatureEntry *)bsearch(&key, index->entries, index->count,
+                                                              sizeof(SignatureEntry), signature_entry_compare)
+                           : NULL;
+  if (!found || fseeko(index->fp, found->offset, SEEK_SET) != 0 ||
+      fread(&path_len, sizeof(path_len), 1, index->fp) != 1 || fseeko(index->fp, path_len, SEEK_CUR) != 0 ||
+      fread(&signature->size, sizeof(signature->size), 1, index->fp) != 1 ||
+      fread(&signature->count, sizeof(signature->count), 1, index->fp) != 1) {
+    return 1;
+  }
+  signature->blocks = (SignatureBlock *)malloc((signature->count ? signature->count : 1) * sizeof(SignatureBlock));
+  if (!signature->blocks ||
+      fread(signature->blocks, sizeof(SignatureBlock), signature->count, index->fp) != signature->count) {
+    signature_free(signature);
+    return 1;
+  }
+  signature->filled = signature->count;
+  return 0;
+}
+
+/**
+  @brief Copy the signature of an unchanged file from the parent's signature file.
+
+  @param [in] index Parent signature index.
+  @param [in] path  Relative path of the file.
+  @param [in] fp    Signature file of the backup.
+
+  @retval 0 success or nothing to copy, 1 failure.
+*/
+static int signature_copy(const SignatureIndex *index, const char *path, FILE *fp) {
+  Signature signature;
+  int ret;
+
+  if (signature_read(index, path, &signature) != 0) {
+    return 0;
+  }
+  ret = signature_write(fp, path, &signature);
+  signature_free(&signature);
+  return ret;
+}
+
+/**
+  @brief Scan the pages of a data file against its parent state.
+
+  Changed pages are appended to the delta file when one is given.
+
+  @param [in,out] source    Open data file.
+  @param [in]     parent    Parent state of the file, or NULL for a new file.
+  @param [in,out] entry     Page state to fill.
+  @param [in]     out       Delta file descriptor, or -1 to only record state.
+  @param [in,out] stats     Backup counters.
+  @param [in]     throttle  I/O limits.
+  @param [in,out] signature Signature to fill, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int scan_file_pages(SourceFile *source, const PageMapFile *parent, PageMapFile *entry, int out,
+                           BackupStats *stats, Throttle *throttle, Signature *signature) {
+  size_t buffer_size = (size_t)BACKUP_SCAN_PAGES * BACKUP_PAGE_SIZE;
+  unsigned char *buffer;
+  unsigned int page = 0;
+  int ret = 0;
+
+  if (posix_memalign((void **)&buffer, BACKUP_DIRECT_ALIGN, buffer_size) != 0) {
+    return 1;
+  }
+
+  while (ret == 0 && page < entry->page_count) {
+    long long offset = (long long)page * BACKUP_PAGE_SIZE;
+    unsigned long long holes;
+    ssize_t n;
+    size_t pos;
+
+    n = source_read_sparse(source, buffer, buffer_size, offset, &holes, throttle);
+    if (n <= 0) {
+      /* File shrank under us: remaining pages stay zero and count as changed */
+      break;
+    }
+    stats->hole_bytes += hole_length(holes, (size_t)n);
+    if (signature) {
+      signature_blocks(signature, buffer, (size_t)n, offset);
+    }
+    for (pos = 0; ret == 0 && pos < (size_t)n && page < entry->page_count; pos += BACKUP_PAGE_SIZE, page++) {
+      const unsigned char *data = buffer + pos;
+      size_t length = (size_t)n - pos < BACKUP_PAGE_SIZE ? (size_t)n - pos : BACKUP_PAGE_SIZE;
+
+      if (track_page(data, length, page, parent, entry, stats) && out >= 0) {
+        throttle_wait(throttle, 1, (long long)length, 1);
+        ret = write_all(out, data, length);
+        stats->bytes += (long long)length;
+      }
+    }
+  }
+
+  free(buffer);
+  return ret;
+}
+
+/**
+  @brief Carry the page state of an untouched file over from the parent.
+
+  @param [in]     file    File description.
+  @param [in]     parent  Parent state of the file, or NULL.
+  @param [in,out] entry   Allocated page state.
+  @param [in,out] stats   Backup counters.
+
+  @retval 1 file unchanged since the parent, 0 it must be scanned.
+*/
+static int carry_over_pages(const BackupFile *file, const PageMapFile *parent, PageMapFile *entry,
+                            BackupStats *stats) {
+  if (!parent || parent->size != file->size || parent->mtime != file->mtime) {
+    return 0;
+  }
+  memcpy(entry->lsns, parent->lsns, entry->page_count * sizeof(unsigned long long));
+  memcpy(entry->crcs, parent->crcs, entry->page_count * sizeof(unsigned int));
+  stats->unchanged_files++;
+  return 1;
+}
+
+/**
+  @brief Store the changed pages of one data file.
+
+  The changed pages go to <path>.delta in page order, so page i of the
+  file is found by counting the bits set before i.  Files unchanged since
+  the parent are carried over by the caller instead.
+
+  @param [in]     src       Source path.
+  @param [in]     dst       Destination path, without the delta suffix.
+  @param [in]     file      File description.
+  @param [in]     parent    Parent state of the file, or NULL.
+  @param [in,out] entry     Allocated page state.
+  @param [in,out] stats     Backup counters.
+  @param [in]     throttle  I/O limits.
+  @param [in]     direct    1 to read around the page cache.
+  @param [in,out] signature Signature to fill, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int copy_changed_pages(const char *src, const char *dst, const BackupFile *file, const PageMapFile *parent,
+                              PageMapFile *entry, BackupStats *stats, Throttle *throttle, int direct,
+                              Signature *signature) {
+  char delta[4096];
+  SourceFile source;
+  int out;
+  int ret;
+
+  if (snprintf(delta, sizeof(delta), "%s%s", dst, BACKUP_DELTA_SUFFIX) >= (int)sizeof(delta) ||
+      create_parent_directory(delta) != 0) {
+    return 1;
+  }
+  if (source_open(&source, src, direct, direct) != 0) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  out = open(delta, O_WRONLY | O_CREAT | O_TRUNC, file->mode ? file->mode : 0640);
+  if (out < 0) {
+    source_close(&source);
+    return 1;
+  }
+  ret = scan_file_pages(&source, parent, entry, out, stats, throttle, signature);
+  stats->files++;
+  source_close(&source);
+  if (close(out) != 0) {
+    ret = 1;
+  }
+  return ret;
+}
+
+/**
+  @brief Copy a data file through user space, recording its page state.
+
+  Every block read from the source is tracked, signed and written in the
+  same pass, so the copy is never read back.  Pages read from holes are
+  skipped and stay holes.
+
+  @param [in,out] source    Open data file.
+  @param [in]     out       Copy descriptor, empty.
+  @param [in]     size      Size to give the copy.
+  @param [in,out] entry     Page state to fill.
+  @param [in,out] stats     Backup counters.
+  @param [in]     throttle  I/O limits.
+  @param [in,out] signature Signature to fill, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int copy_file_pages(SourceFile *source, int out, long long size, PageMapFile *entry, BackupStats *stats,
+                           Throttle *throttle, Signature *signature) {
+  size_t buffer_size = (size_t)BACKUP_SCAN_PAGES * BACKUP_PAGE_SIZE;
+  unsigned char *buffer;
+  unsigned int page = 0;
+  int ret = 0;
+
+  if (posix_memalign((void **)&buffer, BACKUP_DIRECT_ALIGN, buffer_size) != 0) {
+    return 1;
+  }
+
+  while (ret == 0 && page < entry->page_count) {
+    long long offset = (long long)page * BACKUP_PAGE_SIZE;
+    unsigned long long holes;
+    long long hole_bytes;
+    ssize_t n;
+    size_t pos;
+
+    n = source_read_sparse(source, buffer, buffer_size, offset, &holes, throttle);
+    if (n <= 0) {
+      /* File shrank under us: remaining pages stay zero and count as changed */
+      break;
+    }
+    if (signature) {
+      signature_blocks(signature, buffer, (size_t)n, offset);
+    }
+    for (pos = 0; pos < (size_t)n && page < entry->page_count; pos += BACKUP_PAGE_SIZE, page++) {
+      track_page(buffer + pos, (size_t)n - pos < BACKUP_PAGE_SIZE ? (size_t)n - pos : BACKUP_PAGE_SIZE, page, NULL,
+                 entry, stats);
+    }
+    hole_bytes = hole_length(holes, (size_t)n);
+    throttle_wait(throttle, 1, (long long)n - hole_bytes, 1);
+    ret = pwrite_sparse(out, buffer, (size_t)n, offset, holes);
+    stats->bytes += (long long)n - hole_bytes;
+    stats->hole_bytes += hole_bytes;
+  }
+  if (ret == 0 && ftruncate(out, size) != 0) {
+    ret = 1;
+  }
+
+  free(buffer);
+  return ret;
+}
+
+/**
+  @brief Copy one data file into the backup and record its page state.
+
+  A FICLONE reflink shares the extents instantly on XFS and Btrfs; the
+  page state is then read from the clone, which is what the next backup
+  compares against, and that read is the only one the file costs.  Other
+  filesystems copy through user space with copy_file_pages(), building
+  the page state from the same read.  Mode and modification time are
+  kept so the next backup can compare them.
+
+  @param [in]     src       Source path.
+  @param [in]     dst       Destination path.
+  @param [in]     file      File description.
+  @param [in,out] entry     Page state to fill, allocated for the file.
+  @param [in,out] stats     Backup counters.
+  @param [in]     throttle  I/O limits.
+  @param [in]     direct    1 to read around the page cache.
+  @param [in,out] signature Signature to fill, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int copy_data_file(const char *src, const char *dst, const BackupFile *file, PageMapFile *entry,
+                          BackupStats *stats, Throttle *throttle, int direct, Signature *signature) {
+  struct timespec times[2];
+  struct stat st;
+  SourceFile source;
+  int out;
+  int ret = 0;
+
+  if (create_parent_directory(dst) != 0) {
+    return 1;
+  }
+  if (source_open(&source, src, direct, direct) != 0) {
+    /* Dropped while we were copying */
+    return errno == ENOENT ? 0 : 1;
+  }
+  out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, file->mode ? file->mode : 0640);
+  if (out < 0) {
+    source_close(&source);
+    return 1;
+  }
+  if (fstat(source.fd, &st) != 0) {
+    ret = 1;
+  }
+
+  if (ret == 0 && ioctl(out, FICLONE, source.fd) == 0) {
+    /* The clone shares the holes too */
+    long long copied = (long long)st.st_blocks * 512 < (long long)st.st_size ? (long long)st.st_blocks * 512
+                                                                              : (long long)st.st_size;
+    long long holes = stats->hole_bytes;
+    SourceFile copy;
+
+    if (source_open(&copy, dst, direct, direct) == 0) {
+      ret = scan_file_pages(&copy, NULL, entry, -1, stats, throttle, signature);
+      source_close(&copy);
+    }
+    stats->bytes += copied;
+    stats->hole_bytes = holes + (long long)st.st_size - copied;
+    stats->cloned_files++;
+  } else if (ret == 0) {
+    ret = copy_file_pages(&source, out, (long long)st.st_size, entry, stats, throttle, signature);
+  }
+
+  if (ret == 0) {
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    futimens(out, times);
+    stats->files++;
+  }
+  source_close(&source);
+  if (close(out) != 0) {
+    ret = 1;
+  }
+
+  return ret;
+}
+
+/**
+  @brief Order parent signature blocks by weak checksum.
+*/
+static int rsync_match_compare(const void *a, const void *b) {
+  const RsyncMatch *x = (const RsyncMatch *)a;
+  const RsyncMatch *y = (const RsyncMatch *)b;
+
+  if (x->weak != y->weak) {
+    return x->weak < y->weak ? -1 : 1;
+  }
+  return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/**
+  @brief Find a block of the parent's copy equal to the window.
+
+  The block after the previous match is tried first, so a run of
+  unchanged data costs one weak comparison per block.  Elsewhere a bit
+  filter over the weak checksums turns most windows away before the
+  binary search, and the strong checksum is only computed once a weak
+  checksum matches.
+
+  @param [in] base    Parent signature.
+  @param [in] matches Parent blocks by weak checksum.
+  @param [in] filter  Bit set for the weak checksums of the parent, by BACKUP_RSYNC_FILTER().
+  @param [in] data    Window, BACKUP_RSYNC_BLOCK bytes.
+  @param [in] weak    Rolling checksum of the window.
+  @param [in] expect  Block after the previous match, or -1.
+
+  @retval Block number, or -1 if none matches.
+*/
+static long long rsync_find(const Signature *base, const RsyncMatch *matches, const unsigned char *filter,
+                            const unsigned char *data, unsigned int weak, long long expect) {
+  unsigned char strong[sizeof(((SignatureBlock *)0)->strong)];
+  unsigned int low = 0;
+  unsigned int high = base->count;
+  unsigned int bit;
+  int hashed = 0;
+
+  if (expect >= 0 && expect < (long long)base->count && base->blocks[expect].weak == weak) {
+    rsync_strong(data, BACKUP_RSYNC_BLOCK, strong);
+    hashed = 1;
+    if (memcmp(strong, base->blocks[expect].strong, sizeof(strong)) == 0) {
+      return expect;
+    }
+  }
+  bit = BACKUP_RSYNC_FILTER(weak);
+  if (!(filter[bit / 8] & (1 << (bit % 8)))) {
+    return -1;
+  }
+  while (low < high) {
+    unsigned int mid = low + (high - low) / 2;
+    if (matches[mid].weak < weak) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  for (; low < base->count && matches[low].weak == weak; low++) {
+    if (!hashed) {
+      rsync_strong(data, BACKUP_RSYNC_BLOCK, strong);
+      hashed = 1;
+    }
+    if (memcmp(strong, base->blocks[matches[low].block].strong, sizeof(strong)) == 0) {
+      return matches[low].block;
+    }
+  }
+  return -1;
+}
+
+/**
+  @brief Append one record to an rsync delta.
+
+  @param [in] fp     Delta file.
+  @param [in] type   BACKUP_RSYNC_*.
+  @param [in] data   Literal bytes, NULL for a copy.
+  @param [in] length Bytes of the record; nothing is written for 0.
+  @param [in] offset Offset in the parent's copy, for a copy.
+
+  @retval 0 success, 1 failure.
+*/
+static int rsync_put(FILE *fp, unsigned int type, const unsigned char *data, unsigned int length, long long offset) {
+  unsigned int head[2] = {type, length};
+
+  if (length == 0) {
+    return 0;
+  }
+  return fwrite(head, sizeof(head), 1, fp) == 1 && fwrite(&offset, sizeof(offset), 1, fp) == 1 &&
+                 (!data || fwrite(data, 1, length, fp) == length)
+             ? 0
+             : 1;
+}
+
+/**
+  @brief Append literal bytes to an rsync delta, after the copy pending before them.
+
+  @param [in]     fp          Delta file.
+  @param [in,out] copy_offset Pending copy.
+  @param [in,out] copy_length Pending copy, 0 once written.
+  @param [in]     data        Literal bytes.
+  @param [in]     length      Literal bytes.
+
+  @retval 0 success, 1 failure.
+*/
+static int rsync_put_literal(FILE *fp, long long *copy_offset, unsigned int *copy_length, const unsigned char *data,
+                             size_t length) {
+  int ret = 0;
+
+  if (length > 0) {
+    ret = rsync_put(fp, BACKUP_RSYNC_COPY, NULL, *copy_length, *copy_offset) != 0 ||
+          rsync_put(fp, BACKUP_RSYNC_LITERAL, data, (unsigned int)length, 0) != 0;
+    *copy_length = 0;
+  }
+  return ret;
+}
+
+/**
+  @brief Store a changed file as an rsync delta against the parent's copy.
+
+  A window of one signature block rolls over the file, read once.  Where
+  its rolling checksum and then its SHA-256 prefix match a block of the
+  parent's signature, the block is copied from the parent, wherever it
+  sat there, so data shifted by an insertion is still found; otherwise
+  the first byte of the window becomes a literal.  Page state and the
+  new signature come from the same reads.
+
+  Layout of <path>.rdelta: magic, version, block size, the sizes of the
+  parent's copy and of the file, then records of type, length and
+  parent offset, literal records followed by their bytes.
+
+  @param [in]     src       Source path.
+  @param [in]     dst       Destination path, without the suffix.
+  @param [in]     file      File description.
+  @param [in]     parent    Parent state of the file.
+  @param [in]     base      Signature of the parent's copy.
+  @param [in,out] entry     Allocated page state.
+  @param [in,out] signature Signature of the new copy.
+  @param [in,out] stats     Backup counters.
+  @param [in]     throttle  I/O limits.
+  @param [in]     direct    1 to read around the page cache.
+
+  @retval 0 success, 1 failure.
+*/
+static int rsync_encode_file(const char *src, const char *dst, const BackupFile *file, const PageMapFile *parent,
+                             const Signature *base, PageMapFile *entry, Signature *signature, BackupStats *stats,
+                             Throttle *throttle, int direct) {
+  unsigned int header[3] = {BACKUP_RSYNC_MAGIC, BACKUP_RSYNC_VERSION, BACKUP_RSYNC_BLOCK};
+  size_t block = BACKUP_RSYNC_BLOCK;
+  RsyncMatch *matches;
+  unsigned char *filter;
+  unsigned char *chunk = NULL;
+  unsigned char *window;
+  char delta[4096];
+  SourceFile source;
+  FILE *out;
+  size_t avail = 0;   /* bytes in the window */
+  size_t pos = 0;     /* start of the rolling block */
+  size_t literal = 0; /* first byte not yet in a record */
+  long long offset = 0;
+  long long copy_offset = 0;
+  unsigned int copy_length = 0;
+  long long expect = -1;
+  unsigned int a = 0, b = 0;
+  int rolling = 0;
+  int eof = file->size == 0;
+  unsigned int i;
+  int ret = 0;
+
+  if (snprintf(delta, sizeof(delta), "%s%s", dst, BACKUP_RSYNC_SUFFIX) >= (int)sizeof(delta) ||
+      create_parent_directory(delta) != 0) {
+    return 1;
+  }
+  if (source_open(&source, src, direct, direct) != 0) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  matches = (RsyncMatch *)malloc((base->count ? base->count : 1) * sizeof(RsyncMatch));
+  filter = (unsigned char *)calloc(BACKUP_RSYNC_FILTER_BITS / 8, 1);
+  window = (unsigned char *)malloc(BACKUP_BLOCK_SIZE + block);
+  if (posix_memalign((void **)&chunk, BACKUP_DIRECT_ALIGN, BACKUP_BLOCK_SIZE) != 0) {
+    chunk = NULL;
+  }
+  out = fopen(delta, "wb");
+  if (!matches || !filter || !window || !chunk || !out) {
+    ret = 1;
+  } else {
+    for (i = 0; i < base->count; i++) {
+      unsigned int bit = BACKUP_RSYNC_FILTER(base->blocks[i].weak);
+      matches[i].weak = base->blocks[i].weak;
+      matches[i].block = i;
+      filter[bit / 8] |= (unsigned char)(1 << (bit % 8));
+    }
+    qsort(matches, base->count, sizeof(RsyncMatch), rsync_match_compare);
+    ret = fwrite(header, sizeof(header), 1, out) == 1 && fwrite(&base->size, sizeof(base->size), 1, out) == 1 &&
+                  fwrite(&file->size, sizeof(file->size), 1, out) == 1
+              ? 0
+              : 1;
+  }
+
+  while (ret == 0) {
+    long long found;
+    unsigned int weak;
+
+    if (avail - pos < block && !eof) {
+      size_t want = file->size - offset < BACKUP_BLOCK_SIZE ? (size_t)(file->size - offset) : BACKUP_BLOCK_SIZE;
+      unsigned long long holes;
+      ssize_t n;
+      size_t k;
+
+      /* Bytes before the block leave the window: emit them first */
+      ret = rsync_put_literal(out, &copy_offset, &copy_length, window + literal, pos - literal);
+      memmove(window, window + pos, avail - pos);
+      avail -= pos;
+      pos = 0;
+      literal = 0;
+      rolling = 0;
+      n = source_read_sparse(&source, chunk, want, offset, &holes, throttle);
+      if (n < 0) {
+        ret = 1;
+        break;
+      }
+      if (n == 0) {
+        /* File shrank under us: the rest stays as read */
+        eof = 1;
+        continue;
+      }
+      stats->hole_bytes += hole_length(holes, (size_t)n);
+      signature_blocks(signature, chunk, (size_t)n, offset);
+      for (k = 0; k < (size_t)n; k += BACKUP_PAGE_SIZE) {
+        unsigned int page = (unsigned int)((offset + (long long)k) / BACKUP_PAGE_SIZE);
+        if (page < entry->page_count) {
+          track_page(chunk + k, (size_t)n - k < BACKUP_PAGE_SIZE ? (size_t)n - k : BACKUP_PAGE_SIZE, page, parent,
+                     entry, stats);
+        }
+      }
+      memcpy(window + avail, chunk, (size_t)n);
+      avail += (size_t)n;
+      offset += n;
+      eof = offset >= file->size || (size_t)n < want;
+      continue;
+    }
+    if (avail - pos < block) {
+      break;
+    }
+
+    if (!rolling) {
+      weak = rsync_weak(window + pos, block, &a, &b);
+      rolling = 1;
+    } else {
+      weak = (a & 0xffff) | (b << 16);
+    }
+    found = rsync_find(base, matches, filter, window + pos, weak, expect);
+    if (found >= 0) {
+      long long at = found * (long long)block;
+
+      ret = rsync_put_literal(out, &copy_offset, &copy_length, window + literal, pos - literal);
+      if (ret == 0 && copy_length > 0 &&
+          (copy_offset + copy_length != at || copy_length > BACKUP_RSYNC_MAX_COPY - block)) {
+        ret = rsync_put(out, BACKUP_RSYNC_COPY, NULL, copy_length, copy_offset);
+        copy_length = 0;
+      }
+      if (copy_length == 0) {
+        copy_offset = at;
+      }
+      copy_length += (unsigned int)block;
+      stats->rsync_copied_bytes += (long long)block;
+      pos += block;
+      literal = pos;
+      rolling = 0;
+      expect = found + 1;
+    } else {
+      if (pos + block < avail) {
+        unsigned int gone = window[pos];
+        a += window[pos + block] - gone;
+        b += a - (unsigned int)block * gone;
+      } else {
+        rolling = 0;
+      }
+      pos++;
+    }
+  }
+  if (ret == 0) {
+    ret = rsync_put_literal(out, &copy_offset, &copy_length, window + literal, avail - literal) != 0 ||
+          rsync_put(out, BACKUP_RSYNC_COPY, NULL, copy_length, copy_offset) != 0;
+  }
+
+  if (out) {
+    long long size = ftello(out);
+    if (fclose(out) != 0) {
+      ret = 1;
+    }
+    throttle_wait(throttle, 1, size, 1);
+    stats->bytes += size;
+  }
+  stats->files++;
+  stats->rsync_files++;
+  if (ret == 0) {
+    entry->flags |= BACKUP_PAGE_MAP_RSYNC;
+  }
+  source_close(&source);
+  free(matches);
+  free(filter);
+  free(window);
+  free(chunk);
+  return ret;
+}
+
+/**
+  @brief Free a manifest.
+
+  @param [in] manifest Manifest.
+*/
+static void manifest_free(Manifest *manifest) {
+  int i;
+
+  for (i = 0; i < manifest->count; i++) {
+    free(manifest->files[i].path);
+    free(manifest->files[i].blocks);
+  }
+  free(manifest->files);
+  manifest->files = NULL;
+  manifest->count = 0;
+  manifest->size = 0;
+}
+
+/**
+  @brief Add a stored file to a manifest.
+
+  @param [in,out] manifest Manifest.
+  @param [in]     path     Path relative to the backup.
+
+  @retval New entry, or NULL on failure.
+*/
+static ManifestFile *manifest_add(Manifest *manifest, const char *path) {
+  ManifestFile *file;
+
+  if (manifest->count == manifest->size) {
+    int size = manifest->size ? manifest->size * 2 : 16;
+    ManifestFile *files = (ManifestFile *)realloc(manifest->files, size * sizeof(ManifestFile));
+    if (!files) {
+      return NULL;
+    }
+    manifest->files = files;
+    manifest->size = size;
+  }
+  file = &manifest->files[manifest->count];
+  memset(file, 0, sizeof(*file));
+  file->path = strdup(path);
+  if (!file->path) {
+    return NULL;
+  }
+  manifest->count++;
+  return file;
+}
+
+/**
+  @brief Record the checksum of one range of a stored file.
+
+  @param [in,out] file   Manifest entry.
+  @param [in]     offset Range offset.
+  @param [in]     length Range length.
+  @param [in]     crc    CRC32C of the range.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int manifest_add_block(ManifestFile *file, long long offset, unsigned int length, unsigned int crc) {
+  ManifestBlock *block;
+
+  if (file->block_count == file->block_size) {
+    int size = file->block_size ? file->block_size * 2 : 16;
+    ManifestBlock *blocks = (ManifestBlock *)realloc(file->blocks, size * sizeof(ManifestBlock));
+    if (!blocks) {
+      return 1;
+    }
+    file->blocks = blocks;
+    file->block_size = size;
+  }
+  block = &file->blocks[file->block_count++];
+  block->offset = offset;
+  block->length = length;
+  block->crc = crc;
+  return 0;
+}
+
+/**
+  @brief Checksum a file already in the backup, one block at a time.
+
+  Used for files that do not go through the pipeline: serial copies,
+  the page map and the chunk manifest.  Missing files are skipped.
+
+  @param [in,out] manifest    Manifest.
+  @param [in]     backup_path Backup directory.
+  @param [in]     path        Path relative to the backup.
+
+  @retval 0 success, 1 failure.
+*/
+static int manifest_scan_file(Manifest *manifest, const char *backup_path, const char *path) {
+  unsigned char *buffer;
+  ManifestFile *file;
+  char full[4096];
+  int ret = 0;
+  int fd;
+
+  snprintf(full, sizeof(full), "%s/%s", backup_path, path);
+  fd = open(full, O_RDONLY);
+  if (fd < 0) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  buffer = (unsigned char *)malloc(BACKUP_BLOCK_SIZE);
+  file = buffer ? manifest_add(manifest, path) : NULL;
+  if (!file) {
+    free(buffer);
+    close(fd);
+    return 1;
+  }
+  for (;;) {
+    ssize_t n = read(fd, buffer, BACKUP_BLOCK_SIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      ret = 1;
+    }
+    if (n <= 0) {
+      break;
+    }
+    if (manifest_add_block(file, file->size, (unsigned int)n, crc32c(0, buffer, (size_t)n)) != 0) {
+      ret = 1;
+      break;
+    }
+    file->size += n;
+  }
+  free(buffer);
+  close(fd);
+  return ret;
+}
+
+/**
+  @brief Compute the Merkle leaf of a file.
+
+  The leaf is the SHA-256 of the file's lines in the manifest (path,
+  size and every block checksum), so any change to a listed checksum
+  changes the root.
+
+  @param [in]  file Manifest entry.
+  @param [out] leaf Leaf hash.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int manifest_leaf(const ManifestFile *file, unsigned char *leaf) {
+  size_t capacity = strlen(file->path) + 64 + (size_t)file->block_count * 48;
+  char *text = (char *)malloc(capacity);
+  size_t length;
+  int i;
+
+  if (!text) {
+    return 1;
+  }
+  length = (size_t)snprintf(text, capacity, "F %lld %d %s\n", file->size, file->block_count, file->path);
+  for (i = 0; i < file->block_count; i++) {
+    const ManifestBlock *block = &file->blocks[i];
+    length += (size_t)snprintf(text + length, capacity - length, "B %lld %u %08x\n", block->offset, block->length,
+                               block->crc);
+  }
+  SHA256((const unsigned char *)text, length, leaf);
+  free(text);
+  return 0;
+}
+
+/**
+  @brief Compute the Merkle root over the leaves of a sorted manifest.
+
+  Each level hashes pairs of nodes; an odd node is carried up as is.
+
+  @param [in]  manifest Manifest with its leaves filled in.
+  @param [out] root     Root hash.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int manifest_root(const Manifest *manifest, unsigned char *root) {
+  unsigned char *nodes;
+  int count = manifest->count;
+  int i;
+
+  if (count == 0) {
+    SHA256((const unsigned char *)"", 0, root);
+    return 0;
+  }
+  nodes = (unsigned char *)malloc((size_t)count * SHA256_DIGEST_LENGTH);
+  if (!nodes) {
+    return 1;
+  }
+  for (i = 0; i < count; i++) {
+    memcpy(nodes + i * SHA256_DIGEST_LENGTH, manifest->files[i].leaf, SHA256_DIGEST_LENGTH);
+  }
+  while (count > 1) {
+    int next = 0;
+    for (i = 0; i < count; i += 2, next++) {
+      unsigned char *out = nodes + next * SHA256_DIGEST_LENGTH;
+      if (i + 1 < count) {
+        SHA256(nodes + i * SHA256_DIGEST_LENGTH, 2 * SHA256_DIGEST_LENGTH, out);
+      } else {
+        memmove(out, nodes + i * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+      }
+    }
+    count = next;
+  }
+  memcpy(root, nodes, SHA256_DIGEST_LENGTH);
+  free(nodes);
+  return 0;
+}
+
+/**
+  @brief Order manifest entries by path.
+*/
+static int manifest_file_compare(const void *a, const void *b) {
+  return strcmp(((const ManifestFile *)a)->path, ((const ManifestFile *)b)->path);
+}
+
+/**
+  @brief Sort a manifest, compute its Merkle tree and save it.
+
+  Layout, one record per line: "F <size> <blocks> <path>", a
+  "B <offset> <length> <crc32c>" line per block and "L <leaf>" for each
+  file, then "R <root>".  The root also goes into the metadata, which is
+  what validation trusts.
+
+  @param [in]     path     Manifest file path.
+  @param [in,out] manifest Manifest.
+  @param [out]    root     Root hash as hex.
+
+  @retval 0 success, 1 failure.
+*/
+static int manifest_save(const char *path, Manifest *manifest, char *root) {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  FILE *fp;
+  int i, j;
+
+  qsort(manifest->files, manifest->count, sizeof(ManifestFile), manifest_file_compare);
+  for (i = 0; i < manifest->count; i++) {
+    if (manifest_leaf(&manifest->files[i], manifest->files[i].leaf) != 0) {
+      return 1;
+    }
+  }
+  if (manifest_root(manifest, hash) != 0) {
+    return 1;
+  }
+  chunk_hex(hash, root);
+
+  fp = fopen(path, "w");
+  if (!fp) {
+    return 1;
+  }
+  for (i = 0; i < manifest->count; i++) {
+    const ManifestFile *file = &manifest->files[i];
+    char leaf[2 * SHA256_DIGEST_LENGTH + 1];
+
+    fprintf(fp, "F %lld %d %s\n", file->size, file->block_count, file->path);
+    for (j = 0; j < file->block_count; j++) {
+      fprintf(fp, "B %lld %u %08x\n", file->blocks[j].offset, file->blocks[j].length, file->blocks[j].crc);
+    }
+    chunk_hex(file->leaf, leaf);
+    fprintf(fp, "L %s\n", leaf);
+  }
+  fprintf(fp, "R %s\n", root);
+  return fclose(fp) == 0 ? 0 : 1;
+}
+
+/**
+  @brief Parse a hash written by chunk_hex.
+
+  @param [in]  hex  Hex digits.
+  @param [out] hash Hash.
+
+  @retval 0 success, 1 malformed.
+*/
+static int hash_parse(const char *hex, unsigned char *hash) {
+  int i;
+
+  for (i = 0; i < 2 * SHA256_DIGEST_LENGTH; i++) {
+    int c = hex[i];
+    int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    if (digit < 0) {
+      return 1;
+    }
+    if (i % 2 == 0) {
+      hash[i / 2] = (unsigned char)(digit << 4);
+    } else {
+      hash[i / 2] |= (unsigned char)digit;
+    }
+  }
+  return 0;
+}
+
+/**
+  @brief Load a manifest saved by manifest_save.
+
+  Leaves are taken as listed; callers recompute the ones they check.
+
+  @param [in]  path     Manifest file path.
+  @param [out] manifest Manifest.
+
+  @retval 0 success, 1 missing or malformed file.
+*/
+static int manifest_load(const char *path, Manifest *manifest) {
+  ManifestFile *file = NULL;
+  char line[4096];
+  int ret = 0;
+  FILE *fp;
+
+  memset(manifest, 0, sizeof(*manifest));
+  fp = fopen(path, "r");
+  if (!fp) {
+    return 1;
+  }
+  while (ret == 0 && fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == 'F') {
+      long long size;
+      int count;
+      int consumed = 0;
+
+      if (sscanf(line, "F %lld %d %n", &size, &count, &consumed) < 2 || consumed == 0 || count < 0 ||
+          !(file = manifest_add(manifest, line + consumed))) {
+        ret = 1;
+        break;
+      }
+      file->size = size;
+    } else if (line[0] == 'B' && file) {
+      long long offset;
+      unsigned int length, crc;
+
+      if (sscanf(line, "B %lld %u %x", &offset, &length, &crc) != 3 ||
+          manifest_add_block(file, offset, length, crc) != 0) {
+        ret = 1;
+      }
+    } else if (line[0] == 'L' && file) {
+      ret = strlen(line) < 2 + 2 * SHA256_DIGEST_LENGTH || hash_parse(line + 2, file->leaf) != 0;
+      file = NULL;
+    } else if (line[0] != 'R') {
+      ret = 1;
+    }
+  }
+  fclose(fp);
+  if (ret != 0) {
+    manifest_free(manifest);
+  }
+  return ret;
+}
+
+/**
+  @brief Free a checkpoint and close its journal.
+
+  @param [in] checkpoint Checkpoint.
+*/
+static void checkpoint_free(Checkpoint *checkpoint) {
+  int i;
+
+  if (checkpoint->fd >= 0) {
+    close(checkpoint->fd);
+  }
+  for (i = 0; checkpoint->files && i < checkpoint->list->count; i++) {
+    CheckpointFile *file = &checkpoint->files[i];
+
+    page_map_file_free(&file->pages);
+    free(file->sums.path);
+    free(file->sums.blocks);
+    free(file->loaded_raw);
+    free(file->loaded_stored);
+  }
+  free(checkpoint->files);
+  checkpoint->fd = -1;
+  checkpoint->files = NULL;
+}
+
+/**
+  @brief Append one record to the checkpoint journal and make it durable.
+
+  @param [in] fd     Journal descriptor.
+  @param [in] type   BACKUP_CHECKPOINT_HEADER or BACKUP_CHECKPOINT_PROGRESS.
+  @param [in] data   Record payload.
+  @param [in] length Payload length.
+
+  @retval 0 success, 1 failure.
+*/
+static int checkpoint_append(int fd, unsigned int type, const unsigned char *data, size_t length) {
+  unsigned int header[4] = {BACKUP_CHECKPOINT_MAGIC, type, (unsigned int)length, 0};
+
+  if (length > 0xffffffffU) {
+    return 1;
+  }
+  header[3] = crc32c(0, data, length);
+  if (write_all(fd, (const unsigned char *)header, sizeof(header)) != 0 || write_all(fd, data, length) != 0) {
+    return 1;
+  }
+  return fdatasync(fd) != 0 ? 1 : 0;
+}
+
+/**
+  @brief Write a length-prefixed string into a checkpoint record.
+
+  @param [in] fp   Record being built.
+  @param [in] text String.
+
+  @retval 0 success, 1 failure.
+*/
+static int checkpoint_put_string(FILE *fp, const char *text) {
+  unsigned int length = (unsigned int)strlen(text);
+
+  return fwrite(&length, sizeof(length), 1, fp) == 1 && fwrite(text, 1, length, fp) == length ? 0 : 1;
+}
+
+/**
+  @brief Read a length-prefixed string from a checkpoint record.
+
+  @param [in]  fp   Record.
+  @param [out] text Buffer.
+  @param [in]  size Buffer size.
+
+  @retval 0 success, 1 failure.
+*/
+static int checkpoint_get_string(FILE *fp, char *text, size_t size) {
+  unsigned int length;
+
+  if (fread(&length, sizeof(length), 1, fp) != 1 || length >= size || fread(text, 1, length, fp) != length) {
+    return 1;
+  }
+  text[length] = '\0';
+  return 0;
+}
+
+/**
+  @brief Start the checkpoint journal of a new backup.
+
+  The header record fixes what a restart has to agree on: the level, the
+  parent and the stored layout, and the file list, which the restart
+  reuses so that file and block numbers keep their meaning.
+
+  @param [in,out] checkpoint Checkpoint with level, layout, time, parent
+                             and file list set.
+  @param [in]     path       Journal path.
+
+  @retval 0 success, 1 failure.
+*/
+static int checkpoint_begin(Checkpoint *checkpoint, const char *path) {
+  const BackupFileList *list = checkpoint->list;
+  unsigned int header[4] = {BACKUP_CHECKPOINT_VERSION, (unsigned int)checkpoint->level,
+                            (unsigned int)checkpoint->layout, (unsigned int)list->count};
+  char *data = NULL;
+  size_t length = 0;
+  FILE *fp;
+  int ok;
+  int i;
+
+  checkpoint->files = (CheckpointFile *)calloc(list->count ? list->count : 1, sizeof(CheckpointFile));
+  checkpoint->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+  fp = open_memstream(&data, &length);
+  ok = checkpoint->files && checkpoint->fd >= 0 && fp && fwrite(header, sizeof(header), 1, fp) == 1 &&
+       fwrite(&checkpoint->backup_time, sizeof(checkpoint->backup_time), 1, fp) == 1 &&
+       checkpoint_put_string(fp, checkpoint->parent) == 0 && checkpoint_put_string(fp, checkpoint->full) == 0;
+  for (i = 0; ok && i < list->count; i++) {
+    const BackupFile *file = &list->files[i];
+    unsigned int mode = (unsigned int)file->mode;
+
+    ok = checkpoint_put_string(fp, file->path) == 0 && fwrite(&file->size, sizeof(file->size), 1, fp) == 1 &&
+         fwrite(&file->mtime, sizeof(file->mtime), 1, fp) == 1 && fwrite(&mode, sizeof(mode), 1, fp) == 1;
+  }
+  if (fp && fclose(fp) != 0) {
+    ok = 0;
+  }
+  /* syncfs() also makes the new directory entry durable */
+  ok = ok && checkpoint_append(checkpoint->fd, BACKUP_CHECKPOINT_HEADER, (const unsigned char *)data, length) == 0 &&
+       syncfs(checkpoint->fd) == 0;
+  free(data);
+  checkpoint->last_ns = clock_ns();
+  return ok ? 0 : 1;
+}
+
+/**
+  @brief Add the progress of one file since the last checkpoint to a record.
+
+  Only the part that changed is written: the pages of the blocks stored
+  since, the new seek table entries and the new block checksums.
+
+  @param [in]     fp    Record being built.
+  @param [in,out] file  Progress of the file.
+  @param [in]     index File number in the list.
+
+  @retval 0 success, 1 failure.
+*/
+static int checkpoint_put_file(FILE *fp, CheckpointFile *file, unsigned int index) {
+  const PageMapFile *entry = file->entry;
+  unsigned int page_to;
+  unsigned int fields[10];
+  size_t pages, frames, blocks;
+  unsigned int from;
+  unsigned int to;
+  int ok;
+
+  if (!entry) {
+    return 0;
+  }
+  page_to = (long long)file->blocks * BACKUP_SCAN_PAGES < entry->page_count ? file->blocks * BACKUP_SCAN_PAGES
+                                                                             : entry->page_count;
+  if (file->done) {
+    page_to = entry->page_count;
+  }
+  if (file->done == file->saved_done && page_to == file->saved_pages && file->frame_count == file->saved_frames &&
+      (!file->checksums || file->checksums->block_count == file->saved_blocks)) {
+    return 0;
+  }
+
+  fields[0] = (unsigned int)file->mode;
+  fields[1] = (unsigned int)file->done;
+  fields[2] = file->blocks;
+  fields[3] = file->saved_pages;
+  fields[4] = page_to;
+  fields[5] = (unsigned int)file->saved_frames;
+  fields[6] = (unsigned int)file->frame_count;
+  fields[7] = file->checksums != NULL;
+  fields[8] = (unsigned int)file->saved_blocks;
+  fields[9] = file->checksums ? (unsigned int)file->checksums->block_count : 0;
+  pages = fields[4] - fields[3];
+  frames = fields[6] - fields[5];
+  blocks = fields[9] - fields[8];
+  /* Pages come in whole blocks of 64, so the changed bitmap splits on byte boundaries */
+  from = file->saved_pages / 8;
+  to = file->done ? entry->page_count / 8 + 1 : page_to / 8;
+
+  ok = fwrite(&index, sizeof(index), 1, fp) == 1 && fwrite(fields, sizeof(fields), 1, fp) == 1 &&
+       fwrite(&file->stored, sizeof(file->stored), 1, fp) == 1 &&
+       fwrite(entry->lsns + fields[3], sizeof(unsigned long long), pages, fp) == pages &&
+       fwrite(entry->crcs + fields[3], sizeof(unsigned int), pages, fp) == pages &&
+       fwrite(entry->changed + from, 1, to - from, fp) == to - from &&
+       fwrite(file->frame_raw + fields[5], sizeof(unsigned int), frames, fp) == frames &&
+       fwrite(file->frame_stored + fields[5], sizeof(unsigned int), frames, fp) == frames;
+  if (ok && file->checksums) {
+    ok = checkpoint_put_string(fp, file->checksums->path) == 0 &&
+         fwrite(&file->checksums->size, sizeof(file->checksums->size), 1, fp) == 1 &&
+         fwrite(file->checksums->blocks + fields[8], sizeof(ManifestBlock), blocks, fp) == blocks;
+  }
+
+  file->saved_done = file->done;
+  file->saved_pages = page_to;
+  file->saved_frames = file->frame_count;
+  file->saved_blocks = (int)fields[9];
+  return ok ? 0 : 1;
+}
+
+/**
+  @brief Replay the progress of one file from a record.
+
+  @param [in]     fp         Record, positioned after the file number.
+  @param [in,out] checkpoint Checkpoint being loaded.
+  @param [in]     index      File number in the list.
+
+  @retval 0 success, 1 malformed record.
+*/
+static int checkpoint_get_file(FILE *fp, Checkpoint *checkpoint, unsigned int index) {
+  CheckpointFile *file = &checkpoint->files[index];
+  const BackupFile *listed = &checkpoint->list->files[index];
+  unsigned int block_count = (unsigned int)((listed->size + BACKUP_BLOCK_SIZE - 1) / BACKUP_BLOCK_SIZE);
+  unsigned int fields[10];
+  size_t pages, frames;
+  unsigned int from;
+  unsigned int to;
+  char path[4096];
+  int ok;
+
+  if (fread(fields, sizeof(fields), 1, fp) != 1 || fread(&file->stored, sizeof(file->stored), 1, fp) != 1 ||
+      fields[3] != file->saved_pages || fields[4] < fields[3] || fields[5] != (unsigned int)file->saved_frames ||
+      fields[6] < fields[5] || fields[6] > (block_count ? block_count : 1) || fields[9] < fields[8]) {
+    return 1;
+  }
+  if (!file->pages.path && page_map_file_alloc(&file->pages, listed) != 0) {
+    return 1;
+  }
+  if (fields[6] > 0 && !file->loaded_raw) {
+    file->loaded_raw = (unsigned int *)calloc(block_count ? block_count : 1, sizeof(unsigned int));
+    file->loaded_stored = (unsigned int *)calloc(block_count ? block_count : 1, sizeof(unsigned int));
+  }
+  pages = fields[4] - fields[3];
+  frames = fields[6] - fields[5];
+  from = fields[3] / 8;
+  to = fields[1] ? file->pages.page_count / 8 + 1 : fields[4] / 8;
+  ok = fields[4] <= file->pages.page_count && (frames == 0 || (file->loaded_raw && file->loaded_stored)) &&
+       fread(file->pages.lsns + fields[3], sizeof(unsigned long long), pages, fp) == pages &&
+       fread(file->pages.crcs + fields[3], sizeof(unsigned int), pages, fp) == pages &&
+       fread(file->pages.changed + from, 1, to - from, fp) == to - from &&
+       fread(file->loaded_raw + fields[5], sizeof(unsigned int), frames, fp) == frames &&
+       fread(file->loaded_stored + fields[5], sizeof(unsigned int), frames, fp) == frames;
+  if (ok && fields[7]) {
+    ok = checkpoint_get_string(fp, path, sizeof(path)) == 0 &&
+         fread(&file->sums.size, sizeof(file->sums.size), 1, fp) == 1 &&
+         fields[8] == (unsigned int)file->sums.block_count;
+    if (ok && !file->sums.path) {
+      file->sums.path = strdup(path);
+      ok = file->sums.path != NULL;
+    }
+    while (ok && (unsigned int)file->sums.block_count < fields[9]) {
+      ManifestBlock block;
+      ok = fread(&block, sizeof(block), 1, fp) == 1 &&
+           manifest_add_block(&file->sums, block.offset, block.length, block.crc) == 0;
+    }
+  }
+
+  file->mode = (int)fields[0];
+  file->done = (int)fields[1];
+  file->blocks = fields[2];
+  file->frame_count = (int)fields[6];
+  file->saved_done = file->done;
+  file->saved_pages = fields[4];
+  file->saved_frames = file->frame_count;
+  file->saved_blocks = file->sums.block_count;
+  return ok ? 0 : 1;
+}
+
+/**
+  @brief Parse one record of a checkpoint journal.
+
+  @param [in,out] checkpoint Checkpoint being loaded.
+  @param [in]     type       Record type.
+  @param [in]     fp         Record payload.
+  @param [out]    list       File list, filled from the header record.
+
+  @retval 0 success, 1 malformed record.
+*/
+static int checkpoint_parse(Checkpoint *checkpoint, unsigned int type, FILE *fp, BackupFileList *list) {
+  unsigned int header[4];
+  unsigned int index;
+  int ok;
+
+  if (type == BACKUP_CHECKPOINT_PROGRESS && checkpoint->files) {
+    ok = fread(&checkpoint->stats, sizeof(checkpoint->stats), 1, fp) == 1 &&
+         fread(&checkpoint->chunk_length, sizeof(checkpoint->chunk_length), 1, fp) == 1;
+    while (ok && fread(&index, sizeof(index), 1, fp) == 1 && index != 0xffffffffU) {
+      ok = index < (unsigned int)list->count && checkpoint_get_file(fp, checkpoint, index) == 0;
+    }
+    return ok && index == 0xffffffffU ? 0 : 1;
+  }
+  if (type != BACKUP_CHECKPOINT_HEADER || checkpoint->files) {
+    return 1;
+  }
+
+  ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == BACKUP_CHECKPOINT_VERSION &&
+       fread(&checkpoint->backup_time, sizeof(checkpoint->backup_time), 1, fp) == 1 &&
+       checkpoint_get_string(fp, checkpoint->parent, sizeof(checkpoint->parent)) == 0 &&
+       checkpoint_get_string(fp, checkpoint->full, sizeof(checkpoint->full)) == 0;
+  if (!ok) {
+    return 1;
+  }
+  checkpoint->level = (int)header[1];
+  checkpoint->layout = (int)header[2];
+  list->files = (BackupFile *)calloc(header[3] ? header[3] : 1, sizeof(BackupFile));
+  list->size = (int)header[3];
+  checkpoint->files = (CheckpointFile *)calloc(header[3] ? header[3] : 1, sizeof(CheckpointFile));
+  ok = list->files && checkpoint->files;
+  while (ok && list->count < (int)header[3]) {
+    BackupFile *file = &list->files[list->count];
+    unsigned int mode;
+    char path[4096];
+
+    ok = checkpoint_get_string(fp, path, sizeof(path)) == 0 && fread(&file->size, sizeof(file->size), 1, fp) == 1 &&
+         fread(&file->mtime, sizeof(file->mtime), 1, fp) == 1 && fread(&mode, sizeof(mode), 1, fp) == 1;
+    if (ok) {
+      file->path = strdup(path);
+      file->mode = (mode_t)mode;
+      ok = file->path != NULL;
+    }
+    if (ok) {
+      list->count++;
+    }
+  }
+  return ok ? 0 : 1;
+}
+
+/**
+  @brief Load the checkpoint journal of an interrupted backup.
+
+  Records are replayed in order.  A torn record at the end, left by a
+  crash while it was being written, is cut off and later checkpoints
+  are appended in its place.
+
+  @param [out] checkpoint Checkpoint.
+  @param [in]  path       Journal path.
+  @param [out] list       File list of the interrupted run.
+
+  @retval 0 success, 1 no usable checkpoint.
+*/
+static int checkpoint_load(Checkpoint *checkpoint, const char *path, BackupFileList *list) {
+  unsigned char *data = NULL;
+  unsigned int frame[4];
+  long long offset = 0;
+  FILE *journal = fopen(path, "rb");
+  int ok = journal != NULL;
+
+  checkpoint->list = list;
+  while (ok && fread(frame, sizeof(frame), 1, journal) == 1 && frame[0] == BACKUP_CHECKPOINT_MAGIC) {
+    unsigned char *grown = (unsigned char *)realloc(data, frame[2] ? frame[2] : 1);
+    FILE *fp;
+
+    if (!grown) {
+      ok = 0;
+      break;
+    }
+    data = grown;
+    if (fread(data, 1, frame[2], journal) != frame[2] || crc32c(0, data, frame[2]) != frame[3]) {
+      break;
+    }
+    fp = fmemopen(data, frame[2], "rb");
+    ok = fp && checkpoint_parse(checkpoint, frame[1], fp, list) == 0;
+    if (fp) {
+      fclose(fp);
+    }
+    offset += (long long)sizeof(frame) + frame[2];
+  }
+  if (journal) {
+    fclose(journal);
+  }
+  free(data);
+
+  if (ok && checkpoint->files) {
+    checkpoint->fd = open(path, O_WRONLY);
+    ok = checkpoint->fd >= 0 && ftruncate(checkpoint->fd, offset) == 0 &&
+         lseek(checkpoint->fd, offset, SEEK_SET) == offset;
+  }
+  if (!ok || !checkpoint->files) {
+    checkpoint_free(checkpoint);
+    file_list_free(list);
+    return 1;
+  }
+  checkpoint->last_ns = clock_ns();
+  return 0;
+}
+
+/**
+  @brief Check that what a checkpoint describes survived the crash.
+
+  Files done before the checkpoint only have their size checked.  The
+  stored part of files that were in flight is read back and compared
+  with its block checksums: the crash hit right behind it.
+
+  @param [in] checkpoint  Loaded checkpoint.
+  @param [in] backup_path Backup directory.
+
+  @retval 0 usable, 1 not.
+*/
+static int checkpoint_verify(const Checkpoint *checkpoint, const char *backup_path) {
+  size_t capacity = BACKUP_BLOCK_SIZE + BACKUP_FRAME_HEADER_SIZE;
+  unsigned char *buffer = (unsigned char *)malloc(capacity);
+  char path[4096];
+  struct stat st;
+  int ret = buffer ? 0 : 1;
+  int i;
+
+  if (ret == 0 && checkpoint->chunk_length > 0) {
+    snprintf(path, sizeof(path), "%s/%s", backup_path, BACKUP_CHUNK_MANIFEST);
+    if (stat(path, &st) != 0 || st.st_size < checkpoint->chunk_length) {
+      ret = 1;
+    }
+  }
+  for (i = 0; ret == 0 && i < checkpoint->list->count; i++) {
+    const CheckpointFile *file = &checkpoint->files[i];
+    const ManifestFile *sums = &file->sums;
+    int fd;
+    int k;
+
+    if (!sums->path) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", backup_path, sums->path);
+    if (stat(path, &st) != 0 || (file->done ? st.st_size != sums->size : st.st_size < file->stored)) {
+      ret = 1;
+      break;
+    }
+    if (file->done || (fd = open(path, O_RDONLY)) < 0) {
+      ret = file->done ? 0 : 1;
+      continue;
+    }
+    for (k = 0; ret == 0 && k < sums->block_count; k++) {
+      const ManifestBlock *block = &sums->blocks[k];
+      size_t done = 0;
+
+      while (block->length <= capacity && done < block->length) {
+        ssize_t n = pread(fd, buffer + done, block->length - done, block->offset + (long long)done);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          break;
+        }
+        done += (size_t)n;
+      }
+      if (done != block->length || block->length > capacity || crc32c(0, buffer, done) != block->crc) {
+        ret = 1;
+      }
+    }
+    close(fd);
+  }
+  free(buffer);
+  return ret;
+}
+
+/**
+  @brief Hand the saved state of one file over to the new run.
+
+  @param [in,out] file      Checkpointed file.
+  @param [in,out] entry     Page state of the file, freshly allocated.
+  @param [in,out] checksums Manifest, sized for every file.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int checkpoint_restore(CheckpointFile *file, PageMapFile *entry, Manifest *checksums) {
+  file->entry = entry;
+  if (file->pages.path) {
+    memcpy(entry->lsns, file->pages.lsns, file->saved_pages * sizeof(unsigned long long));
+    memcpy(entry->crcs, file->pages.crcs, file->saved_pages * sizeof(unsigned int));
+    memcpy(entry->changed, file->pages.changed, file->done ? entry->page_count / 8 + 1 : file->saved_pages / 8);
+    page_map_file_free(&file->pages);
+  }
+  if (file->sums.path) {
+    file->checksums = manifest_add(checksums, file->sums.path);
+    if (!file->checksums) {
+      return 1;
+    }
+    file->checksums->size = file->sums.size;
+    file->checksums->blocks = file->sums.blocks;
+    file->checksums->block_count = file->sums.block_count;
+    file->checksums->block_size = file->sums.block_size;
+    free(file->sums.path);
+    memset(&file->sums, 0, sizeof(file->sums));
+  }
+  return 0;
+}
+
+/**
+  @brief Make the progress so far durable.
+
+  Everything the backup wrote is flushed first, with one syncfs() over
+  the backup filesystem, so a record never covers data still in the
+  page cache.  Only what changed since the previous record is appended.
+  Called by the thread that writes the backup, so the state it reads is
+  settled.
+
+  @param [in,out] checkpoint Checkpoint.
+
+  @retval 0 success, 1 failure.
+*/
+static int checkpoint_save(Checkpoint *checkpoint) {
+  unsigned int end = 0xffffffffU;
+  char *data = NULL;
+  size_t length = 0;
+  FILE *fp;
+  int ok = 1;
+  int i;
+
+  checkpoint->last_ns = clock_ns();
+  if (checkpoint->chunk_manifest) {
+    ok = fflush(checkpoint->chunk_manifest) == 0;
+    checkpoint->chunk_length = ftell(checkpoint->chunk_manifest);
+  }
+  if (!ok || syncfs(checkpoint->fd) != 0) {
+    return 1;
+  }
+  fp = open_memstream(&data, &length);
+  ok = fp && fwrite(checkpoint->live, sizeof(BackupStats), 1, fp) == 1 &&
+       fwrite(&checkpoint->chunk_length, sizeof(checkpoint->chunk_length), 1, fp) == 1;
+  for (i = 0; ok && i < checkpoint->list->count; i++) {
+    ok = checkpoint_put_file(fp, &checkpoint->files[i], (unsigned int)i) == 0;
+  }
+  ok = ok && fwrite(&end, sizeof(end), 1, fp) == 1;
+  if (fp && fclose(fp) != 0) {
+    ok = 0;
+  }
+  ok = ok && checkpoint_append(checkpoint->fd, BACKUP_CHECKPOINT_PROGRESS, (const unsigned char *)data, length) == 0;
+  free(data);
+  return ok ? 0 : 1;
+}
+
+/**
+  @brief Tell whether the checkpoint interval has passed.
+
+  @param [in] checkpoint Checkpoint, or NULL.
+
+  @retval 1 a checkpoint is due, 0 not.
+*/
+static int checkpoint_due(const Checkpoint *checkpoint) {
+  return checkpoint && checkpoint->fd >= 0 &&
+         clock_ns() - checkpoint->last_ns >= checkpoint->interval * 1000000000LL;
+}
+
+/**
+  @brief Take a checkpoint once the interval has passed.
+
+  @param [in,out] checkpoint Checkpoint, or NULL.
+
+  @retval 0 success or not due, 1 failure.
+*/
+static int checkpoint_tick(Checkpoint *checkpoint) {
+  if (!checkpoint_due(checkpoint)) {
+    return 0;
+  }
+  return checkpoint_save(checkpoint);
+}
+
+/**
+  @brief Release an io_uring instance.
+
+  Callers reap their requests first; the kernel cancels any left over.
+
+  @param [in,out] ring Ring, set up or not.
+*/
+static void io_ring_free(IoRing *ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_size);
+  }
+  if (ring->sq_ring) {
+    munmap(ring->sq_ring, ring->sq_size);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/**
+  @brief Set up an io_uring instance and map its rings.
+
+  Kernels without io_uring, or without the plain and fixed-buffer read
+  and write operations (before 5.6), fail here so the caller can fall
+  back to threads.  Seccomp filters and io_uring_disabled show up the
+  same way.
+
+  @param [out] ring    Ring.
+  @param [in]  entries Submission slots wanted, rounded up by the kernel.
+
+  @retval 0 success, 1 io_uring unavailable.
+*/
+static int io_ring_setup(IoRing *ring, unsigned int entries) {
+#if defined(BACKUP_HAVE_IO_URING)
+  static const int ops[4] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED};
+  size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe;
+  struct io_uring_params params;
+  int ok;
+  int i;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    ring->fd = -1;
+    return 1;
+  }
+  ring->entries = params.sq_entries;
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    io_ring_free(ring);
+    return 1;
+  }
+  ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+                      ? ring->sq_ring
+                      : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_SQES);
+  if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    ring->cq_ring = ring->cq_ring == MAP_FAILED ? NULL : ring->cq_ring;
+    ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+    io_ring_free(ring);
+    return 1;
+  }
+  ring->sq_head = (unsigned int *)((char *)ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (char *)ring->cq_ring + params.cq_off.cqes;
+
+  probe = (struct io_uring_probe *)calloc(1, probe_size);
+  ok = probe && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+  for (i = 0; ok && i < 4; i++) {
+    ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  if (!ok) {
+    io_ring_free(ring);
+    return 1;
+  }
+  return 0;
+#else
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  (void)entries;
+  return 1;
+#endif
+}
+
+/**
+  @brief Register buffers, so fixed reads and writes skip mapping them per request.
+
+  @param [in,out] ring  Ring.
+  @param [in]     iov   Buffers; request buffer indexes refer to this array.
+  @param [in]     count Number of buffers.
+
+  @retval 0 success, 1 failure (plain reads and writes still work).
+*/
+static int io_ring_register(IoRing *ring, const struct iovec *iov, unsigned int count) {
+#if defined(BACKUP_HAVE_IO_URING)
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) != 0) {
+    return 1;
+  }
+  ring->fixed = 1;
+  return 0;
+#else
+  (void)ring;
+  (void)iov;
+  (void)count;
+  return 1;
+#endif
+}
+
+/**
+  @brief Queue one read or write for the next submission.
+
+  Requests in flight never exceed the submission slots, so the
+  completion ring, twice that size, cannot overflow.
+
+  @param [in,out] ring      Ring.
+  @param [in]     write     Nonzero to write.
+  @param [in]     fd        Descriptor.
+  @param [in]     buffer    Buffer.
+  @param [in]     length    Bytes.
+  @param [in]     offset    File offset.
+  @param [in]     buf_index Registered buffer holding buffer, or -1.
+  @param [in]     user_data Returned with the completion.
+
+  @retval 0 queued, 1 ring full.
+*/
+static int io_ring_queue(IoRing *ring, int write, int fd, void *buffer, unsigned int length, long long offset,
+                         int buf_index, unsigned long long user_data) {
+#if defined(BACKUP_HAVE_IO_URING)
+  unsigned int tail = *ring->sq_tail;
+  unsigned int slot = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe;
+
+  if (ring->queued + ring->inflight >= ring->entries) {
+    return 1;
+  }
+  sqe = &((struct io_uring_sqe *)ring->sqes)[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  if (buf_index >= 0 && ring->fixed) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = (unsigned short)buf_index;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  sqe->fd = fd;
+  sqe->off = (unsigned long long)offset;
+  sqe->addr = (unsigned long long)(unsigned long)buffer;
+  sqe->len = length;
+  sqe->user_data = user_data;
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+  return 0;
+#else
+  (void)ring;
+  (void)write;
+  (void)fd;
+  (void)buffer;
+  (void)length;
+  (void)offset;
+  (void)buf_index;
+  (void)user_data;
+  return 1;
+#endif
+}
+
+/**
+  @brief Submit the queued requests in one system call.
+
+  @param [in,out] ring Ring.
+  @param [in]     wait Completions to wait for, capped at the requests outstanding.
+
+  @retval 0 success, 1 failure.
+*/
+static int io_ring_submit(IoRing *ring, unsigned int wait) {
+#if defined(BACKUP_HAVE_IO_URING)
+  if (wait > ring->queued + ring->inflight) {
+    wait = ring->queued + ring->inflight;
+  }
+  for (;;) {
+    long n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    /* The kernel may consume part of the batch before it fails or gets interrupted */
+    unsigned int left = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    ring->inflight += ring->queued - left;
+    ring->queued = left;
+    if (n >= 0 || errno == EAGAIN || errno == EBUSY) {
+      /* Busy rings make progress once the caller reaps completions */
+      return 0;
+    }
+    if (errno != EINTR) {
+      return 1;
+    }
+  }
+#else
+  (void)ring;
+  (void)wait;
+  return 1;
+#endif
+}
+
+/**
+  @brief Take one completion.
+
+  @param [in,out] ring      Ring.
+  @param [out]    user_data As queued.
+  @param [out]    result    Bytes transferred, or a negative errno.
+
+  @retval 1 a completion was taken, 0 none is ready.
+*/
+static int io_ring_reap(IoRing *ring, unsigned long long *user_data, int *result) {
+#if defined(BACKUP_HAVE_IO_URING)
+  unsigned int head = *ring->cq_head;
+  const struct io_uring_cqe *cqe;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  cqe = &((const struct io_uring_cqe *)ring->cqes)[head & *ring->cq_mask];
+  *user_data = cqe->user_data;
+  *result = cqe->res;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  ring->inflight--;
+  return 1;
+#else
+  (void)ring;
+  (void)user_data;
+  (void)result;
+  return 0;
+#endif
+}
+
+/**
+  @brief Initialize a bounded block queue.
+
+  @param [out] queue     Queue.
+  @param [in]  capacity  Maximum number of blocks.
+  @param [in]  producers Number of threads that will close the queue.
+
+  @retval 0 success, 1 failure.
+*/
+static int block_queue_init(BlockQueue *queue, int capacity, int producers) {
+  queue->items = (BackupBlock **)malloc(capacity * sizeof(BackupBlock *));
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  queue->producers = producers;
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+  return queue->items ? 0 : 1;
+}
+
+/**
+  @brief Destroy a block queue.
+
+  @param [in] queue Queue.
+*/
+static void block_queue_destroy(BlockQueue *queue) {
+  free(queue->items);
+  pthread_mutex_destroy(&queue->mutex);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+}
+
+/**
+  @brief Append a block, waiting while the queue is full.
+
+  @param [in]     queue   Queue.
+  @param [in]     block   Block.
+  @param [in,out] wait_ns Time spent waiting.
+*/
+static void block_queue_push(BlockQueue *queue, BackupBlock *block, long long *wait_ns) {
+  pthread_mutex_lock(&queue->mutex);
+  if (queue->count == queue->capacity) {
+    long long start = clock_ns();
+    while (queue->count == queue->capacity) {
+      pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    *wait_ns += clock_ns() - start;
+  }
+  queue->items[(queue->head + queue->count) % queue->capacity] = block;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+  @brief Take the oldest block, waiting while the queue is empty.
+
+  @param [in]     queue   Queue.
+  @param [in,out] wait_ns Time spent waiting.
+
+  @retval Block, or NULL once the queue is empty and every producer closed it.
+*/
+static BackupBlock *block_queue_pop(BlockQueue *queue, long long *wait_ns) {
+  BackupBlock *block = NULL;
+
+  pthread_mutex_lock(&queue->mutex);
+  if (queue->count == 0 && queue->producers > 0) {
+    long long start = clock_ns();
+    while (queue->count == 0 && queue->producers > 0) {
+      pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    *wait_ns += clock_ns() - start;
+  }
+  if (queue->count > 0) {
+    block = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return block;
+}
+
+/**
+  @brief Take the oldest block if there is one, without waiting.
+
+  @param [in] queue Queue.
+
+  @retval Block, or NULL if the queue is empty.
+*/
+static BackupBlock *block_queue_try_pop(BlockQueue *queue) {
+  BackupBlock *block = NULL;
+
+  pthread_mutex_lock(&queue->mutex);
+  if (queue->count > 0) {
+    block = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return block;
+}
+
+/**
+  @brief Mark producers of a queue as finished.
+
+  @param [in] queue Queue.
+  @param [in] count Number of producers that finished.
+*/
+static void block_queue_close(BlockQueue *queue, int count) {
+  pthread_mutex_lock(&queue->mutex);
+  queue->producers -= count;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+  @brief Account work done by one stage thread.
+
+  @param [in] stage   Stage counters.
+  @param [in] bytes   Bytes processed.
+  @param [in] busy_ns Time spent working.
+  @param [in] wait_ns Time spent waiting on queues.
+*/
+static void stage_account(PipelineStage *stage, long long bytes, long long busy_ns, long long wait_ns) {
+  __sync_fetch_and_add(&stage->bytes, bytes);
+  __sync_fetch_and_add(&stage->busy_ns, busy_ns);
+  __sync_fetch_and_add(&stage->wait_ns, wait_ns);
+}
+
+/**
+  @brief Find the job a block sequence number belongs to.
+
+  @param [in] pipeline Pipeline.
+  @param [in] seq      Block sequence number.
+
+  @retval Job index.
+*/
+static int pipeline_find_job(const BackupPipeline *pipeline, long long seq) {
+  int low = 0;
+  int high = pipeline->job_count - 1;
+
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (pipeline->jobs[mid].first_seq <= seq) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return low;
+}
+
+/**
+  @brief Reader stage: fill recycled buffers with the next blocks.
+
+  @param [in] arg Pipeline.
+*/
+static void *pipeline_read_worker(void *arg) {
+  BackupPipeline *pipeline = (BackupPipeline *)arg;
+  long long bytes = 0, busy_ns = 0, wait_ns = 0;
+  SourceFile source;
+  int fd_job = -1;
+
+  source.fd = -1;
+  source.resident = NULL;
+
+  for (;;) {
+    BackupBlock *block = block_queue_pop(&pipeline->free_blocks, &wait_ns);
+    long long seq = __sync_fetch_and_add(&pipeline->next_seq, 1);
+    long long start = clock_ns();
+    BackupJob *job;
+    size_t done = 0;
+
+    if (seq >= pipeline->block_total) {
+      block_queue_push(&pipeline->free_blocks, block, &wait_ns);
+      break;
+    }
+    block->seq = seq;
+    block->job = pipeline_find_job(pipeline, seq);
+    job = &pipeline->jobs[block->job];
+    block->index = job->first_block + (unsigned int)(seq - job->first_seq);
+    block->offset = (long long)block->index * BACKUP_BLOCK_SIZE;
+    block->length = 0;
+    block->holes = 0;
+
+    if (!pipeline->failed && job->file->size > block->offset) {
+      size_t want = job->file->size - block->offset < BACKUP_BLOCK_SIZE ? (size_t)(job->file->size - block->offset)
+                                                                        : BACKUP_BLOCK_SIZE;
+      /* Keep the descriptor while this thread stays on the same file */
+      if (fd_job != block->job) {
+        source_close(&source);
+        if (source_open(&source, job->src, pipeline->direct, pipeline->direct) != 0 && errno != ENOENT) {
+          pipeline->failed = 1;
+        }
+        fd_job = block->job;
+      }
+      if (source.fd >= 0) {
+        /* A short read means the file shrank while we were reading */
+        ssize_t n = source_read_sparse(&source, block->data, want, block->offset, &block->holes, pipeline->throttle);
+        if (n < 0) {
+          pipeline->failed = 1;
+        }
+        done = n > 0 ? (size_t)n : 0;
+      }
+    }
+    block->length = done;
+    block->hole_bytes = done > 0 ? hole_length(block->holes, done) : 0;
+    bytes += done;
+    busy_ns += clock_ns() - start;
+    block_queue_push(&pipeline->compress_queue, block, &wait_ns);
+  }
+
+  source_close(&source);
+  stage_account(&pipeline->stages[BACKUP_STAGE_READ], bytes, busy_ns, wait_ns);
+  block_queue_close(&pipeline->compress_queue, 1);
+  return NULL;
+}
+
+/**
+  @brief Start the reads of one block on the read ring.
+
+  Holes are found as by source_read_sparse() and zero-filled here; each
+  data run becomes one read into the block's registered buffer.  Files
+  whose reads must drop what they bring into the page cache are read
+  synchronously, since the drop has to follow the read.
+
+  @param [in] pipeline Pipeline.
+  @param [in] block    Block, claimed from the pool.
+  @param [in] seq      Sequence number claimed for it.
+  @param [in] sources  Open files, one per job.
+*/
+static void pipeline_uring_read_block(BackupPipeline *pipeline, BackupBlock *block, long long seq,
+                                      SourceFile *sources) {
+  unsigned long long index = (unsigned long long)(block - pipeline->blocks);
+  BackupJob *job;
+  SourceFile *source;
+  unsigned int pages;
+  unsigned int page = 0;
+  size_t want;
+
+  block->seq = seq;
+  block->job = pipeline_find_job(pipeline, seq);
+  job = &pipeline->jobs[block->job];
+  block->index = job->first_block + (unsigned int)(seq - job->first_seq);
+  block->offset = (long long)block->index * BACKUP_BLOCK_SIZE;
+  block->length = 0;
+  block->holes = 0;
+  block->io_pending = 0;
+  block->io_short = 0;
+  if (pipeline->failed || job->file->size <= block->offset) {
+    return;
+  }
+  want = job->file->size - block->offset < BACKUP_BLOCK_SIZE ? (size_t)(job->file->size - block->offset)
+                                                              : BACKUP_BLOCK_SIZE;
+  source = &sources[block->job];
+  if (!source->path && source_open(source, job->src, pipeline->direct, pipeline->direct) != 0 && errno != ENOENT) {
+    pipeline->failed = 1;
+  }
+  if (source->fd < 0) {
+    return;
+  }
+  if (!source->direct && source->drop) {
+    ssize_t n = source_read_sparse(source, block->data, want, block->offset, &block->holes, pipeline->throttle);
+    if (n < 0) {
+      pipeline->failed = 1;
+    }
+    block->length = n > 0 ? (size_t)n : 0;
+    return;
+  }
+
+  block->length = source_holes(source, want, block->offset, &block->holes);
+  pages = (unsigned int)((want + BACKUP_PAGE_SIZE - 1) / BACKUP_PAGE_SIZE);
+  while (page < pages) {
+    size_t from = (size_t)page * BACKUP_PAGE_SIZE;
+    unsigned int run = page;
+    size_t run_length;
+    size_t length;
+
+    if ((block->holes >> page) & 1) {
+      memset(block->data + from, 0, want - from < BACKUP_PAGE_SIZE ? want - from : BACKUP_PAGE_SIZE);
+      page++;
+      continue;
+    }
+    while (run < pages && !((block->holes >> run) & 1)) {
+      run++;
+    }
+    run_length = ((size_t)run * BACKUP_PAGE_SIZE < want ? (size_t)run * BACKUP_PAGE_SIZE : want) - from;
+    length = source->direct ? (run_length + BACKUP_DIRECT_ALIGN - 1) / BACKUP_DIRECT_ALIGN * BACKUP_DIRECT_ALIGN
+                            : run_length;
+    throttle_wait(pipeline->throttle, 0, (long long)run_length, 1);
+    if (io_ring_queue(&pipeline->read_ring, 0, source->fd, block->data + from, (unsigned int)length,
+                      block->offset + (long long)from, (int)index, (index << 32) | run_length) != 0) {
+      /* The caller keeps a block's worth of slots free; read the rest synchronously */
+      block->io_short = 1;
+      break;
+    }
+    block->io_pending++;
+    page = run;
+  }
+}
+
+/**
+  @brief Pass a block whose reads are all reaped to the compress stage.
+
+  A read that came back short or failed, because the file shrank or a
+  filesystem refused O_DIRECT, has the block read again synchronously,
+  which tells the two apart.  A job's file is closed after its last block.
+
+  @param [in]     pipeline Pipeline.
+  @param [in]     block    Block.
+  @param [in]     sources  Open files, one per job.
+  @param [in,out] left     Blocks of each job still to read.
+  @param [in,out] bytes    Bytes read.
+  @param [in,out] wait_ns  Time spent waiting on queues.
+*/
+static void pipeline_uring_read_done(BackupPipeline *pipeline, BackupBlock *block, SourceFile *sources, int *left,
+                                     long long *bytes, long long *wait_ns) {
+  BackupJob *job = &pipeline->jobs[block->job];
+  SourceFile *source = &sources[block->job];
+
+  if (block->io_short && !pipeline->failed) {
+    size_t want = job->file->size - block->offset < BACKUP_BLOCK_SIZE ? (size_t)(job->file->size - block->offset)
+                                                                      : BACKUP_BLOCK_SIZE;
+    ssize_t n = source_read_sparse(source, block->data, want, block->offset, &block->holes, pipeline->throttle);
+    if (n < 0) {
+      pipeline->failed = 1;
+    }
+    block->length = n > 0 ? (size_t)n : 0;
+  }
+  block->io_short = 0;
+  block->hole_bytes = block->length > 0 ? hole_length(block->holes, block->length) : 0;
+  *bytes += block->length;
+  if (--left[block->job] == 0) {
+    source_close(source);
+  }
+  block_queue_push(&pipeline->compress_queue, block, wait_ns);
+}
+
+/**
+  @brief Reader stage on io_uring: one thread keeps the device queue full.
+
+  Blocks are claimed as buffers free up, and the reads of all blocks
+  claimed in a pass go to the kernel in one submission.  The thread
+  waits for completions only when it cannot claim more, so up to
+  queue_depth blocks are read at once with no thread per request.
+
+  @param [in] arg Pipeline.
+*/
+static void *pipeline_uring_read_worker(void *arg) {
+  BackupPipeline *pipeline = (BackupPipeline *)arg;
+  IoRing *ring = &pipeline->read_ring;
+  long long bytes = 0, busy_ns = 0, wait_ns = 0;
+  SourceFile *sources = (SourceFile *)calloc(pipeline->job_count, sizeof(SourceFile));
+  int *left = (int *)calloc(pipeline->job_count, sizeof(int));
+  int claiming = 1;
+  int i;
+
+  if (!sources || !left) {
+    pipeline->failed = 1;
+    claiming = 0;
+  }
+  for (i = 0; claiming && i < pipeline->job_count; i++) {
+    sources[i].fd = -1;
+    left[i] = pipeline->jobs[i].block_count - pipeline->jobs[i].first_block;
+  }
+
+  while (claiming || ring->queued + ring->inflight > 0) {
+    unsigned long long user_data;
+    long long start;
+    int result;
+    int claimed = 0;
+
+    /* Claim blocks while buffers last and a whole block's reads fit in the ring */
+    while (claiming && ring->queued + ring->inflight + BACKUP_SCAN_PAGES <= ring->entries) {
+      BackupBlock *block = ring->queued + ring->inflight == 0 ? block_queue_pop(&pipeline->free_blocks, &wait_ns)
+                                                              : block_queue_try_pop(&pipeline->free_blocks);
+      long long seq;
+
+      if (!block) {
+        break;
+      }
+      seq = __sync_fetch_and_add(&pipeline->next_seq, 1);
+      if (seq >= pipeline->block_total) {
+        block_queue_push(&pipeline->free_blocks, block, &wait_ns);
+        claiming = 0;
+        break;
+      }
+      start = clock_ns();
+      pipeline_uring_read_block(pipeline, block, seq, sources);
+      busy_ns += clock_ns() - start;
+      claimed++;
+      if (block->io_pending == 0) {
+        pipeline_uring_read_done(pipeline, block, sources, left, &bytes, &wait_ns);
+      }
+    }
+
+    start = clock_ns();
+    if (ring->queued + ring->inflight > 0 && io_ring_submit(ring, claimed == 0 ? 1 : 0) != 0) {
+      pipeline->failed = 1;
+      break;
+    }
+    while (io_ring_reap(ring, &user_data, &result)) {
+      BackupBlock *block = &pipeline->blocks[user_data >> 32];
+
+      if (result < 0 || (unsigned long long)result < (user_data & 0xffffffffULL)) {
+        block->io_short = 1;
+      }
+      if (--block->io_pending == 0) {
+        pipeline_uring_read_done(pipeline, block, sources, left, &bytes, &wait_ns);
+      }
+    }
+    busy_ns += clock_ns() - start;
+  }
+
+  for (i = 0; sources && left && i < pipeline->job_count; i++) {
+    source_close(&sources[i]);
+  }
+  free(sources);
+  free(left);
+  stage_account(&pipeline->stages[BACKUP_STAGE_READ], bytes, busy_ns, wait_ns);
+  block_queue_close(&pipeline->compress_queue, 1);
+  return NULL;
+}
+
+/**
+  @brief Compress stage: track pages and shape the stored bytes.
+
+  Full copies store the block as read.  Deltas keep only the changed
+  pages, compacted in place in page order.  Deduplicated copies are cut
+  into content-defined chunks and hashed here, where the work spreads
+  over the pool.  Each block, or each chunk, is then deflated into an
+  independent frame; frames that do not shrink are stored as is, and
+  blocks read wholly from holes become empty zero frames.
+
+  @param [in] arg Pipeline.
+*/
+static void *pipeline_compress_worker(void *arg) {
+  BackupPipeline *pipeline = (BackupPipeline *)arg;
+  long long bytes = 0, busy_ns = 0, wait_ns = 0;
+  size_t capacity = compressBound(BACKUP_BLOCK_SIZE);
+  BackupBlock *block;
+  z_stream stream;
+  int level = pipeline->level;
+
+  memset(&stream, 0, sizeof(stream));
+  if (level > 0 && deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    /* Without a stream every frame is stored as is */
+    level = 0;
+  }
+
+  while ((block = block_queue_pop(&pipeline->compress_queue, &wait_ns)) != NULL) {
+    long long start = clock_ns();
+    BackupJob *job = &pipeline->jobs[block->job];
+    unsigned int first_page = block->index * BACKUP_SCAN_PAGES;
+    unsigned int pages = (unsigned int)((block->length + BACKUP_PAGE_SIZE - 1) / BACKUP_PAGE_SIZE);
+    unsigned long long all_holes = pages >= 64 ? ~0ULL : (1ULL << pages) - 1;
+    BackupStats counts;
+    size_t pos;
+
+    memset(&counts, 0, sizeof(counts));
+    /* Before deltas compact the block in place */
+    if (job->signature && !pipeline->failed) {
+      signature_blocks(job->signature, block->data, block->length, block->offset);
+    }
+    block->out = block->data;
+    block->out_length = job->mode == BACKUP_JOB_DELTA ? 0 : block->length;
+    for (pos = 0; !pipeline->failed && pos < block->length; pos += BACKUP_PAGE_SIZE) {
+      unsigned int page = first_page + (unsigned int)(pos / BACKUP_PAGE_SIZE);
+      size_t length = block->length - pos < BACKUP_PAGE_SIZE ? block->length - pos : BACKUP_PAGE_SIZE;
+
+      if (page >= job->entry->page_count) {
+        break;
+      }
+      if (track_page(block->data + pos, length, page, job->parent, job->entry, &counts) &&
+          job->mode == BACKUP_JOB_DELTA) {
+        if (block->out_length != pos) {
+          memmove(block->data + block->out_length, block->data + pos, length);
+        }
+        block->out_length += length;
+      }
+    }
+    block->scanned_pages = counts.scanned_pages;
+    block->changed_pages = counts.changed_pages;
+    block->raw_length = block->out_length;
+    block->frame_flags = BACKUP_FRAME_STORED;
+    if (job->mode == BACKUP_JOB_CHUNK && !pipeline->failed) {
+      size_t zpos = 0;
+      int i;
+
+      chunk_block(block);
+      for (i = 0; i < block->chunk_count; i++) {
+        BackupChunk *chunk = &block->chunks[i];
+        size_t length = 0;
+
+        chunk->flags = level > 0 ? frame_compress(&stream, block->out + chunk->offset, chunk->length,
+                                                  block->zdata + zpos, capacity - zpos, &length)
+                                 : BACKUP_FRAME_STORED;
+        if (chunk->flags == BACKUP_FRAME_DEFLATE) {
+          chunk->stored_offset = (unsigned int)zpos;
+          chunk->stored_length = (unsigned int)length;
+          zpos += length;
+        } else {
+          chunk->stored_offset = chunk->offset;
+          chunk->stored_length = chunk->length;
+        }
+      }
+    } else if (job->compressed && block->out_length > 0 && block->holes == all_holes && !pipeline->failed) {
+      block->frame_flags = BACKUP_FRAME_ZERO;
+      block->out_length = 0;
+    } else if (job->compressed && block->out_length > 0 && level > 0 && !pipeline->failed) {
+      size_t length = 0;
+
+      block->frame_flags = frame_compress(&stream, block->out, block->out_length, block->zdata, capacity, &length);
+      if (block->frame_flags == BACKUP_FRAME_DEFLATE) {
+        block->out = block->zdata;
+        block->out_length = length;
+      }
+    }
+    bytes += block->length;
+    busy_ns += clock_ns() - start;
+    block_queue_push(&pipeline->checksum_queue, block, &wait_ns);
+  }
+
+  if (level > 0) {
+    deflateEnd(&stream);
+  }
+  stage_account(&pipeline->stages[BACKUP_STAGE_COMPRESS], bytes, busy_ns, wait_ns);
+  block_queue_close(&pipeline->checksum_queue, 1);
+  return NULL;
+}
+
+/**
+  @brief Checksum stage: CRC32C of the bytes that will be stored.
+
+  Frames are checksummed with their header, so each checksum covers one
+  contiguous range of the stored file.
+
+  @param [in] arg Pipeline.
+*/
+static void *pipeline_checksum_worker(void *arg) {
+  BackupPipeline *pipeline = (BackupPipeline *)arg;
+  long long bytes = 0, busy_ns = 0, wait_ns = 0;
+  BackupBlock *block;
+
+  while ((block = block_queue_pop(&pipeline->checksum_queue, &wait_ns)) != NULL) {
+    long long start = clock_ns();
+
+    /* Chunks are already identified by their SHA-256 */
+    block->crc = 0;
+    if (!pipeline->failed && pipeline->jobs[block->job].mode != BACKUP_JOB_CHUNK) {
+      if (pipeline->jobs[block->job].compressed && block->raw_length > 0) {
+        unsigned int header[4];
+        frame_header(header, (unsigned int)block->raw_length, (unsigned int)block->out_length, block->frame_flags);
+        block->crc = crc32c(0, (const unsigned char *)header, sizeof(header));
+      }
+      block->crc = crc32c(block->crc, block->out, block->out_length);
+      bytes += block->out_length;
+    }
+    busy_ns += clock_ns() - start;
+    block_queue_push(&pipeline->write_queue, block, &wait_ns);
+  }
+
+  stage_account(&pipeline->stages[BACKUP_STAGE_CHECKSUM], bytes, busy_ns, wait_ns);
+  block_queue_close(&pipeline->write_queue, 1);
+  return NULL;
+}
+
+/**
+  @brief Return a block to the pool unless writes or the writer still hold it.
+
+  @param [in] pipeline Pipeline.
+  @param [in] block    Block.
+*/
+static void pipeline_uring_release(BackupPipeline *pipeline, BackupBlock *block) {
+  /* The pool has room for every block, so this never waits */
+  long long wait_ns = 0;
+
+  if (block->io_writes == 0 && block != pipeline->held) {
+    block_queue_push(&pipeline->free_blocks, block, &wait_ns);
+  }
+}
+
+/**
+  @brief Submit queued writes and reap the finished ones.
+
+  A ring the kernel stops accepting requests from gives up what it
+  holds, so the pool refills and the failed run can wind down.
+
+  @param [in] pipeline Pipeline.
+  @param [in] wait     Completions to wait for.
+
+  @retval 0 success, 1 a write failed.
+*/
+static int pipeline_uring_reap_writes(BackupPipeline *pipeline, unsigned int wait) {
+  IoRing *ring = &pipeline->write_ring;
+  unsigned long long user_data;
+  int result;
+  int ret = 0;
+  int i;
+
+  if (io_ring_submit(ring, wait) != 0) {
+    ring->queued = 0;
+    ring->inflight = 0;
+    for (i = 0; i < pipeline->depth; i++) {
+      if (pipeline->blocks[i].io_writes > 0) {
+        pipeline->blocks[i].io_writes = 0;
+        pipeline_uring_release(pipeline, &pipeline->blocks[i]);
+      }
+    }
+    return 1;
+  }
+  while (io_ring_reap(ring, &user_data, &result)) {
+    BackupBlock *block = &pipeline->blocks[user_data >> 32];
+
+    if (result < 0 || (unsigned long long)result != (user_data & 0xffffffffULL)) {
+      ret = 1;
+    }
+    if (--block->io_writes == 0) {
+      pipeline_uring_release(pipeline, block);
+    }
+  }
+  return ret;
+}
+
+/**
+  @brief Wait for every write on the ring.
+
+  @param [in] pipeline Pipeline.
+
+  @retval 0 success, 1 a write failed.
+*/
+static int pipeline_uring_drain(BackupPipeline *pipeline) {
+  int ret = 0;
+
+  while (pipeline->write_ring.queued + pipeline->write_ring.inflight > 0) {
+    if (pipeline_uring_reap_writes(pipeline, 1) != 0) {
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+/**
+  @brief Queue one write of a block, making room in the ring if needed.
+
+  @param [in] pipeline Pipeline.
+  @param [in] block    Block the bytes belong to.
+  @param [in] fd       Output descriptor.
+  @param [in] data     Bytes, in the block's data, zdata or header.
+  @param [in] length   Byte count.
+  @param [in] offset   File offset.
+
+  @retval 0 success, 1 failure.
+*/
+static int pipeline_uring_queue(BackupPipeline *pipeline, BackupBlock *block, int fd, unsigned char *data,
+                                size_t length, long long offset) {
+  unsigned long long index = (unsigned long long)(block - pipeline->blocks);
+  int buf_index = data >= block->data && data < block->data + BACKUP_BLOCK_SIZE ? (int)index
+                  : data >= block->zdata && data < block->zdata + compressBound(BACKUP_BLOCK_SIZE)
+                      ? pipeline->depth + (int)index
+                      : -1;
+
+  while (io_ring_queue(&pipeline->write_ring, 1, fd, data, (unsigned int)length, offset, buf_index,
+                       (index << 32) | length) != 0) {
+    if (pipeline_uring_reap_writes(pipeline, 1) != 0) {
+      return 1;
+    }
+  }
+  block->io_writes++;
+  return 0;
+}
+
+/**
+  @brief Queue the writes of a block stored as is, skipping its hole pages.
+
+  As pwrite_sparse(), one write per run of pages.
+
+  @param [in] pipeline Pipeline.
+  @param [in] block    Block; its out bytes are written.
+  @param [in] fd       Output descriptor.
+  @param [in] offset   File offset.
+  @param [in] holes    Bit i set: skip page i.
+
+  @retval 0 success, 1 failure.
+*/
+static int pipeline_uring_write(BackupPipeline *pipeline, BackupBlock *block, int fd, long long offset,
+                                unsigned long long holes) {
+  size_t pos = 0;
+
+  while (pos < block->out_length) {
+    size_t end = pos;
+
+    if ((holes >> (pos / BACKUP_PAGE_SIZE)) & 1) {
+      pos += BACKUP_PAGE_SIZE;
+      continue;
+    }
+    while (end < block->out_length && !((holes >> (end / BACKUP_PAGE_SIZE)) & 1)) {
+      end += BACKUP_PAGE_SIZE;
+    }
+    if (end > block->out_length) {
+      end = block->out_length;
+    }
+    if (pipeline_uring_queue(pipeline, block, fd, block->out + pos, end - pos, offset + (long long)pos) != 0) {
+      return 1;
+    }
+    pos = end;
+  }
+  return 0;
+}
+
+/**
+  @brief Queue the writes of one frame: header, then stored bytes.
+
+  @param [in] pipeline Pipeline.
+  @param [in] block    Block; its header field holds the frame header.
+  @param [in] fd       Output descriptor.
+  @param [in] offset   File offset of the frame.
+
+  @retval 0 success, 1 failure.
+*/
+static int pipeline_uring_write_frame(BackupPipeline *pipeline, BackupBlock *block, int fd, long long offset) {
+  frame_header(block->header, (unsigned int)block->raw_length, (unsigned int)block->out_length, block->frame_flags);
+  return pipeline_uring_queue(pipeline, block, fd, (unsigned char *)block->header, BACKUP_FRAME_HEADER_SIZE,
+                              offset) != 0 ||
+         (block->out_length > 0 &&
+          pipeline_uring_queue(pipeline, block, fd, block->out, block->out_length,
+                               offset + BACKUP_FRAME_HEADER_SIZE) != 0);
+}
+
+/**
+  @brief Append one block of a file to the stream archive.
+
+  Blocks reach the writer in order, so each file is one entry of the
+  archive.  The manifest gets the offsets the file would have had on
+  disk: extraction writes it back byte for byte.
+
+  @param [in] pipeline Pipeline.
+  @param [in] block    Block, the next in sequence.
+
+  @retval 0 success, 1 failure.
+*/
+static int pipeline_stream_block(BackupPipeline *pipeline, BackupBlock *block) {
+  BackupJob *job = &pipeline->jobs[block->job];
+  BackupStream *stream = pipeline->stream;
+
+  if (block->index == 0 && stream_begin(stream, job->dst, job->file->mode ? job->file->mode : 0640,
+                                        job->mode == BACKUP_JOB_COPY ? job->file->mtime : 0) != 0) {
+    return 1;
+  }
+  if (!job->compressed) {
+    unsigned long long holes = job->mode == BACKUP_JOB_COPY ? block->holes : 0;
+
+    if (stream_put_sparse(stream, block->out, block->out_length, holes) != 0 ||
+        (block->out_length > 0 &&
+         manifest_add_block(job->checksums, job->stored, (unsigned int)block->out_length, block->crc) != 0)) {
+      return 1;
+    }
+    job->stored += (long long)block->out_length;
+    pipeline->stats->bytes += (long long)block->out_length - hole_length(holes, block->out_length);
+  } else if (block->raw_length > 0) {
+    frame_header(block->header, (unsigned int)block->raw_length, (unsigned int)block->out_length, block->frame_flags);
+    if (stream_put(stream, (const unsigned char *)block->header, BACKUP_FRAME_HEADER_SIZE) != 0 ||
+        stream_put(stream, block->out, block->out_length) != 0 ||
+        manifest_add_block(job->checksums, job->stored, BACKUP_FRAME_HEADER_SIZE + (unsigned int)block->out_length,
+                           block->crc) != 0) {
+      return 1;
+    }
+    job->stored += BACKUP_FRAME_HEADER_SIZE + (long long)block->out_length;
+    job->frame_raw[job->frame_count] = (unsigned int)block->raw_length;
+    job->frame_stored[job->frame_count] = (unsigned int)block->out_length;
+    job->frame_count++;
+    pipeline->stats->bytes += BACKUP_FRAME_HEADER_SIZE + (long long)block->out_length;
+  }
+  if ((int)block->index + 1 < job->block_count) {
+    return 0;
+  }
+  if (job->compressed) {
+    size_t length;
+    unsigned int *table = frame_seek_table(job->frame_raw, job->frame_stored, job->frame_count, &length);
+    int ret = !table || stream_put(stream, (const unsigned char *)table, length) != 0 ||
+              manifest_add_block(job->checksums, job->stored, (unsigned int)length,
+                                 crc32c(0, (const unsigned char *)table, length)) != 0;
+
+    free(table);
+    if (ret) {
+      return 1;
+    }
+    job->stored += (long long)length;
+    pipeline->stats->bytes += (long long)length;
+  }
+  job->checksums->size = job->stored;
+  pipeline->stats->files++;
+  return stream_end(stream);
+}
+
+/**
+  @brief Write one block in order and recycle its buffer.
+
+  @param [in] pipeline Pipeline.
+  @param [in] block    Block, the next in sequence.
+
+  @retval 0 success, 1 failure.
+*/
+static int pipeline_write_block(BackupPipeline *pipeline, BackupBlock *block) {
+  BackupJob *job = &pipeline->jobs[block->job];
+  int last = (int)block->index + 1 == job->block_count;
+  int i;
+
+  pipeline->stats->scanned_pages += block->scanned_pages;
+  pipeline->stats->changed_pages += block->changed_pages;
+  pipeline->stats->hole_bytes += block->hole_bytes;
+  if (job->mode == BACKUP_JOB_CHUNK) {
+    if (block->index == 0 &&
+        fprintf(pipeline->chunk_manifest, "F %lld %lld %s\n", job->file->size, job->file->mtime, job->file->path) < 0) {
+      return 1;
+    }
+    for (i = 0; i < block->chunk_count; i++) {
+      const BackupChunk *chunk = &block->chunks[i];
+      char hex[2 * SHA256_DIGEST_LENGTH + 1];
+      long long stored;
+
+      chunk_hex(chunk->hash, hex);
+      if (chunk_store_put(pipeline->chunk_dir, hex, chunk,
+                          (chunk->flags == BACKUP_FRAME_DEFLATE ? block->zdata : block->out) + chunk->stored_offset,
+                          &stored) != 0 ||
+          fprintf(pipeline->chunk_manifest, "C %s %u\n", hex, chunk->length) < 0) {
+        return 1;
+      }
+      pipeline->stats->chunks++;
+      pipeline->stats->chunk_bytes += chunk->length;
+      if (stored) {
+        pipeline->stats->new_chunks++;
+        pipeline->stats->bytes += stored;
+      }
+    }
+    if (last) {
+      pipeline->stats->files++;
+    }
+    return 0;
+  }
+  if (pipeline->stream && job->mode != BACKUP_JOB_SCAN) {
+    return pipeline_stream_block(pipeline, block);
+  }
+
+  if (job->mode == BACKUP_JOB_SCAN) {
+    if (block->length > 0 && manifest_add_block(job->checksums, block->offset, (unsigned int)block->length,
+                                                block->crc) != 0) {
+      return 1;
+    }
+    job->stored += (long long)block->length;
+  } else {
+    if (block->index == job->first_block) {
+      /* A resumed file continues after the part the checkpoint covers */
+      job->out_fd = open(job->dst, O_WRONLY | O_CREAT | (job->first_block ? 0 : O_TRUNC),
+                         job->file->mode ? job->file->mode : 0640);
+      if (job->out_fd < 0 || (job->first_block && (ftruncate(job->out_fd, job->stored) != 0 ||
+                                                   lseek(job->out_fd, job->stored, SEEK_SET) != job->stored))) {
+        return 1;
+      }
+    }
+    if (!job->compressed) {
+      /* Pages read from holes are skipped and stay holes; deltas are compacted, so they have none */
+      unsigned long long holes = job->mode == BACKUP_JOB_COPY ? block->holes : 0;
+
+      if ((pipeline->uring ? pipeline_uring_write(pipeline, block, job->out_fd, job->stored, holes)
+                           : pwrite_sparse(job->out_fd, block->out, block->out_length, job->stored, holes)) != 0 ||
+          (block->out_length > 0 &&
+           manifest_add_block(job->checksums, job->stored, (unsigned int)block->out_length, block->crc) != 0)) {
+        return 1;
+      }
+      job->stored += (long long)block->out_length;
+      pipeline->stats->bytes += (long long)block->out_length - hole_length(holes, block->out_length);
+    } else if (block->raw_length > 0) {
+      if ((pipeline->uring ? pipeline_uring_write_frame(pipeline, block, job->out_fd, job->stored)
+                           : frame_write(job->out_fd, block->out, (unsigned int)block->raw_length,
+                                         (unsigned int)block->out_length, block->frame_flags)) != 0 ||
+          manifest_add_block(job->checksums, job->stored, BACKUP_FRAME_HEADER_SIZE + (unsigned int)block->out_length,
+                             block->crc) != 0) {
+        return 1;
+      }
+      job->stored += BACKUP_FRAME_HEADER_SIZE + (long long)block->out_length;
+      job->frame_raw[job->frame_count] = (unsigned int)block->raw_length;
+      job->frame_stored[job->frame_count] = (unsigned int)block->out_length;
+      job->frame_count++;
+      pipeline->stats->bytes += BACKUP_FRAME_HEADER_SIZE + (long long)block->out_length;
+    }
+  }
+  if (last) {
+    job->checksums->size = job->stored;
+  }
+  if (last && job->mode == BACKUP_JOB_SCAN) {
+    pipeline->stats->bytes += job->file->size;
+    pipeline->stats->files++;
+    pipeline->stats->cloned_files++;
+  }
+  if (last && job->mode != BACKUP_JOB_SCAN) {
+    /* Ring writes carry their offsets; the file's must land before its end is written */
+    if (pipeline->uring &&
+        (pipeline_uring_drain(pipeline) != 0 || lseek(job->out_fd, job->stored, SEEK_SET) != job->stored)) {
+      return 1;
+    }
+    if (job->compressed) {
+      unsigned int crc;
+      unsigned int length = 8U * job->frame_count + 8;
+
+      if (frame_write_seek_table(job->out_fd, job->frame_raw, job->frame_stored, job->frame_count, &crc) != 0 ||
+          manifest_add_block(job->checksums, job->stored, length, crc) != 0) {
+        return 1;
+      }
+      job->stored += length;
+      job->checksums->size = job->stored;
+      pipeline->stats->bytes += length;
+    } else if (ftruncate(job->out_fd, job->stored) != 0) {
+      /* Extends the file over trailing holes */
+      return 1;
+    }
+    if (job->mode == BACKUP_JOB_COPY) {
+      struct timespec times[2];
+      times[0].tv_sec = times[1].tv_sec = (time_t)(job->file->mtime / 1000000000LL);
+      times[0].tv_nsec = times[1].tv_nsec = (long)(job->file->mtime % 1000000000LL);
+      futimens(job->out_fd, times);
+    }
+    if (close(job->out_fd) != 0) {
+      job->out_fd = -1;
+      return 1;
+    }
+    job->out_fd = -1;
+    pipeline->stats->files++;
+  }
+  return 0;
+}
+
+/**
+  @brief Writer stage: restore sequence order, write and recycle buffers.
+
+  At most queue_depth blocks are in flight, so a window of that size
+  indexed by sequence number holds every block that arrives early.
+
+  @param [in] pipeline Pipeline.
+*/
+static void pipeline_write(BackupPipeline *pipeline) {
+  long long bytes = 0, busy_ns = 0, wait_ns = 0;
+  long long next = 0;
+  BackupBlock *block;
+
+  for (;;) {
+    long long start = clock_ns();
+
+    /* Writes in flight hold their buffers, so reap them rather than sleep on the queue */
+    if (pipeline->uring && pipeline->write_ring.queued + pipeline->write_ring.inflight > 0) {
+      if ((block = block_queue_try_pop(&pipeline->write_queue)) == NULL) {
+        if (pipeline_uring_reap_writes(pipeline, 1) != 0) {
+          pipeline->failed = 1;
+        }
+        busy_ns += clock_ns() - start;
+        continue;
+      }
+    } else if ((block = block_queue_pop(&pipeline->write_queue, &wait_ns)) == NULL) {
+      break;
+    }
+    start = clock_ns();
+    pipeline->window[block->seq % pipeline->depth] = block;
+    while ((block = pipeline->window[next % pipeline->depth]) != NULL && block->seq == next) {
+      BackupJob *job = &pipeline->jobs[block->job];
+      long long stored = pipeline->stats->bytes;
+
+      pipeline->window[next % pipeline->depth] = NULL;
+      pipeline->held = block;
+      if (!pipeline->failed && pipeline_write_block(pipeline, block) != 0) {
+        pipeline->failed = 1;
+      }
+      /* Every block of the file has been hashed once its last one gets here */
+      if (job->signature && (int)block->index + 1 == job->block_count) {
+        if (!pipeline->failed && signature_write(pipeline->signatures, job->file->path, job->signature) != 0) {
+          pipeline->failed = 1;
+        }
+        signature_free(job->signature);
+      }
+      /* Charge what reached the backup, frames and new chunks included; clones wrote nothing */
+      stored = pipeline->stats->bytes - stored;
+      if (stored > 0 && job->mode != BACKUP_JOB_SCAN) {
+        throttle_wait(pipeline->throttle, 1, stored, 1);
+      }
+      if (job->progress && !pipeline->failed) {
+        job->progress->blocks = block->index + 1;
+        job->progress->done = (int)block->index + 1 == job->block_count;
+        job->progress->stored = job->stored;
+        job->progress->frame_raw = job->frame_raw;
+        job->progress->frame_stored = job->frame_stored;
+        job->progress->frame_count = job->frame_count;
+        /* A checkpoint covers only writes that landed */
+        if (pipeline->uring && checkpoint_due(pipeline->checkpoint) && pipeline_uring_drain(pipeline) != 0) {
+          pipeline->failed = 1;
+        }
+        if (!pipeline->failed && checkpoint_tick(pipeline->checkpoint) != 0) {
+          pipeline->failed = 1;
+        }
+      }
+      bytes += block->out_length;
+      next++;
+      pipeline->held = NULL;
+      if (pipeline->uring) {
+        pipeline_uring_release(pipeline, block);
+      } else {
+        block_queue_push(&pipeline->free_blocks, block, &wait_ns);
+      }
+    }
+    /* One submission for the writes of every block this pass */
+    if (pipeline->uring && pipeline_uring_reap_writes(pipeline, 0) != 0) {
+      pipeline->failed = 1;
+    }
+    busy_ns += clock_ns() - start;
+  }
+
+  if (next != pipeline->block_total) {
+    pipeline->failed = 1;
+  }
+  stage_account(&pipeline->stages[BACKUP_STAGE_WRITE], bytes, busy_ns, wait_ns);
+}
+
+/**
+  @brief Start the threads of one stage.
+
+  @param [out] threads Thread handles.
+  @param [in]  count   Threads wanted.
+  @param [in]  worker  Stage function.
+  @param [in]  arg     Pipeline.
+
+  @retval Number of threads started.
+*/
+static int pipeline_start_stage(pthread_t *threads, int count, void *(*worker)(void *), void *arg) {
+  int started = 0;
+
+  while (started < count && pthread_create(&threads[started], NULL, worker, arg) == 0) {
+    started++;
+  }
+  return started;
+}
+
+/**
+  @brief Set up the io_uring engine of a pipeline.
+
+  One ring serves the reader thread and one the writer, each with a slot
+  per buffer and request kind plus a block's worth of page runs.
+
+  @param [in,out] pipeline Pipeline.
+
+  @retval 1 the pipeline runs on io_uring, 0 it keeps its reader threads.
+*/
+static int pipeline_uring_setup(BackupPipeline *pipeline) {
+  unsigned int depth = (unsigned int)pipeline->depth;
+
+  if (io_ring_setup(&pipeline->read_ring, depth * BACKUP_URING_READ_DEPTH + BACKUP_SCAN_PAGES) != 0 ||
+      io_ring_setup(&pipeline->write_ring, depth * BACKUP_URING_WRITE_DEPTH + BACKUP_SCAN_PAGES) != 0) {
+    io_ring_free(&pipeline->read_ring);
+    io_ring_free(&pipeline->write_ring);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+  @brief Register the block buffers with both rings.
+
+  Reads land in data; writes come from data or zdata.  Registration
+  counts against RLIMIT_MEMLOCK, and without it the rings fall back to
+  plain reads and writes.
+
+  @param [in,out] pipeline Pipeline.
+*/
+static void pipeline_uring_register(BackupPipeline *pipeline) {
+  struct iovec *iov = (struct iovec *)malloc(2 * pipeline->depth * sizeof(struct iovec));
+  int i;
+
+  if (!iov) {
+    return;
+  }
+  for (i = 0; i < pipeline->depth; i++) {
+    iov[i].iov_base = pipeline->blocks[i].data;
+    iov[i].iov_len = BACKUP_BLOCK_SIZE;
+    iov[pipeline->depth + i].iov_base = pipeline->blocks[i].zdata;
+    iov[pipeline->depth + i].iov_len = compressBound(BACKUP_BLOCK_SIZE);
+  }
+  io_ring_register(&pipeline->read_ring, iov, (unsigned int)pipeline->depth);
+  io_ring_register(&pipeline->write_ring, iov, 2 * (unsigned int)pipeline->depth);
+  free(iov);
+}
+
+/**
+  @brief Run backup jobs through the read, compress, checksum and write stages.
+
+  Stages are connected by bounded queues and a fixed pool of block
+  buffers, so a slow stage throttles the ones before it instead of
+  growing memory.  Every stage except the single ordered writer runs
+  the configured number of threads.  With io_uring, one reader thread
+  keeps the reads of every free buffer in flight, and the writer queues
+  its writes instead of waiting on each.
+
+  @param [in]     backup_ctx     Backup context.
+  @param [in]     jobs           Jobs, in output order.
+  @param [in]     job_count      Number of jobs.
+  @param [in]     chunk_manifest Chunk manifest, or NULL without deduplication.
+  @param [in]     chunk_dir      Chunk store directory.
+  @param [in,out] stages         Stage counters.
+  @param [in,out] checkpoint     Checkpoint, taken by the writer.
+  @param [in]     signatures     Signature file, appended to by the writer.
+
+  @retval 0 success, 1 failure.
+*/
+static int run_pipeline(BackupContext *backup_ctx, BackupJob *jobs, int job_count, FILE *chunk_manifest,
+                        const char *chunk_dir, PipelineStage *stages, Checkpoint *checkpoint, FILE *signatures) {
+  BackupPipeline pipeline;
+  pthread_t readers[BACKUP_MAX_THREADS];
+  pthread_t compressors[BACKUP_MAX_THREADS];
+  pthread_t checksummers[BACKUP_MAX_THREADS];
+  int wanted[3] = {backup_ctx->read_threads > 0 ? backup_ctx->read_threads : 1, backup_ctx->compress_threads,
+                   backup_ctx->checksum_threads};
+  int started[3] = {0, 0, 0};
+  BackupBlock *blocks;
+  long long wait_ns = 0;
+  long long start;
+  int depth = backup_ctx->queue_depth;
+  int i;
+
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.jobs = jobs;
+  pipeline.job_count = job_count;
+  pipeline.stats = &backup_ctx->stats;
+  pipeline.chunk_manifest = chunk_manifest;
+  pipeline.chunk_dir = chunk_dir;
+  pipeline.level = backup_ctx->compression_level;
+  pipeline.depth = depth;
+  pipeline.stages = stages;
+  pipeline.throttle = &backup_ctx->throttle;
+  pipeline.direct = backup_ctx->direct_io;
+  pipeline.checkpoint = checkpoint;
+  pipeline.signatures = signatures;
+  pipeline.stream = backup_ctx->output;
+  pipeline.read_ring.fd = -1;
+  pipeline.write_ring.fd = -1;
+  for (i = 0; i < job_count; i++) {
+    jobs[i].first_seq = pipeline.block_total;
+    jobs[i].block_count = (int)((jobs[i].file->size + BACKUP_BLOCK_SIZE - 1) / BACKUP_BLOCK_SIZE);
+    if (jobs[i].block_count == 0) {
+      /* Empty files still pass through the writer so they get created */
+      jobs[i].block_count = 1;
+    }
+    jobs[i].out_fd = -1;
+    /* Resumed files bring the seek table of their stored part */
+    if (jobs[i].compressed && !jobs[i].frame_raw) {
+      jobs[i].frame_raw = (unsigned int *)calloc(jobs[i].block_count, sizeof(unsigned int));
+    }
+    if (jobs[i].compressed && !jobs[i].frame_stored) {
+      jobs[i].frame_stored = (unsigned int *)calloc(jobs[i].block_count, sizeof(unsigned int));
+    }
+    if (jobs[i].compressed && (!jobs[i].frame_raw || !jobs[i].frame_stored)) {
+      pipeline.failed = 1;
+    }
+    pipeline.block_total += jobs[i].block_count - jobs[i].first_block;
+  }
+  if (job_count == 0) {
+    return 0;
+  }
+  pipeline.uring = backup_ctx->io_uring && pipeline_uring_setup(&pipeline);
+  backup_ctx->io_uring_used = pipeline.uring;
+  if (pipeline.uring) {
+    wanted[BACKUP_STAGE_READ] = 1;
+  }
+
+  blocks = (BackupBlock *)calloc(depth, sizeof(BackupBlock));
+  pipeline.window = (BackupBlock **)calloc(depth, sizeof(BackupBlock *));
+  if (!blocks || !pipeline.window || block_queue_init(&pipeline.free_blocks, depth, 1) != 0) {
+    free(blocks);
+    free(pipeline.window);
+    io_ring_free(&pipeline.read_ring);
+    io_ring_free(&pipeline.write_ring);
+    return 1;
+  }
+  pipeline.blocks = blocks;
+  block_queue_init(&pipeline.compress_queue, depth, wanted[BACKUP_STAGE_READ]);
+  block_queue_init(&pipeline.checksum_queue, depth, wanted[BACKUP_STAGE_COMPRESS]);
+  block_queue_init(&pipeline.write_queue, depth, wanted[BACKUP_STAGE_CHECKSUM]);
+  if (!pipeline.compress_queue.items || !pipeline.checksum_queue.items || !pipeline.write_queue.items) {
+    pipeline.failed = 1;
+  }
+  for (i = 0; i < depth; i++) {
+    /* Aligned for O_DIRECT reads */
+    if (posix_memalign((void **)&blocks[i].data, BACKUP_DIRECT_ALIGN, BACKUP_BLOCK_SIZE) != 0) {
+      blocks[i].data = NULL;
+    }
+    blocks[i].chunks = (BackupChunk *)malloc(BACKUP_MAX_BLOCK_CHUNKS * sizeof(BackupChunk));
+    blocks[i].zdata = (unsigned char *)malloc(compressBound(BACKUP_BLOCK_SIZE));
+    if (!blocks[i].data || !blocks[i].chunks || !blocks[i].zdata) {
+      pipeline.failed = 1;
+      break;
+    }
+    block_queue_push(&pipeline.free_blocks, &blocks[i], &wait_ns);
+  }
+  if (pipeline.uring && !pipeline.failed) {
+    pipeline_uring_register(&pipeline);
+  }
+
+  /* Start from the writer end so a stage that cannot start leaves no one blocked */
+  start = clock_ns();
+  if (!pipeline.failed) {
+    started[BACKUP_STAGE_CHECKSUM] =
+        pipeline_start_stage(checksummers, wanted[BACKUP_STAGE_CHECKSUM], pipeline_checksum_worker, &pipeline);
+  }
+  if (started[BACKUP_STAGE_CHECKSUM] > 0) {
+    started[BACKUP_STAGE_COMPRESS] =
+        pipeline_start_stage(compressors, wanted[BACKUP_STAGE_COMPRESS], pipeline_compress_worker, &pipeline);
+  }
+  if (started[BACKUP_STAGE_COMPRESS] > 0) {
+    started[BACKUP_STAGE_READ] =
+        pipeline_start_stage(readers, wanted[BACKUP_STAGE_READ],
+                             pipeline.uring ? pipeline_uring_read_worker : pipeline_read_worker, &pipeline);
+  }
+  if (started[BACKUP_STAGE_READ] == 0) {
+    pipeline.failed = 1;
+  }
+  block_queue_close(&pipeline.compress_queue, wanted[BACKUP_STAGE_READ] - started[BACKUP_STAGE_READ]);
+  block_queue_close(&pipeline.checksum_queue, wanted[BACKUP_STAGE_COMPRESS] - started[BACKUP_STAGE_COMPRESS]);
+  block_queue_close(&pipeline.write_queue, wanted[BACKUP_STAGE_CHECKSUM] - started[BACKUP_STAGE_CHECKSUM]);
+
+  pipeline_write(&pipeline);
+
+  for (i = 0; i < started[BACKUP_STAGE_READ]; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  for (i = 0; i < started[BACKUP_STAGE_COMPRESS]; i++) {
+    pthread_join(compressors[i], NULL);
+  }
+  for (i = 0; i < started[BACKUP_STAGE_CHECKSUM]; i++) {
+    pthread_join(checksummers[i], NULL);
+  }
+  for (i = 0; i < BACKUP_STAGE_COUNT; i++) {
+    stages[i].threads = i == BACKUP_STAGE_WRITE ? 1 : started[i];
+    stages[i].wall_ns += clock_ns() - start;
+  }
+
+  for (i = 0; i < job_count; i++) {
+    if (jobs[i].out_fd >= 0) {
+      close(jobs[i].out_fd);
+    }
+
+  }
+  io_ring_free(&pipeline.read_ring);
+  io_ring_free(&pipeline.write_ring);
+  for (i = 0; i < depth; i++) {
+    free(blocks[i].data);
+    free(blocks[i].chunks);
+    free(blocks[i].zdata);
+  }
+  free(blocks);
+  free(pipeline.window);
+  block_queue_destroy(&pipeline.free_blocks);
+  block_queue_destroy(&pipeline.compress_queue);
+  block_queue_destroy(&pipeline.checksum_queue);
+  block_queue_destroy(&pipeline.write_queue);
+
+  return pipeline.failed ? 1 : 0;
+}
+
+/**
+  @brief Write per-stage throughput to the backup log.
+
+  Busy time is summed over a stage's threads; the stage whose threads
+  are busy for the largest share of the run is the bottleneck.
+
+  @param [in] path   Log file path.
+  @param [in] stages Stage counters.
+
+  @retval 0 success, 1 failure.
+*/
+static int pipeline_report(const char *path, const PipelineStage *stages) {
+  static const char *names[BACKUP_STAGE_COUNT] = {"read", "compress", "checksum", "write"};
+  FILE *fp = fopen(path, "w");
+  int i;
+
+  if (!fp) {
+    return 1;
+  }
+  for (i = 0; i < BACKUP_STAGE_COUNT; i++) {
+    const PipelineStage *stage = &stages[i];
+    double busy = stage->busy_ns / 1e9;
+    double wall = stage->wall_ns / 1e9;
+    double rate = busy > 0 ? stage->bytes / 1048576.0 / (busy / (stage->threads ? stage->threads : 1)) : 0;
+
+    fprintf(fp, "%-8s threads %2d  %10.1f MB  busy %7.2fs  waiting %7.2fs  %8.1f MB/s  utilization %5.1f%%\n",
+            names[i], stage->threads, stage->bytes / 1048576.0, busy, stage->wait_ns / 1e9, rate,
+            wall > 0 && stage->threads > 0 ? 100.0 * busy / (wall * stage->threads) : 0.0);
+  }
+  return fclose(fp) == 0 ? 0 : 1;
+}
+
+/**
+  @brief Read a backup's metadata file.
+
+  @param [in]  backup_dir  Backup directory.
+  @param [in]  backup_name Backup name.
+  @param [out] text        Metadata, NUL-terminated.
+  @param [in]  size        Size of text.
+
+  @retval 0 success, 1 missing metadata.
+*/
+static int metadata_load(const char *backup_dir, const char *backup_name, char *text, size_t size) {
+  char metadata_file[1024];
+  size_t length;
+  FILE *fp;
+
+  snprintf(metadata_file, sizeof(metadata_file), "%s/%s/%s", backup_dir, backup_name, BACKUP_METADATA_FILE);
+  fp = fopen(metadata_file, "r");
+  if (!fp) {
+    return 1;
+  }
+  length = fread(text, 1, size - 1, fp);
+  fclose(fp);
+  text[length] = '\0';
+  return 0;
+}
+
+/**
+  @brief Extract a field from metadata text.
+
+  @param [in]  text  Metadata.
+  @param [in]  key   Field name.
+  @param [out] value Field value.
+  @param [in]  size  Size of value.
+
+  @retval 0 success, 1 missing field.
+*/
+static int metadata_field(const char *text, const char *key, char *value, size_t size) {
+  char pattern[128];
+  const char *start;
+  size_t length;
+
+  snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+  start = strstr(text, pattern);
+  if (!start) {
+    return 1;
+  }
+  start += strlen(pattern);
+  if (*start == '"') {
+    start++;
+  }
+  length = strcspn(start, "\",}");
+  if (length >= size) {
+    return 1;
+  }
+  memcpy(value, start, length);
+  value[length] = '\0';
+  return 0;
+}
+
+/**
+  @brief Read a string field from a backup's metadata.
+
+  @param [in]  backup_dir  Backup directory.
+  @param [in]  backup_name Backup name.
+  @param [in]  key         Field name.
+  @param [out] value       Field value.
+  @param [in]  size        Size of value.
+
+  @retval 0 success, 1 missing metadata or field.
+*/
+static int metadata_read_field(const char *backup_dir, const char *backup_name, const char *key, char *value,
+                               size_t size) {
+  char text[4096];
+
+  return metadata_load(backup_dir, backup_name, text, sizeof(text)) != 0 ||
+         metadata_field(text, key, value, size) != 0;
+}
+
+/**
+  @brief Find the stream archive of a backup.
+
+  The archive is looked for in the stream directory when one is set,
+  else where the backup wrote it; archives written to standard output
+  are to be put back into the backup directory as <name>.kbs.
+
+  @param [in]  backup_ctx Backup context.
+  @param [in]  backup_dir Backup directory.
+  @param [in]  name       Backup name.
+  @param [out] path       Archive path.
+  @param [in]  size       Size of path.
+
+  @retval 0 streamed backup, 1 backup not streamed.
+*/
+static int stream_archive_path(const BackupContext *backup_ctx, const char *backup_dir, const char *name,
+                               char *path, size_t size) {
+  char written[4096];
+
+  if (metadata_read_field(backup_dir, name, "stream", written, sizeof(written)) != 0) {
+    return 1;
+  }
+  if (backup_ctx->stream && strcmp(backup_ctx->stream, "-") != 0) {
+    snprintf(path, size, "%s/%s%s", backup_ctx->stream, name, BACKUP_STREAM_SUFFIX);
+  } else if (strcmp(written, "-") != 0) {
+    snprintf(path, size, "%s", written);
+  } else {
+    snprintf(path, size, "%s/%s%s", backup_dir, name, BACKUP_STREAM_SUFFIX);
+  }
+  return 0;
+}
+
+/**
+  @brief Free a catalog.
+
+  @param [in] catalog Catalog.
+*/
+static void catalog_free(Catalog *catalog) {
+  int i;
+
+  for (i = 0; i < catalog->count; i++) {
+    free(catalog->entries[i].name);
+    free(catalog->entries[i].parent);
+  }
+  free(catalog->entries);
+  memset(catalog, 0, sizeof(*catalog));
+}
+
+/**
+  @brief Order catalog entries by backup time, then by name.
+*/
+static int catalog_entry_compare(const void *a, const void *b) {
+  const CatalogEntry *x = (const CatalogEntry *)a;
+  const CatalogEntry *y = (const CatalogEntry *)b;
+
+  if (x->backup_time != y->backup_time) {
+    return x->backup_time < y->backup_time ? -1 : 1;
+  }
+  return strcmp(x->name, y->name);
+}
+
+/**
+  @brief Find a backup in a catalog.
+
+  @param [in] catalog Catalog.
+  @param [in] name    Backup name.
+
+  @retval Entry, or NULL if the backup is not listed.
+*/
+static const CatalogEntry *catalog_find(const Catalog *catalog, const char *name) {
+  int i;
+
+  for (i = catalog->count - 1; i >= 0; i--) {
+    if (strcmp(catalog->entries[i].name, name) == 0) {
+      return &catalog->entries[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+  @brief Format the catalog record of a backup.
+
+  Fields are tab-separated: name, time, level, parent ("-" for a full
+  backup), size in bytes and status.
+
+  @param [in]  entry  Catalog entry.
+  @param [out] record Record, newline-terminated.
+  @param [in]  size   Size of record.
+
+  @retval Record length, or 0 if it does not fit.
+*/
+static size_t catalog_format(const CatalogEntry *entry, char *record, size_t size) {
+  int length = snprintf(record, size, "%s\t%lld\t%d\t%s\t%lld\t%s\n", entry->name, entry->backup_time, entry->level,
+                        entry->parent ? entry->parent : "-", entry->size, entry->status);
+
+  return length > 0 && (size_t)length < size ? (size_t)length : 0;
+}
+
+/**
+  @brief Parse one catalog record.
+
+  @param [in]  record Record, newline-terminated.
+  @param [out] entry  Catalog entry.
+
+  @retval 0 success, 1 malformed record.
+*/
+static int catalog_parse(const char *record, CatalogEntry *entry) {
+  char name[1024];
+  char parent[1024];
+
+  memset(entry, 0, sizeof(*entry));
+  if (sscanf(record, "%1023[^\t]\t%lld\t%d\t%1023[^\t]\t%lld\t%15[^\n]\n", name, &entry->backup_time, &entry->level,
+             parent, &entry->size, entry->status) != 6) {
+    return 1;
+  }
+  entry->name = strdup(name);
+  entry->parent = strcmp(parent, "-") != 0 ? strdup(parent) : NULL;
+  if (!entry->name || (strcmp(parent, "-") != 0 && !entry->parent)) {
+    free(entry->name);
+    free(entry->parent);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  @brief Add an entry to a catalog, replacing an older one of the same backup.
+
+  @param [in,out] catalog Catalog.
+  @param [in]     entry   Entry; its strings now belong to the catalog.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int catalog_put(Catalog *catalog, CatalogEntry *entry) {
+  CatalogEntry *old = (CatalogEntry *)catalog_find(catalog, entry->name);
+
+  if (old) {
+    free(old->name);
+    free(old->parent);
+    *old = *entry;
+    return 0;
+  }
+  if (catalog->count == catalog->size) {
+    int size = catalog->size ? catalog->size * 2 : 64;
+    CatalogEntry *entries = (CatalogEntry *)realloc(catalog->entries, size * sizeof(CatalogEntry));
+    if (!entries) {
+      free(entry->name);
+      free(entry->parent);
+      return 1;
+    }
+    catalog->entries = entries;
+    catalog->size = size;
+  }
+  catalog->entries[catalog->count++] = *entry;
+  return 0;
+}
+
+/**
+  @brief Write the catalog index.
+
+  The index holds the length and CRC32C of the catalog it describes and
+  the offset of the newest record of every backup, in backup order, so a
+  reader needs one read of each file and never resolves superseded
+  records.  It is replaced atomically.
+
+  @param [in] backup_dir Backup directory.
+  @param [in] length     Catalog length.
+  @param [in] crc        CRC32C of the catalog.
+  @param [in] offsets    Record offsets.
+  @param [in] count      Number of records.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_write_index(const char *backup_dir, long long length, unsigned int crc,
+                               const long long *offsets, int count) {
+  unsigned int header[6] = {BACKUP_CATALOG_MAGIC, BACKUP_CATALOG_VERSION, (unsigned int)count, crc,
+                            (unsigned int)(length & 0xffffffffU), (unsigned int)((unsigned long long)length >> 32)};
+  char path[4096];
+  char temp[sizeof(path) + 8];
+  int fd;
+  int ret;
+
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CATALOG_INDEX);
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+  if (fd < 0) {
+    return 1;
+  }
+  ret = write_all(fd, (const unsigned char *)header, sizeof(header)) != 0 ||
+        write_all(fd, (const unsigned char *)offsets, (size_t)count * sizeof(long long)) != 0;
+  if (close(fd) != 0 || ret != 0 || rename(temp, path) != 0) {
+    unlink(temp);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  @brief Load the catalog through its index.
+
+  @param [in]  backup_dir Backup directory.
+  @param [out] catalog    Backups, oldest first.
+  @param [out] length     Catalog length.
+  @param [out] crc        CRC32C of the catalog.
+
+  @retval 0 success, 1 missing or inconsistent catalog.
+*/
+static int catalog_load(const char *backup_dir, Catalog *catalog, long long *length, unsigned int *crc) {
+  unsigned int header[6] = {0, 0, 0, 0, 0, 0};
+  long long *offsets = NULL;
+  char *text = NULL;
+  char path[4096];
+  struct stat st;
+  int ret = 1;
+  int fd;
+  int i;
+
+  crc32c_init();
+  memset(catalog, 0, sizeof(*catalog));
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CATALOG_INDEX);
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  if (read(fd, header, sizeof(header)) == (ssize_t)sizeof(header) && header[0] == BACKUP_CATALOG_MAGIC &&
+      header[1] == BACKUP_CATALOG_VERSION && header[2] <= BACKUP_CATALOG_MAX) {
+    offsets = (long long *)malloc((header[2] + 1) * sizeof(long long));
+    if (offsets && read(fd, offsets, header[2] * sizeof(long long)) == (ssize_t)(header[2] * sizeof(long long))) {
+      ret = 0;
+    }
+  }
+  close(fd);
+  *length = (long long)header[4] | ((long long)header[5] << 32);
+
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CATALOG_FILE);
+  fd = ret == 0 ? open(path, O_RDONLY) : -1;
+  ret = 1;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size == *length) {
+    text = (char *)malloc((size_t)*length + 1);
+    if (text && pread(fd, text, (size_t)*length, 0) == (ssize_t)*length) {
+      text[*length] = '\0';
+      *crc = crc32c(0, (const unsigned char *)text, (size_t)*length);
+      ret = *crc != header[3];
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  for (i = 0; ret == 0 && i < (int)header[2]; i++) {
+    CatalogEntry entry;
+    if (offsets[i] < 0 || offsets[i] >= *length || catalog_parse(text + offsets[i], &entry) != 0) {
+      ret = 1;
+      break;
+    }
+    entry.offset = offsets[i];
+    ret = catalog_put(catalog, &entry);
+  }
+  free(offsets);
+  free(text);
+  if (ret != 0) {
+    catalog_free(catalog);
+  }
+  return ret;
+}
+
+/**
+  @brief Replace the catalog and its index with one record per backup.
+
+  @param [in]     backup_dir Backup directory.
+  @param [in,out] catalog    Backups, oldest first; record offsets are updated.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_save(const char *backup_dir, Catalog *catalog) {
+  char path[4096];
+  char temp[sizeof(path) + 8];
+  long long *offsets;
+  long long length = 0;
+  unsigned int crc = 0;
+  int ret = 0;
+  int fd;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CATALOG_FILE);
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  offsets = (long long *)malloc((catalog->count + 1) * sizeof(long long));
+  fd = offsets ? open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0640) : -1;
+  if (fd < 0) {
+    free(offsets);
+    return 1;
+  }
+  for (i = 0; ret == 0 && i < catalog->count; i++) {
+    char record[4096];
+    size_t n = catalog_format(&catalog->entries[i], record, sizeof(record));
+
+    offsets[i] = catalog->entries[i].offset = length;
+    ret = n == 0 || write_all(fd, (const unsigned char *)record, n) != 0;
+    crc = crc32c(crc, (const unsigned char *)record, n);
+    length += (long long)n;
+  }
+  if (close(fd) != 0 || ret != 0 || rename(temp, path) != 0 ||
+      catalog_write_index(backup_dir, length, crc, offsets, catalog->count) != 0) {
+    unlink(temp);
+    ret = 1;
+  }
+  free(offsets);
+  return ret;
+}
+
+/**
+  @brief Rebuild the catalog by scanning the backup directory.
+
+  Only run when the catalog is missing or does not match its index.
+
+  @param [in]  backup_dir Backup directory.
+  @param [out] catalog    Backups, oldest first.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_rebuild(const char *backup_dir, Catalog *catalog) {
+  struct dirent *entry;
+  DIR *dir;
+  int ret = 0;
+
+  crc32c_init();
+  memset(catalog, 0, sizeof(*catalog));
+  dir = opendir(backup_dir);
+  if (!dir) {
+    return 1;
+  }
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    char text[4096];
+    char value[1024];
+    CatalogEntry backup;
+
+    if (entry->d_name[0] == '.' || metadata_load(backup_dir, entry->d_name, text, sizeof(text)) != 0) {
+      continue;
+    }
+    memset(&backup, 0, sizeof(backup));
+    backup.name = strdup(entry->d_name);
+    backup.backup_time = metadata_field(text, "backup_time", value, sizeof(value)) == 0 ? atoll(value) : 0;
+    backup.level = metadata_field(text, "backup_level", value, sizeof(value)) == 0 ? atoi(value) : 0;
+    backup.size = metadata_field(text, "backup_size", value, sizeof(value)) == 0 ? atoll(value) : 0;
+    if (metadata_field(text, "parent_backup", value, sizeof(value)) == 0) {
+      backup.parent = strdup(value);
+    }
+    if (metadata_field(text, "status", backup.status, sizeof(backup.status)) != 0) {
+      snprintf(backup.status, sizeof(backup.status), "unknown");
+    }
+    ret = backup.name ? catalog_put(catalog, &backup) : 1;
+  }
+  closedir(dir);
+  if (ret != 0) {
+    catalog_free(catalog);
+    return 1;
+  }
+  qsort(catalog->entries, catalog->count, sizeof(CatalogEntry), catalog_entry_compare);
+  return catalog_save(backup_dir, catalog);
+}
+
+/**
+  @brief Tell whether a catalog names a backup that is gone.
+
+  Cleanup drops the records of the backups it removes, but a backup
+  directory deleted by hand leaves a record that the CRC32C still
+  vouches for.  One stat per backup, newest first, finds it.
+
+  @param [in] backup_dir Backup directory.
+  @param [in] catalog    Backups, oldest first.
+
+  @retval 1 some backup has no metadata, 0 every backup is present.
+*/
+static int catalog_stale(const char *backup_dir, const Catalog *catalog) {
+  char path[4096];
+  struct stat st;
+  int i;
+
+  for (i = catalog->count - 1; i >= 0; i--) {
+    int len = snprintf(path, sizeof(path), "%s/%s/%s", backup_dir, catalog->entries[i].name, BACKUP_METADATA_FILE);
+
+    if (len < 0 || len >= (int)sizeof(path) || stat(path, &st) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+  @brief Open the catalog, rebuilding it if it is missing, inconsistent
+  or names a backup whose metadata is gone.
+
+  @param [in]  backup_dir Backup directory.
+  @param [out] catalog    Backups, oldest first.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_open(const char *backup_dir, Catalog *catalog) {
+  long long length;
+  unsigned int crc;
+
+  if (catalog_load(backup_dir, catalog, &length, &crc) == 0) {
+    if (!catalog_stale(backup_dir, catalog)) {
+      return 0;
+    }
+    catalog_free(catalog);
+  }
+  return catalog_rebuild(backup_dir, catalog);
+}
+
+/**
+  @brief Append the record of a backup to the catalog.
+
+  The record goes to the end of the catalog and the index is rewritten
+  to cover it, under an exclusive lock so concurrent backups do not
+  interleave.  The CRC32C is extended over the new record only.  An
+  inconsistent catalog is rebuilt from the backup directories instead,
+  which already include the new backup.
+
+  @param [in] backup_dir Backup directory.
+  @param [in] backup     Catalog entry of the backup.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_append(const char *backup_dir, const CatalogEntry *backup) {
+  char path[4096];
+  char record[4096];
+  long long *offsets = NULL;
+  long long length;
+  unsigned int crc;
+  Catalog catalog;
+  CatalogEntry entry;
+  size_t n = catalog_format(backup, record, sizeof(record));
+  int lock;
+  int ret = 0;
+  int fd;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/%s.lock", backup_dir, BACKUP_CATALOG_FILE);
+  lock = open(path, O_WRONLY | O_CREAT, 0640);
+  if (n == 0 || lock < 0 || flock(lock, LOCK_EX) != 0) {
+    if (lock >= 0) {
+      close(lock);
+    }
+    return 1;
+  }
+
+  if (catalog_load(backup_dir, &catalog, &length, &crc) != 0) {
+    ret = catalog_rebuild(backup_dir, &catalog);
+    catalog_free(&catalog);
+    close(lock);
+    return ret;
+  }
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CATALOG_FILE);
+  fd = open(path, O_WRONLY | O_APPEND);
+  if (fd < 0 || write_all(fd, (const unsigned char *)record, n) != 0) {
+    ret = 1;
+  }
+  if (fd >= 0 && close(fd) != 0) {
+    ret = 1;
+  }
+  if (ret == 0) {
+    ret = catalog_parse(record, &entry);
+  }
+  if (ret == 0) {
+    entry.offset = length;
+    ret = catalog_put(&catalog, &entry);
+  }
+  if (ret == 0) {
+    qsort(catalog.entries, catalog.count, sizeof(CatalogEntry), catalog_entry_compare);
+    offsets = (long long *)malloc(catalog.count * sizeof(long long));
+    ret = offsets ? 0 : 1;
+  }
+  for (i = 0; ret == 0 && i < catalog.count; i++) {
+    offsets[i] = catalog.entries[i].offset;
+  }
+  if (ret == 0) {
+    ret = catalog_write_index(backup_dir, length + (long long)n, crc32c(crc, (const unsigned char *)record, n),
+                              offsets, catalog.count);
+  }
+  free(offsets);
+  catalog_free(&catalog);
+  close(lock);
+  return ret;
+}
+
+/**
+  @brief Pick the parent of an incremental backup.
+
+  The parent is the newest completed backup in the catalog that has a
+  page map, unless one was named with the parent_backup option.
+
+  @param [in]  backup_ctx Backup context.
+  @param [out] parent     Parent backup name.
+  @param [in]  size       Size of parent.
+
+  @retval 0 success, 1 no usable parent.
+*/
+static int find_parent_backup(BackupContext *backup_ctx, char *parent, size_t size) {
+  Catalog catalog;
+  int i;
+
+  parent[0] = '\0';
+  if (backup_ctx->parent_backup_name) {
+    snprintf(parent, size, "%s", backup_ctx->parent_backup_name);
+    return 0;
+  }
+
+  if (catalog_open(backup_ctx->backup_dir, &catalog) != 0) {
+    return 1;
+  }
+  for (i = catalog.count - 1; i >= 0 && !parent[0]; i--) {
+    const CatalogEntry *entry = &catalog.entries[i];
+    char map_file[4096];
+
+    snprintf(map_file, sizeof(map_file), "%s/%s/%s", backup_ctx->backup_dir, entry->name, BACKUP_PAGE_MAP_FILE);
+    if (strcmp(entry->name, backup_ctx->backup_name) != 0 && strcmp(entry->status, "completed") == 0 &&
+        access(map_file, R_OK) == 0) {
+      snprintf(parent, size, "%s", entry->name);
+    }
+  }
+  catalog_free(&catalog);
+
+  return parent[0] ? 0 : 1;
+}
+
+/**
+  @brief Turn the file list into pipeline jobs and run them.
+
+  Full backups first try to clone each file; cloned files only have
+  their page state recorded.  With deduplication, full backups instead
+  go to the shared chunk store and the backup keeps a chunk manifest.
+  Incremental backups skip files that are unchanged since the parent and
+  store deltas of the rest.  Large files without InnoDB pages that the
+  parent signed are encoded as rsync deltas right here, one at a time,
+  and skip the pipeline; the pipeline signs the others as it reads them.
+  Block checksums of every stored file go to the manifest; chunks are
+  checked by their hash instead.  Stage throughput goes to
+  logs/pipeline.log.
+
+  When resuming, files the checkpoint has as done get their saved state
+  back and no job; a file that was in flight continues, in the same mode,
+  after the blocks the checkpoint covers, and goes unsigned.
+
+  @param [in]     backup_ctx        Backup context.
+  @param [in]     list              Data files.
+  @param [in]     parent_map        Parent page map, or NULL for a full backup.
+  @param [in,out] map               Page map to fill, sized for the file list.
+  @param [in,out] checksums         Manifest to fill, sized for the file list.
+  @param [out]    stages            Stage counters.
+  @param [in,out] checkpoint        Checkpoint, with no files when disabled.
+  @param [in]     parent_signatures Signatures of the parent, empty for none.
+  @param [in]     signatures        Signature file of the backup.
+
+  @retval 0 success, 1 failure.
+*/
+static int build_backup_jobs(BackupContext *backup_ctx, const BackupFileList *list, const PageMap *parent_map,
+                             PageMap *map, Manifest *checksums, PipelineStage *stages, Checkpoint *checkpoint,
+                             const SignatureIndex *parent_signatures, FILE *signatures) {
+  BackupJob *jobs = (BackupJob *)calloc(list->count ? list->count : 1, sizeof(BackupJob));
+  int dedup = backup_ctx->dedup && !parent_map;
+  char backup_path[2048];
+  char chunk_dir[4096];
+  char path[4096];
+  FILE *manifest = NULL;
+  int job_count = 0;
+  int lock = -1;
+  int ret = 0;
+  int i;
+
+  if (!jobs) {
+    return 1;
+  }
+  snprintf(backup_path, sizeof(backup_path), "%s/%s", backup_ctx->backup_dir, backup_ctx->backup_name);
+  snprintf(chunk_dir, sizeof(chunk_dir), "%s/%s", backup_ctx->backup_dir, BACKUP_CHUNK_DIR);
+  if (dedup) {
+    /* Chunks found in the store must outlive the run: collection waits until the manifest is complete */
+    snprintf(path, sizeof(path), "%s/%s", backup_ctx->backup_dir, BACKUP_CHUNK_LOCK);
+    lock = open(path, O_WRONLY | O_CREAT, 0640);
+    if (lock < 0 || flock(lock, LOCK_SH) != 0) {
+      ret = 1;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", backup_ctx->backup_dir, backup_ctx->backup_name,
+             BACKUP_CHUNK_MANIFEST);
+    /* A resumed backup keeps the chunk manifest up to its last checkpoint */
+    manifest = fopen(path, checkpoint->chunk_length > 0 ? "r+" : "w");
+    if (!manifest || create_directory(chunk_dir) != 0 ||
+        (checkpoint->chunk_length > 0 && (ftruncate(fileno(manifest), checkpoint->chunk_length) != 0 ||
+                                          fseek(manifest, 0, SEEK_END) != 0))) {
+      ret = 1;
+    }
+    checkpoint->chunk_manifest = manifest;
+  }
+
+  for (i = 0; ret == 0 && i < list->count; i++) {
+    const BackupFile *file = &list->files[i];
+    const PageMapFile *parent = parent_map ? page_map_find(parent_map, file->path) : NULL;
+    PageMapFile *entry = &map->files[map->count];
+    CheckpointFile *progress = checkpoint->files ? &checkpoint->files[i] : NULL;
+    BackupJob *job = &jobs[job_count];
+    Signature signature;
+    Signature base;
+    char stored[2048];
+    char src[4096];
+    char dst[4096];
+
+    if (page_map_file_alloc(entry, file) != 0) {
+      ret = 1;
+      break;
+    }
+    map->count++;
+    if (progress && progress->done) {
+      ret = checkpoint_restore(progress, entry, checksums);
+      if (progress->mode == BACKUP_JOB_RSYNC) {
+        entry->flags |= BACKUP_PAGE_MAP_RSYNC;
+      }
+      continue;
+    }
+    if (parent_map && carry_over_pages(file, parent, entry, &backup_ctx->stats)) {
+      ret = signature_copy(parent_signatures, file->path, signatures);
+      if (progress) {
+        progress->done = 1;
+        progress->entry = entry;
+      }
+      continue;
+    }
+
+    snprintf(src, sizeof(src), "%s/%s", backup_ctx->datadir, file->path);
+    if (parent_map && !(progress && progress->blocks > 0) && signature_init(&signature, file) &&
+        signature_read(parent_signatures, file->path, &base) == 0) {
+      int known = checksums->count;
+
+      snprintf(stored, sizeof(stored), "%s/%s", BACKUP_DATA_DIR, file->path);
+      snprintf(dst, sizeof(dst), "%s/%s", backup_path, stored);
+      ret = rsync_encode_file(src, dst, file, parent, &base, entry, &signature, &backup_ctx->stats,
+                              &backup_ctx->throttle, backup_ctx->direct_io);
+      if (ret == 0) {
+        ret = signature_write(signatures, file->path, &signature);
+      }
+      signature_free(&base);
+      signature_free(&signature);
+      strncat(stored, BACKUP_RSYNC_SUFFIX, sizeof(stored) - strlen(stored) - 1);
+      if (ret == 0 && (entry->flags & BACKUP_PAGE_MAP_RSYNC)) {
+        ret = manifest_scan_file(checksums, backup_path, stored);
+      }
+      if (ret == 0 && progress) {
+        progress->done = 1;
+        progress->mode = entry->flags & BACKUP_PAGE_MAP_RSYNC ? BACKUP_JOB_RSYNC : BACKUP_JOB_DELTA;
+        progress->entry = entry;
+        progress->checksums = checksums->count > known ? &checksums->files[known] : NULL;
+        progress->stored = progress->checksums ? progress->checksums->size : 0;
+        ret = checkpoint_tick(checkpoint);
+      }
+      continue;
+    }
+    job->compressed = backup_ctx->compression_level > 0 && !dedup;
+    snprintf(stored, sizeof(stored), "%s/%s%s%s", BACKUP_DATA_DIR, file->path,
+             parent_map ? BACKUP_DELTA_SUFFIX : "", job->compressed ? BACKUP_COMPRESSED_SUFFIX : "");
+    snprintf(dst, sizeof(dst), "%s/%s/%s", backup_ctx->backup_dir, backup_ctx->backup_name, stored);
+    job->file = file;
+    job->parent = parent;
+    job->entry = entry;
+    if (!(progress && progress->blocks > 0) && signature_init(&signature, file)) {
+      job->signature = (Signature *)malloc(sizeof(Signature));
+      if (!job->signature) {
+        ret = 1;
+      } else {
+        *job->signature = signature;
+      }
+    }
+    if (progress && progress->blocks > 0) {
+      job->mode = progress->mode;
+      job->first_block = progress->blocks;
+      job->stored = progress->stored;
+      job->frame_raw = progress->loaded_raw;
+      job->frame_stored = progress->loaded_stored;
+      job->frame_count = progress->frame_count;
+      progress->loaded_raw = NULL;
+      progress->loaded_stored = NULL;
+      ret = checkpoint_restore(progress, entry, checksums);
+      if (job->mode == BACKUP_JOB_SCAN) {
+        snprintf(src, sizeof(src), "%s", dst);
+      }
+    } else if (parent_map) {
+      job->mode = BACKUP_JOB_DELTA;
+    } else if (dedup) {
+      job->mode = BACKUP_JOB_CHUNK;
+    } else if (!job->compressed && !backup_ctx->output && clone_data_file(src, dst, file) == 0) {
+      /* Read the clone: it shares extents with the source and is what the backup holds */
+      job->mode = BACKUP_JOB_SCAN;
+      snprintf(src, sizeof(src), "%s", dst);
+    } else {
+      job->mode = BACKUP_JOB_COPY;
+    }
+    job->src = strdup(src);
+    job->dst = strdup(dst);
+    if (!job->src || !job->dst || (!dedup && create_parent_directory(dst) != 0)) {
+      ret = 1;
+    }
+    if (!dedup) {
+      /* The entry's address stays valid: the manifest was sized for every file */
+      job->checksums = progress && progress->checksums ? progress->checksums : manifest_add(checksums, stored);
+      if (!job->checksums) {
+        ret = 1;
+      }
+    }
+    if (progress) {
+      progress->mode = job->mode;
+      progress->entry = entry;
+      progress->checksums = job->checksums;
+    }
+    job->progress = progress;
+    job_count++;
+  }
+
+  if (ret == 0) {
+    ret = run_pipeline(backup_ctx, jobs, job_count, manifest, chunk_dir, stages, checkpoint, signatures);
+  }
+  checkpoint->chunk_manifest = NULL;
+  if (manifest && fclose(manifest) != 0) {
+    ret = 1;
+  }
+  if (lock >= 0) {
+    close(lock);
+  }
+  if (ret == 0 && manifest) {
+    snprintf(path, sizeof(path), "%s/%s", backup_ctx->backup_dir, backup_ctx->backup_name);
+    ret = manifest_scan_file(checksums, path, BACKUP_CHUNK_MANIFEST);
+  }
+  snprintf(path, sizeof(path), "%s/%s/%s/%s", backup_ctx->backup_dir, backup_ctx->backup_name, BACKUP_LOG_DIR,
+           BACKUP_PIPELINE_LOG);
+  if (ret == 0) {
+    ret = pipeline_report(path, stages);
+  }
+
+  for (i = 0; i < job_count; i++) {
+    free(jobs[i].src);
+    free(jobs[i].dst);
+    free(jobs[i].frame_raw);
+    free(jobs[i].frame_stored);
+    signature_free(jobs[i].signature);
+    free(jobs[i].signature);
+  }
+  free(jobs);
+  return ret;
+}
+
+/**
+  @brief Create a restored file, refusing to overwrite an existing one.
+
+  @param [in] target Target directory.
+  @param [in] path   Path relative to the target.
+
+  @retval Descriptor, or -1 on failure.
+*/
+static int restore_create(const char *target, const char *path) {
+  char dst[4096];
+
+  if (snprintf(dst, sizeof(dst), "%s/%s", target, path) >= (int)sizeof(dst) || create_parent_directory(dst) != 0) {
+    return -1;
+  }
+  return open(dst, O_WRONLY | O_CREAT | O_EXCL, 0640);
+}
+
+/**
+  @brief Finish a restored file: set its modification time and close it.
+
+  @param [in] fd    Descriptor.
+  @param [in] mtime Modification time in nanoseconds.
+
+  @retval 0 success, 1 failure.
+*/
+static int restore_finish(int fd, long long mtime) {
+  struct timespec times[2];
+
+  times[0].tv_sec = times[1].tv_sec = (time_t)(mtime / 1000000000LL);
+  times[0].tv_nsec = times[1].tv_nsec = (long)(mtime % 1000000000LL);
+  futimens(fd, times);
+  return close(fd) == 0 ? 0 : 1;
+}
+
+/**
+  @brief Free a chunk index.
+
+  @param [in] index Chunk index.
+*/
+static void chunk_index_free(ChunkIndex *index) {
+  int i;
+
+  for (i = 0; i < index->count; i++) {
+    free(index->files[i].path);
+    free(index->files[i].offsets);
+    free(index->files[i].hashes);
+  }
+  free(index->files);
+  memset(index, 0, sizeof(*index));
+}
+
+/**
+  @brief Order chunked files by path.
+*/
+static int chunked_file_compare(const void *a, const void *b) {
+  return strcmp(((const ChunkedFile *)a)->path, ((const ChunkedFile *)b)->path);
+}
+
+/**
+  @brief Load the chunk lists of a deduplicated backup.
+
+  @param [in]  backup_path Backup directory.
+  @param [out] index       Chunk index, sorted by path.
+
+  @retval 0 success, 1 missing or malformed chunk manifest.
+*/
+static int chunk_index_load(const char *backup_path, ChunkIndex *index) {
+  ChunkedFile *file = NULL;
+  char line[4096];
+  int capacity = 0;
+  int ret = 0;
+  FILE *fp;
+
+  memset(index, 0, sizeof(*index));
+  if (snprintf(line, sizeof(line), "%s/%s", backup_path, BACKUP_CHUNK_MANIFEST) >= (int)sizeof(line)) {
+    return 1;
+  }
+  fp = fopen(line, "r");
+  if (!fp) {
+    return 1;
+  }
+  while (ret == 0 && fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == 'F') {
+      int consumed = 0;
+
+      if (index->count == index->size) {
+        int size = index->size ? index->size * 2 : 64;
+        ChunkedFile *files = (ChunkedFile *)realloc(index->files, size * sizeof(ChunkedFile));
+        if (!files) {
+          ret = 1;
+          break;
+        }
+        index->files = files;
+        index->size = size;
+      }
+      file = &index->files[index->count];
+      memset(file, 0, sizeof(*file));
+      capacity = 0;
+      sscanf(line, "F %*d %*d %n", &consumed);
+      file->path = consumed > 0 ? strdup(line + consumed) : NULL;
+      file->offsets = (long long *)calloc(1, sizeof(long long));
+      if (!file->path || !file->offsets) {
+        free(file->path);
+        free(file->offsets);
+        ret = 1;
+        break;
+      }
+      index->count++;
+    } else if (line[0] == 'C' && file) {
+      unsigned int length;
+
+      if (strlen(line) < 3 + 2 * SHA256_DIGEST_LENGTH ||
+          sscanf(line + 3 + 2 * SHA256_DIGEST_LENGTH, "%u", &length) != 1) {
+        ret = 1;
+        break;
+      }
+      if (file->count == capacity) {
+        int size = capacity ? capacity * 2 : 16;
+        long long *offsets = (long long *)realloc(file->offsets, (size + 1) * sizeof(long long));
+        char *hashes = offsets ? (char *)realloc(file->hashes, (size_t)size * (2 * SHA256_DIGEST_LENGTH + 1)) : NULL;
+        if (offsets) {
+          file->offsets = offsets;
+        }
+        if (!hashes) {
+          ret = 1;
+          break;
+        }
+        file->hashes = hashes;
+        capacity = size;
+      }
+      memcpy(file->hashes + (size_t)file->count * (2 * SHA256_DIGEST_LENGTH + 1), line + 2, 2 * SHA256_DIGEST_LENGTH);
+      file->hashes[(size_t)file->count * (2 * SHA256_DIGEST_LENGTH + 1) + 2 * SHA256_DIGEST_LENGTH] = '\0';
+      file->offsets[file->count + 1] = file->offsets[file->count] + length;
+      file->count++;
+    }
+  }
+  fclose(fp);
+
+  if (ret != 0) {
+    chunk_index_free(index);
+    return 1;
+  }
+  qsort(index->files, index->count, sizeof(ChunkedFile), chunked_file_compare);
+  return 0;
+}
+
+/**
+  @brief Find the chunk list of a file.
+
+  @param [in] index Chunk index.
+  @param [in] path  Relative path.
+
+  @retval Chunk list, or NULL if the file is not in the index.
+*/
+static const ChunkedFile *chunk_index_find(const ChunkIndex *index, const char *path) {
+  ChunkedFile key;
+
+  key.path = (char *)path;
+  return (const ChunkedFile *)bsearch(&key, index->files, index->count, sizeof(ChunkedFile), chunked_file_compare);
+}
+
+/**
+  @brief Free a restore chain.
+
+  @param [in] links Backups of the chain.
+  @param [in] count Number of backups.
+*/
+static void restore_chain_free(RestoreLink *links, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    free(links[i].name);
+    page_map_free(&links[i].map);
+    chunk_index_free(&links[i].chunks);
+  }
+  free(links);
+}
+
+/**
+  @brief Load the chain of a backup, from the backup itself to its full backup.
+
+  @param [in]  backup_dir  Backup directory.
+  @param [in]  backup_name Newest backup of the chain.
+  @param [out] links       Backups of the chain, newest first.
+  @param [out] count       Number of backups.
+
+  @retval 0 success, 1 broken chain.
+*/
+static int restore_load_chain(const char *backup_dir, const char *backup_name, RestoreLink **links, int *count) {
+  Catalog catalog;
+  char name[1024];
+  int listed = catalog_open(backup_dir, &catalog) == 0;
+  int size = 0;
+  int ret = 1;
+
+  *links = NULL;
+  *count = 0;
+  snprintf(name, sizeof(name), "%s", backup_name);
+  while (*count < BACKUP_MAX_CHAIN) {
+    const CatalogEntry *entry = listed ? catalog_find(&catalog, name) : NULL;
+    RestoreLink *link;
+    char path[4096];
+
+    if (*count == size) {
+      int grown = size ? size * 2 : 8;
+      RestoreLink *more = (RestoreLink *)realloc(*links, grown * sizeof(RestoreLink));
+      if (!more) {
+        break;
+      }
+      *links = more;
+      size = grown;
+    }
+    link = &(*links)[*count];
+    memset(link, 0, sizeof(*link));
+    link->name = strdup(name);
+    if (!link->name) {
+      break;
+    }
+    (*count)++;
+
+    snprintf(path, sizeof(path), "%s/%s/%s", backup_dir, name, BACKUP_PAGE_MAP_FILE);
+    if (page_map_load(path, &link->map) != 0) {
+      break;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", backup_dir, name, BACKUP_CHUNK_MANIFEST);
+    if (access(path, F_OK) == 0) {
+      snprintf(path, sizeof(path), "%s/%s", backup_dir, name);
+      link->dedup = 1;
+      if (chunk_index_load(path, &link->chunks) != 0) {
+        break;
+      }
+    }
+    /* The full backup ends the chain; backups missing from the catalog fall back to their metadata */
+    if (entry) {
+      if (!entry->parent) {
+        ret = 0;
+        break;
+      }
+      snprintf(name, sizeof(name), "%s", entry->parent);
+    } else if (metadata_read_field(backup_dir, name, "parent_backup", name, sizeof(name)) != 0) {
+      ret = 0;
+      break;
+    }
+  }
+  if (listed) {
+    catalog_free(&catalog);
+  }
+  return ret;
+}
+
+/**
+  @brief Add the stored copy of a file in one backup as a restore source.
+
+  @param [in,out] run        Restore batch.
+  @param [in]     backup_dir Backup directory.
+  @param [in]     link       Backup holding the copy.
+  @param [in]     delta      1 if the copy holds only the pages changed in that backup.
+  @param [in]     path       Relative path of the file.
+
+  @retval Source index, or -1 on failure.
+*/
+static int restore_add_source(RestoreRun *run, const char *backup_dir, const RestoreLink *link, int delta,
+                              const char *path) {
+  RestoreSource *source;
+  char stored[4096];
+
+  if (run->source_count == run->source_size) {
+    int size = run->source_size ? run->source_size * 2 : 64;
+    RestoreSource *sources = (RestoreSource *)realloc(run->sources, size * sizeof(RestoreSource));
+    if (!sources) {
+      return -1;
+    }
+    run->sources = sources;
+    run->source_size = size;
+  }
+  source = &run->sources[run->source_count];
+  memset(source, 0, sizeof(*source));
+  source->file = run->file_count - 1;
+  source->delta = delta;
+  if (link->dedup) {
+    source->chunked = chunk_index_find(&link->chunks, path);
+    if (!source->chunked) {
+      return -1;
+    }
+  } else {
+    snprintf(stored, sizeof(stored), "%s/%s/%s/%s%s", backup_dir, link->name, BACKUP_DATA_DIR, path,
+             delta ? BACKUP_DELTA_SUFFIX : "");
+    if (access(stored, F_OK) != 0) {
+      strncat(stored, BACKUP_COMPRESSED_SUFFIX, sizeof(stored) - strlen(stored) - 1);
+      source->compressed = 1;
+    }
+    source->path = strdup(stored);
+    if (!source->path) {
+      return -1;
+    }
+  }
+  return run->source_count++;
+}
+
+/**
+  @brief Order the tasks of a file by source, then by offset.
+*/
+static int restore_task_compare(const void *a, const void *b) {
+  const RestoreTask *x = (const RestoreTask *)a;
+  const RestoreTask *y = (const RestoreTask *)b;
+
+  if (x->source != y->source) {
+    return x->source < y->source ? -1 : 1;
+  }
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int restore_rsync_file(RestoreRun *run, const RestoreLink *links, int link_count, const char *backup_dir,
+                              const PageMapFile *target, int rsync);
+
+/**
+  @brief Plan the restore of one file from the newest copy of each page.
+
+  The chain is walked from the newest backup back to the full one, and
+  every page is taken from the first backup whose change bitmap has it,
+  a byte of the bitmap at a time.  Consecutive pages from the same backup
+  become one task of at most a block; in a delta, page i sits after the
+  pages changed before it, which per-backup cursors count as the file is
+  walked.  Each page is therefore read and written once, however long the
+  chain.  The file is created at its final size here, so pages that no
+  backup holds read back as zeros.  A file stored as an rsync delta is
+  instead rebuilt right away as of the backup holding the delta, and only
+  the newer backups are planned over it.
+
+  @param [in,out] run        Restore batch.
+  @param [in]     links      Backups of the chain, newest first.
+  @param [in]     link_count Number of backups.
+  @param [in]     backup_dir Backup directory.
+  @param [in]     target     State of the file in the newest backup.
+
+  @retval 0 success, 1 failure.
+*/
+static int restore_plan_file(RestoreRun *run, const RestoreLink *links, int link_count, const char *backup_dir,
+                             const PageMapFile *target) {
+  unsigned int pages = target->page_count;
+  size_t bytes = pages / 8 + 1;
+  const PageMapFile **entries;
+  unsigned short *from;
+  unsigned char *pending;
+  long long *cursor;
+  int *sources;
+  long long first = run->task_count;
+  unsigned int remaining = pages;
+  unsigned int page;
+  int rsync = -1;
+  int ret = 0;
+  int fd;
+  int l;
+
+  for (l = 0; l < link_count; l++) {
+    const PageMapFile *entry = l == 0 ? target : page_map_find(&links[l].map, target->path);
+    if (!entry) {
+      break;
+    }
+    if (entry->flags & BACKUP_PAGE_MAP_RSYNC) {
+      rsync = l;
+      break;
+    }
+  }
+  if (rsync >= 0) {
+    if (restore_rsync_file(run, links, link_count, backup_dir, target, rsync) != 0) {
+      return 1;
+    }
+    /* Every backup left to plan holds deltas */
+    link_count = rsync;
+  } else {
+    fd = restore_create(run->target, target->path);
+    if (fd < 0 || ftruncate(fd, target->size) != 0) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      return 1;
+    }
+    close(fd);
+  }
+  run->files[run->file_count++] = target;
+  if (pages == 0 || link_count == 0) {
+    return 0;
+  }
+
+  entries = (const PageMapFile **)calloc(link_count, sizeof(PageMapFile *));
+  from = (unsigned short *)malloc(pages * sizeof(unsigned short));
+  pending = (unsigned char *)malloc(bytes);
+  cursor = (long long *)calloc(2 * (size_t)link_count, sizeof(long long));
+  sources = (int *)malloc(link_count * sizeof(int));
+  if (!entries || !from || !pending || !cursor || !sources) {
+    ret = 1;
+    remaining = 0;
+    pages = 0;
+  } else {
+    memset(pending, 0xff, bytes);
+    pending[bytes - 1] = (unsigned char)((1 << (pages % 8)) - 1);
+    for (l = 0; l < link_count; l++) {
+      sources[l] = -1;
+    }
+  }
+
+  /* Newest copy of every page */
+  for (l = 0; l < link_count && remaining > 0; l++) {
+    const PageMapFile *entry = l == 0 ? target : page_map_find(&links[l].map, target->path);
+    size_t count;
+    size_t k;
+
+    if (!entry) {
+      /* The file did not exist before this backup */
+      break;
+    }
+    entries[l] = entry;
+    count = entry->page_count / 8 + 1 < bytes ? entry->page_count / 8 + 1 : bytes;
+    for (k = 0; k < count; k++) {
+      unsigned int take = entry->changed[k] & pending[k];
+      if (!take) {
+        continue;
+      }
+      pending[k] &= (unsigned char)~take;
+      while (take) {
+        int bit = __builtin_ctz(take);
+        from[k * 8 + bit] = (unsigned short)l;
+        remaining--;
+        take &= take - 1;
+      }
+    }
+  }
+  for (page = 0; page < pages; page++) {
+    if (pending[page / 8] & (1 << (page % 8))) {
+      from[page] = 0xffff;
+    }
+  }
+
+  /* Runs of pages from one backup */
+  for (page = 0; ret == 0 && page < pages;) {
+    unsigned int start = page;
+    long long source_page = page;
+    long long offset;
+    RestoreTask *task;
+
+    l = from[page];
+    if (l == 0xffff) {
+      page++;
+      continue;
+    }
+    do {
+      page++;
+    } while (page < pages && from[page] == l && page - start < BACKUP_SCAN_PAGES);
+    if (l < link_count - 1 || rsync >= 0) {
+      /* Rank of the first page among the pages changed in that backup */
+      const unsigned char *changed = entries[l]->changed;
+      long long *at = &cursor[2 * l];
+      long long *rank = &cursor[2 * l + 1];
+
+      while (*at < start) {
+        if (*at % 8 == 0 && *at + 8 <= start) {
+          *rank += __builtin_popcount(changed[*at / 8]);
+          *at += 8;
+        } else {
+          *rank += (changed[*at / 8] >> (*at % 8)) & 1;
+          (*at)++;
+        }
+      }
+      source_page = *rank;
+    }
+    offset = (long long)start * BACKUP_PAGE_SIZE;
+    if (offset >= target->size) {
+      break;
+    }
+    if (sources[l] < 0) {
+      sources[l] = restore_add_source(run, backup_dir, &links[l], l < link_count - 1 || rsync >= 0, target->path);
+      if (sources[l] < 0) {
+        ret = 1;
+        break;
+      }
+    }
+    if (run->task_count == run->task_size) {
+      long long size = run->task_size ? run->task_size * 2 : 1024;
+      RestoreTask *tasks = (RestoreTask *)realloc(run->tasks, size * sizeof(RestoreTask));
+      if (!tasks) {
+        ret = 1;
+        break;
+      }
+      run->tasks = tasks;
+      run->task_size = size;
+    }
+    task = &run->tasks[run->task_count++];
+    task->source = sources[l];
+    task->offset = offset;
+    task->source_offset = source_page * BACKUP_PAGE_SIZE;
+    task->length = (unsigned int)((long long)(page - start) * BACKUP_PAGE_SIZE < target->size - offset
+                                      ? (long long)(page - start) * BACKUP_PAGE_SIZE
+                                      : target->size - offset);
+  }
+  /* Each writer then stays on one stored file at a time */
+  qsort(run->tasks + first, run->task_count - first, sizeof(RestoreTask), restore_task_compare);
+
+  free(entries);
+  free(from);
+  free(pending);
+  free(cursor);
+  free(sources);
+  return ret;
+}
+
+/**
+  @brief Read raw bytes of a deduplicated file from its chunks.
+
+  @param [in]     chunk_dir Chunk store directory.
+  @param [in]     file      Chunk list of the file.
+  @param [in,out] reader    Reader of the last chunk used.
+  @param [in,out] loaded    Index of that chunk, -1 for none.
+  @param [in]     offset    Raw offset.
+  @param [out]    buffer    Destination.
+  @param [in]     length    Bytes wanted.
+
+  @retval Bytes read, or -1 on a missing or malformed chunk.
+*/
+static long long restore_read_chunks(const char *chunk_dir, const ChunkedFile *file, FrameReader *reader,
+                                     int *loaded, long long offset, unsigned char *buffer, size_t length) {
+  size_t done = 0;
+
+  while (done < length && offset + (long long)done < file->offsets[file->count]) {
+    long long position = offset + (long long)done;
+    int low = 0;
+    int high = file->count - 1;
+    long long n;
+    size_t want;
+
+    while (low < high) {
+      int mid = (low + high + 1) / 2;
+      if (file->offsets[mid] <= position) {
+        low = mid;
+      } else {
+        high = mid - 1;
+      }
+    }
+    if (*loaded != low) {
+      char path[4096];
+      const char *hex = file->hashes + (size_t)low * (2 * SHA256_DIGEST_LENGTH + 1);
+
+      frame_reader_close(reader);
+      *loaded = -1;
+      snprintf(path, sizeof(path), "%s/%.2s/%s", chunk_dir, hex, hex);
+      if (frame_reader_open(reader, path) != 0) {
+        return -1;
+      }
+      *loaded = low;
+    }
+    want = length - done;
+    if ((long long)want > file->offsets[low + 1] - position) {
+      want = (size_t)(file->offsets[low + 1] - position);
+    }
+    n = frame_reader_read(reader, position - file->offsets[low], buffer + done, want);
+    if (n <= 0) {
+      return -1;
+    }
+    done += (size_t)n;
+  }
+  return (long long)done;
+}
+
+/**
+  @brief Restore writer: copy claimed runs of pages into the target files.
+
+  Runs whose source is a plain copy at the same offset are copied inside
+  the kernel, extent by extent; the rest are read, decompressed if
+  needed, and written at their offset.  Target files are created empty
+  at their final size and every page is written once, so all-zero pages
+  are simply not written and come back as holes.
+
+  @param [in] arg Restore batch.
+*/
+static void *restore_worker(void *arg) {
+  RestoreRun *run = (RestoreRun *)arg;
+  unsigned char *buffer = (unsigned char *)malloc(BACKUP_BLOCK_SIZE);
+  FrameReader frames;
+  FrameReader chunk;
+  int method = BACKUP_COPY_RANGE;
+  int in_source = -1;
+  int out_file = -1;
+  int loaded = -1;
+  int in = -1;
+  int out = -1;
+
+  memset(&frames, 0, sizeof(frames));
+  memset(&chunk, 0, sizeof(chunk));
+  frames.fd = chunk.fd = -1;
+  if (!buffer) {
+    __sync_fetch_and_add(&run->failed, 1);
+    return NULL;
+  }
+
+  for (;;) {
+    long long index = __sync_fetch_and_add(&run->next, 1);
+    const RestoreTask *task;
+    const RestoreSource *source;
+    long long n;
+    int bad;
+
+    if (index >= run->task_count) {
+      break;
+    }
+    task = &run->tasks[index];
+    source = &run->sources[task->source];
+    if (out_file != source->file) {
+      char path[4096];
+      if (out >= 0) {
+        close(out);
+      }
+      snprintf(path, sizeof(path), "%s/%s", run->target, run->files[source->file]->path);
+      out = open(path, O_WRONLY);
+      out_file = source->file;
+    }
+    if (in_source != task->source) {
+      if (in >= 0) {
+        close(in);
+        in = -1;
+      }
+      frame_reader_close(&frames);
+      loaded = -1;
+      if (source->path && !source->compressed) {
+        in = open(source->path, O_RDONLY);
+      } else if (source->path) {
+        frame_reader_open(&frames, source->path);
+      }
+      in_source = task->source;
+    }
+
+    if (out < 0) {
+      bad = 1;
+    } else if (in >= 0 && task->source_offset == task->offset) {
+      bad = copy_sparse_range(in, out, task->offset, task->length, &method, NULL, NULL, NULL) != 0;
+    } else {
+      if (in >= 0) {
+        n = pread(in, buffer, task->length, task->source_offset);
+      } else if (frames.fd >= 0) {
+        n = frame_reader_read(&frames, task->source_offset, buffer, task->length);
+      } else if (source->chunked) {
+        n = restore_read_chunks(run->chunk_dir, source->chunked, &chunk, &loaded, task->source_offset, buffer,
+                                task->length);
+      } else {
+        n = -1;
+      }
+      /* A page stored short is the end of the file as it was then; the rest stays zero */
+      bad = n < 0 ||
+            (n > 0 && pwrite_sparse(out, buffer, (size_t)n, task->offset, zero_pages(buffer, (size_t)n)) != 0);
+    }
+    if (bad) {
+      __sync_fetch_and_add(&run->failed, 1);
+    }
+  }
+
+  if (in >= 0) {
+    close(in);
+  }
+  if (out >= 0) {
+    close(out);
+  }
+  frame_reader_close(&frames);
+  frame_reader_close(&chunk);
+  free(buffer);
+  return NULL;
+}
+
+/**
+  @brief Run the writers over one planned batch and finish its files.
+
+  @param [in,out] run          Restore batch, emptied on return.
+  @param [in]     thread_count Writers.
+
+  @retval 0 success, 1 failure.
+*/
+static int restore_run_batch(RestoreRun *run, int thread_count) {
+  pthread_t threads[BACKUP_MAX_THREADS];
+  int started = 0;
+  int ret = 0;
+  int i;
+
+  if (run->task_count > 0) {
+    if (thread_count > run->task_count) {
+      thread_count = (int)run->task_count;
+    }
+    started = pipeline_start_stage(threads, thread_count, restore_worker, run);
+    for (i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    ret = started == 0 || run->failed > 0;
+  }
+  for (i = 0; i < run->file_count; i++) {
+    char path[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", run->target, run->files[i]->path);
+    fd = open(path, O_WRONLY);
+    if (fd < 0 || restore_finish(fd, run->files[i]->mtime) != 0) {
+      ret = 1;
+    }
+  }
+  for (i = 0; i < run->source_count; i++) {
+    free(run->sources[i].path);
+  }
+  run->file_count = 0;
+  run->source_count = 0;
+  run->task_count = 0;
+  run->next = 0;
+  return ret;
+}
+
+/**
+  @brief Write pages rebuilt from an rsync delta, checking each against its recorded CRC32C.
+
+  @param [in] out    Restored file.
+  @param [in] data   Pages, BACKUP_BLOCK_SIZE bytes at most.
+  @param [in] length Bytes, short only at the end of the file.
+  @param [in] offset File offset, a multiple of BACKUP_BLOCK_SIZE.
+  @param [in] state  Page state of the file in the backup holding the delta.
+
+  @retval 0 success, 1 failure or mismatch.
+*/
+static int rsync_apply_pages(int out, const unsigned char *data, size_t length, long long offset,
+                             const PageMapFile *state) {
+  size_t pos;
+
+  for (pos = 0; pos < length; pos += BACKUP_PAGE_SIZE) {
+    unsigned int page = (unsigned int)((offset + (long long)pos) / BACKUP_PAGE_SIZE);
+    size_t bytes = length - pos < BACKUP_PAGE_SIZE ? length - pos : BACKUP_PAGE_SIZE;
+
+    if (page >= state->page_count || crc32c(0, data + pos, bytes) != state->crcs[page]) {
+      return 1;
+    }
+  }
+  return pwrite_sparse(out, data, length, offset, zero_pages(data, length));
+}
+
+/**
+  @brief Apply an rsync delta to the restored parent's copy of a file.
+
+  Every page rebuilt is checked against the CRC32C the backup recorded,
+  so a delta applied to the wrong base fails rather than restoring
+  garbage.
+
+  @param [in] base_path  Parent's copy, restored.
+  @param [in] delta_path Delta.
+  @param [in] out        Restored file.
+  @param [in] state      Page state of the file in the backup holding the delta.
+
+  @retval 0 success, 1 failure.
+*/
+static int rsync_apply(const char *base_path, const char *delta_path, int out, const PageMapFile *state) {
+  unsigned char *pages = (unsigned char *)malloc(BACKUP_BLOCK_SIZE);
+  FILE *delta = fopen(delta_path, "rb");
+  int base = open(base_path, O_RDONLY);
+  unsigned int header[3];
+  long long sizes[2];
+  long long written = 0;
+  size_t fill = 0;
+  struct stat st;
+  int ret;
+
+  ret = !pages || !delta || base < 0 || fstat(base, &st) != 0 ||
+        fread(header, sizeof(header), 1, delta) != 1 || fread(sizes, sizeof(sizes), 1, delta) != 1 ||
+        header[0] != BACKUP_RSYNC_MAGIC || header[1] != BACKUP_RSYNC_VERSION || header[2] != BACKUP_RSYNC_BLOCK ||
+        sizes[0] != (long long)st.st_size || sizes[1] != state->size;
+  while (ret == 0) {
+    unsigned int head[2];
+    long long offset;
+
+    if (fread(head, sizeof(head), 1, delta) != 1) {
+      ret = ferror(delta) ? 1 : 0;
+      break;
+    }
+    if (fread(&offset, sizeof(offset), 1, delta) != 1 || head[0] > BACKUP_RSYNC_COPY) {
+      ret = 1;
+      break;
+    }
+    while (ret == 0 && head[1] > 0) {
+      size_t length = BACKUP_BLOCK_SIZE - fill < head[1] ? BACKUP_BLOCK_SIZE - fill : head[1];
+      size_t done = 0;
+
+      if (head[0] == BACKUP_RSYNC_LITERAL) {
+        done = fread(pages + fill, 1, length, delta);
+      } else {
+        while (done < length) {
+          ssize_t n = pread(base, pages + fill + done, length - done, offset + (long long)done);
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          if (n <= 0) {
+            break;
+          }
+          done += (size_t)n;
+        }
+        offset += (long long)length;
+      }
+      ret = done != length || written + (long long)(fill + length) > state->size;
+      head[1] -= (unsigned int)length;
+      fill += length;
+      if (ret == 0 && fill == BACKUP_BLOCK_SIZE) {
+        ret = rsync_apply_pages(out, pages, fill, written, state);
+        written += (long long)fill;
+        fill = 0;
+      }
+    }
+  }
+  /* A file that shrank while it was encoded keeps zeros past what was read */
+  if (ret == 0 && fill > 0) {
+    ret = rsync_apply_pages(out, pages, fill, written, state);
+  }
+
+  if (delta) {
+    fclose(delta);
+  }
+  if (base >= 0) {
+    close(base);
+  }
+  free(pages);
+  return ret;
+}
+
+/**
+  @brief Rebuild a file stored as an rsync delta, as of the backup holding the delta.
+
+  The parent's copy is restored first, by the same planner, under
+  #rsync.<depth> in the target, so a delta further down the chain is
+  rebuilt the same way.  The delta is then applied into the target file,
+  created at its final size, and the parent's copy is removed.
+
+  @param [in,out] run        Restore batch the file belongs to.
+  @param [in]     links      Backups of the chain, newest first.
+  @param [in]     link_count Number of backups.
+  @param [in]     backup_dir Backup directory.
+  @param [in]     target     State of the file in the newest backup.
+  @param [in]     rsync      Link holding the delta.
+
+  @retval 0 success, 1 failure.
+*/
+static int restore_rsync_file(RestoreRun *run, const RestoreLink *links, int link_count, const char *backup_dir,
+                              const PageMapFile *target, int rsync) {
+  const PageMapFile *state = rsync == 0 ? target : page_map_find(&links[rsync].map, target->path);
+  const PageMapFile *base = rsync + 1 < link_count ? page_map_find(&links[rsync + 1].map, target->path) : NULL;
+  const PageMapFile *files[1];
+  RestoreRun sub;
+  char scratch[2048];
+  char path[4096];
+  char delta[4096];
+  char *slash;
+  int ret;
+  int fd;
+
+  if (!state || !base) {
+    return 1;
+  }
+  crc32c_init();
+  snprintf(scratch, sizeof(scratch), "%s/#rsync.%d", run->target, run->depth);
+  snprintf(path, sizeof(path), "%s/%s", scratch, base->path);
+  /* Left over by an interrupted restore */
+  unlink(path);
+  memset(&sub, 0, sizeof(sub));
+  sub.target = scratch;
+  sub.chunk_dir = run->chunk_dir;
+  sub.files = files;
+  sub.threads = run->threads;
+  sub.depth = run->depth + 1;
+  ret = restore_plan_file(&sub, links + rsync + 1, link_count - rsync - 1, backup_dir, base);
+  if (restore_run_batch(&sub, sub.threads) != 0) {
+    ret = 1;
+  }
+  free(sub.sources);
+  free(sub.tasks);
+
+  snprintf(delta, sizeof(delta), "%s/%s/%s/%s%s", backup_dir, links[rsync].name, BACKUP_DATA_DIR, target->path,
+           BACKUP_RSYNC_SUFFIX);
+  fd = ret == 0 ? restore_create(run->target, target->path) : -1;
+  if (fd < 0) {
+    ret = 1;
+  } else {
+    if (rsync_apply(path, delta, fd, state) != 0 || ftruncate(fd, target->size) != 0) {
+      ret = 1;
+    }
+    if (close(fd) != 0) {
+      ret = 1;
+    }
+  }
+
+  unlink(path);
+  while ((slash = strrchr(path, '/')) != NULL && slash > path + strlen(scratch)) {
+    *slash = '\0';
+    rmdir(path);
+  }
+  rmdir(scratch);
+  return ret;
+}
+
+/**
+  @brief Check that a directory is empty or can be created.
+
+  @param [in] path Directory.
+
+  @retval 1 usable, 0 it holds files.
+*/
+static int restore_target_usable(const char *path) {
+  struct dirent *entry;
+  DIR *dir = opendir(path);
+  int usable = 1;
+
+  if (!dir) {
+    return create_directory(path) == 0;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      usable = 0;
+      break;
+    }
+  }
+  closedir(dir);
+  return usable;
+}
+
+/**
+  @brief Check that a chunk still decodes to the data its name hashes.
+
+  @param [in]     run    Validation run.
+  @param [in]     hex    Chunk hash.
+  @param [in,out] buffer Buffer of BACKUP_CHUNK_MAX bytes.
+
+  @retval 0 intact, 1 missing or damaged.
+*/
+static int validate_chunk(const ValidateRun *run, const char *hex, unsigned char *buffer) {
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  unsigned char expected[SHA256_DIGEST_LENGTH];
+  char path[4096];
+  FrameReader reader;
+  long long length;
+
+  snprintf(path, sizeof(path), "%s/%.2s/%s", run->chunk_dir, hex, hex);
+  if (hash_parse(hex, expected) != 0 || frame_reader_open(&reader, path) != 0) {
+    return 1;
+  }
+  length = reader.raw_size <= BACKUP_CHUNK_MAX ? frame_reader_read(&reader, 0, buffer, (size_t)reader.raw_size) : -1;
+  frame_reader_close(&reader);
+  if (length < 0) {
+    return 1;
+  }
+  SHA256(buffer, (size_t)length, hash);
+  return memcmp(hash, expected, sizeof(hash)) != 0;
+}
+
+/**
+  @brief Validation worker: read claimed blocks and compare checksums.
+
+  Tasks are ordered by file and offset, so a thread keeps its descriptor
+  while it stays on one file.
+
+  @param [in] arg Validation run.
+*/
+static void *validate_worker(void *arg) {
+  ValidateRun *run = (ValidateRun *)arg;
+  unsigned char *buffer = NULL;
+  size_t capacity = 0;
+  int fd_file = -1;
+  int fd = -1;
+
+  for (;;) {
+    long long index = __sync_fetch_and_add(&run->next, 1);
+    const ValidateTask *task;
+    const ManifestBlock *block = NULL;
+    size_t want = BACKUP_CHUNK_MAX;
+    size_t done = 0;
+
+    if (index >= run->task_count) {
+      break;
+    }
+    task = &run->tasks[index];
+    if (task->file >= 0) {
+      block = &run->manifest->files[task->file].blocks[task->block];
+      want = block->length;
+    }
+    if (capacity < want) {
+      free(buffer);
+      buffer = (unsigned char *)malloc(want);
+      capacity = buffer ? want : 0;
+    }
+    if (!buffer) {
+      __sync_fetch_and_add(&run->failed, 1);
+      continue;
+    }
+    if (!block) {
+      if (validate_chunk(run, task->chunk, buffer) != 0) {
+        __sync_fetch_and_add(&run->failed, 1);
+      }
+      continue;
+    }
+
+    if (fd_file != task->file) {
+      char path[4096];
+      if (fd >= 0) {
+        close(fd);
+      }
+      snprintf(path, sizeof(path), "%s/%s", run->backup_path, run->manifest->files[task->file].path);
+      fd = open(path, O_RDONLY);
+      fd_file = task->file;
+    }
+    while (fd >= 0 && done < block->length) {
+      ssize_t n = pread(fd, buffer + done, block->length - done, block->offset + (long long)done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      done += (size_t)n;
+    }
+    if (done != block->length || crc32c(0, buffer, done) != block->crc) {
+      __sync_fetch_and_add(&run->failed, 1);
+    }
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(buffer);
+  return NULL;
+}
+
+/**
+  @brief Check the manifest against the Merkle root in the metadata.
+
+  Leaves of the checked files are recomputed from their block lists;
+  the others are taken as listed, which is what lets a single file be
+  verified without the rest of the backup.
+
+  @param [in,out] manifest Manifest.
+  @param [in]     only     Check only this file, or NULL for all.
+  @param [in]     expected Root from the metadata, as hex.
+
+  @retval 0 consistent, 1 mismatch.
+*/
+static int validate_root(Manifest *manifest, const char *only, const char *expected) {
+  unsigned char leaf[SHA256_DIGEST_LENGTH];
+  unsigned char root[SHA256_DIGEST_LENGTH];
+  char hex[2 * SHA256_DIGEST_LENGTH + 1];
+  int i;
+
+  for (i = 0; i < manifest->count; i++) {
+    ManifestFile *file = &manifest->files[i];
+    if (only && strcmp(file->path, only) != 0) {
+      continue;
+    }
+    if (manifest_leaf(file, leaf) != 0 || memcmp(leaf, file->leaf, sizeof(leaf)) != 0) {
+      return 1;
+    }
+  }
+  if (manifest_root(manifest, root) != 0) {
+    return 1;
+  }
+  chunk_hex(root, hex);
+  return strcmp(hex, expected) != 0;
+}
+
+/**
+  @brief Order chunk tasks by hash.
+*/
+static int validate_task_compare(const void *a, const void *b) {
+  return strcmp(((const ValidateTask *)a)->chunk, ((const ValidateTask *)b)->chunk);
+}
+
+/**
+  @brief Queue the chunks of a deduplicated backup, each once.
+
+  @param [in]     backup_path Backup directory.
+  @param [in]     only        Data file whose chunks are wanted, or NULL for all.
+  @param [in,out] tasks       Task array.
+  @param [in,out] count       Tasks in use.
+  @param [in,out] size        Task array capacity.
+
+  @retval 0 success, 1 failure.
+*/
+static int validate_add_chunks(const char *backup_path, const char *only, ValidateTask **tasks, long long *count,
+                               long long *size) {
+  long long first = *count;
+  long long kept;
+  long long i;
+  char line[4096];
+  int wanted = 0;
+  FILE *fp;
+
+  if (snprintf(line, sizeof(line), "%s/%s", backup_path, BACKUP_CHUNK_MANIFEST) >= (int)sizeof(line)) {
+    return 1;
+  }
+  fp = fopen(line, "r");
+  if (!fp) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == 'F') {
+      int consumed = 0;
+      sscanf(line, "F %*d %*d %n", &consumed);
+      wanted = consumed > 0 && (!only || strcmp(line + consumed, only) == 0);
+    } else if (line[0] == 'C' && wanted && strlen(line) >= 2 + 2 * SHA256_DIGEST_LENGTH) {
+      if (*count == *size) {
+        long long grown = *size ? *size * 2 : 1024;
+        ValidateTask *more = (ValidateTask *)realloc(*tasks, grown * sizeof(ValidateTask));
+        if (!more) {
+          fclose(fp);
+          return 1;
+        }
+        *tasks = more;
+        *size = grown;
+      }
+      (*tasks)[*count].file = -1;
+      (*tasks)[*count].block = 0;
+      snprintf((*tasks)[*count].chunk, sizeof((*tasks)[*count].chunk), "%.64s", line + 2);
+      (*count)++;
+    }
+  }
+  fclose(fp);
+
+  qsort(*tasks + first, *count - first, sizeof(ValidateTask), validate_task_compare);
+  kept = first;
+  for (i = first; i < *count; i++) {
+    if (kept == first || strcmp((*tasks)[kept - 1].chunk, (*tasks)[i].chunk) != 0) {
+      (*tasks)[kept++] = (*tasks)[i];
+    }
+  }
+  *count = kept;
+  return 0;
+}
+
+/**
+  @brief Read a little-endian integer from a binlog event.
+
+  @param [in] data   Bytes.
+  @param [in] length Width in bytes.
+
+  @retval Value.
+*/
+static unsigned long long binlog_uint(const unsigned char *data, int length) {
+  unsigned long long value = 0;
+
+  while (length-- > 0) {
+    value = (value << 8) | data[length];
+  }
+  return value;
+}
+
+/**
+  @brief Start a walk over the events of a binlog.
+
+  @param [out] scan       Walk.
+  @param [in]  start_time Start of the replay window.
+  @param [in]  stop_time  End of the replay window.
+*/
+static void binlog_scan_init(BinlogScan *scan, long long start_time, long long stop_time) {
+  memset(scan, 0, sizeof(*scan));
+  scan->next = 4; /* after the magic */
+  scan->start_time = start_time;
+  scan->stop_time = stop_time;
+  scan->start = -1;
+  scan->stop = -1;
+}
+
+/**
+  @brief Account for one event whose header has been collected.
+
+  Transactions begin at their GTID event, or at an anonymous GTID event
+  without GTIDs, so those are the only places a replay may start or stop.
+
+  @param [in,out] scan Walk.
+*/
+static void binlog_scan_event(BinlogScan *scan) {
+  long long when = (long long)binlog_uint(scan->head, 4);
+  int type = scan->head[4];
+  int i;
+
+  if (when > 0) {
+    if (scan->first_time == 0 || when < scan->first_time) {
+      scan->first_time = when;
+    }
+    if (when > scan->last_time) {
+      scan->last_time = when;
+    }
+  }
+  if (type != BACKUP_BINLOG_GTID_EVENT && type != BACKUP_BINLOG_ANONYMOUS_GTID_EVENT) {
+    return;
+  }
+  if (scan->start < 0 && when >= scan->start_time) {
+    scan->start = scan->next;
+  }
+  if (scan->stop < 0 && when > scan->stop_time) {
+    scan->stop = scan->next;
+  }
+  if (type == BACKUP_BINLOG_GTID_EVENT) {
+    const unsigned char *sid = scan->head + BACKUP_BINLOG_HEADER_SIZE + 1;
+    long long gno = (long long)binlog_uint(sid + 16, 8);
+
+    i = 0;
+    while (i < scan->gtid_count && memcmp(scan->gtids[i].sid, sid, 16) != 0) {
+      i++;
+    }
+    if (i == scan->gtid_count && i < BACKUP_BINLOG_MAX_SIDS) {
+      memcpy(scan->gtids[i].sid, sid, 16);
+      scan->gtids[i].first = gno;
+      scan->gtids[i].last = gno;
+      scan->gtid_count++;
+    } else if (i < scan->gtid_count) {
+      scan->gtids[i].first = gno < scan->gtids[i].first ? gno : scan->gtids[i].first;
+      scan->gtids[i].last = gno > scan->gtids[i].last ? gno : scan->gtids[i].last;
+    }
+  }
+}
+
+/**
+  @brief Feed the next bytes of a binlog to a walk.
+
+  Only event headers are looked at; an event header split between two
+  buffers is collected across calls.
+
+  @param [in,out] scan   Walk.
+  @param [in]     data   Bytes.
+  @param [in]     base   Offset of data in the binlog.
+  @param [in]     length Number of bytes.
+*/
+static void binlog_scan_feed(BinlogScan *scan, const unsigned char *data, long long base, size_t length) {
+  long long end = base + (long long)length;
+
+  if (base == 0 && (length < 4 || memcmp(data, BACKUP_BINLOG_MAGIC, 4) != 0)) {
+    scan->malformed = 1;
+  }
+  while (!scan->malformed && scan->next + scan->have < end) {
+    long long from = scan->next + scan->have;
+    int need = scan->have >= BACKUP_BINLOG_HEADER_SIZE && scan->head[4] == BACKUP_BINLOG_GTID_EVENT
+                   ? BACKUP_BINLOG_GTID_SIZE
+                   : BACKUP_BINLOG_HEADER_SIZE;
+    size_t count = (size_t)(need - scan->have) < (size_t)(end - from) ? (size_t)(need - scan->have)
+                                                                        : (size_t)(end - from);
+    long long size;
+
+    memcpy(scan->head + scan->have, data + (from - base), count);
+    scan->have += (int)count;
+    if (scan->have < need ||
+        (need == BACKUP_BINLOG_HEADER_SIZE && scan->head[4] == BACKUP_BINLOG_GTID_EVENT)) {
+      continue;
+    }
+    size = (long long)binlog_uint(scan->head + 9, 4);
+    if (size < need) {
+      scan->malformed = 1;
+      break;
+    }
+    binlog_scan_event(scan);
+    scan->next += size;
+    scan->have = 0;
+  }
+}
+
+/**
+  @brief Format the GTIDs seen by a walk as uuid:first-last ranges.
+
+  @param [in]  scan Walk.
+  @param [out] text GTID ranges, "-" without GTIDs.
+  @param [in]  size Size of text.
+*/
+static void binlog_gtid_format(const BinlogScan *scan, char *text, size_t size) {
+  size_t length = 0;
+  int i, j;
+
+  snprintf(text, size, "-");
+  for (i = 0; i < scan->gtid_count && length < size; i++) {
+    char uuid[37];
+    int pos = 0;
+
+    for (j = 0; j < 16; j++) {
+      pos += snprintf(uuid + pos, sizeof(uuid) - pos, j == 4 || j == 6 || j == 8 || j == 10 ? "-%02x" : "%02x",
+                      scan->gtids[i].sid[j]);
+    }
+    length += snprintf(text + length, size - length, "%s%s:%lld-%lld", i ? "," : "", uuid, scan->gtids[i].first,
+                       scan->gtids[i].last);
+  }
+}
+
+/**
+  @brief Free an archive listing.
+
+  @param [in] archive Archive.
+*/
+static void binlog_archive_free(BinlogArchive *archive) {
+  int i;
+
+  for (i = 0; i < archive->count; i++) {
+    free(archive->segments[i].name);
+    free(archive->segments[i].gtids);
+  }
+  free(archive->segments);
+  memset(archive, 0, sizeof(*archive));
+}
+
+/**
+  @brief Order archived binlogs by name, which is their order on the server.
+*/
+static int binlog_segment_compare(const void *a, const void *b) {
+  return strcmp(((const BinlogSegment *)a)->name, ((const BinlogSegment *)b)->name);
+}
+
+/**
+  @brief Load the archive index.
+
+  Records are tab-separated: binlog name, first and last event time,
+  size, CRC32C and GTID ranges.  A missing index is an empty archive; a
+  partly written last record is ignored.
+
+  @param [in]  archive_dir Archive directory.
+  @param [out] archive     Archived binlogs, in binlog order.
+
+  @retval 0 success, 1 failure.
+*/
+static int binlog_archive_load(const char *archive_dir, BinlogArchive *archive) {
+  char path[4096];
+  char line[4096];
+  FILE *fp;
+  int ret = 0;
+
+  memset(archive, 0, sizeof(*archive));
+  snprintf(path, sizeof(path), "%s/%s", archive_dir, BACKUP_BINLOG_ARCHIVE_INDEX);
+  fp = fopen(path, "r");
+  if (!fp) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  while (ret == 0 && fgets(line, sizeof(line), fp)) {
+    char name[256];
+    char gtids[2048];
+    BinlogSegment segment;
+
+    memset(&segment, 0, sizeof(segment));
+    if (!strchr(line, '\n') ||
+        sscanf(line, "%255[^\t]\t%lld\t%lld\t%lld\t%x\t%2047[^\n]", name, &segment.first_time, &segment.last_time,
+               &segment.size, &segment.crc, gtids) != 6) {
+      continue;
+    }
+    if (archive->count == archive->size) {
+      int size = archive->size ? archive->size * 2 : 64;
+      BinlogSegment *segments = (BinlogSegment *)realloc(archive->segments, size * sizeof(BinlogSegment));
+      if (!segments) {
+        ret = 1;
+        break;
+      }
+      archive->segments = segments;
+      archive->size = size;
+    }
+    segment.name = strdup(name);
+    segment.gtids = strdup(gtids);
+    archive->segments[archive->count++] = segment;
+    ret = segment.name && segment.gtids ? 0 : 1;
+  }
+  fclose(fp);
+  if (ret != 0) {
+    binlog_archive_free(archive);
+    return 1;
+  }
+  qsort(archive->segments, archive->count, sizeof(BinlogSegment), binlog_segment_compare);
+  return 0;
+}
+
+/**
+  @brief Find an archived binlog.
+
+  @param [in] archive Archive.
+  @param [in] name    Binlog name.
+
+  @retval Segment, or NULL if the binlog is not archived.
+*/
+static const BinlogSegment *binlog_archive_find(const BinlogArchive *archive, const char *name) {
+  BinlogSegment key;
+
+  key.name = (char *)name;
+  return (const BinlogSegment *)bsearch(&key, archive->segments, archive->count, sizeof(BinlogSegment),
+                                        binlog_segment_compare);
+}
+
+/**
+  @brief Archive one closed binlog.
+
+  The binlog is streamed through seekable frames into <name>.z, written
+  under a temporary name and renamed once synced.  Its events are walked
+  on the way for the time and GTID ranges, and a record with those, the
+  size and the CRC32C of the binlog is then appended to the index.
+
+  @param [in] archiver Archiver.
+  @param [in] path     Binlog path.
+  @param [in] name     Binlog name.
+  @param [in] log      Archive log, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int binlog_archive_file(const BinlogArchiver *archiver, const char *path, const char *name, FILE *log) {
+  size_t capacity = compressBound(BACKUP_BLOCK_SIZE);
+  unsigned char *raw = (unsigned char *)malloc(BACKUP_BLOCK_SIZE);
+  unsigned char *zdata = (unsigned char *)malloc(capacity);
+  unsigned int *raw_lengths = NULL;
+  unsigned int *stored_lengths = NULL;
+  int frame_count = 0;
+  int frame_size = 0;
+  long long size = 0;
+  long long stored = 0;
+  unsigned int crc = 0;
+  char target[4096];
+  char temp[sizeof(target) + 8];
+  char record[4096];
+  char gtids[2048];
+  int level = archiver->level;
+  BinlogScan scan;
+  z_stream stream;
+  ssize_t n = 0;
+  int in, out;
+  int ret;
+
+  snprintf(target, sizeof(target), "%s/%s%s", archiver->archive_dir, name, BACKUP_COMPRESSED_SUFFIX);
+  snprintf(temp, sizeof(temp), "%s.tmp", target);
+  binlog_scan_init(&scan, 0, 0);
+  memset(&stream, 0, sizeof(stream));
+  if (level > 0 && deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    level = 0;
+  }
+  in = open(path, O_RDONLY);
+  out = in >= 0 ? open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0640) : -1;
+  ret = !raw || !zdata || out < 0;
+  while (ret == 0 && (n = read(in, raw, BACKUP_BLOCK_SIZE)) > 0) {
+    size_t length = (size_t)n;
+    int flags = level > 0 ? frame_compress(&stream, raw, length, zdata, capacity, &length) : BACKUP_FRAME_STORED;
+
+    if (frame_count == frame_size) {
+      int grown = frame_size ? frame_size * 2 : 64;
+      unsigned int *more_raw = (unsigned int *)realloc(raw_lengths, grown * sizeof(unsigned int));
+      unsigned int *more_stored = more_raw ? (unsigned int *)realloc(stored_lengths, grown * sizeof(unsigned int))
+                                           : NULL;
+      raw_lengths = more_raw ? more_raw : raw_lengths;
+      stored_lengths = more_stored ? more_stored : stored_lengths;
+      if (!more_raw || !more_stored) {
+        ret = 1;
+        break;
+      }
+      frame_size = grown;
+    }
+    binlog_scan_feed(&scan, raw, size, (size_t)n);
+    crc = crc32c(crc, raw, (size_t)n);
+    raw_lengths[frame_count] = (unsigned int)n;
+    stored_lengths[frame_count++] = (unsigned int)length;
+    ret = frame_write(out, flags == BACKUP_FRAME_DEFLATE ? zdata : raw, (unsigned int)n, (unsigned int)length, flags);
+    size += n;
+    stored += BACKUP_FRAME_HEADER_SIZE + (long long)length;
+  }
+  /* A closed binlog ends with a whole event */
+  if (n < 0 || scan.malformed || scan.have != 0 || scan.next != size ||
+      frame_write_seek_table(out, raw_lengths, stored_lengths, frame_count, NULL) != 0 || fsync(out) != 0) {
+    ret = 1;
+  }
+  if (out >= 0 && close(out) != 0) {
+    ret = 1;
+  }
+  if (in >= 0) {
+    close(in);
+  }
+  if (ret == 0 && rename(temp, target) != 0) {
+    ret = 1;
+  }
+  if (ret != 0) {
+    unlink(temp);
+  }
+
+  if (ret == 0) {
+    int length;
+    int fd;
+
+    binlog_gtid_format(&scan, gtids, sizeof(gtids));
+    length = snprintf(record, sizeof(record), "%s\t%lld\t%lld\t%lld\t%08x\t%s\n", name, scan.first_time,
+                      scan.last_time, size, crc, gtids);
+    snprintf(target, sizeof(target), "%s/%s", archiver->archive_dir, BACKUP_BINLOG_ARCHIVE_INDEX);
+    fd = length > 0 && (size_t)length < sizeof(record) ? open(target, O_WRONLY | O_CREAT | O_APPEND, 0640) : -1;
+    ret = fd < 0 || write_all(fd, (const unsigned char *)record, (size_t)length) != 0;
+    if (fd >= 0 && close(fd) != 0) {
+      ret = 1;
+    }
+  }
+  if (log) {
+    fprintf(log, "%ld %s size %lld stored %lld %s\n", (long)time(NULL), name, size, stored + (long long)frame_count * 8 + 8,
+            ret == 0 ? "ok" : "FAILED");
+  }
+
+  if (level > 0) {
+    deflateEnd(&stream);
+  }
+  free(raw_lengths);
+  free(stored_lengths);
+  free(raw);
+  free(zdata);
+  return ret;
+}
+
+/**
+  @brief Archive every closed binlog that is not archived yet.
+
+  Every binlog in the server's index but the last one is closed.  Passes
+  of archivers sharing a backup directory are serialized by a lock; a
+  pass that finds the lock taken does nothing.
+
+  @param [in] archiver Archiver.
+
+  @retval 0 success, 1 some binlog could not be archived.
+*/
+static int binlog_archive_pass(const BinlogArchiver *archiver) {
+  BinlogArchive archive;
+  char dir[4096];
+  char line[1024];
+  char closed[1024] = "";
+  char path[sizeof(dir) + sizeof(closed) + 1];
+  const char *slash = strrchr(archiver->binlog_index, '/');
+  FILE *index;
+  FILE *log;
+  int lock;
+  int ret = 0;
+
+  snprintf(path, sizeof(path), "%s/%s", archiver->archive_dir, BACKUP_BINLOG_LOCK);
+  lock = open(path, O_WRONLY | O_CREAT, 0640);
+  if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) != 0) {
+    if (lock >= 0) {
+      close(lock);
+    }
+    return lock < 0;
+  }
+  index = fopen(archiver->binlog_index, "r");
+  if (!index || binlog_archive_load(archiver->archive_dir, &archive) != 0) {
+    if (index) {
+      fclose(index);
+    }
+    close(lock);
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/%s", archiver->archive_dir, BACKUP_BINLOG_ARCHIVE_LOG);
+  log = fopen(path, "a");
+  /* Relative binlog paths are relative to the index */
+  snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - archiver->binlog_index) : 1,
+           slash ? archiver->binlog_index : ".");
+
+  while (fgets(line, sizeof(line), index)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!line[0]) {
+      continue;
+    }
+    /* A binlog followed by another one is closed */
+    if (closed[0]) {
+      const char *name = strrchr(closed, '/') ? strrchr(closed, '/') + 1 : closed;
+
+      if (!binlog_archive_find(&archive, name)) {
+        if (closed[0] == '/') {
+          snprintf(path, sizeof(path), "%s", closed);
+        } else {
+          snprintf(path, sizeof(path), "%s/%s", dir, closed);
+        }
+        ret |= binlog_archive_file(archiver, path, name, log);
+      }
+    }
+    snprintf(closed, sizeof(closed), "%s", line);
+  }
+
+  if (log) {
+    fclose(log);
+  }
+  fclose(index);
+  binlog_archive_free(&archive);
+  close(lock);
+  return ret;
+}
+
+/**
+  @brief Archiver thread: a pass every BACKUP_BINLOG_INTERVAL seconds.
+
+  A stop request wakes the thread for one last pass.
+
+  @param [in] arg Archiver.
+*/
+static void *binlog_archiver_main(void *arg) {
+  BinlogArchiver *archiver = (BinlogArchiver *)arg;
+  int stop;
+
+  do {
+    binlog_archive_pass(archiver);
+    pthread_mutex_lock(&archiver->mutex);
+    stop = archiver->stop;
+    if (!stop) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += BACKUP_BINLOG_INTERVAL;
+      pthread_cond_timedwait(&archiver->wake, &archiver->mutex, &deadline);
+    }
+    pthread_mutex_unlock(&archiver->mutex);
+  } while (!stop);
+  return NULL;
+}
+
+/**
+  @brief Free an archiver whose thread is not running.
+
+  @param [in] archiver Archiver.
+*/
+static void binlog_archiver_free(BinlogArchiver *archiver) {
+  free(archiver->binlog_index);
+  free(archiver->archive_dir);
+  free(archiver);
+}
+
+/**
+  @brief Start archiving closed binlogs into <backup_dir>/binlog.
+
+  @param [in] backup_ctx Backup context.
+
+  @retval 0 success, 1 failure.
+*/
+static int binlog_archiver_start(BackupContext *backup_ctx) {
+  BinlogArchiver *archiver;
+  char path[4096];
+
+  if (backup_ctx->archiver) {
+    return 0;
+  }
+  if (!backup_ctx->backup_dir) {
+    return 1;
+  }
+  archiver = (BinlogArchiver *)calloc(1, sizeof(BinlogArchiver));
+  if (!archiver) {
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/%s", backup_ctx->backup_dir, BACKUP_BINLOG_DIR);
+  archiver->archive_dir = strdup(path);
+  snprintf(path, sizeof(path), "%s/%s", backup_ctx->datadir, BACKUP_BINLOG_DEFAULT_INDEX);
+  archiver->binlog_index = strdup(backup_ctx->binlog_index ? backup_ctx->binlog_index : path);
+  archiver->level = backup_ctx->compression_level;
+  if (!archiver->archive_dir || !archiver->binlog_index || create_directory(archiver->archive_dir) != 0) {
+    binlog_archiver_free(archiver);
+    return 1;
+  }
+  crc32c_init();
+  pthread_mutex_init(&archiver->mutex, NULL);
+  pthread_cond_init(&archiver->wake, NULL);
+  if (pthread_create(&archiver->thread, NULL, binlog_archiver_main, archiver) != 0) {
+    pthread_mutex_destroy(&archiver->mutex);
+    pthread_cond_destroy(&archiver->wake);
+    binlog_archiver_free(archiver);
+    return 1;
+  }
+  backup_ctx->archiver = archiver;
+  return 0;
+}
+
+/**
+  @brief Stop the archiver after a last pass.
+
+  @param [in] backup_ctx Backup context.
+*/
+static void binlog_archiver_stop(BackupContext *backup_ctx) {
+  BinlogArchiver *archiver = backup_ctx->archiver;
+
+  if (!archiver) {
+    return;
+  }
+  pthread_mutex_lock(&archiver->mutex);
+  archiver->stop = 1;
+  pthread_cond_signal(&archiver->wake);
+  pthread_mutex_unlock(&archiver->mutex);
+  pthread_join(archiver->thread, NULL);
+  pthread_mutex_destroy(&archiver->mutex);
+  pthread_cond_destroy(&archiver->wake);
+  binlog_archiver_free(archiver);
+  backup_ctx->archiver = NULL;
+}
+
+/**
+  @brief Sequence number of a binlog, from its name.
+
+  @param [in] name Binlog name, <basename>.<number>.
+
+  @retval Sequence number, or -1.
+*/
+static long long binlog_sequence(const char *name) {
+  const char *dot = strrchr(name, '.');
+
+  return dot && dot[1] ? atoll(dot + 1) : -1;
+}
+
+/**
+  @brief Pick the archived binlogs that cover a replay window.
+
+  The binlogs must be consecutive, the first one must start no later
+  than the window and the last one must have been closed after it.
+
+  @param [in]  archive    Archive.
+  @param [in]  start_time Start of the window, the backup time.
+  @param [in]  stop_time  End of the window, the restore target.
+  @param [out] first      First binlog needed.
+  @param [out] last       Last binlog needed.
+
+  @retval 0 success, 1 the archive does not cover the window.
+*/
+static int binlog_replay_plan(const BinlogArchive *archive, long long start_time, long long stop_time, int *first,
+                              int *last) {
+  int i;
+
+  *first = -1;
+  *last = -1;
+  for (i = 0; i < archive->count; i++) {
+    if (archive->segments[i].last_time >= start_time && archive->segments[i].first_time <= stop_time) {
+      *first = *first < 0 ? i : *first;
+      *last = i;
+    }
+  }
+  if (*first < 0 || archive->segments[*first].first_time > start_time ||
+      archive->segments[*last].last_time < stop_time) {
+    return 1;
+  }
+  for (i = *first + 1; i <= *last; i++) {
+    if (binlog_sequence(archive->segments[i].name) != binlog_sequence(archive->segments[i - 1].name) + 1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+  @brief Extract the binlogs of a replay window next to a restore.
+
+  Each archived binlog is decompressed into <target>/#binlog_replay and
+  checked against its recorded size and CRC32C.  The first binlog is
+  replayed from its first transaction at or after the backup time; the
+  binlog holding the first transaction after the target time is cut
+  there and ends the replay.  replay.list names the binlogs in order,
+  with the positions to replay them from and to.
+
+  @param [in] archive_dir Archive directory.
+  @param [in] archive     Archive.
+  @param [in] first       First binlog needed.
+  @param [in] last        Last binlog needed.
+  @param [in] start_time  Backup time.
+  @param [in] stop_time   Restore target time.
+  @param [in] target      Restore target.
+
+  @retval 0 success, 1 failure.
+*/
+static int binlog_replay(const char *archive_dir, const BinlogArchive *archive, int first, int last,
+                         long long start_time, long long stop_time, const char *target) {
+  char dir[4096];
+  char path[sizeof(dir) + 512];
+  int listed = 0;
+  int ret = 0;
+  FILE *list;
+  int i;
+
+  snprintf(dir, sizeof(dir), "%s/%s", target, BACKUP_BINLOG_REPLAY_DIR);
+  snprintf(path, sizeof(path), "%s/%s", dir, BACKUP_BINLOG_REPLAY_LIST);
+  if (create_directory(dir) != 0 || !(list = fopen(path, "w"))) {
+    return 1;
+  }
+  for (i = first; ret == 0 && i <= last; i++) {
+    const BinlogSegment *segment = &archive->segments[i];
+    FrameReader reader;
+    BinlogScan scan;
+    unsigned int crc = 0;
+    long long size = 0;
+    long long from, to;
+    int frame;
+    int out;
+
+    snprintf(path, sizeof(path), "%s/%s%s", archive_dir, segment->name, BACKUP_COMPRESSED_SUFFIX);
+    if (frame_reader_open(&reader, path) != 0) {
+      ret = 1;
+      break;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, segment->name);
+    out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    ret = out < 0;
+    binlog_scan_init(&scan, start_time, stop_time);
+    for (frame = 0; ret == 0 && frame < reader.frame_count; frame++) {
+      unsigned int length = reader.raw_lengths[frame];
+
+      ret = frame_reader_load(&reader, frame) != 0 || write_all(out, reader.raw, length) != 0;
+      if (ret == 0) {
+        binlog_scan_feed(&scan, reader.raw, size, length);
+        crc = crc32c(crc, reader.raw, length);
+        size += length;
+      }
+    }
+    frame_reader_close(&reader);
+    if (size != segment->size || crc != segment->crc || scan.malformed) {
+      ret = 1;
+    }
+
+    /* Later binlogs are replayed from their start, all of them up to the first transaction after the target */
+    from = listed ? 4 : scan.start;
+    to = scan.stop >= 0 ? scan.stop : size;
+    if (ret == 0 && (from < 0 || to <= from)) {
+      unlink(path);
+    } else if (ret == 0) {
+      ret = ftruncate(out, to) != 0 || fprintf(list, "%s\t%lld\t%lld\n", segment->name, from, to) < 0;
+      listed++;
+    }
+    if (out >= 0 && close(out) != 0) {
+      ret = 1;
+    }
+    if (scan.stop >= 0) {
+      break;
+    }
+  }
+  if (fclose(list) != 0) {
+    ret = 1;
+  }
+  return ret;
+}
+
+/**
+  @brief Queue a path for an unlink run.
+
+  @param [in,out] run  Unlink run.
+  @param [in]     path Path.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int unlink_run_add(UnlinkRun *run, const char *path) {
+  char *copy;
+
+  if (run->count == run->size) {
+    long long size = run->size ? run->size * 2 : 1024;
+    char **paths = (char **)realloc(run->paths, size * sizeof(char *));
+    if (!paths) {
+      return 1;
+    }
+    run->paths = paths;
+    run->size = size;
+  }
+  copy = strdup(path);
+  if (!copy) {
+    return 1;
+  }
+  run->paths[run->count++] = copy;
+  return 0;
+}
+
+/**
+  @brief Free an unlink run.
+
+  @param [in] run Unlink run.
+*/
+static void unlink_run_free(UnlinkRun *run) {
+  long long i;
+
+  for (i = 0; i < run->count; i++) {
+    free(run->paths[i]);
+  }
+  free(run->paths);
+  memset(run, 0, sizeof(*run));
+}
+
+/**
+  @brief Unlink worker: remove claimed paths until none are left.
+
+  @param [in] arg Unlink run.
+*/
+static void *unlink_worker(void *arg) {
+  UnlinkRun *run = (UnlinkRun *)arg;
+
+  for (;;) {
+    long long index = __sync_fetch_and_add(&run->next, 1);
+
+    if (index >= run->count) {
+      break;
+    }
+    if (unlinkat(AT_FDCWD, run->paths[index], 0) != 0 && errno != ENOENT) {
+      __sync_fetch_and_add(&run->failed, 1);
+    }
+  }
+  return NULL;
+}
+
+/**
+  @brief Unlink every path of a run in parallel.
+
+  Removing files is dominated by metadata updates, which filesystems
+  spread over allocation groups and devices handle concurrently.
+
+  @param [in,out] run          Unlink run.
+  @param [in]     thread_count Threads.
+
+  @retval 0 success, 1 failure.
+*/
+static int unlink_run_execute(UnlinkRun *run, int thread_count) {
+  pthread_t threads[BACKUP_MAX_THREADS];
+  int started;
+  int i;
+
+  if (run->count == 0) {
+    return 0;
+  }
+  if (thread_count > run->count) {
+    thread_count = (int)run->count;
+  }
+  started = pipeline_start_stage(threads, thread_count, unlink_worker, run);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (started == 0) {
+    unlink_worker(run);
+  }
+  return run->failed > 0;
+}
+
+/**
+  @brief List the files and directories of a tree, directories after their contents.
+
+  @param [in]     path  Tree root.
+  @param [in,out] files Files found.
+  @param [in,out] dirs  Directories found, root last.
+
+  @retval 0 success, 1 failure.
+*/
+static int remove_tree_collect(const char *path, UnlinkRun *files, UnlinkRun *dirs) {
+  struct dirent *entry;
+  DIR *dir = opendir(path);
+  int ret = 0;
+
+  if (!dir) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    char child[4096];
+    struct stat st;
+    int is_dir;
+
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child)) {
+      ret = 1;
+      break;
+    }
+    is_dir = entry->d_type == DT_DIR ||
+             (entry->d_type == DT_UNKNOWN && lstat(child, &st) == 0 && S_ISDIR(st.st_mode));
+    ret = is_dir ? remove_tree_collect(child, files, dirs) : unlink_run_add(files, child);
+  }
+  closedir(dir);
+  return ret == 0 ? unlink_run_add(dirs, path) : 1;
+}
+
+/**
+  @brief Remove a directory tree, unlinking its files in parallel.
+
+  @param [in] path         Tree root.
+  @param [in] thread_count Unlink threads.
+
+  @retval 0 success, 1 failure.
+*/
+static int remove_tree(const char *path, int thread_count) {
+  UnlinkRun files;
+  UnlinkRun dirs;
+  long long i;
+  int ret;
+
+  memset(&files, 0, sizeof(files));
+  memset(&dirs, 0, sizeof(dirs));
+  ret = remove_tree_collect(path, &files, &dirs);
+  if (ret == 0) {
+    ret = unlink_run_execute(&files, thread_count);
+  }
+  for (i = 0; ret == 0 && i < dirs.count; i++) {
+    if (unlinkat(AT_FDCWD, dirs.paths[i], AT_REMOVEDIR) != 0 && errno != ENOENT) {
+      ret = 1;
+    }
+  }
+  unlink_run_free(&files);
+  unlink_run_free(&dirs);
+  return ret;
+}
+
+/**
+  @brief Order chunk hashes.
+*/
+static int hash_compare(const void *a, const void *b) {
+  return memcmp(a, b, SHA256_DIGEST_LENGTH);
+}
+
+/**
+  @brief Remove the chunks that no backup references any more.
+
+  References are counted over every chunk manifest in the backup
+  directory, interrupted backups that may still resume included; chunks
+  with none, and temporary files of interrupted writes, are unlinked in
+  parallel.  Deduplicated backups hold the chunk store lock shared while
+  they run, so a pass that finds the store busy leaves it for the next
+  cleanup.  Results are appended to cleanup.log.
+
+  @param [in] backup_dir   Backup directory.
+  @param [in] thread_count Unlink threads.
+
+  @retval 0 success or store busy, 1 failure.
+*/
+static int chunk_collect(const char *backup_dir, int thread_count) {
+  unsigned char *refs = NULL;
+  long long ref_count = 0;
+  long long ref_size = 0;
+  long long unique = 0;
+  long long freed = 0;
+  long long i;
+  struct dirent *entry;
+  char path[4096];
+  UnlinkRun run;
+  FILE *log;
+  DIR *dir;
+  int lock;
+  int ret = 0;
+
+  memset(&run, 0, sizeof(run));
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CLEANUP_LOG);
+  log = fopen(path, "a");
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CHUNK_LOCK);
+  lock = open(path, O_WRONLY | O_CREAT, 0640);
+  if (lock < 0 || flock(lock, LOCK_EX | LOCK_NB) != 0) {
+    if (log) {
+      fprintf(log, "%ld gc skipped: chunk store in use\n", (long)time(NULL));
+      fclose(log);
+    }
+    if (lock >= 0) {
+      close(lock);
+    }
+    return lock < 0;
+  }
+
+  dir = opendir(backup_dir);
+  ret = dir ? 0 : 1;
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    char line[8192];
+    FILE *fp;
+
+    /* Trash is never resumed */
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", backup_dir, entry->d_name, BACKUP_CHUNK_MANIFEST);
+    fp = fopen(path, "r");
+    if (!fp) {
+      /* A manifest that exists but cannot be read could hide live chunks */
+      ret = errno != ENOENT && errno != ENOTDIR;
+      continue;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), fp)) {
+      if (line[0] != 'C' || line[1] != ' ') {
+        continue;
+      }
+      if (ref_count == ref_size) {
+        long long size = ref_size ? ref_size * 2 : 65536;
+        unsigned char *grown = (unsigned char *)realloc(refs, (size_t)size * SHA256_DIGEST_LENGTH);
+        if (!grown) {
+          ret = 1;
+          break;
+        }
+        refs = grown;
+        ref_size = size;
+      }
+      ret = hash_parse(line + 2, refs + ref_count * SHA256_DIGEST_LENGTH);
+      ref_count++;
+    }
+    fclose(fp);
+  }
+  if (dir) {
+    closedir(dir);
+  }
+  if (ret == 0 && ref_count > 0) {
+    qsort(refs, (size_t)ref_count, SHA256_DIGEST_LENGTH, hash_compare);
+    for (i = 0; i < ref_count; i++) {
+      if (i == 0 || memcmp(refs + i * SHA256_DIGEST_LENGTH, refs + (i - 1) * SHA256_DIGEST_LENGTH,
+                           SHA256_DIGEST_LENGTH) != 0) {
+        memmove(refs + unique * SHA256_DIGEST_LENGTH, refs + i * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+        unique++;
+      }
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CHUNK_DIR);
+  dir = ret == 0 ? opendir(path) : NULL;
+  while (dir && ret == 0 && (entry = readdir(dir)) != NULL) {
+    struct dirent *chunk;
+    char sub[4096];
+    DIR *chunks;
+
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(sub, sizeof(sub), "%s/%s/%s", backup_dir, BACKUP_CHUNK_DIR, entry->d_name);
+    chunks = opendir(sub);
+    while (chunks && ret == 0 && (chunk = readdir(chunks)) != NULL) {
+      unsigned char hash[SHA256_DIGEST_LENGTH];
+      char file[sizeof(sub) + 256];
+      struct stat st;
+
+      if (chunk->d_name[0] == '.') {
+        continue;
+      }
+      if (strlen(chunk->d_name) == 2 * SHA256_DIGEST_LENGTH && hash_parse(chunk->d_name, hash) == 0 && unique > 0 &&
+          bsearch(hash, refs, (size_t)unique, SHA256_DIGEST_LENGTH, hash_compare)) {
+        continue;
+      }
+      snprintf(file, sizeof(file), "%s/%s", sub, chunk->d_name);
+      if (stat(file, &st) == 0) {
+        freed += (long long)st.st_size;
+      }
+      ret = unlink_run_add(&run, file);
+    }
+    if (chunks) {
+      closedir(chunks);
+    }
+  }
+  if (dir) {
+    closedir(dir);
+  }
+  if (ret == 0) {
+    ret = unlink_run_execute(&run, thread_count);
+  }
+  if (log) {
+    fprintf(log, "%ld gc references %lld chunks %lld removed %lld freed %lld %s\n", (long)time(NULL), ref_count,
+            unique, run.count, freed, ret == 0 ? "ok" : "failed");
+    fclose(log);
+  }
+  unlink_run_free(&run);
+  free(refs);
+  close(lock);
+  return ret;
+}
+
+/**
+  @brief Background chunk collection.
+
+  @param [in] arg Collector.
+*/
+static void *chunk_collector_main(void *arg) {
+  ChunkCollector *collector = (ChunkCollector *)arg;
+
+  chunk_collect(collector->backup_dir, collector->threads);
+  return NULL;
+}
+
+/**
+  @brief Wait for a running chunk collection to finish.
+
+  @param [in] backup_ctx Backup context.
+*/
+static void chunk_collector_wait(BackupContext *backup_ctx) {
+  ChunkCollector *collector = backup_ctx->collector;
+
+  if (!collector) {
+    return;
+  }
+  pthread_join(collector->thread, NULL);
+  free(collector->backup_dir);
+  free(collector);
+  backup_ctx->collector = NULL;
+}
+
+/**
+  @brief Collect unreferenced chunks in the background.
+
+  @param [in] backup_ctx   Backup context.
+  @param [in] backup_dir   Backup directory.
+  @param [in] thread_count Unlink threads.
+
+  @retval 0 success, 1 failure.
+*/
+static int chunk_collector_start(BackupContext *backup_ctx, const char *backup_dir, int thread_count) {
+  ChunkCollector *collector;
+
+  chunk_collector_wait(backup_ctx);
+  collector = (ChunkCollector *)calloc(1, sizeof(ChunkCollector));
+  if (!collector) {
+    return 1;
+  }
+  collector->backup_dir = strdup(backup_dir);
+  collector->threads = thread_count;
+  if (!collector->backup_dir || pthread_create(&collector->thread, NULL, chunk_collector_main, collector) != 0) {
+    free(collector->backup_dir);
+    free(collector);
+    return 1;
+  }
+  backup_ctx->collector = collector;
+  return 0;
+}
+
+/**
+  @brief Index of the parent of a catalog entry.
+
+  @param [in] catalog Catalog.
+  @param [in] index   Entry.
+
+  @retval Index, or -1 for a full backup or a parent not in the catalog.
+*/
+static int catalog_parent(const Catalog *catalog, int index) {
+  const CatalogEntry *parent =
+      catalog->entries[index].parent ? catalog_find(catalog, catalog->entries[index].parent) : NULL;
+
+  return parent ? (int)(parent - catalog->entries) : -1;
+}
+
+/**
+  @brief Pick the backups the retention policy keeps.
+
+  The policies select the newest retain_fulls full backups with every
+  incremental built on them, the backups younger than retain_days, and
+  the newest backup of each of the last retain_monthly months; the
+  newest completed backup is always selected.  Every backup a selected
+  one depends on is kept as well, so no kept incremental loses its chain.
+
+  @param [in]  backup_ctx Backup context.
+  @param [in]  catalog    Backups, oldest first.
+  @param [in]  now        Current time.
+  @param [out] keep       Nonzero for each kept backup.
+
+  @retval 1 a policy is set, 0 none is and nothing was picked.
+*/
+static int retention_select(const BackupContext *backup_ctx, const Catalog *catalog, long long now, char *keep) {
+  int newest = 0;
+  int fulls = 0;
+  int months = 0;
+  int last_month = -1;
+  int depth;
+  int i, j;
+
+  memset(keep, 0, (size_t)catalog->count);
+  if (!backup_ctx->retain_fulls && !backup_ctx->retain_days && !backup_ctx->retain_monthly) {
+    return 0;
+  }
+  for (i = catalog->count - 1; i >= 0; i--) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    time_t when = (time_t)entry->backup_time;
+    struct tm tm;
+
+    if (strcmp(entry->status, "completed") != 0) {
+      continue;
+    }
+    if (!newest) {
+      keep[i] = 1;
+      newest = 1;
+    }
+    if (entry->level == BACKUP_LEVEL_FULL && fulls < backup_ctx->retain_fulls) {
+      /* Chain root: the incrementals built on it are kept below */
+      keep[i] |= 2;
+      fulls++;
+    }
+    if (backup_ctx->retain_days && entry->backup_time >= now - (long long)backup_ctx->retain_days * 86400) {
+      keep[i] |= 1;
+    }
+    if (months < backup_ctx->retain_monthly && localtime_r(&when, &tm) && tm.tm_year * 12 + tm.tm_mon != last_month) {
+      /* Newest first, so the first backup seen in a month is its newest */
+      keep[i] |= 1;
+      last_month = tm.tm_year * 12 + tm.tm_mon;
+      months++;
+    }
+  }
+  for (i = 0; i < catalog->count; i++) {
+    for (j = i, depth = 0; j >= 0 && depth < BACKUP_MAX_CHAIN; j = catalog_parent(catalog, j), depth++) {
+      if (keep[j] & 2) {
+        keep[i] |= 1;
+        break;
+      }
+    }
+  }
+  for (i = 0; i < catalog->count; i++) {
+    if (!(keep[i] & 1)) {
+      continue;
+    }
+    for (j = catalog_parent(catalog, i), depth = 0; j >= 0 && depth < BACKUP_MAX_CHAIN;
+         j = catalog_parent(catalog, j), depth++) {
+      keep[j] |= 1;
+    }
+  }
+  return 1;
+}
+
+/**
+  @brief Free a dirty set.
+
+  @param [in] set Dirty set.
+*/
+static void dirty_set_free(DirtySet *set) {
+  int i;
+
+  for (i = 0; i < set->count; i++) {
+    free(set->paths[i]);
+  }
+  free(set->paths);
+  memset(set, 0, sizeof(*set));
+}
+
+/**
+  @brief Find a path in a dirty set.
+
+  @param [in]  set   Dirty set.
+  @param [in]  path  Path.
+  @param [out] found 1 if the path is in the set.
+
+  @retval Index of the path, or where it would be inserted.
+*/
+static int dirty_set_search(const DirtySet *set, const char *path, int *found) {
+  int low = 0;
+  int high = set->count - 1;
+
+  *found = 0;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    int cmp = strcmp(set->paths[mid], path);
+    if (cmp == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (cmp < 0) {
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return low;
+}
+
+/**
+  @brief Add a path to a dirty set.
+
+  @param [in,out] set  Dirty set.
+  @param [in]     path Path; a directory ends in '/'.
+
+  @retval 0 success, 1 out of memory or a path the state file cannot hold.
+*/
+static int dirty_set_add(DirtySet *set, const char *path) {
+  int found;
+  int at = dirty_set_search(set, path, &found);
+  char *copy;
+
+  if (found) {
+    return 0;
+  }
+  if (strchr(path, '\n')) {
+    return 1;
+  }
+  if (set->count == set->size) {
+    int size = set->size ? set->size * 2 : 64;
+    char **grown = (char **)realloc(set->paths, size * sizeof(char *));
+    if (!grown) {
+      return 1;
+    }
+    set->paths = grown;
+    set->size = size;
+  }
+  copy = strdup(path);
+  if (!copy) {
+    return 1;
+  }
+  memmove(&set->paths[at + 1], &set->paths[at], (set->count - at) * sizeof(char *));
+  set->paths[at] = copy;
+  set->count++;
+  return 0;
+}
+
+/**
+  @brief Move the paths of one dirty set into another.
+
+  @param [in,out] into Receiving set.
+  @param [in,out] from Set emptied.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int dirty_set_merge(DirtySet *into, DirtySet *from) {
+  int ret = 0;
+  int i;
+
+  for (i = 0; ret == 0 && i < from->count; i++) {
+    ret = dirty_set_add(into, from->paths[i]);
+  }
+  dirty_set_free(from);
+  return ret;
+}
+
+/**
+  @brief Check whether a path, or a directory above it, is dirty.
+
+  @param [in] set  Dirty set.
+  @param [in] path Relative path; a directory ends in '/'.
+  @param [in] self 0 to check only the directories above the path.
+
+  @retval 1 dirty, 0 not.
+*/
+static int dirty_set_covers(const DirtySet *set, const char *path, int self) {
+  char prefix[4096];
+  size_t length = strlen(path);
+  size_t i;
+  int found = 0;
+
+  if (set->count == 0) {
+    return 0;
+  }
+  if (self) {
+    dirty_set_search(set, path, &found);
+  }
+  for (i = 0; !found && i + 1 < length && i + 1 < sizeof(prefix); i++) {
+    prefix[i] = path[i];
+    if (path[i] == '/') {
+      prefix[i + 1] = '\0';
+      dirty_set_search(set, prefix, &found);
+    }
+  }
+  return found;
+}
+
+/**
+  @brief Watch a directory and every directory below it.
+
+  The watch is added before the directory is read, so a later change is
+  reported and an earlier one is visible to the read.  With a dirty set,
+  regular files missing from the base page map or differing from it in
+  size or mtime are added to the set, and the base entries found are
+  flagged.
+
+  @param [in,out] tracker Tracker.
+  @param [in]     rel     Directory relative to the data directory, "" for itself.
+  @param [in]     base    Page map of the base backup, or NULL.
+  @param [in,out] seen    Flag per base entry, or NULL.
+  @param [in,out] dirty   Set receiving changed files, or NULL.
+
+  @retval 0 success, 1 a directory could not be watched or read.
+*/
+static int dirty_tracker_watch(DirtyTracker *tracker, const char *rel, const PageMap *base, char *seen,
+                               DirtySet *dirty) {
+  char path[4096];
+  struct dirent *entry;
+  DIR *dir;
+  int ret = 0;
+  int wd;
+
+  snprintf(path, sizeof(path), "%s%s%s", tracker->datadir, *rel ? "/" : "", rel);
+  wd = inotify_add_watch(tracker->notify, path, BACKUP_DIRTY_EVENTS | IN_ONLYDIR);
+  if (wd < 0) {
+    return 1;
+  }
+  if (wd >= tracker->watch_size) {
+    int size = wd + 1 > tracker->watch_size * 2 ? wd + 1 : tracker->watch_size * 2;
+    char **grown = (char **)realloc(tracker->watches, size * sizeof(char *));
+    if (!grown) {
+      return 1;
+    }
+    memset(&grown[tracker->watch_size], 0, (size - tracker->watch_size) * sizeof(char *));
+    tracker->watches = grown;
+    tracker->watch_size = size;
+  }
+  /* A directory moved inside the data directory keeps its descriptor and takes the new path */
+  free(tracker->watches[wd]);
+  tracker->watches[wd] = strdup(rel);
+  dir = tracker->watches[wd] ? opendir(path) : NULL;
+  if (!dir) {
+    return 1;
+  }
+
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    char child[4096];
+    char full[4096];
+    struct stat st;
+
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "", entry->d_name) >= (int)sizeof(child) ||
+        snprintf(full, sizeof(full), "%s/%s", tracker->datadir, child) >= (int)sizeof(full)) {
+      ret = 1;
+      break;
+    }
+    if (lstat(full, &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      ret = dirty_tracker_watch(tracker, child, base, seen, dirty);
+    } else if (S_ISREG(st.st_mode) && dirty) {
+      const PageMapFile *known = base ? page_map_find(base, child) : NULL;
+
+      if (known) {
+        seen[known - base->files] = 1;
+      }
+      if (!known || known->size != (long long)st.st_size ||
+          known->mtime != (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec) {
+        ret = dirty_set_add(dirty, child);
+      }
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+/**
+  @brief Add the data files this process holds open for writing.
+
+  Writes through native AIO (InnoDB's default on Linux) raise no inotify
+  event; only their file's close does, as IN_CLOSE_WRITE.  A data file
+  open for writing therefore counts as dirty whenever a set is cut.
+
+  @param [in]     tracker Tracker.
+  @param [in,out] set     Dirty set.
+
+  @retval 0 success, 1 the descriptors could not be listed.
+*/
+static int dirty_tracker_open_files(const DirtyTracker *tracker, DirtySet *set) {
+  size_t length = strlen(tracker->real_datadir);
+  struct dirent *entry;
+  DIR *dir = opendir("/proc/self/fd");
+  int ret = 0;
+
+  if (!dir) {
+    return 1;
+  }
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    char link[sizeof(entry->d_name) + 16];
+    char target[4096];
+    ssize_t n;
+    int flags;
+
+    if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+      continue;
+    }
+    flags = fcntl(atoi(entry->d_name), F_GETFL);
+    if (flags < 0 || (flags & O_ACCMODE) == O_RDONLY) {
+      continue;
+    }
+    snprintf(link, sizeof(link), "/proc/self/fd/%s", entry->d_name);
+    n = readlink(link, target, sizeof(target) - 1);
+    if (n <= (ssize_t)length) {
+      continue;
+    }
+    target[n] = '\0';
+    if (strncmp(target, tracker->real_datadir, length) == 0 && target[length] == '/') {
+      ret = dirty_set_add(set, target + length + 1);
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+/**
+  @brief Save the tracker state: the base backup, then one dirty path per line.
+
+  While a backup runs, its taken set is saved too: the base only moves
+  once the backup completes.  After lost events no base is saved.
+
+  @param [in,out] tracker Tracker, mutex held.
+
+  @retval 0 success, 1 failure.
+*/
+static int dirty_tracker_save(DirtyTracker *tracker) {
+  char path[4096];
+  char temp[sizeof(path) + 8];
+  FILE *fp;
+  int ret = 0;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/%s", tracker->backup_dir, BACKUP_DIRTY_FILE);
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  fp = fopen(temp, "w");
+  if (!fp) {
+    return 1;
+  }
+  ret |= fprintf(fp, "base %s\n", tracker->lost ? "" : tracker->base) < 0;
+  for (i = 0; i < tracker->dirty.count; i++) {
+    ret |= fprintf(fp, "%s\n", tracker->dirty.paths[i]) < 0;
+  }
+  for (i = 0; i < tracker->taken.count; i++) {
+    ret |= fprintf(fp, "%s\n", tracker->taken.paths[i]) < 0;
+  }
+  if (fclose(fp) != 0 || ret != 0 || rename(temp, path) != 0) {
+    unlink(temp);
+    return 1;
+  }
+  tracker->saved = 1;
+  return 0;
+}
+
+/**
+  @brief Load the state a previous tracker saved.
+
+  @param [in,out] tracker Tracker with empty sets.
+
+  @retval 0 success, 1 no usable state.
+*/
+static int dirty_tracker_load(DirtyTracker *tracker) {
+  char line[4096];
+  FILE *fp;
+  int ret = 0;
+
+  if (snprintf(line, sizeof(line), "%s/%s", tracker->backup_dir, BACKUP_DIRTY_FILE) >= (int)sizeof(line)) {
+    return 1;
+  }
+  fp = fopen(line, "r");
+  if (!fp) {
+    return 1;
+  }
+  if (!fgets(line, sizeof(line), fp) || strncmp(line, "base ", 5) != 0) {
+    fclose(fp);
+    return 1;
+  }
+  line[strcspn(line, "\n")] = '\0';
+  if (snprintf(tracker->base, sizeof(tracker->base), "%s", line + 5) >= (int)sizeof(tracker->base)) {
+    fclose(fp);
+    return 1;
+  }
+  while (ret == 0 && fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0]) {
+      ret = dirty_set_add(&tracker->dirty, line);
+    }
+  }
+  fclose(fp);
+  return ret;
+}
+
+/**
+  @brief Mark what one inotify event names as dirty.
+
+  A directory created or moved in is watched at once; files created in
+  it before the watch are covered by marking the whole directory.
+
+  @param [in,out] tracker Tracker, mutex held.
+  @param [in]     event   Event.
+*/
+static void dirty_tracker_event(DirtyTracker *tracker, const struct inotify_event *event) {
+  const char *dir = event->wd >= 0 && event->wd < tracker->watch_size ? tracker->watches[event->wd] : NULL;
+  char path[4096];
+  size_t length;
+
+  tracker->saved = 0;
+  if (event->mask & IN_Q_OVERFLOW) {
+    tracker->lost = 1;
+    return;
+  }
+  if (event->mask & IN_IGNORED) {
+    /* The directory is gone; its removal was reported to its parent */
+    if (dir) {
+      free(tracker->watches[event->wd]);
+      tracker->watches[event->wd] = NULL;
+    }
+    return;
+  }
+  if (!dir || !event->len) {
+    return;
+  }
+  length = (size_t)snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "", event->name);
+  if (length + 1 >= sizeof(path)) {
+    tracker->lost = 1;
+    return;
+  }
+  if (event->mask & IN_ISDIR) {
+    struct stat st;
+    char full[sizeof(path) + 1024];
+
+    if (!(event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+      return;
+    }
+    snprintf(full, sizeof(full), "%s/%s", tracker->datadir, path);
+    if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && dirty_tracker_watch(tracker, path, NULL, NULL, NULL) != 0 &&
+        lstat(full, &st) == 0) {
+      tracker->lost = 1;
+    }
+    path[length] = '/';
+    path[length + 1] = '\0';
+  }
+  if (dirty_set_add(&tracker->dirty, path) != 0) {
+    tracker->lost = 1;
+  }
+}
+
+/**
+  @brief Tracker thread.
+
+  Starts from the saved state: every directory is watched, and files
+  that differ from the page map of the saved base backup or are open for
+  writing join the saved set.  Events then mark the files they name; the
+  state is saved at most every BACKUP_DIRTY_INTERVAL ms while it changes,
+  and once more on stop.
+
+  @param [in] arg Tracker.
+*/
+static void *dirty_tracker_main(void *arg) {
+  DirtyTracker *tracker = (DirtyTracker *)arg;
+  DirtySet found = {NULL, 0, 0};
+  PageMap base = {NULL, 0, 0};
+  char events[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char path[4096];
+  char *seen;
+  long long saved_at = 0;
+  int lost;
+  int stop;
+  int i;
+
+  /* Backups leave the sets alone until the tracker is ready */
+  if (dirty_tracker_load(tracker) != 0) {
+    tracker->base[0] = '\0';
+    dirty_set_free(&tracker->dirty);
+  }
+  snprintf(path, sizeof(path), "%s/%s/%s", tracker->backup_dir, tracker->base, BACKUP_PAGE_MAP_FILE);
+  if (tracker->base[0] && page_map_load(path, &base) != 0) {
+    tracker->base[0] = '\0';
+  }
+  seen = (char *)calloc(base.count + 1, 1);
+  lost = !seen ||
+         dirty_tracker_watch(tracker, "", tracker->base[0] ? &base : NULL, seen, tracker->base[0] ? &found : NULL);
+  for (i = 0; !lost && tracker->base[0] && i < base.count; i++) {
+    /* Removed since the base backup */
+    if (!seen[i]) {
+      lost = dirty_set_add(&found, base.files[i].path);
+    }
+  }
+  lost = lost || dirty_tracker_open_files(tracker, &found) != 0;
+  free(seen);
+  page_map_free(&base);
+
+  pthread_mutex_lock(&tracker->mutex);
+  if (dirty_set_merge(&tracker->dirty, &found) != 0 || lost) {
+    tracker->lost = 1;
+  }
+  tracker->ready = 1;
+  tracker->saved = 0;
+  pthread_mutex_unlock(&tracker->mutex);
+
+  do {
+    struct pollfd fds[2];
+    long long now;
+    ssize_t n;
+
+    fds[0].fd = tracker->notify;
+    fds[0].events = POLLIN;
+    fds[1].fd = tracker->wake[0];
+    fds[1].events = POLLIN;
+    poll(fds, 2, BACKUP_DIRTY_INTERVAL);
+    pthread_mutex_lock(&tracker->mutex);
+    stop = tracker->stop;
+    while ((n = read(tracker->notify, events, sizeof(events))) > 0) {
+      const char *event = events;
+
+      while (event < events + n) {
+        dirty_tracker_event(tracker, (const struct inotify_event *)event);
+        event += sizeof(struct inotify_event) + ((const struct inotify_event *)event)->len;
+      }
+    }
+    now = clock_ns();
+    if (!tracker->saved && (stop || now - saved_at >= BACKUP_DIRTY_INTERVAL * 1000000LL)) {
+      dirty_tracker_save(tracker);
+      saved_at = now;
+    }
+    pthread_mutex_unlock(&tracker->mutex);
+  } while (!stop);
+  return NULL;
+}
+
+/**
+  @brief Free a tracker whose thread is not running.
+
+  @param [in] tracker Tracker.
+*/
+static void dirty_tracker_free(DirtyTracker *tracker) {
+  int i;
+
+  for (i = 0; i < tracker->watch_size; i++) {
+    free(tracker->watches[i]);
+  }
+  free(tracker->watches);
+  dirty_set_free(&tracker->dirty);
+  dirty_set_free(&tracker->taken);
+  if (tracker->notify >= 0) {
+    close(tracker->notify);
+  }
+  if (tracker->wake[0] >= 0) {
+    close(tracker->wake[0]);
+    close(tracker->wake[1]);
+  }
+  free(tracker->datadir);
+  free(tracker->real_datadir);
+  free(tracker->backup_dir);
+  free(tracker);
+}
+
+/**
+  @brief Start tracking the files written in the data directory.
+
+  The state lives in <backup_dir>/dirty, so a tracker restarted later
+  resumes from it after checking the data directory once.
+
+  @param [in] backup_ctx Backup context.
+
+  @retval 0 success, 1 failure.
+*/
+static int dirty_tracker_start(BackupContext *backup_ctx) {
+  DirtyTracker *tracker;
+
+  if (backup_ctx->tracker) {
+    return 0;
+  }
+  if (!backup_ctx->backup_dir) {
+    return 1;
+  }
+  tracker = (DirtyTracker *)calloc(1, sizeof(DirtyTracker));
+  if (!tracker) {
+    return 1;
+  }
+  tracker->notify = -1;
+  tracker->wake[0] = tracker->wake[1] = -1;
+  tracker->datadir = strdup(backup_ctx->datadir);
+  tracker->real_datadir = realpath(backup_ctx->datadir, NULL);
+  tracker->backup_dir = strdup(backup_ctx->backup_dir);
+  if (!tracker->datadir || !tracker->real_datadir || !tracker->backup_dir ||
+      (tracker->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 || pipe2(tracker->wake, O_CLOEXEC) != 0) {
+    dirty_tracker_free(tracker);
+    return 1;
+  }
+  pthread_mutex_init(&tracker->mutex, NULL);
+  if (pthread_create(&tracker->thread, NULL, dirty_tracker_main, tracker) != 0) {
+    pthread_mutex_destroy(&tracker->mutex);
+    dirty_tracker_free(tracker);
+    return 1;
+  }
+  backup_ctx->tracker = tracker;
+  return 0;
+}
+
+/**
+  @brief Stop the tracker after saving its state.
+
+  @param [in] backup_ctx Backup context.
+*/
+static void dirty_tracker_stop(BackupContext *backup_ctx) {
+  DirtyTracker *tracker = backup_ctx->tracker;
+
+  if (!tracker) {
+    return;
+  }
+  pthread_mutex_lock(&tracker->mutex);
+  tracker->stop = 1;
+  pthread_mutex_unlock(&tracker->mutex);
+  if (write(tracker->wake[1], "", 1) < 0) {
+    /* The thread still sees the flag within BACKUP_DIRTY_INTERVAL */
+  }
+  pthread_join(tracker->thread, NULL);
+  pthread_mutex_destroy(&tracker->mutex);
+  dirty_tracker_free(tracker);
+  backup_ctx->tracker = NULL;
+}
+
+/**
+  @brief Hand the dirty set to a starting backup and begin a new one.
+
+  Called before the backup lists any file, so every later change lands
+  in the new set.  Files open for writing go to both sets.  The taken
+  set is only usable when it is relative to the backup's parent and no
+  event was lost since.
+
+  @param [in] backup_ctx Backup context.
+  @param [in] parent     Parent backup, "" for a full backup.
+
+  @retval 1 the taken set lists every file changed since the parent, 0 the data directory must be walked.
+*/
+static int dirty_tracker_cut(BackupContext *backup_ctx, const char *parent) {
+  DirtyTracker *tracker = backup_ctx->tracker;
+  DirtySet open_files = {NULL, 0, 0};
+  int usable;
+  int lost;
+  int i;
+
+  if (!tracker || strcmp(tracker->datadir, backup_ctx->datadir) != 0 ||
+      strcmp(tracker->backup_dir, backup_ctx->backup_dir) != 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&tracker->mutex);
+  if (!tracker->ready) {
+    pthread_mutex_unlock(&tracker->mutex);
+    return 0;
+  }
+  lost = dirty_tracker_open_files(tracker, &open_files) != 0;
+  if (tracker->pending[0] && dirty_set_merge(&tracker->dirty, &tracker->taken) != 0) {
+    tracker->lost = 1;
+  }
+  usable = !lost && !tracker->lost && parent[0] && strcmp(tracker->base, parent) == 0;
+  dirty_set_free(&tracker->taken);
+  tracker->taken = tracker->dirty;
+  memset(&tracker->dirty, 0, sizeof(tracker->dirty));
+  for (i = 0; i < open_files.count; i++) {
+    if (dirty_set_add(&tracker->taken, open_files.paths[i]) != 0) {
+      usable = 0;
+    }
+  }
+  tracker->lost = dirty_set_merge(&tracker->dirty, &open_files) != 0 || lost;
+  snprintf(tracker->pending, sizeof(tracker->pending), "%s", backup_ctx->backup_name);
+  tracker->saved = 0;
+  pthread_mutex_unlock(&tracker->mutex);
+  return usable;
+}
+
+/**
+  @brief Settle the taken set once the backup ends.
+
+  A completed backup becomes the base of the new set; after a failure
+  the taken set goes back, still relative to the old base.
+
+  @param [in] backup_ctx Backup context.
+  @param [in] completed  1 if the backup completed.
+*/
+static void dirty_tracker_finish(BackupContext *backup_ctx, int completed) {
+  DirtyTracker *tracker = backup_ctx->tracker;
+
+  if (!tracker) {
+    return;
+  }
+  pthread_mutex_lock(&tracker->mutex);
+  if (tracker->pending[0]) {
+    if (completed) {
+      snprintf(tracker->base, sizeof(tracker->base), "%s", tracker->pending);
+      dirty_set_free(&tracker->taken);
+    } else if (dirty_set_merge(&tracker->dirty, &tracker->taken) != 0) {
+      tracker->lost = 1;
+    }
+    tracker->pending[0] = '\0';
+    tracker->saved = 0;
+  }
+  pthread_mutex_unlock(&tracker->mutex);
+}
+
+/**
+  @brief List the data files from the parent page map and a dirty set.
+
+  Files outside the set are unchanged since the parent listed them and
+  keep its size and mtime without a stat.  Dirty files are looked up
+  again and dirty directories walked, so the data directory is never
+  read as a whole.
+
+  @param [in]  datadir    Data directory.
+  @param [in]  parent_map Page map of the parent backup.
+  @param [in]  dirty      Files changed since the parent.
+  @param [out] list       File list, sorted.
+
+  @retval 0 success, 1 failure.
+*/
+static int dirty_file_list(const char *datadir, const PageMap *parent_map, const DirtySet *dirty,
+                           BackupFileList *list) {
+  int ret = 0;
+  int i;
+
+  for (i = 0; ret == 0 && i < dirty->count; i++) {
+    const char *path = dirty->paths[i];
+    int length = (int)strlen(path);
+    int is_dir = path[length - 1] == '/';
+    char rel[4096];
+    char full[sizeof(rel) + 4096];
+    struct stat st;
+
+    /* Listed with a dirty directory above it */
+    if (dirty_set_covers(dirty, path, 0)) {
+      continue;
+    }
+    snprintf(rel, sizeof(rel), "%.*s", is_dir ? length - 1 : length, path);
+    snprintf(full, sizeof(full), "%s/%s", datadir, rel);
+    if (lstat(full, &st) != 0) {
+      continue;
+    }
+    if (is_dir && S_ISDIR(st.st_mode)) {
+      ret = file_list_collect(datadir, rel, list);
+    } else if (!is_dir && S_ISREG(st.st_mode)) {
+      ret = file_list_add(list, rel, (long long)st.st_size,
+                          (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, st.st_mode & 07777);
     }
-    p++;
   }
+  for (i = 0; ret == 0 && i < parent_map->count; i++) {
+    const PageMapFile *file = &parent_map->files[i];
 
-  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
-    free(dir);
-    return 1;
+    if (!dirty_set_covers(dirty, file->path, 1)) {
+      ret = file_list_add(list, file->path, file->size, file->mtime, 0);
+    }
   }
-
-  free(dir);
-  return 0;
+  if (ret == 0) {
+    qsort(list->files, list->count, sizeof(BackupFile), file_compare);
+  }
+  return ret;
 }
 
 /**
@@ -208,6 +10523,21 @@ static int backup_init_backup(void *ctx, const char *backup_dir, const char *bac
   return 0;
 }
 
+/**
+  @brief Drop the stream archive of a failed backup.
+
+  @param [in,out] backup_ctx Backup context.
+*/
+static void backup_stream_abort(BackupContext *backup_ctx) {
+  if (backup_ctx->output) {
+    stream_free(backup_ctx->output);
+    if (backup_ctx->output->path[0]) {
+      unlink(backup_ctx->output->path);
+    }
+    backup_ctx->output = NULL;
+  }
+}
+
 /**
   @brief Perform incremental backup.
 
@@ -218,8 +10548,27 @@ static int backup_init_backup(void *ctx, const char *backup_dir, const char *bac
 */
 static int backup_perform_backup(void *ctx, int incremental) {
   BackupContext *backup_ctx = (BackupContext *)ctx;
+  BackupFileList list = {NULL, 0, 0};
+  PageMap parent_map = {NULL, 0, 0};
+  PageMap map = {NULL, 0, 0};
+  Manifest checksums = {NULL, 0, 0};
+  SignatureIndex parent_signatures;
+  CatalogEntry entry;
+  Checkpoint checkpoint;
+  char parent[1024] = "";
   char metadata_file[1024];
+  char map_file[4096];
+  char checkpoint_file[4096];
+  char backup_path[2048];
+  char root[2 * SHA256_DIGEST_LENGTH + 1];
+  PipelineStage stages[BACKUP_STAGE_COUNT];
+  BackupStream stream;
+  FILE *signatures = NULL;
   FILE *fp;
+  int layout;
+  int dirty_files = -1;
+  int ret = 0;
+  int i;
   
   if (!backup_ctx->backup_dir || !backup_ctx->backup_name) {
     return 1;
@@ -227,6 +10576,222 @@ static int backup_perform_backup(void *ctx, int incremental) {
   
   /* Set backup level */
   backup_ctx->backup_level = incremental ? BACKUP_LEVEL_INCREMENTAL : BACKUP_LEVEL_FULL;
+  memset(&backup_ctx->stats, 0, sizeof(backup_ctx->stats));
+  throttle_reset(backup_ctx);
+  memset(stages, 0, sizeof(stages));
+  crc32c_init();
+  chunker_init();
+  snprintf(backup_path, sizeof(backup_path), "%s/%s", backup_ctx->backup_dir, backup_ctx->backup_name);
+  snprintf(checkpoint_file, sizeof(checkpoint_file), "%s/%s", backup_path, BACKUP_CHECKPOINT_FILE);
+  memset(&checkpoint, 0, sizeof(checkpoint));
+  checkpoint.fd = -1;
+  /* An archive on a pipe cannot be taken back to a checkpoint */
+  checkpoint.interval = backup_ctx->stream ? 0 : backup_ctx->checkpoint_interval;
+  checkpoint.live = &backup_ctx->stats;
+  checkpoint.list = &list;
+  layout = (backup_ctx->compression_level > 0 ? BACKUP_CHECKPOINT_COMPRESSED : 0) |
+           (backup_ctx->dedup ? BACKUP_CHECKPOINT_DEDUP : 0) |
+           (backup_ctx->read_threads == 0 && !backup_ctx->dedup ? BACKUP_CHECKPOINT_SERIAL : 0);
+
+  /* A restart of an interrupted backup resumes from its checkpoint, if the files it covers are intact */
+  if (checkpoint.interval > 0 && checkpoint_load(&checkpoint, checkpoint_file, &list) == 0) {
+    if (checkpoint.layout != layout || (!incremental && checkpoint.level != BACKUP_LEVEL_FULL) ||
+        checkpoint_verify(&checkpoint, backup_path) != 0) {
+      checkpoint_free(&checkpoint);
+      file_list_free(&list);
+    } else {
+      backup_ctx->backup_time = (time_t)checkpoint.backup_time;
+      backup_ctx->backup_level = checkpoint.level;
+      backup_ctx->stats = checkpoint.stats;
+      snprintf(parent, sizeof(parent), "%s", checkpoint.parent);
+      for (i = 0; i < list.count; i++) {
+        checkpoint.resumed += checkpoint.files[i].done;
+      }
+      if (parent[0]) {
+        snprintf(map_file, sizeof(map_file), "%s/%s/%s", backup_ctx->backup_dir, parent, BACKUP_PAGE_MAP_FILE);
+        free(backup_ctx->full_backup_name);
+        backup_ctx->full_backup_name = strdup(checkpoint.full);
+        ret = page_map_load(map_file, &parent_map);
+      }
+    }
+  }
+
+  if (!checkpoint.files) {
+    /* An incremental backup needs the page map of its parent; without one it becomes a full backup */
+    if (incremental && find_parent_backup(backup_ctx, parent, sizeof(parent)) == 0) {
+      char full[1024];
+      snprintf(map_file, sizeof(map_file), "%s/%s/%s", backup_ctx->backup_dir, parent, BACKUP_PAGE_MAP_FILE);
+      if (page_map_load(map_file, &parent_map) != 0) {
+        return 1;
+      }
+      if (metadata_read_field(backup_ctx->backup_dir, parent, "full_backup", full, sizeof(full)) != 0) {
+        snprintf(full, sizeof(full), "%s", parent);
+      }
+      free(backup_ctx->full_backup_name);
+      backup_ctx->full_backup_name = strdup(full);
+    } else {
+      parent[0] = '\0';
+      backup_ctx->backup_level = BACKUP_LEVEL_FULL;
+    }
+
+    /* The dirty file tracker knows which files changed since the parent: the rest are not even listed */
+    if (dirty_tracker_cut(backup_ctx, parent)) {
+      dirty_files = backup_ctx->tracker->taken.count;
+      ret = dirty_file_list(backup_ctx->datadir, &parent_map, &backup_ctx->tracker->taken, &list);
+    } else if (file_list_collect(backup_ctx->datadir, "", &list) != 0) {
+      ret = 1;
+    }
+    if (ret == 0 && checkpoint.interval > 0) {
+      checkpoint.level = backup_ctx->backup_level;
+      checkpoint.layout = layout;
+      checkpoint.backup_time = (long long)backup_ctx->backup_time;
+      snprintf(checkpoint.parent, sizeof(checkpoint.parent), "%s", parent);
+      snprintf(checkpoint.full, sizeof(checkpoint.full), "%s",
+               parent[0] && backup_ctx->full_backup_name ? backup_ctx->full_backup_name : "");
+      ret = checkpoint_begin(&checkpoint, checkpoint_file);
+    }
+  }
+
+  /* Pipeline output goes straight into the stream archive; the other files follow it once the backup is complete */
+  if (ret == 0 && backup_ctx->stream) {
+    snprintf(map_file, sizeof(map_file), "%s/%s%s", backup_ctx->stream, backup_ctx->backup_name, BACKUP_STREAM_SUFFIX);
+    backup_ctx->output = &stream;
+    ret = stream_open(&stream, strcmp(backup_ctx->stream, "-") == 0 ? NULL : map_file, backup_path);
+  }
+
+  /* Copy every data file, or only its changed pages */
+  if (ret == 0 && list.count > 0) {
+    map.files = (PageMapFile *)calloc(list.count, sizeof(PageMapFile));
+    map.size = list.count;
+    ret = map.files ? 0 : 1;
+  }
+  if (ret == 0) {
+    /* Every data file plus the page map, the signatures and the chunk manifest */
+    checksums.files = (ManifestFile *)calloc(list.count + 3, sizeof(ManifestFile));
+    checksums.size = list.count + 3;
+    ret = checksums.files ? 0 : 1;
+  }
+  /* Block signatures of the parent let changed files become rsync deltas; a parent without any has none */
+  memset(&parent_signatures, 0, sizeof(parent_signatures));
+  if (parent[0]) {
+    snprintf(map_file, sizeof(map_file), "%s/%s/%s", backup_ctx->backup_dir, parent, BACKUP_SIGNATURE_FILE);
+    signature_index_load(map_file, &parent_signatures);
+  }
+  if (ret == 0) {
+    snprintf(map_file, sizeof(map_file), "%s/%s", backup_path, BACKUP_SIGNATURE_FILE);
+    signatures = signature_create(map_file);
+    ret = signatures ? 0 : 1;
+  }
+  if (ret == 0 && (backup_ctx->read_threads > 0 || backup_ctx->dedup)) {
+    ret = build_backup_jobs(backup_ctx, &list, parent[0] ? &parent_map : NULL, &map, &checksums, stages,
+                            &checkpoint, &parent_signatures, signatures);
+  } else if (ret == 0) {
+    /* Serial mode: whole files are cloned or copied in one read pass */
+    for (i = 0; ret == 0 && i < list.count; i++) {
+      char src[4096];
+      char dst[4096];
+      char stored[2048];
+      PageMapFile *entry = &map.files[map.count];
+      CheckpointFile *progress = checkpoint.files ? &checkpoint.files[i] : NULL;
+      int restored = progress && progress->done;
+      int known = checksums.count;
+      Signature signature;
+      Signature base;
+
+      snprintf(src, sizeof(src), "%s/%s", backup_ctx->datadir, list.files[i].path);
+      snprintf(dst, sizeof(dst), "%s/%s/%s", backup_path, BACKUP_DATA_DIR, list.files[i].path);
+      snprintf(stored, sizeof(stored), "%s/%s%s", BACKUP_DATA_DIR, list.files[i].path,
+               parent[0] ? BACKUP_DELTA_SUFFIX : "");
+      if (restored) {
+        /* Copied before the restart */
+        ret = page_map_file_alloc(entry, &list.files[i]);
+        if (ret == 0) {
+          ret = checkpoint_restore(progress, entry, &checksums);
+        }
+        if (progress->mode == BACKUP_JOB_RSYNC) {
+          entry->flags |= BACKUP_PAGE_MAP_RSYNC;
+        }
+      } else if (parent[0]) {
+        const PageMapFile *known_entry = page_map_find(&parent_map, list.files[i].path);
+
+        signature_init(&signature, &list.files[i]);
+        ret = page_map_file_alloc(entry, &list.files[i]);
+        if (ret != 0) {
+        } else if (carry_over_pages(&list.files[i], known_entry, entry, &backup_ctx->stats)) {
+          ret = signature_copy(&parent_signatures, list.files[i].path, signatures);
+        } else if (!signature.invalid && signature_read(&parent_signatures, list.files[i].path, &base) == 0) {
+          ret = rsync_encode_file(src, dst, &list.files[i], known_entry, &base, entry, &signature,
+                                  &backup_ctx->stats, &backup_ctx->throttle, backup_ctx->direct_io);
+          signature_free(&base);
+          snprintf(stored, sizeof(stored), "%s/%s%s", BACKUP_DATA_DIR, list.files[i].path, BACKUP_RSYNC_SUFFIX);
+        } else {
+          ret = copy_changed_pages(src, dst, &list.files[i], known_entry, entry, &backup_ctx->stats,
+                                   &backup_ctx->throttle, backup_ctx->direct_io, &signature);
+        }
+        /* Carried-over files have no blocks hashed: their signature was copied */
+        if (ret == 0) {
+          ret = signature_write(signatures, list.files[i].path, &signature);
+        }
+        signature_free(&signature);
+      } else {
+        signature_init(&signature, &list.files[i]);
+        ret = page_map_file_alloc(entry, &list.files[i]);
+        if (ret == 0) {
+          ret = copy_data_file(src, dst, &list.files[i], entry, &backup_ctx->stats, &backup_ctx->throttle,
+                               backup_ctx->direct_io, &signature);
+        }
+        if (ret == 0) {
+          ret = signature_write(signatures, list.files[i].path, &signature);
+        }
+        signature_free(&signature);
+      }
+      if (entry->path) {
+        map.count++;
+      }
+      if (ret == 0 && !restored) {
+        ret = manifest_scan_file(&checksums, backup_path, stored);
+      }
+      if (ret == 0 && progress && !restored) {
+        progress->done = 1;
+        progress->mode = parent[0] ? BACKUP_JOB_DELTA : BACKUP_JOB_COPY;
+        if (entry->flags & BACKUP_PAGE_MAP_RSYNC) {
+          progress->mode = BACKUP_JOB_RSYNC;
+        }
+        progress->entry = entry;
+        progress->checksums = checksums.count > known ? &checksums.files[known] : NULL;
+        progress->stored = progress->checksums ? progress->checksums->size : 0;
+        ret = checkpoint_tick(&checkpoint);
+      }
+    }
+  }
+  if (signatures && fclose(signatures) != 0) {
+    ret = 1;
+  }
+  signature_index_free(&parent_signatures);
+  if (ret == 0) {
+    snprintf(map_file, sizeof(map_file), "%s/%s", backup_path, BACKUP_PAGE_MAP_FILE);
+    ret = page_map_save(map_file, &map);
+  }
+  if (ret == 0) {
+    ret = manifest_scan_file(&checksums, backup_path, BACKUP_PAGE_MAP_FILE);
+  }
+  if (ret == 0) {
+    ret = manifest_scan_file(&checksums, backup_path, BACKUP_SIGNATURE_FILE);
+  }
+  if (ret == 0) {
+    snprintf(map_file, sizeof(map_file), "%s/%s", backup_path, BACKUP_MANIFEST_FILE);
+    ret = manifest_save(map_file, &checksums, root);
+  }
+  checkpoint_free(&checkpoint);
+  file_list_free(&list);
+  page_map_free(&map);
+  page_map_free(&parent_map);
+  manifest_free(&checksums);
+  if (ret != 0) {
+    backup_stream_abort(backup_ctx);
+    dirty_tracker_finish(backup_ctx, 0);
+    return 1;
+  }
   
   /* Create metadata file */
   snprintf(metadata_file, sizeof(metadata_file), "%s/%s/%s", 
@@ -234,6 +10799,8 @@ static int backup_perform_backup(void *ctx, int incremental) {
   
   fp = fopen(metadata_file, "w");
   if (!fp) {
+    backup_stream_abort(backup_ctx);
+    dirty_tracker_finish(backup_ctx, 0);
     return 1;
   }
   
@@ -243,29 +10810,106 @@ static int backup_perform_backup(void *ctx, int incremental) {
   fprintf(fp, "\"backup_time\": %ld,", backup_ctx->backup_time);
   fprintf(fp, "\"backup_level\": %d,", backup_ctx->backup_level);
   
-  if (incremental && backup_ctx->full_backup_name) {
+  if (parent[0] && backup_ctx->full_backup_name) {
     fprintf(fp, "\"full_backup\": \"%s\",", backup_ctx->full_backup_name);
+    fprintf(fp, "\"parent_backup\": \"%s\",", parent);
   }
   
-  fprintf(fp, "\"backup_size\": 0,");
+  fprintf(fp, "\"datadir\": \"%s\",", backup_ctx->datadir);
+  fprintf(fp, "\"backup_size\": %lld,", backup_ctx->stats.bytes);
+  fprintf(fp, "\"file_count\": %d,", backup_ctx->stats.files);
+  fprintf(fp, "\"cloned_files\": %d,", backup_ctx->stats.cloned_files);
+  fprintf(fp, "\"unchanged_files\": %d,", backup_ctx->stats.unchanged_files);
+  fprintf(fp, "\"scanned_pages\": %lld,", backup_ctx->stats.scanned_pages);
+  fprintf(fp, "\"changed_pages\": %lld,", backup_ctx->stats.changed_pages);
+  fprintf(fp, "\"hole_bytes\": %lld,", backup_ctx->stats.hole_bytes);
+  if (backup_ctx->io_uring) {
+    fprintf(fp, "\"io_engine\": \"%s\",", backup_ctx->io_uring_used ? "uring" : "threads");
+  }
+  if (backup_ctx->stats.rsync_files > 0) {
+    fprintf(fp, "\"rsync_files\": %d,", backup_ctx->stats.rsync_files);
+    fprintf(fp, "\"rsync_copied_bytes\": %lld,", backup_ctx->stats.rsync_copied_bytes);
+  }
+  if (backup_ctx->dedup && !parent[0]) {
+    fprintf(fp, "\"chunks\": %lld,", backup_ctx->stats.chunks);
+    fprintf(fp, "\"new_chunks\": %lld,", backup_ctx->stats.new_chunks);
+    fprintf(fp, "\"chunk_bytes\": %lld,", backup_ctx->stats.chunk_bytes);
+  }
+  if (checkpoint.resumed > 0) {
+    fprintf(fp, "\"resumed_files\": %d,", checkpoint.resumed);
+  }
+  if (dirty_files >= 0) {
+    fprintf(fp, "\"dirty_files\": %d,", dirty_files);
+  }
+  if (backup_ctx->output) {
+    fprintf(fp, "\"stream\": \"%s\",", stream.path[0] ? stream.path : "-");
+  }
+  if (backup_ctx->throttle.active) {
+    fprintf(fp, "\"throttle_wait_ms\": %lld,", backup_ctx->throttle.wait_ns / 1000000);
+    fprintf(fp, "\"throttle_backoffs\": %lld,", backup_ctx->throttle.backoffs);
+  }
+  for (i = 0; i < BACKUP_STAGE_COUNT; i++) {
+    static const char *names[BACKUP_STAGE_COUNT] = {"read", "compress", "checksum", "write"};
+    double busy = stages[i].busy_ns / 1e9 / (stages[i].threads ? stages[i].threads : 1);
+    fprintf(fp, "\"%s_mb_s\": %.1f,", names[i], busy > 0 ? stages[i].bytes / 1048576.0 / busy : 0.0);
+  }
+  fprintf(fp, "\"manifest_root\": \"%s\",", root);
   fprintf(fp, "\"status\": \"completed\"");
   fprintf(fp, "}\n");
   
-  fclose(fp);
-  
-  /* In a real-world scenario, you would:
-   * 1. For full backup: Copy all data files
-   * 2. For incremental backup: Copy only changed files since last backup
-   * 3. Create backup logs
-   * 4. Verify backup integrity
-   */
+  if (fclose(fp) != 0) {
+    backup_stream_abort(backup_ctx);
+    dirty_tracker_finish(backup_ctx, 0);
+    return 1;
+  }
+
+  /* The archive takes every other file and its index; data/ then only lives in the archive */
+  if (backup_ctx->output) {
+    snprintf(map_file, sizeof(map_file), "%s/%s", backup_path, BACKUP_DATA_DIR);
+    if (stream_add_tree(&stream, backup_path) != 0 || stream_finish(&stream) != 0 ||
+        remove_tree(map_file, backup_ctx->read_threads > 0 ? backup_ctx->read_threads : 1) != 0) {
+      backup_stream_abort(backup_ctx);
+      dirty_tracker_finish(backup_ctx, 0);
+      return 1;
+    }
+    stream_free(&stream);
+    backup_ctx->output = NULL;
+  }
   
+  /* Record the backup in the catalog */
+  memset(&entry, 0, sizeof(entry));
+  entry.name = backup_ctx->backup_name;
+  entry.backup_time = backup_ctx->backup_time;
+  entry.level = backup_ctx->backup_level;
+  entry.parent = parent[0] ? parent : NULL;
+  entry.size = backup_ctx->stats.bytes;
+  snprintf(entry.status, sizeof(entry.status), "completed");
+  if (catalog_append(backup_ctx->backup_dir, &entry) != 0) {
+    dirty_tracker_finish(backup_ctx, 0);
+    return 1;
+  }
+  dirty_tracker_finish(backup_ctx, 1);
+
+  /* Complete: nothing left to resume */
+  unlink(checkpoint_file);
   return 0;
 }
 
 /**
   @brief Restore backup.
 
+  The chain from the backup back to its full backup is resolved first,
+  then every file is rebuilt in one pass: each page is copied once, from
+  the newest backup that stored it, by read_threads parallel writers.
+  Work is planned and written in batches of files to bound memory.
+
+  With restore_time set, the archived binlogs from the backup time up to
+  that time are extracted next to the restored files for replay.
+
+  Backups of the chain that were written to a stream archive have the
+  data files wanted extracted from it first, found through its index,
+  and removed again afterwards.
+
   @param [in] ctx          Backup context.
   @param [in] backup_dir   Backup directory.
   @param [in] backup_name  Backup name.
@@ -274,32 +10918,111 @@ static int backup_perform_backup(void *ctx, int incremental) {
 */
 static int backup_restore_backup(void *ctx, const char *backup_dir, const char *backup_name) {
   BackupContext *backup_ctx = (BackupContext *)ctx;
-  char metadata_file[1024];
-  FILE *fp;
+  const char *target = backup_ctx->restore_dir ? backup_ctx->restore_dir : backup_ctx->datadir;
+  const char *only = backup_ctx->restore_file;
+  int thread_count = backup_ctx->read_threads > 0 ? backup_ctx->read_threads : 1;
+  BinlogArchive archive = {NULL, 0, 0};
+  char archive_dir[4096];
+  char chunk_dir[4096];
+  char stream_file[4096];
+  char level[16];
+  char value[32];
+  long long backup_time = 0;
+  RestoreLink *links;
+  RestoreRun run;
+  int *staged;
+  int link_count;
+  int first = -1, last = -1;
+  int found = 0;
+  int ret = 0;
+  int i;
   
   /* Check if backup exists */
-  snprintf(metadata_file, sizeof(metadata_file), "%s/%s/%s", 
-           backup_dir, backup_name, BACKUP_METADATA_FILE);
-  
-  fp = fopen(metadata_file, "r");
-  if (!fp) {
+  if (metadata_read_field(backup_dir, backup_name, "backup_level", level, sizeof(level)) != 0) {
     return 1;
   }
-  fclose(fp);
+  /* A point-in-time restore needs archived binlogs from the backup time to the target */
+  snprintf(archive_dir, sizeof(archive_dir), "%s/%s", backup_dir, BACKUP_BINLOG_DIR);
+  if (backup_ctx->restore_time && !only) {
+    if (metadata_read_field(backup_dir, backup_name, "backup_time", value, sizeof(value)) == 0) {
+      backup_time = atoll(value);
+    }
+    if (backup_time == 0 || backup_ctx->restore_time < backup_time ||
+        binlog_archive_load(archive_dir, &archive) != 0 ||
+        binlog_replay_plan(&archive, backup_time, backup_ctx->restore_time, &first, &last) != 0) {
+      binlog_archive_free(&archive);
+      return 1;
+    }
+  }
+  /* A whole restore goes into an empty directory; a single file may join existing ones */
+  if (only ? create_directory(target) != 0 : !restore_target_usable(target)) {
+    binlog_archive_free(&archive);
+    return 1;
+  }
+  if (restore_load_chain(backup_dir, backup_name, &links, &link_count) != 0) {
+    restore_chain_free(links, link_count);
+    binlog_archive_free(&archive);
+    return 1;
+  }
+  
+  /* Streamed backups of the chain get the data files wanted back from their archives first */
+  crc32c_init();
+  staged = (int *)calloc(link_count, sizeof(int));
+  ret = staged ? 0 : 1;
+  for (i = 0; ret == 0 && i < link_count; i++) {
+    snprintf(chunk_dir, sizeof(chunk_dir), "%s/%s", backup_dir, links[i].name);
+    if (stream_archive_path(backup_ctx, backup_dir, links[i].name, stream_file, sizeof(stream_file)) == 0) {
+      ret = stream_stage(stream_file, chunk_dir, only, &staged[i]);
+    }
+  }
+
+  snprintf(chunk_dir, sizeof(chunk_dir), "%s/%s", backup_dir, BACKUP_CHUNK_DIR);
+  memset(&run, 0, sizeof(run));
+  run.target = target;
+  run.chunk_dir = chunk_dir;
+  run.threads = thread_count;
+  run.files = ret == 0 ? (const PageMapFile **)malloc(BACKUP_RESTORE_BATCH * sizeof(PageMapFile *)) : NULL;
+  ret = run.files ? 0 : 1;
+  for (i = 0; ret == 0 && i < links[0].map.count; i++) {
+    if (only && strcmp(links[0].map.files[i].path, only) != 0) {
+      continue;
+    }
+    found = 1;
+    ret = restore_plan_file(&run, links, link_count, backup_dir, &links[0].map.files[i]);
+    if (ret == 0 && (run.task_count >= BACKUP_RESTORE_BATCH || run.file_count == BACKUP_RESTORE_BATCH)) {
+      ret = restore_run_batch(&run, thread_count);
+    }
+  }
+  if (restore_run_batch(&run, thread_count) != 0) {
+    ret = 1;
+  }
+  if (ret == 0 && found && first >= 0) {
+    ret = binlog_replay(archive_dir, &archive, first, last, backup_time, backup_ctx->restore_time, target);
+  }
   
-  /* In a real-world scenario, you would:
-   * 1. For full backup: Restore all data files
-   * 2. For incremental backup: Restore full backup first, then apply incremental changes
-   * 3. Apply transaction logs
-   * 4. Verify restore integrity
-   */
+  for (i = 0; staged && i < link_count; i++) {
+    if (staged[i]) {
+      snprintf(stream_file, sizeof(stream_file), "%s/%s/%s", backup_dir, links[i].name, BACKUP_DATA_DIR);
+      remove_tree(stream_file, thread_count);
+    }
+  }
   
-  return 0;
+  binlog_archive_free(&archive);
+  free(staged);
+  free(run.files);
+  free(run.sources);
+  free(run.tasks);
+  restore_chain_free(links, link_count);
+  return ret == 0 && found ? 0 : 1;
 }
 
 /**
   @brief List available backups.
 
+  Backups come from the catalog, oldest first.  A catalog that names a
+  backup whose directory was removed by hand is rebuilt first, so only
+  backups that still exist are listed.
+
   @param [in]  ctx           Backup context.
   @param [in]  backup_dir    Backup directory.
   @param [out] backups       Pointer to store backup names.
@@ -308,58 +11031,32 @@ static int backup_restore_backup(void *ctx, const char *backup_dir, const char *
   @retval 0 success, 1 failure.
 */
 static int backup_list_backups(void *ctx, const char *backup_dir, char ***backups, int *backup_count) {
-  DIR *dir;
-  struct dirent *entry;
-  int count = 0;
+  Catalog catalog;
   char **backup_list = NULL;
+  int count = 0;
+  int i;
   
-  /* Open backup directory */
-  dir = opendir(backup_dir);
-  if (!dir) {
+  /* One read of the catalog and its index instead of a scan of every backup */
+  if (catalog_open(backup_dir, &catalog) != 0) {
     return 1;
   }
   
-  /* Count backup directories */
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-      char metadata_file[1024];
-      snprintf(metadata_file, sizeof(metadata_file), "%s/%s/%s", 
-               backup_dir, entry->d_name, BACKUP_METADATA_FILE);
-      
-      if (access(metadata_file, F_OK) == 0) {
-        count++;
-      }
-    }
-  }
-  
-  /* Rewind directory */
-  rewinddir(dir);
-  
   /* Allocate backup list */
-  if (count > 0) {
-    backup_list = (char **)malloc(count * sizeof(char *));
+  if (catalog.count > 0) {
+    backup_list = (char **)malloc(catalog.count * sizeof(char *));
     if (!backup_list) {
-      closedir(dir);
+      catalog_free(&catalog);
       return 1;
     }
     
-    /* Fill backup list */
-    count = 0;
-    while ((entry = readdir(dir)) != NULL) {
-      if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-        char metadata_file[1024];
-        snprintf(metadata_file, sizeof(metadata_file), "%s/%s/%s", 
-                 backup_dir, entry->d_name, BACKUP_METADATA_FILE);
-        
-        if (access(metadata_file, F_OK) == 0) {
-          backup_list[count] = strdup(entry->d_name);
-          count++;
-        }
-      }
+    /* Fill backup list, oldest first; the catalog gives up its names */
+    for (i = 0; i < catalog.count; i++) {
+      backup_list[count++] = catalog.entries[i].name;
+      catalog.entries[i].name = NULL;
     }
   }
   
-  closedir(dir);
+  catalog_free(&catalog);
   
   *backups = backup_list;
   *backup_count = count;
@@ -368,37 +11065,173 @@ static int backup_list_backups(void *ctx, const char *backup_dir, char ***backup
 }
 
 /**
-  @brief Cleanup backup.
+  @brief Remove backups: one named backup, or those the retention policy drops.
+
+  A named backup is only removed when no other backup depends on it.
+  Without a name, retain_fulls, retain_days and retain_monthly are
+  evaluated over the backup chains in the catalog, and nothing is
+  removed unless one of them is set.  Under the catalog lock each doomed
+  backup is renamed to a hidden trash name, which rebuilds and parent
+  lookups ignore, and the catalog is rewritten without it; catalog
+  entries whose backup has vanished are dropped too.  The trash, that of
+  interrupted cleanups included, is then unlinked by read_threads
+  threads, and chunks no backup references any more are collected in
+  the background.  Decisions are appended to cleanup.log.
 
   @param [in] ctx          Backup context.
   @param [in] backup_dir   Backup directory.
-  @param [in] backup_name  Backup name.
+  @param [in] backup_name  Backup name, or empty to apply the retention policy.
 
   @retval 0 success, 1 failure.
 */
 static int backup_cleanup_backup(void *ctx, const char *backup_dir, const char *backup_name) {
-  char backup_path[1024];
-  char command[1024];
-  
-  /* Build backup path */
-  snprintf(backup_path, sizeof(backup_path), "%s/%s", backup_dir, backup_name);
-  
-  /* In a real-world scenario, you would:
-   * 1. Verify backup exists
-   * 2. Remove backup files and directories
-   * 3. Clean up metadata
-   */
-  
-  /* For demonstration, just print the command that would be executed */
-  snprintf(command, sizeof(command), "rm -rf %s", backup_path);
-  printf("Would execute: %s\n", command);
-  
-  return 0;
+  BackupContext *backup_ctx = (BackupContext *)ctx;
+  int thread_count = backup_ctx->read_threads > 0 ? backup_ctx->read_threads : 1;
+  size_t prefix = strlen(BACKUP_TRASH_PREFIX);
+  struct dirent *entry;
+  Catalog catalog;
+  char path[4096];
+  char trash[4096];
+  char archive[4096];
+  char *keep;
+  FILE *log;
+  DIR *dir;
+  int streamed;
+  int removed = 0;
+  int swept = 0;
+  int lock;
+  int ret = 0;
+  int i, j;
+
+  snprintf(path, sizeof(path), "%s/%s.lock", backup_dir, BACKUP_CATALOG_FILE);
+  lock = open(path, O_WRONLY | O_CREAT, 0640);
+  if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+    if (lock >= 0) {
+      close(lock);
+    }
+    return 1;
+  }
+  if (catalog_open(backup_dir, &catalog) != 0) {
+    close(lock);
+    return 1;
+  }
+  keep = (char *)malloc((size_t)catalog.count + 1);
+  if (!keep) {
+    catalog_free(&catalog);
+    close(lock);
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CLEANUP_LOG);
+  log = fopen(path, "a");
+
+  if (backup_name && *backup_name) {
+    const CatalogEntry *victim = catalog_find(&catalog, backup_name);
+
+    memset(keep, 1, (size_t)catalog.count);
+    ret = victim ? 0 : 1;
+    for (i = 0; victim && i < catalog.count; i++) {
+      if (catalog.entries[i].parent && strcmp(catalog.entries[i].parent, backup_name) == 0) {
+        /* Removing it would orphan the incremental */
+        if (log) {
+          fprintf(log, "%ld kept %s: %s depends on it\n", (long)time(NULL), backup_name, catalog.entries[i].name);
+        }
+        ret = 1;
+      }
+    }
+    if (ret == 0) {
+      keep[victim - catalog.entries] = 0;
+    }
+  } else if (!retention_select(backup_ctx, &catalog, (long long)time(NULL), keep)) {
+    memset(keep, 1, (size_t)catalog.count);
+  }
+
+  for (i = 0; i < catalog.count; i++) {
+    const CatalogEntry *backup = &catalog.entries[i];
+
+    snprintf(path, sizeof(path), "%s/%s", backup_dir, backup->name);
+    if (keep[i]) {
+      char metadata[sizeof(path) + 32];
+      snprintf(metadata, sizeof(metadata), "%s/%s", path, BACKUP_METADATA_FILE);
+      if (access(metadata, F_OK) != 0 && errno == ENOENT) {
+        keep[i] = 0;
+        removed++;
+        if (log) {
+          fprintf(log, "%ld dropped %s: backup is gone\n", (long)time(NULL), backup->name);
+        }
+      }
+      continue;
+    }
+    /* A streamed backup goes with its archive */
+    streamed = stream_archive_path(backup_ctx, backup_dir, backup->name, archive, sizeof(archive)) == 0;
+    snprintf(trash, sizeof(trash), "%s/%s%s", backup_dir, BACKUP_TRASH_PREFIX, backup->name);
+    if (rename(path, trash) != 0 && errno != ENOENT) {
+      keep[i] = 1;
+      ret = 1;
+      continue;
+    }
+    if (streamed) {
+      unlink(archive);
+    }
+    removed++;
+    if (log) {
+      fprintf(log, "%ld removed %s level %d time %lld size %lld\n", (long)time(NULL), backup->name, backup->level,
+              backup->backup_time, backup->size);
+    }
+  }
+  for (i = 0, j = 0; i < catalog.count; i++) {
+    if (keep[i]) {
+      catalog.entries[j++] = catalog.entries[i];
+    } else {
+      free(catalog.entries[i].name);
+      free(catalog.entries[i].parent);
+    }
+  }
+  catalog.count = j;
+  if (removed > 0 && catalog_save(backup_dir, &catalog) != 0) {
+    ret = 1;
+  }
+  catalog_free(&catalog);
+  free(keep);
+  close(lock);
+
+  dir = opendir(backup_dir);
+  while (dir && (entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, BACKUP_TRASH_PREFIX, prefix) != 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", backup_dir, entry->d_name);
+    if (remove_tree(path, thread_count) != 0) {
+      ret = 1;
+    } else {
+      swept++;
+    }
+  }
+  if (dir) {
+    closedir(dir);
+  }
+  if (log) {
+    fclose(log);
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", backup_dir, BACKUP_CHUNK_DIR);
+  if (swept > 0 && access(path, F_OK) == 0 && chunk_collector_start(backup_ctx, backup_dir, thread_count) != 0) {
+    ret = 1;
+  }
+  return ret;
 }
 
 /**
   @brief Validate backup.
 
+  The manifest is first checked against the Merkle root recorded in the
+  metadata.  Unless only the root is wanted, the listed blocks are then
+  read back in parallel and compared with their CRC32C, and chunks of a
+  deduplicated backup are decoded and rehashed.  A sample check reads a
+  random share of the blocks; validate_file limits every mode to one
+  file.  The data files of a streamed backup are extracted from its
+  archive for the check and removed after it.  Results are appended to
+  logs/validation.log.
+
   @param [in] ctx          Backup context.
   @param [in] backup_dir   Backup directory.
   @param [in] backup_name  Backup name.
@@ -406,25 +11239,274 @@ static int backup_cleanup_backup(void *ctx, const char *backup_dir, const char *
   @retval 0 success, 1 failure.
 */
 static int backup_validate_backup(void *ctx, const char *backup_dir, const char *backup_name) {
-  char metadata_file[1024];
+  static const char *modes[] = {"full", "root", "sample"};
+  BackupContext *backup_ctx = (BackupContext *)ctx;
+  const char *only = backup_ctx->validate_file;
+  char expected[2 * SHA256_DIGEST_LENGTH + 1];
+  char backup_path[4096];
+  char chunk_dir[4096];
+  char path[sizeof(backup_path) + 64];
+  pthread_t threads[BACKUP_MAX_THREADS];
+  unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+  int thread_count = backup_ctx->read_threads > 0 ? backup_ctx->read_threads : 1;
+  long long start = clock_ns();
+  long long block_count = 0;
+  long long size = 0;
+  long long kept = 0;
+  long long i;
+  ValidateRun run;
+  Manifest manifest;
+  int started = 0;
+  int staged;
+  int found = !only;
+  int ret;
   FILE *fp;
-  
-  /* Check if backup exists */
-  snprintf(metadata_file, sizeof(metadata_file), "%s/%s/%s", 
-           backup_dir, backup_name, BACKUP_METADATA_FILE);
-  
-  fp = fopen(metadata_file, "r");
-  if (!fp) {
+
+  crc32c_init();
+  if (metadata_read_field(backup_dir, backup_name, "manifest_root", expected, sizeof(expected)) != 0) {
     return 1;
   }
-  fclose(fp);
-  
-  /* In a real-world scenario, you would:
-   * 1. Check backup files integrity
-   * 2. Verify metadata consistency
-   * 3. Test restore process
-   */
-  
+  snprintf(backup_path, sizeof(backup_path), "%s/%s", backup_dir, backup_name);
+  snprintf(chunk_dir, sizeof(chunk_dir), "%s/%s", backup_dir, BACKUP_CHUNK_DIR);
+  snprintf(path, sizeof(path), "%s/%s", backup_path, BACKUP_MANIFEST_FILE);
+  if (manifest_load(path, &manifest) != 0) {
+    return 1;
+  }
+  for (i = 0; only && !found && i < manifest.count; i++) {
+    if (stored_name_matches(manifest.files[i].path, only)) {
+      only = manifest.files[i].path;
+      found = 1;
+    }
+  }
+  /* A streamed backup has its data checked as extracted from the archive */
+  staged = 0;
+  if (backup_ctx->validate_mode != BACKUP_VALIDATE_ROOT &&
+      stream_archive_path(backup_ctx, backup_dir, backup_name, path, sizeof(path)) == 0 &&
+      stream_stage(path, backup_path, backup_ctx->validate_file, &staged) != 0) {
+    manifest_free(&manifest);
+    return 1;
+  }
+
+  ret = validate_root(&manifest, found ? only : NULL, expected);
+  memset(&run, 0, sizeof(run));
+  run.backup_path = backup_path;
+  run.chunk_dir = chunk_dir;
+  run.manifest = &manifest;
+  if (ret == 0 && backup_ctx->validate_mode != BACKUP_VALIDATE_ROOT) {
+    for (i = 0; i < manifest.count; i++) {
+      if (!only || strcmp(manifest.files[i].path, only) == 0) {
+        block_count += manifest.files[i].block_count;
+      }
+    }
+    size = block_count > 0 ? block_count : 1;
+    run.tasks = (ValidateTask *)malloc(size * sizeof(ValidateTask));
+    ret = run.tasks ? 0 : 1;
+    for (i = 0; ret == 0 && i < manifest.count; i++) {
+      int j;
+      if (only && strcmp(manifest.files[i].path, only) != 0) {
+        continue;
+      }
+      for (j = 0; j < manifest.files[i].block_count; j++) {
+        run.tasks[run.task_count].file = (int)i;
+        run.tasks[run.task_count].block = j;
+        run.task_count++;
+      }
+    }
+    if (ret == 0) {
+      ret = validate_add_chunks(backup_path, found ? NULL : backup_ctx->validate_file, &run.tasks, &run.task_count,
+                                &size);
+      found = found || run.task_count > 0;
+    }
+  }
+  if (ret == 0 && backup_ctx->validate_mode == BACKUP_VALIDATE_SAMPLE && run.task_count > 0) {
+    for (i = 0; i < run.task_count; i++) {
+      if ((int)(rand_r(&seed) % 100) < backup_ctx->validate_sample) {
+        run.tasks[kept++] = run.tasks[i];
+      }
+    }
+    if (kept == 0) {
+      run.tasks[kept++] = run.tasks[rand_r(&seed) % run.task_count];
+    }
+    run.task_count = kept;
+  }
+
+  if (ret == 0 && run.task_count > 0) {
+    if (thread_count > run.task_count) {
+      thread_count = (int)run.task_count;
+    }
+    started = pipeline_start_stage(threads, thread_count, validate_worker, &run);
+    if (started == 0) {
+      ret = 1;
+    }
+    for (i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    if (run.failed > 0) {
+      ret = 1;
+    }
+  }
+  if (!found) {
+    /* Files unchanged since the parent have nothing stored in this backup */
+    PageMap map;
+    snprintf(path, sizeof(path), "%s/%s", backup_path, BACKUP_PAGE_MAP_FILE);
+    if (page_map_load(path, &map) == 0) {
+      found = page_map_find(&map, backup_ctx->validate_file) != NULL;
+      page_map_free(&map);
+    }
+  }
+  if (!found && backup_ctx->validate_mode != BACKUP_VALIDATE_ROOT) {
+    ret = 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", backup_path, BACKUP_LOG_DIR);
+  create_directory(path);
+  snprintf(path, sizeof(path), "%s/%s/%s", backup_path, BACKUP_LOG_DIR, BACKUP_VALIDATION_LOG);
+  fp = fopen(path, "a");
+  if (fp) {
+    fprintf(fp, "%ld mode %s file %s checked %lld failed %lld threads %d %.2fs %s\n", (long)time(NULL),
+            modes[backup_ctx->validate_mode], backup_ctx->validate_file ? backup_ctx->validate_file : "-",
+            run.task_count, run.failed, started, (clock_ns() - start) / 1e9, ret == 0 ? "ok" : "FAILED");
+    fclose(fp);
+  }
+
+  if (staged) {
+    snprintf(path, sizeof(path), "%s/%s", backup_path, BACKUP_DATA_DIR);
+    remove_tree(path, backup_ctx->read_threads > 0 ? backup_ctx->read_threads : 1);
+  }
+  free(run.tasks);
+  manifest_free(&manifest);
+  return ret;
+}
+
+/**
+  @brief Set a backup option.
+
+  @param [in] ctx   Backup context.
+  @param [in] name  Option name.
+  @param [in] value Option value.
+
+  @retval 0 success, 1 unknown option or invalid value.
+*/
+static int backup_set_option(void *ctx, const char *name, const char *value) {
+  BackupContext *backup_ctx = (BackupContext *)ctx;
+  char *end;
+  long number = strtol(value, &end, 10);
+  int is_number = end != value && *end == '\0';
+
+  if (strcmp(name, "datadir") == 0 && *value) {
+    char *datadir = strdup(value);
+    if (!datadir) {
+      return 1;
+    }
+    free(backup_ctx->datadir);
+    backup_ctx->datadir = datadir;
+  } else if (strcmp(name, "parent_backup") == 0) {
+    char *parent = *value ? strdup(value) : NULL;
+    if (*value && !parent) {
+      return 1;
+    }
+    free(backup_ctx->parent_backup_name);
+    backup_ctx->parent_backup_name = parent;
+  } else if (strcmp(name, "read_threads") == 0 && is_number && number >= 0 && number <= BACKUP_MAX_THREADS) {
+    backup_ctx->read_threads = (int)number;
+  } else if (strcmp(name, "compress_threads") == 0 && is_number && number >= 1 && number <= BACKUP_MAX_THREADS) {
+    backup_ctx->compress_threads = (int)number;
+  } else if (strcmp(name, "checksum_threads") == 0 && is_number && number >= 1 && number <= BACKUP_MAX_THREADS) {
+    backup_ctx->checksum_threads = (int)number;
+  } else if (strcmp(name, "restore_dir") == 0 || strcmp(name, "restore_file") == 0 || strcmp(name, "stream") == 0) {
+    char **target = name[1] == 't' ? &backup_ctx->stream
+                    : name[8] == 'd' ? &backup_ctx->restore_dir
+                                     : &backup_ctx->restore_file;
+    char *copy = *value ? strdup(value) : NULL;
+    if (*value && !copy) {
+      return 1;
+    }
+    free(*target);
+    *target = copy;
+  } else if (strcmp(name, "compression_level") == 0 && is_number && number >= 0 && number <= 9) {
+    backup_ctx->compression_level = (int)number;
+  } else if (strcmp(name, "dedup") == 0 && is_number && (number == 0 || number == 1)) {
+    backup_ctx->dedup = (int)number;
+  } else if (strcmp(name, "validate_mode") == 0 &&
+             (strcmp(value, "full") == 0 || strcmp(value, "root") == 0 || strcmp(value, "sample") == 0)) {
+    backup_ctx->validate_mode = value[0] == 'f' ? BACKUP_VALIDATE_FULL
+                                : value[0] == 'r' ? BACKUP_VALIDATE_ROOT
+                                                  : BACKUP_VALIDATE_SAMPLE;
+  } else if (strcmp(name, "validate_sample") == 0 && is_number && number >= 1 && number <= 100) {
+    backup_ctx->validate_sample = (int)number;
+  } else if (strcmp(name, "validate_file") == 0) {
+    char *file = *value ? strdup(value) : NULL;
+    if (*value && !file) {
+      return 1;
+    }
+    free(backup_ctx->validate_file);
+    backup_ctx->validate_file = file;
+  } else if (strcmp(name, "binlog_index") == 0) {
+    char *index = *value ? strdup(value) : NULL;
+    if (*value && !index) {
+      return 1;
+    }
+    free(backup_ctx->binlog_index);
+    backup_ctx->binlog_index = index;
+  } else if (strcmp(name, "binlog_archive") == 0 && is_number && (number == 0 || number == 1)) {
+    if (number == 0) {
+      binlog_archiver_stop(backup_ctx);
+    } else if (binlog_archiver_start(backup_ctx) != 0) {
+      return 1;
+    }
+  } else if (strcmp(name, "dirty_tracking") == 0 && is_number && (number == 0 || number == 1)) {
+    if (number == 0) {
+      dirty_tracker_stop(backup_ctx);
+    } else if (dirty_tracker_start(backup_ctx) != 0) {
+      return 1;
+    }
+  } else if (strcmp(name, "restore_time") == 0) {
+    struct tm tm;
+    const char *rest;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_isdst = -1;
+    if (!*value) {
+      backup_ctx->restore_time = 0;
+    } else if (is_number && number > 0) {
+      backup_ctx->restore_time = number;
+    } else if ((rest = strptime(value, "%Y-%m-%d %H:%M:%S", &tm)) != NULL && *rest == '\0') {
+      backup_ctx->restore_time = (long long)mktime(&tm);
+    } else {
+      return 1;
+    }
+  } else if ((strcmp(name, "read_limit_mb") == 0 || strcmp(name, "read_iops") == 0 ||
+              strcmp(name, "write_limit_mb") == 0 || strcmp(name, "write_iops") == 0) &&
+             is_number && number >= 0 && number <= 1000000) {
+    int write = name[0] == 'w';
+    int ops = strstr(name, "iops") != NULL;
+    backup_ctx->io_limits[write ? (ops ? BACKUP_THROTTLE_WRITE_OPS : BACKUP_THROTTLE_WRITE_BYTES)
+                                : (ops ? BACKUP_THROTTLE_READ_OPS : BACKUP_THROTTLE_READ_BYTES)] = (int)number;
+  } else if (strcmp(name, "throttle_adaptive") == 0 && is_number && (number == 0 || number == 1)) {
+    backup_ctx->throttle_adaptive = (int)number;
+  } else if (strcmp(name, "throttle_latency_ms") == 0 && is_number && number >= 1 && number <= 10000) {
+    backup_ctx->throttle_latency = (int)number;
+  } else if (strcmp(name, "throttle_queue_depth") == 0 && is_number && number >= 1 && number <= 1024) {
+    backup_ctx->throttle_queue = (int)number;
+  } else if (strcmp(name, "direct_io") == 0 && is_number && (number == 0 || number == 1)) {
+    backup_ctx->direct_io = (int)number;
+  } else if (strcmp(name, "io_engine") == 0 && (strcmp(value, "threads") == 0 || strcmp(value, "uring") == 0)) {
+    backup_ctx->io_uring = value[0] == 'u';
+  } else if ((strcmp(name, "retain_fulls") == 0 || strcmp(name, "retain_days") == 0 ||
+              strcmp(name, "retain_monthly") == 0) &&
+             is_number && number >= 0 && number <= BACKUP_MAX_RETAIN) {
+    int *policy = name[7] == 'f' ? &backup_ctx->retain_fulls
+                  : name[7] == 'd' ? &backup_ctx->retain_days
+                                   : &backup_ctx->retain_monthly;
+    *policy = (int)number;
+  } else if (strcmp(name, "checkpoint_interval") == 0 && is_number && number >= 0 && number <= 86400) {
+    backup_ctx->checkpoint_interval = (int)number;
+  } else if (strcmp(name, "queue_depth") == 0 && is_number && number >= 1 && number <= BACKUP_MAX_QUEUE_DEPTH) {
+    backup_ctx->queue_depth = (int)number;
+  } else {
+    return 1;
+  }
+
   return 0;
 }
 
@@ -461,7 +11543,8 @@ static st_mysql_incremental_backup_descriptor backup_descriptor = {
   backup_cleanup_backup,
   backup_validate_backup,
   backup_create_context,
-  backup_destroy_context
+  backup_destroy_context,
+  backup_set_option
 };
 
 /* Plugin declaration */
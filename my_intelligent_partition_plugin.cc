@@ -16,11 +16,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* MySQL plugin structures */
 struct st_mysql_plugin {
@@ -49,199 +60,4273 @@ typedef struct {
   int (*monitor_partition_performance)(void *ctx, const char *table_name, char **performance_data);
   void *(*create_context)(void);
   void (*destroy_context)(void *ctx);
+  int (*analyze_schema)(void *ctx, const char *schema_name, const char **tables, int table_count, int threads);
+  int (*recommend_schema)(void *ctx, const char *schema_name, const char **tables, int table_count, char **partition_scripts);
+  int (*apply_change_stream)(void *ctx, const char *table_name, const char *stream_file, const char *column_names);
+  int (*replay_workload)(void *ctx, const char *table_name, const char *workload_file);
+  int (*set_option)(void *ctx, const char *name, const char *value);
+  int (*analyze_export)(void *ctx, const char *table_name, const char *export_file, const char *column_names, int threads);
+  int (*advise_indexes)(void *ctx, const char *table_name, const char *index_definitions, char **advice);
 } st_mysql_intelligent_partition_descriptor;
 
+/* Column sketch dimensions */
+#define QSKETCH_BUCKETS 2560
+#define HLL_REGISTERS 4096
+#define CMS_DEPTH 4
+#define CMS_WIDTH 1024
+#define HEAVY_HITTERS 32
+
+/*
+  Relative-error quantile sketch over log-spaced buckets.  Bucket counts
+  can be decremented, so deleted rows are removed exactly, and two
+  sketches merge by adding their buckets.
+*/
+typedef struct {
+  long long positive[QSKETCH_BUCKETS];
+  long long negative[QSKETCH_BUCKETS];
+  long long zero;
+  long long count;
+  double min;
+  double max;
+} QuantileSketch;
+
+/* Heavy-hitter candidate tracked on top of the count-min sketch */
+typedef struct {
+  unsigned long long hash;
+  long long count;
+  char value[64];
+} HeavyHitter;
+
+/* Mergeable sketches for one column */
+typedef struct {
+  char *column_name;
+  QuantileSketch quantiles;
+  unsigned char hll[HLL_REGISTERS];
+  long long cms[CMS_DEPTH][CMS_WIDTH];
+  HeavyHitter heavy_hitters[HEAVY_HITTERS];
+  int heavy_hitter_count;
+  long long inserts;
+  long long deletes;
+} ColumnStats;
+
+/* Catalog hash buckets */
+#define CATALOG_BUCKETS 256
+
+/* Predicate usage of one column in the replayed workload */
+typedef struct {
+  char *column_name;
+  long long eq_predicates;
+  long long range_predicates;
+  long long bounded_ranges;
+  double log_width_sum;
+} PredicateStats;
+
+/* Per-table statistics kept in the catalog */
+typedef struct TableStats {
+  char *table_name;
+  time_t analysis_time;
+  long long row_count;
+  long long data_size;
+  char *partition_key;
+  char *partition_type;
+  ColumnStats **columns;
+  int column_count;
+  char *stream_file;
+  long long stream_offset;
+  long long change_count;
+  PredicateStats *predicates;
+  int predicate_count;
+  long long workload_queries;
+  int ref_count;
+  struct TableStats *next;
+} TableStats;
+
+/* Thread-safe catalog of table statistics, shared by all contexts */
+typedef struct {
+  TableStats *buckets[CATALOG_BUCKETS];
+  int table_count;
+  time_t max_age;
+  int dirty;
+  char *catalog_file;
+  int users;           /* the plugin and each context; guarded by g_catalog_mutex */
+  pthread_mutex_t lock;
+  pthread_mutex_t writers[CATALOG_BUCKETS]; /* serialize read-modify-write of the tables in a bucket */
+} PartitionCatalog;
+
+/* Partition layout tuning, settable per context */
+typedef struct {
+  long long target_partition_bytes;
+  long long open_files_limit;
+  double growth_bytes_per_day;
+  int projection_days;
+  int max_subpartitions;
+} PartitionTuning;
+
+/* Partition layout derived from statistics and tuning */
+typedef struct {
+  int partition_count;
+  int range_slices; /* equi-depth slices the RANGE boundaries come from */
+  int partition_cap;
+  int interval_days;
+  double first_boundary;
+  double growth_bytes_per_day;
+  double pruning_width;
+  double bytes_per_partition;
+  double days_until_split;
+  const char *limited_by;
+  const char *subpartition_column;
+  int subpartition_count;
+  int subpartition_by_key;
+  double hot_partition_bytes;
+  double hot_file_share;
+  const char *subpartition_note;
+} PartitionPlan;
+
 /* Partition context structure */
 typedef struct {
-  char *current_table;
-  time_t analysis_time;
-  int row_count;
-  int data_size;
-  char *partition_key;
-  char *partition_type;
-  int partition_count;
-  char *recommendation;
-  char *performance_metrics;
-} PartitionContext;
+  PartitionCatalog *catalog;
+  PartitionTuning tuning;
+  char *current_table;
+  char *recommendation;
+  char *performance_metrics;
+} PartitionContext;
+
+/* Plugin type definitions */
+#define MYSQL_INTELLIGENT_PARTITION_PLUGIN 15
+#define PLUGIN_LICENSE_GPL "GPL"
+
+/* Partition types */
+#define PARTITION_TYPE_RANGE "RANGE"
+#define PARTITION_TYPE_LIST "LIST"
+#define PARTITION_TYPE_HASH "HASH"
+#define PARTITION_TYPE_KEY "KEY"
+#define PARTITION_TYPE_TIME "TIME"
+
+/* Catalog settings */
+#define CATALOG_FILE "partition_stats.catalog"
+#define CATALOG_MAGIC 0x4350534dU /* "MSPC" */
+#define CATALOG_VERSION 3
+#define CATALOG_MAX_AGE 3600 /* 1 hour */
+#define ANALYZE_MAX_THREADS 64
+
+/* Partition layout defaults */
+#define DEFAULT_TARGET_PARTITION_BYTES (1024LL * 1024 * 1024) /* 1GB */
+#define DEFAULT_PROJECTION_DAYS 365
+#define MAX_PARTITIONS 8192
+#define MIN_PARTITIONS 2
+#define MIN_PARTITION_FRACTION 16 /* smallest partition worth pruning: target / 16 */
+#define DEFAULT_MAX_SUBPARTITIONS 64
+#define MAX_SUBPARTITIONS 1024
+#define SUBPARTITION_BALANCE_SLACK 1.1 /* accept within 10% of the best achievable balance */
+
+static PartitionCatalog *g_partition_catalog = NULL;
+static pthread_mutex_t g_catalog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PartitionCatalog *g_plugin_catalog = NULL; /* the plugin's own reference */
+
+/**
+  @brief Finalize a 64-bit hash (splitmix64).
+
+  @param [in] x Value to mix.
+
+  @retval Mixed value.
+*/
+static unsigned long long mix64(unsigned long long x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/**
+  @brief Hash a column value.
+
+  Numeric values hash by value so that 5 and 5.0 collide on purpose.
+
+  @param [in] value      Value text.
+  @param [in] is_numeric Whether the value parsed as a number.
+  @param [in] number     Parsed numeric value.
+
+  @retval 64-bit hash.
+*/
+static unsigned long long column_value_hash(const char *value, int is_numeric, double number) {
+  unsigned long long hash = 14695981039346656037ULL;
+
+  if (is_numeric) {
+    unsigned long long bits;
+    if (number == (double)(long long)number) {
+      bits = (unsigned long long)(long long)number;
+    } else {
+      memcpy(&bits, &number, sizeof(bits));
+    }
+    return mix64(bits);
+  }
+  while (*value) {
+    hash ^= (unsigned char)*value++;
+    hash *= 1099511628211ULL;
+  }
+  return mix64(hash);
+}
+
+/**
+  @brief Parse a column value as a number.
+
+  Integers and decimals are taken as-is; 'YYYY-MM-DD[ HH:MM:SS]' dates are
+  converted to UTC epoch seconds so time columns get quantiles too.
+
+  @param [in]  value  Value text.
+  @param [out] number Parsed value.
+
+  @retval 1 if numeric, 0 otherwise.
+*/
+static int parse_column_number(const char *value, double *number) {
+  char *end;
+  int year, month, day, hour = 0, minute = 0, second = 0;
+
+  if (!*value) {
+    return 0;
+  }
+  *number = strtod(value, &end);
+  if (end != value && *end == '\0') {
+    return 1;
+  }
+  /* Only 'YYYY-' prefixes are worth a full date parse */
+  if (!isdigit((unsigned char)value[0]) || !isdigit((unsigned char)value[1]) ||
+      !isdigit((unsigned char)value[2]) || !isdigit((unsigned char)value[3]) || value[4] != '-') {
+    return 0;
+  }
+  if (sscanf(value, "%4d-%2d-%2d %2d:%2d:%2d", &year, &month, &day, &hour, &minute, &second) >= 3 &&
+      month >= 1 && month <= 12 && day >= 1 && day <= 31) {
+    /* Days from civil date, proleptic Gregorian */
+    int y = year - (month <= 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long long days = (long long)era * 146097 + doe - 719468;
+    *number = (double)(days * 86400 + hour * 3600 + minute * 60 + second);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  @brief Map a positive magnitude to its quantile bucket.
+
+  @param [in] magnitude Absolute value, greater than zero.
+
+  @retval Bucket index.
+*/
+static int quantile_bucket(double magnitude) {
+  /* gamma = 1.02 gives 1% relative error; offset covers values down to 1e-3 */
+  int index = (int)ceil(log(magnitude) / log(1.02)) + 350;
+  if (index < 0) {
+    return 0;
+  }
+  if (index >= QSKETCH_BUCKETS) {
+    return QSKETCH_BUCKETS - 1;
+  }
+  return index;
+}
+
+/**
+  @brief Representative magnitude of a quantile bucket.
+
+  @param [in] index Bucket index.
+
+  @retval Bucket midpoint.
+*/
+static double quantile_bucket_value(int index) {
+  return 2.0 * pow(1.02, index - 350) / 2.02;
+}
+
+/**
+  @brief Add or remove a value from a quantile sketch.
+
+  @param [in] sketch Quantile sketch.
+  @param [in] number Value.
+  @param [in] delta  +1 for an insert, -1 for a delete.
+*/
+static void quantile_sketch_update(QuantileSketch *sketch, double number, int delta) {
+  if (number > 0) {
+    sketch->positive[quantile_bucket(number)] += delta;
+  } else if (number < 0) {
+    sketch->negative[quantile_bucket(-number)] += delta;
+  } else {
+    sketch->zero += delta;
+  }
+  if (sketch->count == 0 && delta > 0) {
+    sketch->min = number;
+    sketch->max = number;
+  } else if (delta > 0) {
+    if (number < sketch->min) sketch->min = number;
+    if (number > sketch->max) sketch->max = number;
+  }
+  sketch->count += delta;
+}
+
+/**
+  @brief Query a quantile.
+
+  @param [in] sketch Quantile sketch.
+  @param [in] q      Quantile in [0, 1].
+
+  @retval Estimated value, 0 for an empty sketch.
+*/
+static double quantile_sketch_query(const QuantileSketch *sketch, double q) {
+  long long rank;
+  long long seen = 0;
+  double value = 0;
+  int i;
+
+  if (sketch->count <= 0) {
+    return 0;
+  }
+  rank = (long long)(q * (double)(sketch->count - 1));
+
+  for (i = QSKETCH_BUCKETS - 1; i >= 0; i--) {
+    seen += sketch->negative[i];
+    if (seen > rank) {
+      value = -quantile_bucket_value(i);
+      goto found;
+    }
+  }
+  seen += sketch->zero;
+  if (seen > rank) {
+    goto found;
+  }
+  for (i = 0; i < QSKETCH_BUCKETS; i++) {
+    seen += sketch->positive[i];
+    if (seen > rank) {
+      value = quantile_bucket_value(i);
+      goto found;
+    }
+  }
+  value = sketch->max;
+
+found:
+  if (value < sketch->min) value = sketch->min;
+  if (value > sketch->max) value = sketch->max;
+  return value;
+}
+
+/**
+  @brief Estimate distinct values from the HyperLogLog registers.
+
+  HyperLogLog cannot forget deleted values, so the estimate is capped by
+  the number of live rows.
+
+  @param [in] column Column statistics.
+
+  @retval Estimated number of distinct values.
+*/
+static long long column_distinct_values(const ColumnStats *column) {
+  double sum = 0;
+  double estimate;
+  int zeros = 0;
+  int i;
+  long long live = column->inserts - column->deletes;
+
+  for (i = 0; i < HLL_REGISTERS; i++) {
+    sum += ldexp(1.0, -column->hll[i]);
+    if (column->hll[i] == 0) {
+      zeros++;
+    }
+  }
+  estimate = (0.7213 / (1.0 + 1.079 / HLL_REGISTERS)) * HLL_REGISTERS * HLL_REGISTERS / sum;
+  if (estimate <= 2.5 * HLL_REGISTERS && zeros > 0) {
+    /* Linear counting for small cardinalities */
+    estimate = HLL_REGISTERS * log((double)HLL_REGISTERS / zeros);
+  }
+  if (live >= 0 && estimate > (double)live) {
+    estimate = (double)live;
+  }
+  return (long long)(estimate + 0.5);
+}
+
+/**
+  @brief Estimate the frequency of a value from the count-min sketch.
+
+  @param [in] column Column statistics.
+  @param [in] hash   Value hash.
+
+  @retval Estimated frequency.
+*/
+static long long cms_estimate(const ColumnStats *column, unsigned long long hash) {
+  long long estimate = 0;
+  int d;
+
+  for (d = 0; d < CMS_DEPTH; d++) {
+    long long count = column->cms[d][mix64(hash + d) % CMS_WIDTH];
+    if (d == 0 || count < estimate) {
+      estimate = count;
+    }
+  }
+  return estimate;
+}
+
+/**
+  @brief Offer a value to the heavy-hitter candidate list.
+
+  @param [in] column Column statistics.
+  @param [in] hash   Value hash.
+  @param [in] value  Value text.
+  @param [in] count  Current frequency estimate.
+*/
+static void heavy_hitter_offer(ColumnStats *column, unsigned long long hash, const char *value, long long count) {
+  int smallest = -1;
+  size_t len;
+  int i;
+
+  for (i = 0; i < column->heavy_hitter_count; i++) {
+    if (column->heavy_hitters[i].hash == hash) {
+      column->heavy_hitters[i].count = count;
+      return;
+    }
+    if (smallest < 0 || column->heavy_hitters[i].count < column->heavy_hitters[smallest].count) {
+      smallest = i;
+    }
+  }
+  if (column->heavy_hitter_count < HEAVY_HITTERS) {
+    smallest = column->heavy_hitter_count++;
+  } else if (count <= column->heavy_hitters[smallest].count) {
+    return;
+  }
+  column->heavy_hitters[smallest].hash = hash;
+  column->heavy_hitters[smallest].count = count;
+  len = strnlen(value, sizeof(column->heavy_hitters[smallest].value) - 1);
+  memcpy(column->heavy_hitters[smallest].value, value, len);
+  column->heavy_hitters[smallest].value[len] = '\0';
+}
+
+/**
+  @brief Apply one inserted or deleted value to a column's sketches.
+
+  @param [in] column Column statistics.
+  @param [in] value  Value text, unquoted.
+  @param [in] delta  +1 for an insert, -1 for a delete.
+*/
+static void column_stats_update(ColumnStats *column, const char *value, int delta) {
+  double number = 0;
+  int is_numeric = parse_column_number(value, &number);
+  unsigned long long hash = column_value_hash(value, is_numeric, number);
+  long long estimate = 0;
+  int d;
+
+  if (delta > 0) {
+    /* HyperLogLog: trailing zeros of the remaining hash bits, plus one */
+    unsigned int reg = (unsigned int)(hash & (HLL_REGISTERS - 1));
+    unsigned long long rest = hash >> 12;
+    unsigned char rank = rest ? (unsigned char)(__builtin_ctzll(rest) + 1) : 53;
+    if (rank > column->hll[reg]) {
+      column->hll[reg] = rank;
+    }
+    column->inserts++;
+  } else {
+    column->deletes++;
+  }
+
+  if (is_numeric) {
+    quantile_sketch_update(&column->quantiles, number, delta);
+  }
+
+  /* Count-Min: the updated counters give the estimate directly */
+  for (d = 0; d < CMS_DEPTH; d++) {
+    long long count = column->cms[d][mix64(hash + d) % CMS_WIDTH] += delta;
+    if (d == 0 || count < estimate) {
+      estimate = count;
+    }
+  }
+  heavy_hitter_offer(column, hash, value, estimate);
+}
+
+/**
+  @brief Merge the sketches of one column into another.
+
+  @param [in] dst Destination column statistics.
+  @param [in] src Source column statistics.
+*/
+static void column_stats_merge(ColumnStats *dst, const ColumnStats *src) {
+  HeavyHitter candidates[HEAVY_HITTERS * 2];
+  int candidate_count = 0;
+  int i, d;
+
+  if (src->quantiles.count > 0) {
+    if (dst->quantiles.count == 0 || src->quantiles.min < dst->quantiles.min) {
+      dst->quantiles.min = src->quantiles.min;
+    }
+    if (dst->quantiles.count == 0 || src->quantiles.max > dst->quantiles.max) {
+      dst->quantiles.max = src->quantiles.max;
+    }
+  }
+  for (i = 0; i < QSKETCH_BUCKETS; i++) {
+    dst->quantiles.positive[i] += src->quantiles.positive[i];
+    dst->quantiles.negative[i] += src->quantiles.negative[i];
+  }
+  dst->quantiles.zero += src->quantiles.zero;
+  dst->quantiles.count += src->quantiles.count;
+
+  for (i = 0; i < HLL_REGISTERS; i++) {
+    if (src->hll[i] > dst->hll[i]) {
+      dst->hll[i] = src->hll[i];
+    }
+  }
+  for (d = 0; d < CMS_DEPTH; d++) {
+    for (i = 0; i < CMS_WIDTH; i++) {
+      dst->cms[d][i] += src->cms[d][i];
+    }
+  }
+  dst->inserts += src->inserts;
+  dst->deletes += src->deletes;
+
+  /* Re-rank the union of both candidate lists against the merged counts */
+  memcpy(candidates, dst->heavy_hitters, dst->heavy_hitter_count * sizeof(HeavyHitter));
+  candidate_count = dst->heavy_hitter_count;
+  memcpy(candidates + candidate_count, src->heavy_hitters, src->heavy_hitter_count * sizeof(HeavyHitter));
+  candidate_count += src->heavy_hitter_count;
+  dst->heavy_hitter_count = 0;
+  for (i = 0; i < candidate_count; i++) {
+    heavy_hitter_offer(dst, candidates[i].hash, candidates[i].value, cms_estimate(dst, candidates[i].hash));
+  }
+}
+
+/**
+  @brief Find a column's statistics.
+
+  @param [in] stats       Table statistics.
+  @param [in] column_name Column name.
+
+  @retval Column statistics, or NULL if the column has no sketches.
+*/
+static ColumnStats *table_stats_find_column(const TableStats *stats, const char *column_name) {
+  int i;
+
+  for (i = 0; i < stats->column_count; i++) {
+    if (strcmp(stats->columns[i]->column_name, column_name) == 0) {
+      return stats->columns[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+  @brief Find a column's statistics, optionally adding it.
+
+  @param [in] stats       Table statistics.
+  @param [in] column_name Column name.
+  @param [in] create      Add the column if it is missing.
+
+  @retval Column statistics, or NULL if missing or out of memory.
+*/
+static ColumnStats *table_stats_column(TableStats *stats, const char *column_name, int create) {
+  ColumnStats *column = table_stats_find_column(stats, column_name);
+  ColumnStats **grown;
+
+  if (column || !create) {
+    return column;
+  }
+
+  grown = (ColumnStats **)realloc(stats->columns, (stats->column_count + 1) * sizeof(ColumnStats *));
+  if (!grown) {
+    return NULL;
+  }
+  stats->columns = grown;
+
+  column = (ColumnStats *)calloc(1, sizeof(ColumnStats));
+  if (!column) {
+    return NULL;
+  }
+  column->column_name = strdup(column_name);
+  if (!column->column_name) {
+    free(column);
+    return NULL;
+  }
+  stats->columns[stats->column_count++] = column;
+
+  return column;
+}
+
+/**
+  @brief Hash a table name into a catalog bucket.
+
+  @param [in] table_name Table name.
+
+  @retval Bucket index.
+*/
+static unsigned int catalog_bucket(const char *table_name) {
+  unsigned int hash = 2166136261U;
+  while (*table_name) {
+    hash ^= (unsigned char)*table_name++;
+    hash *= 16777619U;
+  }
+  return hash % CATALOG_BUCKETS;
+}
+
+/**
+  @brief Free table statistics.
+
+  @param [in] stats Statistics to free.
+*/
+static void table_stats_free(TableStats *stats) {
+  if (stats) {
+    int i;
+    for (i = 0; i < stats->column_count; i++) {
+      free(stats->columns[i]->column_name);
+      free(stats->columns[i]);
+    }
+    if (stats->columns) free(stats->columns);
+    for (i = 0; i < stats->predicate_count; i++) {
+      free(stats->predicates[i].column_name);
+    }
+    if (stats->predicates) free(stats->predicates);
+    if (stats->table_name) free(stats->table_name);
+    if (stats->partition_key) free(stats->partition_key);
+    if (stats->partition_type) free(stats->partition_type);
+    if (stats->stream_file) free(stats->stream_file);
+    free(stats);
+  }
+}
+
+/**
+  @brief Copy the column sketches, change-stream position and workload of a table.
+
+  @param [in] dst Destination statistics, without columns.
+  @param [in] src Source statistics.
+
+  @retval 0 success, 1 failure.
+*/
+static int table_stats_copy_columns(TableStats *dst, const TableStats *src) {
+  int i;
+
+  for (i = 0; i < src->column_count; i++) {
+    ColumnStats *column = table_stats_column(dst, src->columns[i]->column_name, 1);
+    if (!column) {
+      return 1;
+    }
+    column_stats_merge(column, src->columns[i]);
+  }
+  if (src->stream_file) {
+    dst->stream_file = strdup(src->stream_file);
+    if (!dst->stream_file) {
+      return 1;
+    }
+  }
+  dst->stream_offset = src->stream_offset;
+  dst->change_count = src->change_count;
+
+  if (src->predicate_count > 0) {
+    dst->predicates = (PredicateStats *)calloc(src->predicate_count, sizeof(PredicateStats));
+    if (!dst->predicates) {
+      return 1;
+    }
+    for (i = 0; i < src->predicate_count; i++) {
+      dst->predicates[i] = src->predicates[i];
+      dst->predicates[i].column_name = strdup(src->predicates[i].column_name);
+      if (!dst->predicates[i].column_name) {
+        return 1;
+      }
+      dst->predicate_count++;
+    }
+  }
+  dst->workload_queries = src->workload_queries;
+
+  return 0;
+}
+
+/**
+  @brief Release a reference obtained from catalog_lookup().
+
+  Entries replaced in the catalog stay alive until the last reader
+  releases them, so readers never block writers for long.
+
+  @param [in] catalog Statistics catalog.
+  @param [in] stats   Statistics entry to release.
+*/
+static void catalog_release(PartitionCatalog *catalog, TableStats *stats) {
+  int ref_count;
+
+  if (!stats) {
+    return;
+  }
+  pthread_mutex_lock(&catalog->lock);
+  ref_count = --stats->ref_count;
+  pthread_mutex_unlock(&catalog->lock);
+
+  if (ref_count == 0) {
+    table_stats_free(stats);
+  }
+}
+
+/**
+  @brief Look up table statistics.
+
+  @param [in] catalog    Statistics catalog.
+  @param [in] table_name Table name.
+  @param [in] fresh_only Ignore entries older than the catalog max age.
+
+  @retval Referenced statistics entry, or NULL if not found.
+*/
+static TableStats *catalog_lookup(PartitionCatalog *catalog, const char *table_name, int fresh_only) {
+  TableStats *stats;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&catalog->lock);
+  for (stats = catalog->buckets[catalog_bucket(table_name)]; stats; stats = stats->next) {
+    if (strcmp(stats->table_name, table_name) == 0) {
+      break;
+    }
+  }
+  if (stats && fresh_only && now - stats->analysis_time > catalog->max_age) {
+    stats = NULL;
+  }
+  if (stats) {
+    stats->ref_count++;
+  }
+  pthread_mutex_unlock(&catalog->lock);
+
+  return stats;
+}
+
+/**
+  @brief Start updating the statistics of a table.
+
+  Updates clone the published entry, change the copy and publish it
+  with catalog_put(); holding the table's writer lock from the lookup to
+  the put keeps two updates of one table from both starting from the
+  same entry, which would drop the first one published.  Readers are not
+  blocked.  The lock is recursive, and covers every table of a bucket.
+
+  @param [in] catalog    Statistics catalog.
+  @param [in] table_name Table name.
+*/
+static void catalog_write_begin(PartitionCatalog *catalog, const char *table_name) {
+  pthread_mutex_lock(&catalog->writers[catalog_bucket(table_name)]);
+}
+
+/**
+  @brief Finish updating the statistics of a table.
+
+  @param [in] catalog    Statistics catalog.
+  @param [in] table_name Table name.
+*/
+static void catalog_write_end(PartitionCatalog *catalog, const char *table_name) {
+  pthread_mutex_unlock(&catalog->writers[catalog_bucket(table_name)]);
+}
+
+/**
+  @brief Insert or replace table statistics.
+
+  The catalog takes ownership of the entry.  Callers that derive the
+  entry from the published one hold the table's writer lock.
+
+  @param [in] catalog Statistics catalog.
+  @param [in] stats   New statistics entry.
+*/
+static void catalog_put(PartitionCatalog *catalog, TableStats *stats) {
+  TableStats **link;
+  TableStats *old = NULL;
+  int free_old = 0;
+  unsigned int bucket = catalog_bucket(stats->table_name);
+
+  stats->ref_count = 1;
+
+  pthread_mutex_lock(&catalog->lock);
+  for (link = &catalog->buckets[bucket]; *link; link = &(*link)->next) {
+    if (strcmp((*link)->table_name, stats->table_name) == 0) {
+      old = *link;
+      *link = old->next;
+      break;
+    }
+  }
+  stats->next = catalog->buckets[bucket];
+  catalog->buckets[bucket] = stats;
+  if (old) {
+    old->next = NULL;
+    free_old = (--old->ref_count == 0);
+  } else {
+    catalog->table_count++;
+  }
+  catalog->dirty = 1;
+  pthread_mutex_unlock(&catalog->lock);
+
+  if (free_old) {
+    table_stats_free(old);
+  }
+}
+
+/**
+  @brief Write a length-prefixed string to the catalog file.
+
+  @param [in] fp  Catalog file.
+  @param [in] str String to write, may be NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_write_string(FILE *fp, const char *str) {
+  unsigned int len = str ? (unsigned int)strlen(str) : 0;
+
+  if (fwrite(&len, sizeof(len), 1, fp) != 1) {
+    return 1;
+  }
+  if (len && fwrite(str, 1, len, fp) != len) {
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  @brief Read a length-prefixed string from the catalog file.
+
+  @param [in] fp Catalog file.
+
+  @retval Allocated string, or NULL on failure.
+*/
+static char *catalog_read_string(FILE *fp) {
+  unsigned int len;
+  char *str;
+
+  if (fread(&len, sizeof(len), 1, fp) != 1 || len > 4096) {
+    return NULL;
+  }
+  str = (char *)malloc(len + 1);
+  if (!str) {
+    return NULL;
+  }
+  if (len && fread(str, 1, len, fp) != len) {
+    free(str);
+    return NULL;
+  }
+  str[len] = '\0';
+  return str;
+}
+
+/**
+  @brief Write the non-zero entries of a counter array.
+
+  @param [in] fp     Catalog file.
+  @param [in] counts Counter array.
+  @param [in] size   Number of counters.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_write_counts(FILE *fp, const long long *counts, int size) {
+  int nonzero = 0;
+  int i;
+
+  for (i = 0; i < size; i++) {
+    if (counts[i]) nonzero++;
+  }
+  if (fwrite(&nonzero, sizeof(nonzero), 1, fp) != 1) {
+    return 1;
+  }
+  for (i = 0; i < size; i++) {
+    if (counts[i] &&
+        (fwrite(&i, sizeof(i), 1, fp) != 1 || fwrite(&counts[i], sizeof(long long), 1, fp) != 1)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+  @brief Read a counter array written by catalog_write_counts().
+
+  @param [in]  fp     Catalog file.
+  @param [out] counts Counter array, zeroed by the caller.
+  @param [in]  size   Number of counters.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_read_counts(FILE *fp, long long *counts, int size) {
+  int nonzero;
+  int i;
+
+  if (fread(&nonzero, sizeof(nonzero), 1, fp) != 1 || nonzero < 0 || nonzero > size) {
+    return 1;
+  }
+  for (i = 0; i < nonzero; i++) {
+    int index;
+    long long count;
+    if (fread(&index, sizeof(index), 1, fp) != 1 || fread(&count, sizeof(count), 1, fp) != 1 ||
+        index < 0 || index >= size) {
+      return 1;
+    }
+    counts[index] = count;
+  }
+  return 0;
+}
+
+/**
+  @brief Write the sketches of one column to the catalog file.
+
+  @param [in] fp     Catalog file.
+  @param [in] column Column statistics.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_write_column(FILE *fp, const ColumnStats *column) {
+  const QuantileSketch *q = &column->quantiles;
+  long long counters[4];
+  double bounds[2];
+  int d;
+
+  counters[0] = column->inserts;
+  counters[1] = column->deletes;
+  counters[2] = q->count;
+  counters[3] = q->zero;
+  bounds[0] = q->min;
+  bounds[1] = q->max;
+
+  if (catalog_write_string(fp, column->column_name) ||
+      fwrite(counters, sizeof(counters), 1, fp) != 1 ||
+      fwrite(bounds, sizeof(bounds), 1, fp) != 1 ||
+      catalog_write_counts(fp, q->positive, QSKETCH_BUCKETS) ||
+      catalog_write_counts(fp, q->negative, QSKETCH_BUCKETS) ||
+      fwrite(column->hll, sizeof(column->hll), 1, fp) != 1) {
+    return 1;
+  }
+  for (d = 0; d < CMS_DEPTH; d++) {
+    if (catalog_write_counts(fp, column->cms[d], CMS_WIDTH)) {
+      return 1;
+    }
+  }
+  if (fwrite(&column->heavy_hitter_count, sizeof(int), 1, fp) != 1 ||
+      (column->heavy_hitter_count &&
+       fwrite(column->heavy_hitters, sizeof(HeavyHitter), column->heavy_hitter_count, fp) !=
+           (size_t)column->heavy_hitter_count)) {
+    return 1;
+  }
+  return 0;
+}
+
+/**
+  @brief Read the sketches of one column from the catalog file.
+
+  @param [in] fp    Catalog file.
+  @param [in] stats Table statistics receiving the column.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_read_column(FILE *fp, TableStats *stats) {
+  ColumnStats *column;
+  long long counters[4];
+  double bounds[2];
+  char *column_name = catalog_read_string(fp);
+  int d;
+
+  if (!column_name) {
+    return 1;
+  }
+  column = table_stats_column(stats, column_name, 1);
+  free(column_name);
+  if (!column ||
+      fread(counters, sizeof(counters), 1, fp) != 1 ||
+      fread(bounds, sizeof(bounds), 1, fp) != 1 ||
+      catalog_read_counts(fp, column->quantiles.positive, QSKETCH_BUCKETS) ||
+      catalog_read_counts(fp, column->quantiles.negative, QSKETCH_BUCKETS) ||
+      fread(column->hll, sizeof(column->hll), 1, fp) != 1) {
+    return 1;
+  }
+  for (d = 0; d < CMS_DEPTH; d++) {
+    if (catalog_read_counts(fp, column->cms[d], CMS_WIDTH)) {
+      return 1;
+    }
+  }
+  if (fread(&column->heavy_hitter_count, sizeof(int), 1, fp) != 1 ||
+      column->heavy_hitter_count < 0 || column->heavy_hitter_count > HEAVY_HITTERS ||
+      fread(column->heavy_hitters, sizeof(HeavyHitter), column->heavy_hitter_count, fp) !=
+          (size_t)column->heavy_hitter_count) {
+    return 1;
+  }
+  column->inserts = counters[0];
+  column->deletes = counters[1];
+  column->quantiles.count = counters[2];
+  column->quantiles.zero = counters[3];
+  column->quantiles.min = bounds[0];
+  column->quantiles.max = bounds[1];
+
+  return 0;
+}
+
+/**
+  @brief Persist the catalog to disk.
+
+  The catalog is written to a temporary file and renamed into place so
+  a crash never leaves a truncated catalog behind.
+
+  @param [in] catalog Statistics catalog.
+
+  @retval 0 success, 1 failure.
+*/
+static int catalog_save(PartitionCatalog *catalog) {
+  char tmp_file[1024];
+  unsigned int header[3];
+  FILE *fp;
+  int ret = 0;
+  int i;
+
+  snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", catalog->catalog_file);
+  fp = fopen(tmp_file, "wb");
+  if (!fp) {
+    return 1;
+  }
+
+  pthread_mutex_lock(&catalog->lock);
+  header[0] = CATALOG_MAGIC;
+  header[1] = CATALOG_VERSION;
+  header[2] = (unsigned int)catalog->table_count;
+  if (fwrite(header, sizeof(header), 1, fp) != 1) {
+    ret = 1;
+  }
+  for (i = 0; i < CATALOG_BUCKETS && ret == 0; i++) {
+    TableStats *stats;
+    for (stats = catalog->buckets[i]; stats && ret == 0; stats = stats->next) {
+      long long values[6];
+      int c;
+      values[0] = (long long)stats->analysis_time;
+      values[1] = stats->row_count;
+      values[2] = stats->data_size;
+      values[3] = stats->stream_offset;
+      values[4] = stats->change_count;
+      values[5] = stats->workload_queries;
+      if (catalog_write_string(fp, stats->table_name) ||
+          catalog_write_string(fp, stats->partition_key) ||
+          catalog_write_string(fp, stats->partition_type) ||
+          catalog_write_string(fp, stats->stream_file) ||
+          fwrite(values, sizeof(values), 1, fp) != 1 ||
+          fwrite(&stats->column_count, sizeof(int), 1, fp) != 1) {
+        ret = 1;
+      }
+      for (c = 0; c < stats->column_count && ret == 0; c++) {
+        ret = catalog_write_column(fp, stats->columns[c]);
+      }
+      if (ret == 0 && fwrite(&stats->predicate_count, sizeof(int), 1, fp) != 1) {
+        ret = 1;
+      }
+      for (c = 0; c < stats->predicate_count && ret == 0; c++) {
+        const PredicateStats *predicate = &stats->predicates[c];
+        long long counts[3];
+        counts[0] = predicate->eq_predicates;
+        counts[1] = predicate->range_predicates;
+        counts[2] = predicate->bounded_ranges;
+        if (catalog_write_string(fp, predicate->column_name) ||
+            fwrite(counts, sizeof(counts), 1, fp) != 1 ||
+            fwrite(&predicate->log_width_sum, sizeof(double), 1, fp) != 1) {
+          ret = 1;
+        }
+      }
+    }
+  }
+  if (ret == 0) {
+    catalog->dirty = 0;
+  }
+  pthread_mutex_unlock(&catalog->lock);
+
+  if (fclose(fp) != 0) {
+    ret = 1;
+  }
+  if (ret == 0 && rename(tmp_file, catalog->catalog_file) != 0) {
+    ret = 1;
+  }
+  if (ret != 0) {
+    unlink(tmp_file);
+  }
+
+  return ret;
+}
+
+/**
+  @brief Load the catalog from disk.
+
+  A missing or unreadable catalog file simply leaves the catalog empty.
+
+  @param [in] catalog Statistics catalog.
+
+  @retval Number of entries loaded.
+*/
+static int catalog_load(PartitionCatalog *catalog) {
+  unsigned int header[3];
+  unsigned int i;
+  int loaded = 0;
+  FILE *fp = fopen(catalog->catalog_file, "rb");
+
+  if (!fp) {
+    return 0;
+  }
+  if (fread(header, sizeof(header), 1, fp) != 1 ||
+      header[0] != CATALOG_MAGIC || header[1] != CATALOG_VERSION) {
+    /* Catalogs from older versions are rebuilt by the next analysis */
+    fclose(fp);
+    return 0;
+  }
+
+  for (i = 0; i < header[2]; i++) {
+    long long values[6];
+    int column_count = 0;
+    int predicate_count = 0;
+    int c;
+    TableStats *stats = (TableStats *)calloc(1, sizeof(TableStats));
+    if (!stats) {
+      break;
+    }
+    stats->table_name = catalog_read_string(fp);
+    stats->partition_key = catalog_read_string(fp);
+    stats->partition_type = catalog_read_string(fp);
+    stats->stream_file = catalog_read_string(fp);
+    if (!stats->table_name || !stats->partition_key || !stats->partition_type || !stats->stream_file ||
+        fread(values, sizeof(values), 1, fp) != 1 ||
+        fread(&column_count, sizeof(int), 1, fp) != 1) {
+      table_stats_free(stats);
+      break;
+    }
+    for (c = 0; c < column_count; c++) {
+      if (catalog_read_column(fp, stats) != 0) {
+        break;
+      }
+    }
+    if (c < column_count || fread(&predicate_count, sizeof(int), 1, fp) != 1 ||
+        predicate_count < 0 || predicate_count > 4096) {
+      table_stats_free(stats);
+      break;
+    }
+    stats->predicates = predicate_count ? (PredicateStats *)calloc(predicate_count, sizeof(PredicateStats)) : NULL;
+    for (c = 0; c < predicate_count && stats->predicates; c++) {
+      PredicateStats *predicate = &stats->predicates[c];
+      long long counts[3];
+      predicate->column_name = catalog_read_string(fp);
+      if (!predicate->column_name) {
+        break;
+      }
+      stats->predicate_count++;
+      if (fread(counts, sizeof(counts), 1, fp) != 1 ||
+          fread(&predicate->log_width_sum, sizeof(double), 1, fp) != 1) {
+        break;
+      }
+      predicate->eq_predicates = counts[0];
+      predicate->range_predicates = counts[1];
+      predicate->bounded_ranges = counts[2];
+    }
+    if (c < predicate_count) {
+      table_stats_free(stats);
+      break;
+    }
+    if (!*stats->stream_file) {
+      free(stats->stream_file);
+      stats->stream_file = NULL;
+    }
+    stats->analysis_time = (time_t)values[0];
+    stats->row_count = values[1];
+    stats->data_size = values[2];
+    stats->stream_offset = values[3];
+    stats->change_count = values[4];
+    stats->workload_queries = values[5];
+    catalog_put(catalog, stats);
+    loaded++;
+  }
+
+  fclose(fp);
+  catalog->dirty = 0;
+  return loaded;
+}
+
+/**
+  @brief Create a statistics catalog and load it from disk.
+
+  @retval Catalog, or NULL on failure.
+*/
+static PartitionCatalog *catalog_create(void) {
+  PartitionCatalog *catalog = (PartitionCatalog *)calloc(1, sizeof(PartitionCatalog));
+  pthread_mutexattr_t attr;
+  int i;
+
+  if (!catalog) {
+    return NULL;
+  }
+
+  catalog->max_age = CATALOG_MAX_AGE;
+  catalog->catalog_file = strdup(CATALOG_FILE);
+  if (!catalog->catalog_file) {
+    free(catalog);
+    return NULL;
+  }
+  pthread_mutex_init(&catalog->lock, NULL);
+  pthread_mutexattr_init(&attr);
+  /* A writer may refresh the table it is updating */
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  for (i = 0; i < CATALOG_BUCKETS; i++) {
+    pthread_mutex_init(&catalog->writers[i], &attr);
+  }
+  pthread_mutexattr_destroy(&attr);
+  catalog_load(catalog);
+  return catalog;
+}
+
+/**
+  @brief Destroy a statistics catalog, saving pending changes.
+
+  @param [in] catalog Catalog no one uses any more.
+*/
+static void catalog_destroy(PartitionCatalog *catalog) {
+  int i;
+
+  if (catalog->dirty) {
+    catalog_save(catalog);
+  }
+  for (i = 0; i < CATALOG_BUCKETS; i++) {
+    TableStats *stats = catalog->buckets[i];
+    while (stats) {
+      TableStats *next = stats->next;
+      table_stats_free(stats);
+      stats = next;
+    }
+  }
+  pthread_mutex_destroy(&catalog->lock);
+  for (i = 0; i < CATALOG_BUCKETS; i++) {
+    pthread_mutex_destroy(&catalog->writers[i]);
+  }
+  free(catalog->catalog_file);
+  free(catalog);
+}
+
+/**
+  @brief Take a reference to the shared statistics catalog, creating it if needed.
+
+  The plugin holds one reference between init and deinit and every
+  context one for its lifetime, so a context that outlives deinit keeps
+  a valid catalog, and a later init loads a fresh one.
+
+  @retval Catalog, or NULL on failure.
+*/
+static PartitionCatalog *catalog_acquire(void) {
+  PartitionCatalog *catalog;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+  if (!g_partition_catalog) {
+    g_partition_catalog = catalog_create();
+  }
+  catalog = g_partition_catalog;
+  if (catalog) {
+    catalog->users++;
+  }
+  pthread_mutex_unlock(&g_catalog_mutex);
+  return catalog;
+}
+
+/**
+  @brief Drop a reference to a statistics catalog; the last one destroys it.
+
+  @param [in] catalog Catalog from catalog_acquire().
+*/
+static void catalog_unref(PartitionCatalog *catalog) {
+  int last;
+
+  pthread_mutex_lock(&g_catalog_mutex);
+  last = --catalog->users == 0;
+  if (last && g_partition_catalog == catalog) {
+    g_partition_catalog = NULL;
+  }
+  pthread_mutex_unlock(&g_catalog_mutex);
+  if (last) {
+    catalog_destroy(catalog);
+  }
+}
+
+/**
+  @brief Create partition context.
+
+  @retval Partition context pointer, or NULL on failure.
+*/
+static void *partition_create_context(void) {
+  PartitionContext *ctx = (PartitionContext *)malloc(sizeof(PartitionContext));
+
+  if (!ctx) {
+    return NULL;
+  }
+
+  /* All contexts share one statistics catalog */
+  ctx->catalog = catalog_acquire();
+  if (!ctx->catalog) {
+    free(ctx);
+    return NULL;
+  }
+
+  /* Initialize context */
+  ctx->tuning.target_partition_bytes = DEFAULT_TARGET_PARTITION_BYTES;
+  ctx->tuning.open_files_limit = 0;
+  ctx->tuning.growth_bytes_per_day = -1;
+  ctx->tuning.projection_days = DEFAULT_PROJECTION_DAYS;
+  ctx->tuning.max_subpartitions = DEFAULT_MAX_SUBPARTITIONS;
+  ctx->current_table = NULL;
+  ctx->recommendation = NULL;
+  ctx->performance_metrics = NULL;
+
+  return ctx;
+}
+
+/**
+  @brief Destroy partition context.
+
+  @param [in] ctx Partition context to destroy.
+*/
+static void partition_destroy_context(void *ctx) {
+  if (ctx) {
+    PartitionContext *partition_ctx = (PartitionContext *)ctx;
+    
+    if (partition_ctx->current_table) {
+      free(partition_ctx->current_table);
+    }
+    if (partition_ctx->recommendation) {
+      free(partition_ctx->recommendation);
+    }
+    if (partition_ctx->performance_metrics) {
+      free(partition_ctx->performance_metrics);
+    }
+    catalog_unref(partition_ctx->catalog);
+    
+    free(partition_ctx);
+  }
+}
+
+/**
+  @brief Collect partitioning statistics for one table.
+
+  Does not touch shared state, so it can run on any worker thread.
+
+  @param [in] table_name Table name to analyze.
+
+  @retval Newly allocated statistics, or NULL on failure.
+*/
+static TableStats *collect_table_stats(const char *table_name) {
+  TableStats *stats = (TableStats *)calloc(1, sizeof(TableStats));
+  if (!stats) {
+    return NULL;
+  }
+
+  stats->table_name = strdup(table_name);
+  stats->analysis_time = time(NULL);
+
+  /* Simulate table analysis */
+  /* In a real-world scenario, you would:
+   * 1. Get table metadata
+   * 2. Analyze data distribution
+   * 3. Calculate row count and data size
+   * 4. Identify candidate partition keys
+   */
+  stats->row_count = 1000000; /* Simulated row count */
+  stats->data_size = 100000000; /* Simulated data size (100MB) */
+  
+  /* Determine partition key based on table name patterns */
+  if (strstr(table_name, "log") || strstr(table_name, "audit") || strstr(table_name, "history")) {
+    stats->partition_key = strdup("created_at");
+    stats->partition_type = strdup(PARTITION_TYPE_TIME);
+  } else if (strstr(table_name, "user") || strstr(table_name, "customer")) {
+    stats->partition_key = strdup("id");
+    stats->partition_type = strdup(PARTITION_TYPE_RANGE);
+  } else {
+    stats->partition_key = strdup("id");
+    stats->partition_type = strdup(PARTITION_TYPE_HASH);
+  }
+
+
+  if (!stats->table_name || !stats->partition_key || !stats->partition_type) {
+    table_stats_free(stats);
+    return NULL;
+  }
+
+  return stats;
+}
+
+/**
+  @brief Resample a table and publish the new statistics.
+
+  Column sketches, the row count, the data size and the change-stream
+  position survive resampling; they are measured by export scans and
+  maintained incrementally by the change stream rather than rebuilt.
+
+  @param [in] catalog    Statistics catalog.
+  @param [in] table_name Table name.
+
+  @retval 0 success, 1 failure.
+*/
+static int refresh_table_stats(PartitionCatalog *catalog, const char *table_name) {
+  TableStats *previous;
+  TableStats *stats = collect_table_stats(table_name);
+  if (!stats) {
+    return 1;
+  }
+
+  catalog_write_begin(catalog, table_name);
+  previous = catalog_lookup(catalog, table_name, 0);
+  if (previous) {
+    int ret = table_stats_copy_columns(stats, previous);
+    stats->row_count = previous->row_count;
+    stats->data_size = previous->data_size;
+    catalog_release(catalog, previous);
+    if (ret != 0) {
+      catalog_write_end(catalog, table_name);
+      table_stats_free(stats);
+      return 1;
+    }
+  }
+  catalog_put(catalog, stats);
+  catalog_write_end(catalog, table_name);
+
+  return 0;
+}
+
+/**
+  @brief Get statistics for a table, analyzing it if the catalog has none.
+
+  @param [in] partition_ctx Partition context.
+  @param [in] table_name    Table name.
+
+  @retval Referenced statistics entry, or NULL on failure.
+*/
+static TableStats *get_table_stats(PartitionContext *partition_ctx, const char *table_name) {
+  TableStats *stats = catalog_lookup(partition_ctx->catalog, table_name, 1);
+  if (stats) {
+    return stats;
+  }
+
+  if (refresh_table_stats(partition_ctx->catalog, table_name) != 0) {
+    return NULL;
+  }
+
+  return catalog_lookup(partition_ctx->catalog, table_name, 0);
+}
+
+/**
+  @brief Analyze table for partitioning.
+
+  @param [in] ctx         Partition context.
+  @param [in] table_name  Table name to analyze.
+
+  @retval 0 success, 1 failure.
+*/
+static int partition_analyze_table(void *ctx, const char *table_name) {
+  PartitionContext *partition_ctx = (PartitionContext *)ctx;
+  
+  /* Set current table */
+  if (partition_ctx->current_table) {
+    free(partition_ctx->current_table);
+  }
+  partition_ctx->current_table = strdup(table_name);
+  
+  if (!partition_ctx->current_table) {
+    return 1;
+  }
+  
+  /* Always resample on explicit analysis */
+  return refresh_table_stats(partition_ctx->catalog, table_name);
+}
+
+/* Shared state of one schema analysis run */
+typedef struct {
+  PartitionCatalog *catalog;
+  const char *schema_name;
+  const char **tables;
+  int table_count;
+  int next_table;
+  int failed;
+  int force;
+} SchemaAnalysisJob;
+
+/**
+  @brief Build the catalog key of a schema table.
+
+  @param [in]  schema_name Schema name, may be NULL or empty.
+  @param [in]  table_name  Table name.
+  @param [out] buf         Output buffer.
+  @param [in]  size        Output buffer size.
+*/
+static void qualified_table_name(const char *schema_name, const char *table_name, char *buf, size_t size) {
+  if (schema_name && *schema_name && !strchr(table_name, '.')) {
+    snprintf(buf, size, "%s.%s", schema_name, table_name);
+  } else {
+    snprintf(buf, size, "%s", table_name);
+  }
+}
+
+/**
+  @brief Worker thread of the schema analysis pool.
+
+  Workers claim tables through an atomic cursor, so a slow table never
+  holds up the rest of the schema.
+
+  @param [in] arg Schema analysis job.
+
+  @retval NULL.
+*/
+static void *schema_analysis_worker(void *arg) {
+  SchemaAnalysisJob *job = (SchemaAnalysisJob *)arg;
+  char table_name[512];
+  int index;
+
+  while ((index = __sync_fetch_and_add(&job->next_table, 1)) < job->table_count) {
+    TableStats *stats;
+
+    qualified_table_name(job->schema_name, job->tables[index], table_name, sizeof(table_name));
+
+    /* Skip tables whose statistics are still fresh */
+    if (!job->force) {
+      stats = catalog_lookup(job->catalog, table_name, 1);
+      if (stats) {
+        catalog_release(job->catalog, stats);
+        continue;
+      }
+    }
+
+    if (refresh_table_stats(job->catalog, table_name) != 0) {
+      __sync_fetch_and_add(&job->failed, 1);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  @brief Analyze tables with a pool of worker threads.
+
+  @param [in] catalog     Statistics catalog.
+  @param [in] schema_name Schema name.
+  @param [in] tables      Table names.
+  @param [in] table_count Number of tables.
+  @param [in] threads     Worker count, 0 for one per CPU.
+  @param [in] force       Reanalyze tables with fresh statistics too.
+
+  @retval 0 success, 1 failure.
+*/
+static int run_schema_analysis(PartitionCatalog *catalog, const char *schema_name, const char **tables, int table_count, int threads, int force) {
+  pthread_t workers[ANALYZE_MAX_THREADS];
+  SchemaAnalysisJob job;
+  int started = 0;
+  int i;
+
+  if (table_count <= 0) {
+    return 0;
+  }
+
+  if (threads <= 0) {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > ANALYZE_MAX_THREADS) {
+    threads = ANALYZE_MAX_THREADS;
+  }
+  if (threads > table_count) {
+    threads = table_count;
+  }
+
+  job.catalog = catalog;
+  job.schema_name = schema_name;
+  job.tables = tables;
+  job.table_count = table_count;
+  job.next_table = 0;
+  job.failed = 0;
+  job.force = force;
+
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], NULL, schema_analysis_worker, &job) != 0) {
+      break;
+    }
+    started++;
+  }
+
+  /* Fall back to the calling thread if no worker could be started */
+  if (started == 0) {
+    schema_analysis_worker(&job);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  if (catalog->dirty) {
+    catalog_save(catalog);
+  }
+
+  return job.failed ? 1 : 0;
+}
+
+/**
+  @brief Analyze all tables of a schema in parallel.
+
+  @param [in] ctx          Partition context.
+  @param [in] schema_name  Schema name.
+  @param [in] tables       Table names.
+  @param [in] table_count  Number of tables.
+  @param [in] threads      Worker count, 0 for one per CPU.
+
+  @retval 0 success, 1 failure.
+*/
+static int partition_analyze_schema(void *ctx, const char *schema_name, const char **tables, int table_count, int threads) {
+  PartitionContext *partition_ctx = (PartitionContext *)ctx;
+
+  return run_schema_analysis(partition_ctx->catalog, schema_name, tables, table_count, threads, 1);
+}
+
+/* Growable script text */
+typedef struct {
+  char *text;
+  size_t len;
+  size_t size;
+  int failed;
+} ScriptBuffer;
+
+/**
+  @brief Append formatted text to a script buffer.
+
+  @param [in] buf    Script buffer.
+  @param [in] format printf-style format.
+*/
+static void script_append(ScriptBuffer *buf, const char *format, ...) {
+  va_list args;
+  int needed;
+
+  if (buf->failed) {
+    return;
+  }
+  for (;;) {
+    va_start(args, format);
+    needed = vsnprintf(buf->text ? buf->text + buf->len : NULL, buf->text ? buf->size - buf->len : 0, format, args);
+    va_end(args);
+    if (needed < 0) {
+      buf->failed = 1;
+      return;
+    }
+    if (buf->text && buf->len + needed < buf->size) {
+      buf->len += needed;
+      return;
+    }
+    {
+      size_t size = buf->size ? buf->size * 2 : 1024;
+      char *grown;
+      while (size <= buf->len + needed) {
+        size *= 2;
+      }
+      grown = (char *)realloc(buf->text, size);
+      if (!grown) {
+        buf->failed = 1;
+        return;
+      }
+      buf->text = grown;
+      buf->size = size;
+    }
+  }
+}
+
+/**
+  @brief Find the workload predicate statistics of a column.
+
+  @param [in] stats       Table statistics.
+  @param [in] column_name Column name.
+
+  @retval Predicate statistics, or NULL if the workload never filters on it.
+*/
+static const PredicateStats *table_stats_find_predicate(const TableStats *stats, const char *column_name) {
+  int i;
+
+  for (i = 0; i < stats->predicate_count; i++) {
+    if (strcmp(stats->predicates[i].column_name, column_name) == 0) {
+      return &stats->predicates[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+  @brief Find a column whose sketch describes row creation time.
+
+  @param [in] stats Table statistics.
+
+  @retval Column statistics, or NULL if there is none.
+*/
+static const ColumnStats *table_stats_time_column(const TableStats *stats) {
+  const ColumnStats *column = NULL;
+  int i;
+
+  if (strcmp(stats->partition_type, PARTITION_TYPE_TIME) == 0) {
+    column = table_stats_find_column(stats, stats->partition_key);
+  }
+  for (i = 0; !column && i < stats->column_count; i++) {
+    const char *name = stats->columns[i]->column_name;
+    size_t len = strlen(name);
+    if ((len > 3 && strcmp(name + len - 3, "_at") == 0) || strstr(name, "time") || strstr(name, "date")) {
+      column = stats->columns[i];
+    }
+  }
+  if (column && (column->quantiles.count <= 0 || column->quantiles.max <= column->quantiles.min)) {
+    return NULL;
+  }
+  return column;
+}
+
+/**
+  @brief Number of partitions one table may use.
+
+  InnoDB keeps one open file per partition.  Three quarters of the
+  descriptor limit are left to other tables and connections, and MySQL
+  itself refuses more than 8192 partitions.
+
+  @param [in] tuning Partition tuning.
+
+  @retval Partition cap.
+*/
+static int partition_open_file_cap(const PartitionTuning *tuning) {
+  long long limit = tuning->open_files_limit;
+  long long cap;
+
+  if (limit <= 0) {
+    struct rlimit rl;
+    limit = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+      limit = rl.rlim_cur == RLIM_INFINITY ? MAX_PARTITIONS * 4LL : (long long)rl.rlim_cur;
+    }
+  }
+  cap = limit / 4;
+  if (cap > MAX_PARTITIONS) cap = MAX_PARTITIONS;
+  if (cap < MIN_PARTITIONS) cap = MIN_PARTITIONS;
+  return (int)cap;
+}
+
+/**
+  @brief qsort comparator for ascending doubles.
+*/
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+  @brief Pick the column to spread a table's hot partition by.
+
+  Candidates are columns the workload filters on by equality, so that
+  lookups still prune to one subpartition; a column named like a tenant
+  wins ties.  The column needs a sketch with more than one live value.
+
+  @param [in] stats Table statistics.
+
+  @retval Column statistics, or NULL if no column qualifies.
+*/
+static const ColumnStats *table_stats_subpartition_column(const TableStats *stats) {
+  const ColumnStats *best = NULL;
+  long long best_eq = -1;
+  int best_tenant = 0;
+  int i;
+
+  for (i = 0; i < stats->column_count; i++) {
+    const ColumnStats *column = stats->columns[i];
+    const PredicateStats *predicate = table_stats_find_predicate(stats, column->column_name);
+    long long eq = predicate ? predicate->eq_predicates : 0;
+    int tenant = strstr(column->column_name, "tenant") != NULL;
+
+    if (strcmp(column->column_name, stats->partition_key) == 0 ||
+        column->inserts - column->deletes <= 0 || column_distinct_values(column) < 2) {
+      continue;
+    }
+    if (eq == 0 && !tenant) {
+      continue;
+    }
+    if (eq > best_eq || (eq == best_eq && tenant && !best_tenant)) {
+      best = column;
+      best_eq = eq;
+      best_tenant = tenant;
+    }
+  }
+  return best;
+}
+
+/**
+  @brief Share of writes landing in the busiest of k subpartitions.
+
+  Heavy hitters are placed where MySQL would put them: MOD(value, k) for
+  HASH, a value hash for KEY (MySQL's own KEY hash differs, so KEY
+  placement is only representative).  The remaining rows are spread over
+  as many subpartitions as they have distinct values, filling the
+  lightest ones first.
+
+  @param [in] column Subpartition column statistics.
+  @param [in] k      Subpartition count.
+  @param [in] by_key Whether the column is subpartitioned by KEY.
+
+  @retval Share of the busiest subpartition, between 1/k and 1.
+*/
+static double subpartition_max_share(const ColumnStats *column, int k, int by_key) {
+  double shares[MAX_SUBPARTITIONS];
+  double live = (double)(column->inserts - column->deletes);
+  double heavy = 0;
+  double rest;
+  double max_share = 0;
+  long long spread;
+  int h;
+  int j;
+
+  if (k <= 1 || live <= 0) {
+    return 1;
+  }
+  for (j = 0; j < k; j++) {
+    shares[j] = 0;
+  }
+
+  for (h = 0; h < column->heavy_hitter_count; h++) {
+    const HeavyHitter *hitter = &column->heavy_hitters[h];
+    double share = hitter->count / live;
+    double number = 0;
+    int numeric = parse_column_number(hitter->value, &number);
+    int bucket;
+
+    if (share > 1 - heavy) {
+      share = 1 - heavy;
+    }
+    if (by_key) {
+      bucket = (int)(column_value_hash(hitter->value, numeric, number) % (unsigned long long)k);
+    } else {
+      bucket = (int)(llabs((long long)number) % k);
+    }
+    shares[bucket] += share;
+    heavy += share;
+  }
+
+  rest = 1 - heavy;
+  spread = column_distinct_values(column) - column->heavy_hitter_count;
+  if (spread > k) spread = k;
+  if (spread < 1) spread = 1;
+  if (spread < k) {
+    /* Few other values: they fill the lightest subpartitions */
+    qsort(shares, k, sizeof(double), compare_doubles);
+  }
+  for (j = 0; j < spread; j++) {
+    shares[j] += rest / spread;
+  }
+
+  for (j = 0; j < k; j++) {
+    if (shares[j] > max_share) {
+      max_share = shares[j];
+    }
+  }
+  return max_share;
+}
+
+/**
+  @brief Evaluate a two-level layout with HASH or KEY subpartitions.
+
+  Only the newest partition of a RANGE or time layout takes writes.
+  Subpartitioning it by a tenant-like column spreads that hot spot over
+  several files, but multiplies the file count of every partition.  The
+  count is the smallest one whose busiest file is within 10% of the best
+  balance the open-file budget allows; files smaller than the pruning
+  floor (target / 16) are not worth creating.
+
+  @param [in]     stats  Table statistics.
+  @param [in]     tuning Partition tuning.
+  @param [in,out] plan   Single-level layout, extended with subpartitions.
+*/
+static void plan_subpartitioning(const TableStats *stats, const PartitionTuning *tuning, PartitionPlan *plan) {
+  const ColumnStats *column;
+  double min_file = (double)tuning->target_partition_bytes / MIN_PARTITION_FRACTION;
+  double shares[MAX_SUBPARTITIONS + 1];
+  double best_share = 1;
+  long long max_k;
+  int by_key;
+  int k;
+
+  plan->hot_partition_bytes = plan->bytes_per_partition;
+  plan->hot_file_share = 1;
+  if (strcmp(stats->partition_type, PARTITION_TYPE_TIME) != 0 &&
+      strcmp(stats->partition_type, PARTITION_TYPE_RANGE) != 0) {
+    plan->subpartition_note = "hash layouts have no hot partition";
+    return;
+  }
+  if (tuning->max_subpartitions < 2) {
+    plan->subpartition_note = "disabled";
+    return;
+  }
+  column = table_stats_subpartition_column(stats);
+  if (!column) {
+    plan->subpartition_note = "no equality-filtered column to spread writes by";
+    return;
+  }
+
+  max_k = plan->partition_cap / plan->partition_count;
+  if (max_k > tuning->max_subpartitions) {
+    max_k = tuning->max_subpartitions;
+  }
+  if (max_k < 2) {
+    plan->subpartition_note = "open files";
+    return;
+  }
+  if ((long long)(plan->hot_partition_bytes / min_file) < 2) {
+    plan->subpartition_note = "hot partition too small to split";
+    return;
+  }
+  if (max_k > (long long)(plan->hot_partition_bytes / min_file)) {
+    max_k = (long long)(plan->hot_partition_bytes / min_file);
+  }
+
+  /* HASH needs an integer expression; anything else goes through KEY */
+  by_key = column->quantiles.count < column->inserts - column->deletes;
+  for (k = 0; !by_key && k < column->heavy_hitter_count; k++) {
+    double number;
+    if (!parse_column_number(column->heavy_hitters[k].value, &number) || number != floor(number)) {
+      by_key = 1;
+    }
+  }
+
+  /* Busiest-file share per candidate count; shares[k] for k subpartitions */
+  for (k = 2; k <= max_k; k++) {
+    shares[k] = subpartition_max_share(column, k, by_key);
+    if (shares[k] < best_share) {
+      best_share = shares[k];
+    }
+  }
+  for (k = 2; k <= max_k; k++) {
+    if (shares[k] <= best_share * SUBPARTITION_BALANCE_SLACK) {
+      break;
+    }
+  }
+  if (k > max_k || best_share > 0.9) {
+    plan->subpartition_note = "one value dominates the writes";
+    return;
+  }
+
+  plan->subpartition_column = column->column_name;
+  plan->subpartition_count = k;
+  plan->subpartition_by_key = by_key;
+  plan->hot_file_share = shares[k];
+  plan->subpartition_note = NULL;
+}
+
+/**
+  @brief Upper bound of one RANGE partition.
+
+  Equi-depth when the key column has a sketch, equal row counts otherwise.
+
+  @param [in] stats  Table statistics.
+  @param [in] column Partition key sketch, or NULL.
+  @param [in] count  Number of partitions.
+  @param [in] i      Partition boundary, 1 to count - 1.
+
+  @retval Boundary value.
+*/
+static long long range_boundary(const TableStats *stats, const ColumnStats *column, int count, int i) {
+  if (column && column->quantiles.count > 0) {
+    return (long long)ceil(quantile_sketch_query(&column->quantiles, (double)i / count));
+  }
+  return stats->row_count / count * i;
+}
+
+/**
+  @brief Count the RANGE partitions left once duplicate boundaries collapse.
+
+  Heavily repeated key values put several boundaries on the same value;
+  each distinct boundary gives one partition, plus the MAXVALUE one.
+
+  @param [in] stats  Table statistics.
+  @param [in] column Partition key sketch, or NULL.
+  @param [in] count  Planned partitions.
+
+  @retval Partitions the script defines.
+*/
+static int range_partition_count(const TableStats *stats, const ColumnStats *column, int count) {
+  long long previous = 0;
+  int partitions = 1;
+  int i;
+
+  for (i = 1; i < count; i++) {
+    long long boundary = range_boundary(stats, column, count, i);
+    if (i > 1 && boundary <= previous) {
+      continue;
+    }
+    previous = boundary;
+    partitions++;
+  }
+  return partitions;
+}
+
+/**
+  @brief Derive the partition layout of a table.
+
+  The count follows from the target bytes per partition at the end of
+  the projection window, raised to the pruning granularity the workload
+  needs, and capped by the open-file budget.  Time partitions pick the
+  coarsest calendar interval that still fits both the target size and
+  the typical query span.  RANGE and time layouts may then add a second
+  level of subpartitions.
+
+  @param [in]  stats  Table statistics.
+  @param [in]  tuning Partition tuning.
+  @param [out] plan   Derived layout.
+*/
+static void plan_partitioning(const TableStats *stats, const PartitionTuning *tuning, PartitionPlan *plan) {
+  static const int intervals[] = {1, 7, 30, 91, 365};
+  const ColumnStats *time_column = table_stats_time_column(stats);
+  const ColumnStats *key_column = table_stats_find_column(stats, stats->partition_key);
+  const PredicateStats *predicate = table_stats_find_predicate(stats, stats->partition_key);
+  double target = (double)tuning->target_partition_bytes;
+  double size_now = (double)stats->data_size;
+  double size_then;
+  long long count;
+
+  memset(plan, 0, sizeof(*plan));
+  plan->partition_cap = partition_open_file_cap(tuning);
+  plan->days_until_split = -1;
+
+  /* Growth: configured, or rows per day over the observed time span */
+  plan->growth_bytes_per_day = tuning->growth_bytes_per_day;
+  if (plan->growth_bytes_per_day < 0) {
+    plan->growth_bytes_per_day = 0;
+    if (time_column && stats->row_count > 0) {
+      double span_days = (time_column->quantiles.max - time_column->quantiles.min) / 86400.0;
+      if (span_days < 1) span_days = 1;
+      plan->growth_bytes_per_day = size_now / span_days;
+    }
+  }
+  size_then = size_now + plan->growth_bytes_per_day * tuning->projection_days;
+
+  /* Pruning granularity: typical width of bounded range predicates */
+  if (predicate && predicate->bounded_ranges > 0) {
+    plan->pruning_width = exp(predicate->log_width_sum / predicate->bounded_ranges);
+  }
+
+  if (strcmp(stats->partition_type, PARTITION_TYPE_TIME) == 0) {
+    int last_choice = (int)(sizeof(intervals) / sizeof(intervals[0])) - 1;
+    /* Round to the hour: the geometric mean carries log/exp noise */
+    double query_days = round(plan->pruning_width / 3600.0) / 24.0;
+    double now = (double)time(NULL);
+    double first = time_column ? time_column->quantiles.min : now - 5 * 365 * 86400.0;
+    double last = now + tuning->projection_days * 86400.0;
+    double interval;
+    int by_size = 0;
+    int choice;
+
+    /* Coarsest interval whose partitions stay under the target size */
+    for (by_size = last_choice; by_size > 0; by_size--) {
+      if (plan->growth_bytes_per_day * intervals[by_size] <= target) {
+        break;
+      }
+    }
+    /* ... and no coarser than the typical query span, unless that makes them tiny */
+    choice = by_size;
+    while (choice > 0 && query_days > 0 && intervals[choice] > (query_days < 1 ? 1 : query_days) &&
+           plan->growth_bytes_per_day * intervals[choice - 1] >= target / MIN_PARTITION_FRACTION) {
+      choice--;
+    }
+    plan->limited_by = choice < by_size ? "query span" : "target size";
+
+    /* Coarsen until history plus projection fits the file budget */
+    for (;;) {
+      count = (long long)ceil((last - first) / (intervals[choice] * 86400.0)) + 1;
+      if (count <= plan->partition_cap || choice == last_choice) {
+        break;
+      }
+      choice++;
+      plan->limited_by = "open files";
+    }
+    interval = intervals[choice] * 86400.0;
+    if (count > plan->partition_cap) {
+      /* Older history collapses into the first partition */
+      count = plan->partition_cap;
+      plan->limited_by = "open files";
+      if (first < now - interval) {
+        first = now - interval;
+      }
+      last = first + (count - 1) * interval;
+    }
+    plan->interval_days = intervals[choice];
+    plan->first_boundary = first;
+    plan->bytes_per_partition = plan->growth_bytes_per_day * intervals[choice];
+    if (plan->bytes_per_partition <= 0) {
+      plan->bytes_per_partition = size_now / count;
+    }
+    /* New dated partitions are due once the last boundary is reached */
+    plan->days_until_split = (last - now) / 86400.0;
+  } else {
+    long long by_size = (long long)ceil(size_then / target);
+    long long by_pruning = 0;
+
+    count = by_size;
+    plan->limited_by = "target size";
+    if (strcmp(stats->partition_type, PARTITION_TYPE_RANGE) == 0 && plan->pruning_width > 0) {
+      double domain = key_column && key_column->quantiles.count > 0
+                          ? key_column->quantiles.max - key_column->quantiles.min
+                          : (double)stats->row_count;
+      by_pruning = (long long)ceil(domain / plan->pruning_width);
+      /* Pruning stops paying off once partitions get tiny */
+      if (by_pruning > (long long)(size_then * MIN_PARTITION_FRACTION / target)) {
+        by_pruning = (long long)(size_then * MIN_PARTITION_FRACTION / target);
+      }
+      if (by_pruning > count) {
+        count = by_pruning;
+        plan->limited_by = "query span";
+      }
+    }
+    if (count < MIN_PARTITIONS) {
+      count = MIN_PARTITIONS;
+    }
+    if (count > plan->partition_cap) {
+      count = plan->partition_cap;
+      plan->limited_by = "open files";
+    }
+    /* Repeated key values share boundaries: plan the partitions the script defines */
+    if (strcmp(stats->partition_type, PARTITION_TYPE_RANGE) == 0) {
+      plan->range_slices = (int)count;
+      count = range_partition_count(stats, key_column, plan->range_slices);
+      if (count < plan->range_slices) {
+        plan->limited_by = "distinct key values";
+      }
+    }
+    plan->bytes_per_partition = size_now / count;
+
+    if (plan->growth_bytes_per_day > 0) {
+      if (strcmp(stats->partition_type, PARTITION_TYPE_RANGE) == 0) {
+        /* New keys all land in the MAXVALUE partition */
+        plan->days_until_split = (target - plan->bytes_per_partition) / plan->growth_bytes_per_day;
+      } else {
+        plan->days_until_split = ((double)count * target - size_now) / plan->growth_bytes_per_day;
+      }
+      if (plan->days_until_split < 0) {
+        plan->days_until_split = 0;
+      }
+    }
+  }
+
+  plan->partition_count = (int)count;
+  plan_subpartitioning(stats, tuning, plan);
+}
+
+/**
+  @brief Format an epoch time as a date.
+
+  @param [in]  epoch  Seconds since the epoch.
+  @param [in]  format strftime format.
+  @param [out] buf    Output buffer.
+  @param [in]  size   Output buffer size.
+*/
+static void format_epoch(double epoch, const char *format, char *buf, size_t size) {
+  time_t seconds = (time_t)epoch;
+  struct tm tm;
+
+  gmtime_r(&seconds, &tm);
+  strftime(buf, size, format, &tm);
+}
+
+/**
+  @brief Emit the SUBPARTITION BY clause of a two-level layout, if any.
+
+  @param [in] buf  Script buffer.
+  @param [in] plan Partition layout.
+*/
+static void build_subpartition_clause(ScriptBuffer *buf, const PartitionPlan *plan) {
+  if (plan->subpartition_count < 2) {
+    return;
+  }
+  script_append(buf, " SUBPARTITION BY %s (%s) SUBPARTITIONS %d",
+                plan->subpartition_by_key ? PARTITION_TYPE_KEY : PARTITION_TYPE_HASH,
+                plan->subpartition_column, plan->subpartition_count);
+}
+
+/**
+  @brief Emit time-interval RANGE partitions.
+
+  @param [in] buf   Script buffer.
+  @param [in] stats Table statistics.
+  @param [in] plan  Partition layout.
+*/
+static void build_time_partitions(ScriptBuffer *buf, const TableStats *stats, const PartitionPlan *plan) {
+  time_t boundary;
+  struct tm tm;
+  int i;
+
+  boundary = (time_t)plan->first_boundary;
+  gmtime_r(&boundary, &tm);
+  tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+  if (plan->interval_days >= 30) {
+    tm.tm_mday = 1;
+  }
+  if (plan->interval_days == 365) {
+    tm.tm_mon = 0;
+  }
+
+  if (plan->interval_days == 365) {
+    script_append(buf, "PARTITION BY RANGE (YEAR(%s))", stats->partition_key);
+  } else {
+    script_append(buf, "PARTITION BY RANGE (TO_DAYS(%s))", stats->partition_key);
+  }
+  build_subpartition_clause(buf, plan);
+  script_append(buf, " (\n");
+
+  for (i = 1; i < plan->partition_count; i++) {
+    char name[32];
+    char value[32];
+
+    /* The first partition also takes everything older */
+    format_epoch((double)timegm(&tm), plan->interval_days == 365 ? "p%Y" : plan->interval_days >= 30 ? "p%Y%m" : "p%Y%m%d", name, sizeof(name));
+    if (plan->interval_days == 365) {
+      tm.tm_year++;
+    } else if (plan->interval_days >= 30) {
+      tm.tm_mon += plan->interval_days / 30;
+    } else {
+      tm.tm_mday += plan->interval_days;
+    }
+    boundary = timegm(&tm);
+    gmtime_r(&boundary, &tm);
+
+    if (plan->interval_days == 365) {
+      script_append(buf, "  PARTITION %s VALUES LESS THAN (%d),\n", name, tm.tm_year + 1900);
+    } else {
+      format_epoch((double)boundary, "%Y-%m-%d", value, sizeof(value));
+      script_append(buf, "  PARTITION %s VALUES LESS THAN (TO_DAYS('%s')),\n", name, value);
+    }
+  }
+  script_append(buf, "  PARTITION pfuture VALUES LESS THAN MAXVALUE\n)");
+}
+
+/**
+  @brief Emit the partition clause for analyzed table statistics.
+
+  @param [in] buf    Script buffer.
+  @param [in] stats  Table statistics.
+  @param [in] plan   Partition layout.
+*/
+static void build_partition_clause(ScriptBuffer *buf, const TableStats *stats, const PartitionPlan *plan) {
+  if (strcmp(stats->partition_type, PARTITION_TYPE_TIME) == 0) {
+    /* Time-based partitioning */
+    build_time_partitions(buf, stats, plan);
+  } else if (strcmp(stats->partition_type, PARTITION_TYPE_RANGE) == 0) {
+    /* Range partitioning, equi-depth when the key column has a sketch */
+    ColumnStats *column = table_stats_find_column(stats, stats->partition_key);
+    long long previous = 0;
+    int partitions = 0;
+    int i;
+
+    script_append(buf, "PARTITION BY RANGE (%s)", stats->partition_key);
+    build_subpartition_clause(buf, plan);
+    script_append(buf, " (\n");
+    for (i = 1; i < plan->range_slices; i++) {
+      long long boundary = range_boundary(stats, column, plan->range_slices, i);
+      if (i > 1 && boundary <= previous) {
+        /* Collapse duplicate boundaries from heavily repeated values */
+        continue;
+      }
+      previous = boundary;
+      script_append(buf, "  PARTITION p%d VALUES LESS THAN (%lld),\n", ++partitions, boundary);
+    }
+    script_append(buf, "  PARTITION p%d VALUES LESS THAN MAXVALUE\n)", partitions + 1);
+  } else {
+    /* Hash partitioning */
+    script_append(buf, "PARTITION BY HASH (%s) PARTITIONS %d", stats->partition_key, plan->partition_count);
+  }
+}
+
+/**
+  @brief Generate the partition script for analyzed table statistics.
+
+  @param [in] stats       Table statistics.
+  @param [in] tuning      Partition tuning.
+  @param [in] table_name  Table name.
+  @param [in] buf         Script buffer receiving the statement.
+*/
+static void build_partition_script(const TableStats *stats, const PartitionTuning *tuning, const char *table_name, ScriptBuffer *buf) {
+  PartitionPlan plan;
+
+  plan_partitioning(stats, tuning, &plan);
+  script_append(buf, "ALTER TABLE %s ", table_name);
+  build_partition_clause(buf, stats, &plan);
+  script_append(buf, ";");
+}
+
+/**
+  @brief Recommend partitioning strategy.
+
+  @param [in]  ctx           Partition context.
+  @param [in]  table_name    Table name.
+  @param [out] partition_script  Generated partition script.
+
+  @retval 0 success, 1 failure.
+*/
+static int partition_recommend_partitioning(void *ctx, const char *table_name, char **partition_script) {
+  PartitionContext *partition_ctx = (PartitionContext *)ctx;
+  TableStats *stats;
+  ScriptBuffer script = {NULL, 0, 0, 0};
+  
+  /* Reuse catalog statistics, analyzing only when missing or stale */
+  stats = get_table_stats(partition_ctx, table_name);
+  if (!stats) {
+    return 1;
+  }
+  
+  /* Generate partition script based on analysis */
+  build_partition_script(stats, &partition_ctx->tuning, table_name, &script);
+  catalog_release(partition_ctx->catalog, stats);
+  if (script.failed) {
+    free(script.text);
+    return 1;
+  }
+  
+  /* Hand the partition script to the caller */
+  *partition_script = script.text;
+  
+  /* Store recommendation */
+  if (partition_ctx->recommendation) {
+    free(partition_ctx->recommendation);
+  }
+  partition_ctx->recommendation = strdup(script.text);
+  
+  return 0;
+}
+
+/**
+  @brief Recommend partitioning strategies for many tables in one call.
+
+  Stale or missing tables are analyzed in parallel first; everything
+  else comes straight from the catalog.
+
+  @param [in]  ctx                Partition context.
+  @param [in]  schema_name        Schema name.
+  @param [in]  tables             Table names.
+  @param [in]  table_count        Number of tables.
+  @param [out] partition_scripts  Generated scripts, one per table.
+
+  @retval 0 success, 1 failure.
+*/
+static int partition_recommend_schema(void *ctx, const char *schema_name, const char **tables, int table_count, char **partition_scripts) {
+  PartitionContext *partition_ctx = (PartitionContext *)ctx;
+  ScriptBuffer scripts = {NULL, 0, 0, 0};
+  char table_name[512];
+  int i;
+
+  if (run_schema_analysis(partition_ctx->catalog, schema_name, tables, table_count, 0, 0) != 0) {
+    return 1;
+  }
+
+  script_append(&scripts, "%s", "");
+  for (i = 0; i < table_count && !scripts.failed; i++) {
+    TableStats *stats;
+
+    qualified_table_name(schema_name, tables[i], table_name, sizeof(table_name));
+    stats = get_table_stats(partition_ctx, table_name);
+    if (!stats) {
+      free(scripts.text);
+      return 1;
+    }
+    build_partition_script(stats, &partition_ctx->tuning, table_name, &scripts);
+    script_append(&scripts, "\n");
+    catalog_release(partition_ctx->catalog, stats);
+  }
+
+  if (scripts.failed) {
+    free(scripts.text);
+    return 1;
+  }
+  *partition_scripts = scripts.text;
+
+  return 0;
+}
+
+/**
+  @brief Deep-copy table statistics for copy-on-write updates.
+
+  @param [in] src Statistics to copy.
+
+  @retval New statistics, or NULL on failure.
+*/
+static TableStats *table_stats_clone(const TableStats *src) {
+  TableStats *dst = (TableStats *)calloc(1, sizeof(TableStats));
+  if (!dst) {
+    return NULL;
+  }
+
+  dst->table_name = strdup(src->table_name);
+  dst->partition_key = strdup(src->partition_key);
+  dst->partition_type = strdup(src->partition_type);
+  dst->analysis_time = src->analysis_time;
+  dst->row_count = src->row_count;
+  dst->data_size = src->data_size;
+  if (!dst->table_name || !dst->partition_key || !dst->partition_type ||
+      table_stats_copy_columns(dst, src) != 0) {
+    table_stats_free(dst);
+    return NULL;
+  }
+
+  return dst;
+}
+
+/**
+  @brief Check whether a binlog row event targets the analyzed table.
+
+  @param [in] event_table Table from the event, as `db`.`table`.
+  @param [in] table_name  Analyzed table, optionally schema-qualified.
+
+  @retval 1 if it matches, 0 otherwise.
+*/
+static int change_stream_table_matches(const char *event_table, const char *table_name) {
+  char name[512];
+  const char *dot;
+  size_t len = 0;
+
+  /* Strip the backticks */
+  for (; *event_table && !isspace((unsigned char)*event_table) && len < sizeof(name) - 1; event_table++) {
+    if (*event_table != '`') {
+      name[len++] = *event_table;
+    }
+  }
+  name[len] = '\0';
+
+  if (strcmp(name, table_name) == 0) {
+    return 1;
+  }
+  dot = strchr(name, '.');
+  return !strchr(table_name, '.') && dot && strcmp(dot + 1, table_name) == 0;
+}
+
+/**
+  @brief Extract the value of a "###   @N=value" row image line.
+
+  Handles quoted strings and the type comments printed by mysqlbinlog -vv.
+
+  @param [in]  text   Text following the '=' sign.
+  @param [out] value  Unquoted value.
+  @param [in]  size   Value buffer size.
+
+  @retval 1 for a value, 0 for NULL.
+*/
+static int change_stream_value(const char *text, char *value, size_t size) {
+  size_t len = 0;
+
+  if (*text == '\'') {
+    for (text++; *text && len < size - 1; text++) {
+      if (*text == '\\' && text[1]) {
+        text++;
+      } else if (*text == '\'') {
+        if (text[1] != '\'') break;
+        text++;
+      }
+      value[len++] = *text;
+    }
+  } else {
+    while (*text && !isspace((unsigned char)*text) && len < size - 1) {
+      value[len++] = *text++;
+    }
+  }
+  value[len] = '\0';
+
+  return strcmp(value, "NULL") != 0;
+}
+
+/* Column value of a row image that has not been applied yet */
+typedef struct {
+  ColumnStats *column;
+  int sign;
+  char value[256];
+} PendingValue;
+
+/**
+  @brief Apply a decoded binlog to a table; the caller holds its writer lock.
+
+  @param [in] partition_ctx Partition context.
+  @param [in] table_name    Table name.
+  @param [in] stream_file   Decoded binlog file.
+  @param [in] column_names  Column names in table order, or NULL.
+
+  @retval 0 success, 1 failure.
+*/
+static int change_stream_apply(PartitionContext *partition_ctx, const char *table_name, const char *stream_file,
+                               const char *column_names) {
+  TableStats *current;
+  TableStats *stats;
+  FILE *fp;
+  struct stat st;
+  char *line = NULL;
+  size_t line_size = 0;
+  PendingValue *pending_values = NULL;
+  int pending_count = 0;
+  int pending_size = 0;
+  int pending_rows = 0;
+  long long committed;
+  long long net_rows = 0;
+  long long changes = 0;
+  int in_table = 0;
+  int sign = 0;
+  int i;
+
+  current = get_table_stats(partition_ctx, table_name);
+  if (!current) {
+    return 1;
+  }
+  stats = table_stats_clone(current);
+  catalog_release(partition_ctx->catalog, current);
+  if (!stats) {
+    return 1;
+  }
+
+  fp = fopen(stream_file, "r");
+  if (!fp || fstat(fileno(fp), &st) != 0) {
+    if (fp) fclose(fp);
+    table_stats_free(stats);
+    return 1;
+  }
+
+  /* Resume after the last applied event unless the file was replaced */
+  committed = 0;
+  if (stats->stream_file && strcmp(stats->stream_file, stream_file) == 0 &&
+      stats->stream_offset <= (long long)st.st_size) {
+    committed = stats->stream_offset;
+    fseek(fp, (long)committed, SEEK_SET);
+  }
+
+  for (;;) {
+    long long line_start = ftell(fp);
+    /* Row images can hold long values: read whole lines, however long */
+    ssize_t len = getline(&line, &line_size, fp);
+
+    if (len <= 0) {
+      /* A file cut inside an event resumes at that event's header */
+      if (!in_table && !sign && !pending_rows) {
+        committed = line_start;
+      }
+      break;
+    }
+    if (line[len - 1] != '\n') {
+      /* Partial trailing line, still being written; pick the event up next time */
+      break;
+    }
+
+    if (strncmp(line, "###   @", 7) == 0) {
+      char column_name[128];
+      const char *eq = strchr(line + 7, '=');
+      int ordinal = atoi(line + 7);
+      PendingValue *pending;
+
+      if (!in_table || !sign || !eq || ordinal <= 0) {
+        continue;
+      }
+
+      /* Map the ordinal to a column name */
+      snprintf(column_name, sizeof(column_name), "@%d", ordinal);
+      if (column_names) {
+        const char *name = column_names;
+        int i;
+        for (i = 1; i < ordinal && name; i++) {
+          name = strchr(name, ',');
+          if (name) name++;
+        }
+        if (name) {
+          size_t name_len = strcspn(name, ",");
+          if (name_len > 0 && name_len < sizeof(column_name)) {
+            memcpy(column_name, name, name_len);
+            column_name[name_len] = '\0';
+          }
+        }
+      }
+
+      if (pending_count == pending_size) {
+        PendingValue *grown = (PendingValue *)realloc(pending_values, (pending_size + 16) * sizeof(PendingValue));
+        if (!grown) {
+          goto error;
+        }
+        pending_values = grown;
+        pending_size += 16;
+      }
+      pending = &pending_values[pending_count];
+      pending->column = table_stats_column(stats, column_name, 1);
+      pending->sign = sign;
+      if (!pending->column) {
+        goto error;
+      }
+      if (change_stream_value(eq + 1, pending->value, sizeof(pending->value))) {
+        pending_count++;
+      }
+      continue;
+    }
+    if (strncmp(line, "### WHERE", 9) == 0) {
+      sign = -1;
+      continue;
+    }
+    if (strncmp(line, "### SET", 7) == 0) {
+      sign = 1;
+      continue;
+    }
+
+    /* Any other line completes the previous row image */
+    for (i = 0; i < pending_count; i++) {
+      column_stats_update(pending_values[i].column, pending_values[i].value, pending_values[i].sign);
+    }
+    changes += pending_count;
+    net_rows += pending_rows;
+    pending_count = 0;
+    pending_rows = 0;
+    committed = line_start;
+
+    in_table = 0;
+    sign = 0;
+    if (strncmp(line, "### INSERT INTO ", 16) == 0) {
+      in_table = change_stream_table_matches(line + 16, table_name);
+      pending_rows = in_table;
+    } else if (strncmp(line, "### DELETE FROM ", 16) == 0) {
+      in_table = change_stream_table_matches(line + 16, table_name);
+      pending_rows = -in_table;
+    } else if (strncmp(line, "### UPDATE ", 11) == 0) {
+      in_table = change_stream_table_matches(line + 11, table_name);
+    }
+  }
+  fclose(fp);
+  free(line);
+  free(pending_values);
+
+  /* Keep the size estimate in step with the row count */
+  if (stats->row_count > 0) {
+    stats->data_size += net_rows * (stats->data_size / stats->row_count);
+  }
+  stats->row_count += net_rows;
+  if (stats->row_count < 0) {
+    stats->row_count = 0;
+  }
+  stats->change_count += changes;
+  /* Stats kept current by the stream are as fresh as a resample */
+  stats->analysis_time = time(NULL);
+  if (stats->stream_file) {
+    free(stats->stream_file);
+  }
+  stats->stream_file = strdup(stream_file);
+  stats->stream_offset = committed;
+  if (!stats->stream_file) {
+    table_stats_free(stats);
+    return 1;
+  }
+
+  catalog_put(partition_ctx->catalog, stats);
+  return catalog_save(partition_ctx->catalog);
+
+error:
+  fclose(fp);
+  free(line);
+  free(pending_values);
+  table_stats_free(stats);
+  return 1;
+}
+
+/**
+  @brief Apply row changes from a decoded binlog to the table's sketches.
+
+  Reads the output of `mysqlbinlog -v --base64-output=DECODE-ROWS`.
+  INSERT after-images are added, DELETE before-images removed, and
+  UPDATE rows do both.  The position reached is remembered, so calling
+  again on a growing file only reads the new events: the cost follows
+  the change volume, not the table size.  A row image is applied only
+  once it is complete, so a file cut mid-event resumes cleanly.
+
+  @param [in] ctx           Partition context.
+  @param [in] table_name    Table name.
+  @param [in] stream_file   Decoded binlog file.
+  @param [in] column_names  Comma-separated column names in table order,
+                            or NULL to name columns @1, @2, ...
+
+  @retval 0 success, 1 failure.
+*/
+static int partition_apply_change_stream(void *ctx, const char *table_name, const char *stream_file, const char *column_names) {
+  PartitionCatalog *catalog = ((PartitionContext *)ctx)->catalog;
+  int ret;
+
+  /* The stream position and sketches are read and republished as one update */
+  catalog_write_begin(catalog, table_name);
+  ret = change_stream_apply((PartitionContext *)ctx, table_name, stream_file, column_names);
+  catalog_write_end(catalog, table_name);
+  return ret;
+}
+
+/* Export scan settings */
+#define EXPORT_COLUMNAR_MAGIC 0x4c4f434dU /* "MCOL" */
+#define EXPORT_COLUMNAR_VERSION 1
+#define EXPORT_MAX_COLUMNS 256
+#define EXPORT_MAX_VALUE 256
+#define EXPORT_MIN_CHUNK (4 * 1024 * 1024)
+#define EXPORT_CHUNKS_PER_THREAD 4
+#define EXPORT_SKETCH_MEMORY (512LL * 1024 * 1024) /* per-thread sketches, all threads */
+
+/* One byte range of an export, scanned by one worker */
+typedef struct {
+  size_t begin;
+  size_t end;
+  int column; /* columnar section, or -1 for CSV rows */
+  long long rows;
+} ExportChunk;
+
+/* State shared by the export scan workers */
+typedef struct {
+  const char *data;
+  size_t size;
+  char delimiter;
+  int csv;
+  int column_count;
+  ExportChunk *chunks;
+  int chunk_count;
+  int next_chunk;
+  ColumnStats *sketches; /* column_count per worker */
+  int next_worker;
+} ExportScan;
+
+/**
+  @brief Find the next delimiter, quote or newline.
+
+  Sixteen bytes are compared at a time with SSE2 where available; the
+  scalar loop handles the tail and other targets.  Passing '\n' as the
+  delimiter and quote turns this into a plain line scan.
+
+  @param [in] p         Scan start.
+  @param [in] end       Scan end.
+  @param [in] delimiter Field delimiter.
+  @param [in] quote     Quote character.
+
+  @retval First matching byte, or end.
+*/
+static const char *export_scan(const char *p, const char *end, char delimiter, char quote) {
+#ifdef __SSE2__
+  const __m128i newlines = _mm_set1_epi8('\n');
+  const __m128i delimiters = _mm_set1_epi8(delimiter);
+  const __m128i quotes = _mm_set1_epi8(quote);
+
+  while (end - p >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)p);
+    __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, newlines),
+                                _mm_or_si128(_mm_cmpeq_epi8(block, delimiters), _mm_cmpeq_epi8(block, quotes)));
+    int mask = _mm_movemask_epi8(hits);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '\n' && *p != delimiter && *p != quote) {
+    p++;
+  }
+  return p;
+}
+
+/**
+  @brief Feed one field into a column sketch.
+
+  Values longer than EXPORT_MAX_VALUE are truncated; \N is NULL.
+
+  @param [in] column Column sketch, may be NULL for unnamed columns.
+  @param [in] value  Field bytes.
+  @param [in] len    Field length.
+*/
+static void export_field(ColumnStats *column, const char *value, size_t len) {
+  char buf[EXPORT_MAX_VALUE];
+
+  if (!column) {
+    return;
+  }
+  if (len > 0 && value[len - 1] == '\r') {
+    len--;
+  }
+  if (len == 2 && value[0] == '\\' && value[1] == 'N') {
+    return;
+  }
+  if (len >= sizeof(buf)) {
+    len = sizeof(buf) - 1;
+  }
+  memcpy(buf, value, len);
+  buf[len] = '\0';
+  column_stats_update(column, buf, 1);
+}
+
+/**
+  @brief Scan the CSV rows of one chunk.
+
+  @param [in]     scan     Export scan.
+  @param [in,out] chunk    Chunk to scan, cut at row boundaries.
+  @param [in]     sketches Worker's column sketches.
+*/
+static void export_scan_csv(const ExportScan *scan, ExportChunk *chunk, ColumnStats *sketches) {
+  const char *data_end = scan->data + scan->size;
+  const char *p = scan->data + chunk->begin;
+  const char *end = scan->data + chunk->end;
+  char value[EXPORT_MAX_VALUE];
+
+  while (p < end) {
+    int column = 0;
+
+    if (*p == '\n' || (*p == '\r' && p + 1 < data_end && p[1] == '\n')) {
+      /* Blank line */
+      p += *p == '\r' ? 2 : 1;
+      continue;
+    }
+    for (;;) {
+      ColumnStats *sketch = column < scan->column_count ? &sketches[column] : NULL;
+      const char *q;
+
+      if (p >= data_end) {
+        /* Trailing delimiter at the end of the file: empty last field */
+        export_field(sketch, p, 0);
+        break;
+      }
+      if (*p == '"') {
+        /* Quoted field: "" stands for one quote */
+        size_t len = 0;
+        p++;
+        for (;;) {
+          q = export_scan(p, data_end, '"', '"');
+          while (p < q) {
+            if (len < sizeof(value) - 1) value[len++] = *p;
+            p++;
+          }
+          if (q >= data_end) break;
+          if (*q != '"') {
+            if (len < sizeof(value) - 1) value[len++] = *q;
+            p = q + 1;
+            continue;
+          }
+          if (q + 1 < data_end && q[1] == '"') {
+            if (len < sizeof(value) - 1) value[len++] = '"';
+            p = q + 2;
+            continue;
+          }
+          p = q + 1;
+          break;
+        }
+        if (sketch) {
+          value[len] = '\0';
+          column_stats_update(sketch, value, 1);
+        }
+        q = export_scan(p, data_end, scan->delimiter, scan->delimiter);
+      } else {
+        q = export_scan(p, data_end, scan->delimiter, scan->delimiter);
+        export_field(sketch, p, (size_t)(q - p));
+      }
+
+      if (q >= data_end || *q == '\n') {
+        p = q + 1;
+        break;
+      }
+      p = q + 1;
+      column++;
+    }
+    chunk->rows++;
+  }
+}
+
+/**
+  @brief Scan the newline-separated values of one columnar chunk.
+
+  @param [in]     scan     Export scan.
+  @param [in,out] chunk    Chunk to scan.
+  @param [in]     sketches Worker's column sketches.
+*/
+static void export_scan_column(const ExportScan *scan, ExportChunk *chunk, ColumnStats *sketches) {
+  const char *p = scan->data + chunk->begin;
+  const char *end = scan->data + chunk->end;
+
+  while (p < end) {
+    const char *q = export_scan(p, end, '\n', '\n');
+    export_field(&sketches[chunk->column], p, (size_t)(q - p));
+    chunk->rows++;
+    p = q + 1;
+  }
+}
+
+/**
+  @brief Worker thread of the export scan.
+
+  @param [in] arg Export scan.
+
+  @retval NULL.
+*/
+static void *export_scan_worker(void *arg) {
+  ExportScan *scan = (ExportScan *)arg;
+  ColumnStats *sketches = scan->sketches + (size_t)__sync_fetch_and_add(&scan->next_worker, 1) * scan->column_count;
+  int index;
+
+  while ((index = __sync_fetch_and_add(&scan->next_chunk, 1)) < scan->chunk_count) {
+    ExportChunk *chunk = &scan->chunks[index];
+    if (scan->csv) {
+      export_scan_csv(scan, chunk, sketches);
+    } else {
+      export_scan_column(scan, chunk, sketches);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  @brief Find where a CSV chunk should end.
+
+  Quoted fields may hold newlines, so the quote state is followed from
+  the chunk start, which is a row start; only quotes are looked at up to
+  the target size.  A quote opens a field only right after a delimiter
+  or newline and "" inside a quoted field stands for one quote, as in
+  export_scan_csv().
+
+  @param [in] scan  Export scan.
+  @param [in] begin Chunk start, at a row start.
+  @param [in] stop  Target chunk end.
+  @param [in] end   Range end.
+
+  @retval Offset just past the first unquoted newline at or after stop, or end.
+*/
+static size_t export_csv_chunk_end(const ExportScan *scan, size_t begin, size_t stop, size_t end) {
+  const char *start = scan->data + begin;
+  const char *cut = scan->data + stop;
+  const char *limit = scan->data + end;
+  const char *p = start;
+  int quoted = 0;
+
+  while (p < limit) {
+    const char *q = p < cut ? (const char *)memchr(p, '"', (size_t)(cut - p)) : export_scan(p, limit, '"', '"');
+
+    if (!q) {
+      p = cut;
+      continue;
+    }
+    if (q >= limit) {
+      break;
+    }
+    if (*q == '\n') {
+      if (!quoted) {
+        return (size_t)(q - scan->data) + 1;
+      }
+    } else if (quoted) {
+      if (q + 1 < limit && q[1] == '"') {
+        q++;
+      } else {
+        quoted = 0;
+      }
+    } else if (q == start || q[-1] == '\n' || q[-1] == scan->delimiter) {
+      quoted = 1;
+    }
+    p = q + 1;
+  }
+  return end;
+}
+
+/**
+  @brief Split a byte range into chunks for the scan workers.
+
+  Chunks are cut after a row's newline so that every value or row
+  belongs to exactly one chunk.
+
+  @param [in] scan       Export scan.
+  @param [in] begin      Range start.
+  @param [in] end        Range end.
+  @param [in] column     Columnar section, or -1 for CSV.
+  @param [in] chunk_size Target chunk size.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int export_add_chunks(ExportScan *scan, size_t begin, size_t end, int column, size_t chunk_size) {
+  while (begin < end) {
+    size_t stop = end - begin > chunk_size ? begin + chunk_size : end;
+    ExportChunk *grown;
+
+    if (column >= 0 && stop < end) {
+      const char *nl = (const char *)memchr(scan->data + stop, '\n', end - stop);
+      stop = nl ? (size_t)(nl - scan->data) + 1 : end;
+    } else if (stop < end) {
+      stop = export_csv_chunk_end(scan, begin, stop, end);
+    }
+    grown = (ExportChunk *)realloc(scan->chunks, (scan->chunk_count + 1) * sizeof(ExportChunk));
+    if (!grown) {
+      return 1;
+    }
+    scan->chunks = grown;
+    scan->chunks[scan->chunk_count].begin = begin;
+    scan->chunks[scan->chunk_count].end = stop;
+    scan->chunks[scan->chunk_count].column = column;
+    scan->chunks[scan->chunk_count].rows = 0;
+    scan->chunk_count++;
+    begin = stop;
+  }
+  return 0;
+}
+
+/**
+  @brief Split a comma-separated name list.
+
+  @param [in]     list  Column names.
+  @param [out]    names Column names, strdup'ed.
+  @param [in,out] count Number of names stored so far.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int export_split_names(const char *list, char **names, int *count) {
+  while (list && *list && *count < EXPORT_MAX_COLUMNS) {
+    size_t len = strcspn(list, ",");
+    size_t trimmed = len;
+    const char *name = list;
+
+    while (trimmed > 0 && isspace((unsigned char)*name)) {
+      name++;
+      trimmed--;
+    }
+    while (trimmed > 0 && isspace((unsigned char)name[trimmed - 1])) {
+      trimmed--;
+    }
+    names[*count] = strndup(name, trimmed);
+    if (!names[*count]) {
+      return 1;
+    }
+    (*count)++;
+    list += len;
+    if (*list == ',') list++;
+  }
+  return 0;
+}
+
+/**
+  @brief Build the statistics of a table from an offline export.
+
+  The export is mapped read-only and scanned by a worker pool, each
+  worker filling private column sketches that are merged at the end, so
+  the database sees no load at all.  Two formats are understood:
+
+  - CSV or tab-separated text (chosen by the first line).  Column names
+    come from column_names, or from the header line when it is NULL or
+    empty.  \N is read as NULL.
+  - A columnar dump: magic "MCOL", version, column count, then per column
+    its name (length-prefixed) and the offset and length of a section of
+    newline-separated values.  column_names is ignored.
+
+  Exported columns replace the sketches kept in the catalog, and the
+  row count follows the export.
+
+  @param [in] ctx          Partition context.
+  @param [in] table_name   Table name.
+  @param [in] export_file  Export path.
+  @param [in] column_names Comma-separated column names, may be NULL.
+  @param [in] threads      Worker count, 0 for one per CPU.
+
+  @retval 0 success, 1 failure.
+*/
+static int partition_analyze_export(void *ctx, const char *table_name, const char *export_file, const char *column_names, int threads) {
+  PartitionContext *partition_ctx = (PartitionContext *)ctx;
+  char *names[EXPORT_MAX_COLUMNS];
+  pthread_t workers[ANALYZE_MAX_THREADS];
+  ExportScan scan;
+  TableStats *current;
+  TableStats *stats = NULL;
+  struct stat st;
+  void *map = MAP_FAILED;
+  size_t data_begin = 0;
+  size_t chunk_size;
+  long long rows = 0;
+  int column_count = 0;
+  int name_count = 0;
+  int started = 0;
+  int locked = 0;
+  int ret = 1;
+  int fd;
+  int i, t;
+
+  memset(&scan, 0, sizeof(scan));
+  fd = open(export_file, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return 1;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return 1;
+  }
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  scan.data = (const char *)map;
+  scan.size = (size_t)st.st_size;
+
+  if (threads <= 0) {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads < 1) threads = 1;
+  if (threads > ANALYZE_MAX_THREADS) threads = ANALYZE_MAX_THREADS;
+  chunk_size = scan.size / ((size_t)threads * EXPORT_CHUNKS_PER_THREAD);
+  if (chunk_size < EXPORT_MIN_CHUNK) {
+    chunk_size = EXPORT_MIN_CHUNK;
+  }
+
+  if (scan.size >= 12 && *(const unsigned int *)scan.data == EXPORT_COLUMNAR_MAGIC) {
+    /* Columnar dump: one chunk list per column section */
+    const char *p = scan.data + 12;
+    const char *data_end = scan.data + scan.size;
+
+    if (*(const unsigned int *)(scan.data + 4) != EXPORT_COLUMNAR_VERSION) {
+      goto done;
+    }
+    column_count = (int)*(const unsigned int *)(scan.data + 8);
+    if (column_count <= 0 || column_count > EXPORT_MAX_COLUMNS) {
+      goto done;
+    }
+    for (i = 0; i < column_count; i++) {
+      unsigned int len;
+      unsigned long long section[2];
+
+      if (data_end - p < 4) goto done;
+      memcpy(&len, p, 4);
+      p += 4;
+      if ((size_t)(data_end - p) < (size_t)len + sizeof(section)) goto done;
+      names[name_count] = strndup(p, len);
+      if (!names[name_count]) goto done;
+      name_count++;
+      p += len;
+      memcpy(section, p, sizeof(section));
+      p += sizeof(section);
+      if (section[0] > scan.size || section[1] > scan.size - section[0] ||
+          export_add_chunks(&scan, (size_t)section[0], (size_t)(section[0] + section[1]), i, chunk_size) != 0) {
+        goto done;
+      }
+    }
+  } else {
+    /* CSV: header or caller-supplied names, delimiter from the first line */
+    const char *line_end = export_scan(scan.data, scan.data + scan.size, '\n', '\n');
+    int commas = 0;
+    int tabs = 0;
+    const char *p;
+
+    for (p = scan.data; p < line_end; p++) {
+      commas += *p == ',';
+      tabs += *p == '\t';
+    }
+    scan.csv = 1;
+    scan.delimiter = tabs > commas ? '\t' : ',';
+    if (column_names && *column_names) {
+      if (export_split_names(column_names, names, &name_count) != 0) {
+        goto done;
+      }
+    } else {
+      char header[EXPORT_MAX_COLUMNS * 64];
+      size_t len = (size_t)(line_end - scan.data);
+      if (len >= sizeof(header)) len = sizeof(header) - 1;
+      memcpy(header, scan.data, len);
+      header[len] = '\0';
+      if (len > 0 && header[len - 1] == '\r') header[len - 1] = '\0';
+      for (i = 0; header[i]; i++) {
+        if (header[i] == scan.delimiter) header[i] = ',';
+        else if (header[i] == '"') header[i] = ' ';
+      }
+      if (export_split_names(header, names, &name_count) != 0) {
+        goto done;
+      }
+      data_begin = line_end < scan.data + scan.size ? (size_t)(line_end - scan.data) + 1 : scan.size;
+    }
+    column_count = name_count;
+    if (column_count <= 0 || export_add_chunks(&scan, data_begin, scan.size, -1, chunk_size) != 0) {
+      goto done;
+    }
+  }
+  scan.column_count = column_count;
+
+  /* Keep all per-thread sketches within budget */
+  while (threads > 1 && (long long)threads * column_count * (long long)sizeof(ColumnStats) > EXPORT_SKETCH_MEMORY) {
+    threads--;
+  }
+  if (threads > scan.chunk_count) {
+    threads = scan.chunk_count > 0 ? scan.chunk_count : 1;
+  }
+  scan.sketches = (ColumnStats *)calloc((size_t)threads * column_count, sizeof(ColumnStats));
+  if (!scan.sketches) {
+    goto done;
+  }
+
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], NULL, export_scan_worker, &scan) != 0) {
+      break;
+    }
+    started++;
+  }
+  if (started == 0) {
+    export_scan_worker(&scan);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  /* Rows: CSV lines, or values of the first column section */
+  for (i = 0; i < scan.chunk_count; i++) {
+    if (scan.chunks[i].column <= 0) {
+      rows += scan.chunks[i].rows;
+    }
+  }
+
+  /* Replace the exported columns' sketches in a private copy */
+  catalog_write_begin(partition_ctx->catalog, table_name);
+  locked = 1;
+  current = catalog_lookup(partition_ctx->catalog, table_name, 0);
+  if (current) {
+    stats = table_stats_clone(current);
+    catalog_release(partition_ctx->catalog, current);
+  } else {
+    stats = collect_table_stats(table_name);
+  }
+  if (!stats) {
+    goto done;
+  }
+  for (i = 0; i < column_count; i++) {
+    ColumnStats *column = table_stats_column(stats, names[i], 1);
+    char *name;
+    if (!column) {
+      goto done;
+    }
+    name = column->column_name;
+    memset(column, 0, sizeof(*column));
+    column->column_name = name;
+    for (t = 0; t < (started > 0 ? started : 1); t++) {
+      column_stats_merge(column, &scan.sketches[(size_t)t * column_count + i]);
+    }
+  }
+  stats->row_count = rows;
+  stats->data_size = (long long)scan.size;
+  stats->analysis_time = time(NULL);
+
+  catalog_put(partition_ctx->catalog, stats);
+  stats = NULL;
+  ret = catalog_save(partition_ctx->catalog);
+
+done:
+  if (locked) {
+    catalog_write_end(partition_ctx->catalog, table_name);
+  }
+  for (i = 0; i < name_count; i++) {
+    free(names[i]);
+  }
+  if (stats) {
+    table_stats_free(stats);
+  }
+  free(scan.sketches);
+  free(scan.chunks);
+  munmap(map, scan.size);
+  return ret;
+}
+
+/* SQL token kinds used by the workload replay */
+#define SQL_TOKEN_IDENT 1
+#define SQL_TOKEN_NUMBER 2
+#define SQL_TOKEN_STRING 3
+#define SQL_TOKEN_OPERATOR 4
+#define SQL_TOKEN_PUNCT 5
+
+/* One token of a replayed statement */
+typedef struct {
+  int type;
+  char text[128];
+} SqlToken;
+
+/* Bounds collected for one column within a statement */
+typedef struct {
+  char column_name[128];
+  int equality;
+  int has_lower;
+  int has_upper;
+  double lower;
+  double upper;
+} StatementPredicate;
+
+/**
+  @brief Split a SQL statement into tokens.
+
+  @param [in]  sql        Statement text.
+  @param [out] tokens     Token array.
+  @param [in]  max_tokens Token array capacity.
+
+  @retval Number of tokens.
+*/
+static int tokenize_sql(const char *sql, SqlToken *tokens, int max_tokens) {
+  int count = 0;
+
+  while (*sql && count < max_tokens) {
+    SqlToken *token = &tokens[count];
+    size_t len = 0;
+
+    if (isspace((unsigned char)*sql)) {
+      sql++;
+      continue;
+    }
+    if (*sql == '\'' || *sql == '"') {
+      char quote = *sql++;
+      token->type = SQL_TOKEN_STRING;
+      while (*sql && *sql != quote) {
+        if (*sql == '\\' && sql[1]) sql++;
+        if (len < sizeof(token->text) - 1) token->text[len++] = *sql;
+        sql++;
+      }
+      if (*sql) sql++;
+    } else if (*sql == '`' || isalpha((unsigned char)*sql) || *sql == '_') {
+      /* Qualified names keep only the last component */
+      token->type = SQL_TOKEN_IDENT;
+      while (*sql == '`' || isalnum((unsigned char)*sql) || *sql == '_' || *sql == '$' || *sql == '.') {
+        if (*sql == '.') {
+          len = 0;
+        } else if (*sql != '`' && len < sizeof(token->text) - 1) {
+          token->text[len++] = *sql;
+        }
+        sql++;
+      }
+    } else if (isdigit((unsigned char)*sql) || ((*sql == '-' || *sql == '.') && isdigit((unsigned char)sql[1]))) {
+      token->type = SQL_TOKEN_NUMBER;
+      while ((isalnum((unsigned char)*sql) || *sql == '.' || *sql == '-') && len < sizeof(token->text) - 1) {
+        token->text[len++] = *sql++;
+      }
+    } else if (strchr("<>=!", *sql)) {
+      token->type = SQL_TOKEN_OPERATOR;
+      while (*sql && strchr("<>=!", *sql) && len < 2) {
+        token->text[len++] = *sql++;
+      }
+    } else {
+      token->type = SQL_TOKEN_PUNCT;
+      token->text[len++] = *sql++;
+    }
+    token->text[len] = '\0';
+    count++;
+  }
+
+  return count;
+}
+
+/**
+  @brief Find or add the per-statement bounds of a column.
+
+  @param [in] predicates Statement predicates.
+  @param [in] count      Number of predicates in use.
+  @param [in] max_count  Predicate array capacity.
+  @param [in] name       Column name.
+
+  @retval Predicate, or NULL if the array is full.
+*/
+static StatementPredicate *statement_predicate(StatementPredicate *predicates, int *count, int max_count, const char *name) {
+  int i;
+
+  for (i = 0; i < *count; i++) {
+    if (strcasecmp(predicates[i].column_name, name) == 0) {
+      return &predicates[i];
+    }
+  }
+  if (*count == max_count) {
+    return NULL;
+  }
+  memset(&predicates[*count], 0, sizeof(StatementPredicate));
+  snprintf(predicates[*count].column_name, sizeof(predicates[*count].column_name), "%s", name);
+  return &predicates[(*count)++];
+}
+
+/**
+  @brief Record one replayed statement's predicates in the table workload.
+
+  Recognizes `col op literal`, `literal op col`, `col BETWEEN a AND b` and
+  `col IN (...)`.  Lower and upper bounds on the same column within one
+  statement combine into a bounded range whose width drives the pruning
+  granularity.
+
+  @param [in] stats      Table statistics.
+  @param [in] table_name Unqualified table name.
+  @param [in] sql        Statement text.
+
+  @retval 0 success, 1 out of memory.
+*/
+static int replay_statement(TableStats *stats, const char *table_name, const char *sql) {
+  SqlToken tokens[512];
+  StatementPredicate predicates[32];
+  int predicate_count = 0;
+  int token_count = tokenize_sql(sql, tokens, 512);
+  int mentions_table = 0;
+  int i;
+
+  for (i = 0; i < token_count; i++) {
+    if (tokens[i].type == SQL_TOKEN_IDENT && strcasecmp(tokens[i].text, table_name) == 0) {
+      mentions_table = 1;
+      break;
+    }
+  }
+  if (!mentions_table) {
+    return 0;
+  }
+
+  for (i = 0; i + 2 < token_count; i++) {
+    const SqlToken *column = &tokens[i];
+    const SqlToken *op = &tokens[i + 1];
+    const SqlToken *literal = &tokens[i + 2];
+    StatementPredicate *predicate;
+    char op_text[4];
+    double number;
+
+    /* Normalize `literal op column` to `column op' literal`; =, <> and != read the same both ways */
+    if (column->type != SQL_TOKEN_IDENT && literal->type == SQL_TOKEN_IDENT && op->type == SQL_TOKEN_OPERATOR) {
+      const SqlToken *swap = column;
+      const char *mirrored = op->text;
+      column = literal;
+      literal = swap;
+      if (strcmp(op->text, "<") == 0) {
+        mirrored = ">";
+      } else if (strcmp(op->text, "<=") == 0) {
+        mirrored = ">=";
+      } else if (strcmp(op->text, ">") == 0) {
+        mirrored = "<";
+      } else if (strcmp(op->text, ">=") == 0) {
+        mirrored = "<=";
+      }
+      snprintf(op_text, sizeof(op_text), "%.2s", mirrored);
+    } else {
+      snprintf(op_text, sizeof(op_text), "%.2s", op->text);
+    }
+    if (column->type != SQL_TOKEN_IDENT) {
+      continue;
+    }
+
+    if (op->type == SQL_TOKEN_IDENT && strcasecmp(op->text, "IN") == 0 && literal->text[0] == '(') {
+      predicate = statement_predicate(predicates, &predicate_count, 32, column->text);
+      if (predicate) predicate->equality = 1;
+      continue;
+    }
+    if (op->type == SQL_TOKEN_IDENT && strcasecmp(op->text, "BETWEEN") == 0 && i + 4 < token_count &&
+        (literal->type == SQL_TOKEN_NUMBER || literal->type == SQL_TOKEN_STRING) &&
+        parse_column_number(literal->text, &number)) {
+      double upper;
+      predicate = statement_predicate(predicates, &predicate_count, 32, column->text);
+      if (predicate && parse_column_number(tokens[i + 4].text, &upper)) {
+        predicate->has_lower = predicate->has_upper = 1;
+        predicate->lower = number;
+        predicate->upper = upper;
+      }
+      continue;
+    }
+    if (op->type != SQL_TOKEN_OPERATOR || (literal->type != SQL_TOKEN_NUMBER && literal->type != SQL_TOKEN_STRING)) {
+      continue;
+    }
+
+    predicate = statement_predicate(predicates, &predicate_count, 32, column->text);
+    if (!predicate) {
+      continue;
+    }
+    if (strcmp(op_text, "=") == 0) {
+      predicate->equality = 1;
+    } else if (parse_column_number(literal->text, &number)) {
+      if (op_text[0] == '>') {
+        predicate->has_lower = 1;
+        predicate->lower = number;
+      } else if (op_text[0] == '<' && op_text[1] != '>') {
+        predicate->has_upper = 1;
+        predicate->upper = number;
+      }
+    }
+  }
+
+  for (i = 0; i < predicate_count; i++) {
+    const StatementPredicate *predicate = &predicates[i];
+    PredicateStats *usage = NULL;
+    int p;
+
+    if (!predicate->equality && !predicate->has_lower && !predicate->has_upper) {
+      continue;
+    }
+    for (p = 0; p < stats->predicate_count; p++) {
+      if (strcmp(stats->predicates[p].column_name, predicate->column_name) == 0) {
+        usage = &stats->predicates[p];
+        break;
+      }
+    }
+    if (!usage) {
+      PredicateStats *grown = (PredicateStats *)realloc(stats->predicates, (stats->predicate_count + 1) * sizeof(PredicateStats));
+      if (!grown) {
+        return 1;
+      }
+      stats->predicates = grown;
+      usage = &stats->predicates[stats->predicate_count];
+      memset(usage, 0, sizeof(*usage));
+      usage->column_name = strdup(predicate->column_name);
+      if (!usage->column_name) {
+        return 1;
+      }
+      stats->predicate_count++;
+    }
+
+    if (predicate->equality) {
+      usage->eq_predicates++;
+    } else {
+      usage->range_predicates++;
+      if (predicate->has_lower && predicate->has_upper) {
+        double width = predicate->upper - predicate->lower;
+        usage->bounded_ranges++;
+        usage->log_width_sum += log(width > 1 ? width : 1);
+      }
+    }
+  }
+  stats->workload_queries++;
+
+  return 0;
+}
+
+/**
+  @brief Replay a workload file into a table's statistics; the caller holds its writer lock.
+
+  @param [in] partition_ctx Partition context.
+  @param [in] table_name    Table name.
+  @param [in] workload_file File with SQL statements.
+
+  @retval 0 success, 1 failure.
+*/
+static int workload_replay(PartitionContext *partition_ctx, const char *table_name, const char *workload_file) {
+  const char *short_name = strrchr(table_name, '.') ? strrchr(table_name, '.') + 1 : table_name;
+  ScriptBuffer statement = {NULL, 0, 0, 0};
+  TableStats *current;
+  TableStats *stats;
+  char *line = NULL;
+  size_t line_size = 0;
+  char quote = 0; /* quote of an open string or identifier */
+  int in_comment = 0; /* inside a block comment */
+  FILE *fp;
+  int i;
+
+  current = get_table_stats(partition_ctx, table_name);
+  if (!current) {
+    return 1;
+  }
+  stats = table_stats_clone(current);
+  catalog_release(partition_ctx->catalog, current);
+  if (!stats) {
+    return 1;
+  }
+  for (i = 0; i < stats->predicate_count; i++) {
+    free(stats->predicates[i].column_name);
+  }
+  stats->predicate_count = 0;
+  stats->workload_queries = 0;
+
+  fp = fopen(workload_file, "r");
+  if (!fp) {
+    table_stats_free(stats);
+    return 1;
+  }
+
+  script_append(&statement, "%s", "");
+  /* Statements can be longer than any line buffer: read whole lines */
+  while (!statement.failed && getline(&line, &line_size, fp) > 0) {
+    char *start = line;
+    char *p;
+
+    /* Split on semicolons outside strings and comments */
+    for (p = line; *p && !statement.failed; p++) {
+      if (in_comment) {
+        if (p[0] == '*' && p[1] == '/') {
+          in_comment = 0;
+          start = ++p + 1;
+        }
+      } else if (quote) {
+        if (*p == '\\' && p[1] && quote != '`') {
+          p++;
+        } else if (*p == quote) {
+          quote = 0;
+        }
+      } else if (*p == '\'' || *p == '"' || *p == '`') {
+        quote = *p;
+      } else if (*p == '#' || (p[0] == '-' && p[1] == '-' && (!p[2] || isspace((unsigned char)p[2])))) {
+        /* The rest of the line is a comment */
+        break;
+      } else if (p[0] == '/' && p[1] == '*') {
+        script_append(&statement, "%.*s ", (int)(p - start), start);
+        in_comment = 1;
+        p++;
+      } else if (*p == ';') {
+        script_append(&statement, "%.*s", (int)(p - start), start);
+        if (statement.failed || replay_statement(stats, short_name, statement.text) != 0) {
+          statement.failed = 1;
+          break;
+        }
+        statement.len = 0;
+        statement.text[0] = '\0';
+        start = p + 1;
+      }
+    }
+    if (!in_comment && !statement.failed) {
+      script_append(&statement, "%.*s%s", (int)(p - start), start, *p ? "\n" : "");
+    }
+  }
+  free(line);
+  if (!statement.failed && statement.len > 0 && replay_statement(stats, short_name, statement.text) != 0) {
+    statement.failed = 1;
+  }
+  fclose(fp);
+  free(statement.text);
+
+  if (statement.failed) {
+    table_stats_free(stats);
+    return 1;
+  }
+
+  catalog_put(partition_ctx->catalog, stats);
+  return catalog_save(partition_ctx->catalog);
+}
+
+/**
+  @brief Replay a query workload against a table's statistics.
+
+  Statements are separated by semicolons outside quoted strings and
+  comments; comments, such as the header lines of slow or general
+  query logs, are skipped.  Replaying replaces the previously
+  recorded workload of the table.
+
+  @param [in] ctx           Partition context.
+  @param [in] table_name    Table name.
+  @param [in] workload_file File with SQL statements.
+
+  @retval 0 success, 1 failure.
+*/
+static int partition_replay_workload(void *ctx, const char *table_name, const char *workload_file) {
+  PartitionCatalog *catalog = ((PartitionContext *)ctx)->catalog;
+  int ret;
+
+  catalog_write_begin(catalog, table_name);
+  ret = workload_replay((PartitionContext *)ctx, table_name, workload_file);
+  catalog_write_end(catalog, table_name);
+  return ret;
+}
+
+/* Index advisor settings */
+#define INDEX_MAX 64
+#define INDEX_MAX_COLUMNS 16
+#define INDEX_MAX_TOKENS 8192
+#define INDEX_PAGE_BYTES 16384
+#define INDEX_FILL_FACTOR 0.7
+#define INDEX_ENTRY_OVERHEAD 13 /* record header and page directory share */
+#define INDEX_LOOKUP_SHARE 20 /* equality lookups worth an index: 1/20 of queries */
+
+/* Index kinds */
+#define INDEX_SECONDARY 0
+#define INDEX_PRIMARY 1
+#define INDEX_UNIQUE 2
+#define INDEX_FOREIGN 3
+
+/* One index of a table definition */
+typedef struct {
+  char name[128];
+  int kind;
+  char columns[INDEX_MAX_COLUMNS][128];
+  int lengths[INDEX_MAX_COLUMNS]; /* prefix length, 0 for the whole column */
+  int descending[INDEX_MAX_COLUMNS];
+  int column_count;
+  int partial; /* has key parts that cannot be reproduced, such as expressions */
+  int dropped;
+} IndexDefinition;
 
-/* Plugin type definitions */
-#define MYSQL_INTELLIGENT_PARTITION_PLUGIN 15
-#define PLUGIN_LICENSE_GPL "GPL"
+/**
+  @brief Read the column list of an index definition.
 
-/* Partition types */
-#define PARTITION_TYPE_RANGE "RANGE"
-#define PARTITION_TYPE_LIST "LIST"
-#define PARTITION_TYPE_HASH "HASH"
-#define PARTITION_TYPE_KEY "KEY"
-#define PARTITION_TYPE_TIME "TIME"
+  Prefix lengths and ASC/DESC are kept.  Expression key parts, or more
+  than INDEX_MAX_COLUMNS columns, mark the index partial.
+
+  @param [in]  tokens      Tokens.
+  @param [in]  token_count Number of tokens.
+  @param [in]  i           Index of the opening parenthesis.
+  @param [out] index       Index receiving the columns.
+
+  @retval Index of the token after the closing parenthesis.
+*/
+static int index_parse_columns(const SqlToken *tokens, int token_count, int i, IndexDefinition *index) {
+  int depth = 0;
+  int expect_column = 1;
+  int part = -1; /* key part being read */
+
+  for (; i < token_count; i++) {
+    const SqlToken *token = &tokens[i];
+    if (token->type == SQL_TOKEN_PUNCT && token->text[0] == '(') {
+      /* "col(N)" is a prefix length; any other nested parenthesis an expression */
+      if (depth == 1 && part >= 0 && !index->lengths[part] && !index->descending[part] && i + 2 < token_count &&
+          tokens[i + 1].type == SQL_TOKEN_NUMBER && tokens[i + 2].type == SQL_TOKEN_PUNCT && tokens[i + 2].text[0] == ')') {
+        index->lengths[part] = atoi(tokens[i + 1].text);
+        i += 2;
+        continue;
+      }
+      if (depth >= 1) {
+        index->partial = 1;
+      }
+      depth++;
+      continue;
+    }
+    if (token->type == SQL_TOKEN_PUNCT && token->text[0] == ')') {
+      if (--depth == 0) {
+        return i + 1;
+      }
+      continue;
+    }
+    if (depth != 1) {
+      continue;
+    }
+    if (token->type == SQL_TOKEN_PUNCT && token->text[0] == ',') {
+      expect_column = 1;
+      part = -1;
+    } else if (expect_column && token->type == SQL_TOKEN_IDENT) {
+      if (index->column_count < INDEX_MAX_COLUMNS) {
+        part = index->column_count++;
+        snprintf(index->columns[part], sizeof(index->columns[0]), "%s", token->text);
+      } else {
+        index->partial = 1;
+      }
+      expect_column = 0;
+    } else if (!expect_column && token->type == SQL_TOKEN_IDENT &&
+               (strcasecmp(token->text, "ASC") == 0 || strcasecmp(token->text, "DESC") == 0)) {
+      if (part >= 0) {
+        index->descending[part] = strcasecmp(token->text, "DESC") == 0;
+      }
+    } else {
+      index->partial = 1;
+    }
+  }
+  return i;
+}
 
 /**
-  @brief Create partition context.
+  @brief Parse index definitions.
 
-  @retval Partition context pointer, or NULL on failure.
+  Accepts SHOW CREATE TABLE output or bare key clauses such as
+  "PRIMARY KEY (id), UNIQUE KEY uk (email), KEY idx (tenant_id, created_at)".
+  Inline "col ... PRIMARY KEY" and "col ... UNIQUE" column attributes are
+  recognized too.
+
+  @param [in]  definitions Index definitions.
+  @param [out] indexes     Parsed indexes.
+  @param [in]  max_indexes Capacity of indexes.
+
+  @retval Number of indexes, -1 on failure.
 */
-static void *partition_create_context(void) {
-  PartitionContext *ctx = (PartitionContext *)malloc(sizeof(PartitionContext));
-  if (!ctx) {
-    return NULL;
+static int index_parse_definitions(const char *definitions, IndexDefinition *indexes, int max_indexes) {
+  SqlToken *tokens = (SqlToken *)malloc(INDEX_MAX_TOKENS * sizeof(SqlToken));
+  int token_count;
+  int count = 0;
+  int i;
+
+  if (!tokens) {
+    return -1;
   }
+  token_count = tokenize_sql(definitions, tokens, INDEX_MAX_TOKENS);
 
-  /* Initialize context */
-  ctx->current_table = NULL;
-  ctx->analysis_time = 0;
-  ctx->row_count = 0;
-  ctx->data_size = 0;
-  ctx->partition_key = NULL;
-  ctx->partition_type = NULL;
-  ctx->partition_count = 0;
-  ctx->recommendation = NULL;
-  ctx->performance_metrics = NULL;
+  for (i = 0; i < token_count && count < max_indexes; i++) {
+    const SqlToken *token = &tokens[i];
+    IndexDefinition *index = &indexes[count];
+    int kind = -1;
+    int next = i + 1;
 
-  return ctx;
+    if (token->type != SQL_TOKEN_IDENT) {
+      continue;
+    }
+    if (strcasecmp(token->text, "PRIMARY") == 0) {
+      kind = INDEX_PRIMARY;
+    } else if (strcasecmp(token->text, "UNIQUE") == 0) {
+      kind = INDEX_UNIQUE;
+    } else if (strcasecmp(token->text, "FOREIGN") == 0) {
+      kind = INDEX_FOREIGN;
+    } else if ((strcasecmp(token->text, "KEY") == 0 || strcasecmp(token->text, "INDEX") == 0) &&
+               (i == 0 || tokens[i - 1].type == SQL_TOKEN_PUNCT)) {
+      kind = INDEX_SECONDARY;
+    } else {
+      continue;
+    }
+
+    memset(index, 0, sizeof(*index));
+    index->kind = kind;
+    /* Skip KEY/INDEX after PRIMARY/UNIQUE/FOREIGN */
+    if (kind != INDEX_SECONDARY && next < token_count && tokens[next].type == SQL_TOKEN_IDENT &&
+        (strcasecmp(tokens[next].text, "KEY") == 0 || strcasecmp(tokens[next].text, "INDEX") == 0)) {
+      next++;
+    }
+    /* Optional index name, or the name of a CONSTRAINT clause */
+    if (next < token_count && tokens[next].type == SQL_TOKEN_IDENT) {
+      snprintf(index->name, sizeof(index->name), "%s", tokens[next].text);
+      next++;
+    } else if (i >= 2 && tokens[i - 1].type == SQL_TOKEN_IDENT && strcasecmp(tokens[i - 2].text, "CONSTRAINT") == 0) {
+      snprintf(index->name, sizeof(index->name), "%s", tokens[i - 1].text);
+    }
+
+    if (next < token_count && tokens[next].type == SQL_TOKEN_PUNCT && tokens[next].text[0] == '(') {
+      i = index_parse_columns(tokens, token_count, next, index) - 1;
+    } else if (kind == INDEX_PRIMARY || kind == INDEX_UNIQUE) {
+      /* Column attribute: the column starts this definition */
+      int start = i;
+      int level = 0;
+      while (start > 0) {
+        const SqlToken *prev = &tokens[start - 1];
+        if (prev->type == SQL_TOKEN_PUNCT && prev->text[0] == ')') level++;
+        if (prev->type == SQL_TOKEN_PUNCT && prev->text[0] == '(' && level-- == 0) break;
+        if (prev->type == SQL_TOKEN_PUNCT && prev->text[0] == ',' && level == 0) break;
+        start--;
+      }
+      if (tokens[start].type != SQL_TOKEN_IDENT) {
+        continue;
+      }
+      index->name[0] = '\0';
+      snprintf(index->columns[0], sizeof(index->columns[0]), "%s", tokens[start].text);
+      index->column_count = 1;
+    }
+    /* Expression-only keys are kept when named, so they are reported rather than lost */
+    if (index->column_count == 0 && (!index->partial || !index->name[0])) {
+      continue;
+    }
+    if (kind == INDEX_PRIMARY) {
+      snprintf(index->name, sizeof(index->name), "PRIMARY");
+    } else if (!index->name[0]) {
+      snprintf(index->name, sizeof(index->name), "%s", index->columns[0]);
+    }
+    count++;
+  }
+
+  free(tokens);
+  return count;
 }
 
 /**
-  @brief Destroy partition context.
+  @brief Whether an index covers a column.
 
-  @param [in] ctx Partition context to destroy.
+  @param [in] index  Index.
+  @param [in] column Column name.
+
+  @retval 1 if the column is part of the index, 0 otherwise.
 */
-static void partition_destroy_context(void *ctx) {
-  if (ctx) {
-    PartitionContext *partition_ctx = (PartitionContext *)ctx;
-    
-    if (partition_ctx->current_table) {
-      free(partition_ctx->current_table);
+static int index_has_column(const IndexDefinition *index, const char *column) {
+  int i;
+
+  for (i = 0; i < index->column_count; i++) {
+    if (strcasecmp(index->columns[i], column) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+  @brief Whether one index is a left prefix of another.
+
+  Columns must match in prefix length and direction too.  Partial
+  indexes are never prefixes of anything, nor have any.
+
+  @param [in] prefix Candidate prefix.
+  @param [in] index  Longer index.
+
+  @retval 1 if prefix's columns lead index, 0 otherwise.
+*/
+static int index_is_prefix(const IndexDefinition *prefix, const IndexDefinition *index) {
+  int i;
+
+  if (prefix->partial || index->partial || prefix->column_count > index->column_count) {
+    return 0;
+  }
+  for (i = 0; i < prefix->column_count; i++) {
+    if (strcasecmp(prefix->columns[i], index->columns[i]) != 0 || prefix->lengths[i] != index->lengths[i] ||
+        prefix->descending[i] != index->descending[i]) {
+      return 0;
     }
-    if (partition_ctx->partition_key) {
-      free(partition_ctx->partition_key);
+  }
+  return 1;
+}
+
+/**
+  @brief Estimated stored width of a column.
+
+  Numeric columns take 8 bytes; other columns the average length of
+  their heavy hitters, or 32 bytes without a sketch.
+
+  @param [in] stats  Table statistics.
+  @param [in] column Column name.
+
+  @retval Width in bytes.
+*/
+static double index_column_width(const TableStats *stats, const char *column) {
+  const ColumnStats *sketch = table_stats_find_column(stats, column);
+  double total = 0;
+  int i;
+
+  if (!sketch || sketch->inserts - sketch->deletes <= 0) {
+    return 32;
+  }
+  if (sketch->quantiles.count >= sketch->inserts - sketch->deletes) {
+    return 8;
+  }
+  for (i = 0; i < sketch->heavy_hitter_count; i++) {
+    total += strlen(sketch->heavy_hitters[i].value);
+  }
+  return sketch->heavy_hitter_count > 0 ? total / sketch->heavy_hitter_count + 2 : 32;
+}
+
+/**
+  @brief Estimated size and B-tree depth of the secondary indexes.
+
+  InnoDB secondary entries carry the primary key columns.
+
+  @param [in]  stats      Table statistics.
+  @param [in]  indexes    Indexes.
+  @param [in]  count      Number of indexes.
+  @param [in]  partitions Partitions (and subpartitions) per index.
+  @param [out] depth      Deepest per-partition B-tree.
+
+  @retval Total secondary index bytes.
+*/
+static double index_secondary_bytes(const TableStats *stats, const IndexDefinition *indexes, int count, int partitions, int *depth) {
+  const IndexDefinition *primary = NULL;
+  double total = 0;
+  int i, c;
+
+  *depth = 0;
+  for (i = 0; i < count; i++) {
+    if (indexes[i].kind == INDEX_PRIMARY && !indexes[i].dropped) {
+      primary = &indexes[i];
     }
-    if (partition_ctx->partition_type) {
-      free(partition_ctx->partition_type);
+  }
+  for (i = 0; i < count; i++) {
+    double entry = INDEX_ENTRY_OVERHEAD;
+    double entries = (double)stats->row_count / partitions;
+    double fanout;
+    int levels;
+
+    if (indexes[i].dropped || indexes[i].kind == INDEX_PRIMARY || indexes[i].kind == INDEX_FOREIGN) {
+      continue;
     }
-    if (partition_ctx->recommendation) {
-      free(partition_ctx->recommendation);
+    for (c = 0; c < indexes[i].column_count; c++) {
+      entry += index_column_width(stats, indexes[i].columns[c]);
     }
-    if (partition_ctx->performance_metrics) {
-      free(partition_ctx->performance_metrics);
+    /* Primary key columns not already in the index, or the hidden row id */
+    if (primary) {
+      for (c = 0; c < primary->column_count; c++) {
+        if (!index_has_column(&indexes[i], primary->columns[c])) {
+          entry += index_column_width(stats, primary->columns[c]);
+        }
+      }
+    } else {
+      entry += 6;
+    }
+    total += (double)stats->row_count * entry / INDEX_FILL_FACTOR;
+
+    fanout = INDEX_PAGE_BYTES * INDEX_FILL_FACTOR / entry;
+    levels = entries > 1 && fanout > 1 ? (int)ceil(log(entries) / log(fanout)) : 1;
+    if (levels > *depth) {
+      *depth = levels;
     }
-    
-    free(partition_ctx);
   }
+  return total;
 }
 
 /**
-  @brief Analyze table for partitioning.
+  @brief Count live secondary and unique indexes.
 
-  @param [in] ctx         Partition context.
-  @param [in] table_name  Table name to analyze.
+  @param [in] indexes Indexes.
+  @param [in] count   Number of indexes.
+
+  @retval Number of B-trees besides the clustered index.
+*/
+static int index_secondary_count(const IndexDefinition *indexes, int count) {
+  int total = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (!indexes[i].dropped && (indexes[i].kind == INDEX_SECONDARY || indexes[i].kind == INDEX_UNIQUE)) {
+      total++;
+    }
+  }
+  return total;
+}
+
+/**
+  @brief Append an index column list.
+
+  @param [in] buf   Script buffer.
+  @param [in] index Index.
+*/
+static void index_append_columns(ScriptBuffer *buf, const IndexDefinition *index) {
+  int c;
+
+  script_append(buf, "(");
+  for (c = 0; c < index->column_count; c++) {
+    script_append(buf, "%s%s", c ? ", " : "", index->columns[c]);
+    if (index->lengths[c]) {
+      script_append(buf, "(%d)", index->lengths[c]);
+    }
+    if (index->descending[c]) {
+      script_append(buf, " DESC");
+    }
+  }
+  script_append(buf, ")");
+}
+
+/**
+  @brief Advise index changes for the recommended partitioning.
+
+  Compares existing index definitions with the planned partition layout
+  and the replayed workload:
+
+  - primary and unique keys must contain every partitioning column, so
+    the missing ones are appended (uniqueness then holds per partition);
+  - foreign keys are not supported on partitioned InnoDB tables;
+  - secondary indexes that are a left prefix of another index, or that
+    only serve ranges wider than a partition on the partition key, are
+    dropped;
+  - columns the workload looks up by equality get an index that ends
+    with the partition key, so lookups stay in the pruned partitions.
+
+  Index size, per-partition B-tree depth and index insertions per day
+  are estimated before and after.
+
+  @param [in]  ctx               Partition context.
+  @param [in]  table_name        Table name.
+  @param [in]  index_definitions SHOW CREATE TABLE output or key clauses.
+  @param [out] advice            Advice text and ALTER TABLE script.
 
   @retval 0 success, 1 failure.
 */
-static int partition_analyze_table(void *ctx, const char *table_name) {
+static int partition_advise_indexes(void *ctx, const char *table_name, const char *index_definitions, char **advice) {
   PartitionContext *partition_ctx = (PartitionContext *)ctx;
-  
-  /* Set current table */
-  if (partition_ctx->current_table) {
-    free(partition_ctx->current_table);
+  ScriptBuffer text = {NULL, 0, 0, 0};
+  ScriptBuffer script = {NULL, 0, 0, 0};
+  IndexDefinition *indexes;
+  PartitionPlan plan;
+  TableStats *stats;
+  const char *partition_columns[2];
+  int partition_column_count = 1;
+  int original_count;
+  int count;
+  int files;
+  int depth_before;
+  int depth_after;
+  double bytes_before;
+  double bytes_after;
+  double rows_per_day = 0;
+  int trees_before;
+  int i, j, p, c;
+
+  indexes = (IndexDefinition *)calloc(INDEX_MAX, sizeof(IndexDefinition));
+  if (!indexes) {
+    return 1;
   }
-  partition_ctx->current_table = strdup(table_name);
-  
-  if (!partition_ctx->current_table) {
+  count = index_parse_definitions(index_definitions ? index_definitions : "", indexes, INDEX_MAX);
+  if (count < 0) {
+    free(indexes);
     return 1;
   }
-  
-  /* Set analysis time */
-  partition_ctx->analysis_time = time(NULL);
-  
-  /* Simulate table analysis */
-  /* In a real-world scenario, you would:
-   * 1. Get table metadata
-   * 2. Analyze data distribution
-   * 3. Calculate row count and data size
-   * 4. Identify candidate partition keys
-   */
-  partition_ctx->row_count = 1000000; /* Simulated row count */
-  partition_ctx->data_size = 100000000; /* Simulated data size (100MB) */
-  
-  /* Determine partition key based on table name patterns */
-  if (strstr(table_name, "log") || strstr(table_name, "audit") || strstr(table_name, "history")) {
-    partition_ctx->partition_key = strdup("created_at");
-    partition_ctx->partition_type = strdup(PARTITION_TYPE_TIME);
-  } else if (strstr(table_name, "user") || strstr(table_name, "customer")) {
-    partition_ctx->partition_key = strdup("id");
-    partition_ctx->partition_type = strdup(PARTITION_TYPE_RANGE);
-  } else {
-    partition_ctx->partition_key = strdup("id");
-    partition_ctx->partition_type = strdup(PARTITION_TYPE_HASH);
+  stats = get_table_stats(partition_ctx, table_name);
+  if (!stats) {
+    free(indexes);
+    return 1;
   }
-  
-  /* Calculate recommended partition count */
-  if (partition_ctx->row_count > 10000000) {
-    partition_ctx->partition_count = 32;
-  } else if (partition_ctx->row_count > 1000000) {
-    partition_ctx->partition_count = 16;
-  } else if (partition_ctx->row_count > 100000) {
-    partition_ctx->partition_count = 8;
+  plan_partitioning(stats, &partition_ctx->tuning, &plan);
+  files = plan.partition_count * (plan.subpartition_count >= 2 ? plan.subpartition_count : 1);
+  partition_columns[0] = stats->partition_key;
+  if (plan.subpartition_count >= 2) {
+    partition_columns[partition_column_count++] = plan.subpartition_column;
+  }
+  if (stats->row_count > 0 && stats->data_size > 0) {
+    rows_per_day = plan.growth_bytes_per_day / ((double)stats->data_size / stats->row_count);
+  }
+  bytes_before = index_secondary_bytes(stats, indexes, count, 1, &depth_before);
+  trees_before = index_secondary_count(indexes, count);
+  original_count = count;
+
+  script_append(&text, "Index advice for table %s (partitioned by %s on %s",
+                table_name, stats->partition_type, stats->partition_key);
+  if (plan.subpartition_count >= 2) {
+    script_append(&text, ", %s subpartitions on %s", plan.subpartition_by_key ? PARTITION_TYPE_KEY : PARTITION_TYPE_HASH,
+                  plan.subpartition_column);
+  }
+  script_append(&text, ", %d partitions):\n", files);
+
+  for (i = 0; i < original_count; i++) {
+    IndexDefinition *index = &indexes[i];
+
+    if (index->kind == INDEX_FOREIGN) {
+      index->dropped = 1;
+      script_append(&text, "- FOREIGN KEY %s: not supported on partitioned InnoDB tables, enforce in the application\n", index->name);
+      script_append(&script, "%s  DROP FOREIGN KEY %s", script.len ? ",\n" : "", index->name);
+    } else if (index->kind == INDEX_PRIMARY || index->kind == INDEX_UNIQUE) {
+      int missing = 0;
+      int manual = index->partial;
+      for (p = 0; p < partition_column_count; p++) {
+        for (c = 0; c < index->column_count && strcasecmp(index->columns[c], partition_columns[p]) != 0; c++) {
+        }
+        /* A prefix of a partitioning column does not count */
+        if (c == index->column_count || index->lengths[c]) {
+          manual |= c < index->column_count;
+          missing++;
+        }
+      }
+      if (!missing) {
+        continue;
+      }
+      /* Rather no script than one that changes what the key means */
+      if (manual || index->column_count + missing > INDEX_MAX_COLUMNS) {
+        if (index->kind == INDEX_PRIMARY) {
+          script_append(&text, "- PRIMARY KEY must include every partitioning column in full; ");
+        } else {
+          script_append(&text, "- UNIQUE KEY %s must include every partitioning column in full; ", index->name);
+        }
+        script_append(&text, "its key parts cannot be rewritten safely, change it by hand\n");
+        continue;
+      }
+      for (p = 0; p < partition_column_count; p++) {
+        if (!index_has_column(index, partition_columns[p])) {
+          snprintf(index->columns[index->column_count++], sizeof(index->columns[0]), "%s", partition_columns[p]);
+        }
+      }
+      if (index->kind == INDEX_PRIMARY) {
+        script_append(&text, "- PRIMARY KEY must include every partitioning column: ");
+      } else {
+        script_append(&text, "- UNIQUE KEY %s must include every partitioning column: ", index->name);
+      }
+      index_append_columns(&text, index);
+      script_append(&text, "; uniqueness of the original columns is then enforced per partition only\n");
+      if (index->kind == INDEX_PRIMARY) {
+        script_append(&script, "%s  DROP PRIMARY KEY,\n  ADD PRIMARY KEY ", script.len ? ",\n" : "");
+      } else {
+        script_append(&script, "%s  DROP INDEX %s,\n  ADD UNIQUE KEY %s ", script.len ? ",\n" : "", index->name, index->name);
+      }
+      index_append_columns(&script, index);
+    }
+  }
+
+  /* Redundant secondary indexes */
+  for (i = 0; i < original_count; i++) {
+    IndexDefinition *index = &indexes[i];
+    const char *reason = NULL;
+    char detail[160];
+
+    if (index->kind != INDEX_SECONDARY || index->dropped) {
+      continue;
+    }
+    for (j = 0; j < original_count && !reason; j++) {
+      if (j == i || indexes[j].dropped || indexes[j].kind == INDEX_FOREIGN || !index_is_prefix(index, &indexes[j])) {
+        continue;
+      }
+      /* Of two identical indexes keep the first */
+      if (indexes[j].column_count == index->column_count && indexes[j].kind == INDEX_SECONDARY && j > i) {
+        continue;
+      }
+      snprintf(detail, sizeof(detail), "%s %s", indexes[j].column_count == index->column_count ? "duplicate of" : "left prefix of",
+               indexes[j].name);
+      reason = detail;
+    }
+    if (!reason && !index->partial && index->column_count == 1 && strcasecmp(index->columns[0], stats->partition_key) == 0 &&
+        strcmp(stats->partition_type, PARTITION_TYPE_HASH) != 0) {
+      const PredicateStats *predicate = table_stats_find_predicate(stats, stats->partition_key);
+      double partition_span = plan.interval_days > 0 ? plan.interval_days * 86400.0 : 0;
+      if (partition_span == 0) {
+        const ColumnStats *key = table_stats_find_column(stats, stats->partition_key);
+        if (key && key->quantiles.count > 0) {
+          partition_span = (key->quantiles.max - key->quantiles.min) / plan.partition_count;
+        }
+      }
+      if (predicate && predicate->eq_predicates == 0 && predicate->bounded_ranges > 0 &&
+          partition_span > 0 && plan.pruning_width >= partition_span * 0.99) {
+        reason = "queries span whole partitions, pruning replaces it";
+      }
+    }
+    if (reason) {
+      index->dropped = 1;
+      script_append(&text, "- KEY %s ", index->name);
+      index_append_columns(&text, index);
+      script_append(&text, ": redundant (%s), drop it\n", reason);
+      script_append(&script, "%s  DROP INDEX %s", script.len ? ",\n" : "", index->name);
+    }
+  }
+
+  /* Equality lookups that need a partition-local index */
+  for (i = 0; i < stats->predicate_count && count < INDEX_MAX; i++) {
+    const PredicateStats *predicate = &stats->predicates[i];
+    IndexDefinition *index = &indexes[count];
+    int covered = 0;
+
+    if (predicate->eq_predicates == 0 || predicate->eq_predicates * INDEX_LOOKUP_SHARE < stats->workload_queries) {
+      continue;
+    }
+    /* Lookups on the partition key are pruned already */
+    covered = strcasecmp(predicate->column_name, stats->partition_key) == 0;
+    for (j = 0; j < count && !covered; j++) {
+      covered = !indexes[j].dropped && indexes[j].kind != INDEX_FOREIGN &&
+                strcasecmp(indexes[j].columns[0], predicate->column_name) == 0;
+    }
+    if (covered) {
+      continue;
+    }
+
+    memset(index, 0, sizeof(*index));
+    index->kind = INDEX_SECONDARY;
+    snprintf(index->columns[index->column_count++], sizeof(index->columns[0]), "%s", predicate->column_name);
+    if (strcmp(stats->partition_type, PARTITION_TYPE_HASH) != 0) {
+      snprintf(index->columns[index->column_count++], sizeof(index->columns[0]), "%s", stats->partition_key);
+    }
+    snprintf(index->name, sizeof(index->name), "idx_%.60s%s%.60s", predicate->column_name,
+             index->column_count > 1 ? "_" : "", index->column_count > 1 ? stats->partition_key : "");
+    count++;
+
+    script_append(&text, "- ADD KEY %s ", index->name);
+    index_append_columns(&text, index);
+    if (strcmp(stats->partition_type, PARTITION_TYPE_HASH) == 0) {
+      script_append(&text, ": %lld equality lookups on %s; each probes all %d partitions\n",
+                    predicate->eq_predicates, predicate->column_name, files);
+    } else {
+      script_append(&text, ": %lld equality lookups on %s stay within the pruned partitions\n",
+                    predicate->eq_predicates, predicate->column_name);
+    }
+    script_append(&script, "%s  ADD KEY %s ", script.len ? ",\n" : "", index->name);
+    index_append_columns(&script, index);
+  }
+
+  bytes_after = index_secondary_bytes(stats, indexes, count, files, &depth_after);
+  script_append(&text, "Secondary index size: ~%.0f bytes now, ~%.0f bytes after\n", bytes_before, bytes_after);
+  script_append(&text, "Deepest B-tree: %d levels unpartitioned, %d levels per partition\n", depth_before, depth_after);
+  script_append(&text, "Index insertions per new row: %d now, %d after (~%.0f/day at current growth)\n",
+                trees_before + 1, index_secondary_count(indexes, count) + 1,
+                rows_per_day * (index_secondary_count(indexes, count) + 1));
+  if (script.len) {
+    script_append(&text, "Script:\nALTER TABLE %s\n%s;\n", table_name, script.text);
   } else {
-    partition_ctx->partition_count = 4;
+    script_append(&text, "No index changes needed\n");
   }
-  
+  catalog_release(partition_ctx->catalog, stats);
+  free(indexes);
+  free(script.text);
+
+  if (text.failed || script.failed) {
+    free(text.text);
+    return 1;
+  }
+  *advice = text.text;
+
   return 0;
 }
 
 /**
-  @brief Recommend partitioning strategy.
+  @brief Set a partition tuning option.
 
-  @param [in]  ctx           Partition context.
-  @param [in]  table_name    Table name.
-  @param [out] partition_script  Generated partition script.
+  @param [in] ctx   Partition context.
+  @param [in] name  Option name.
+  @param [in] value Option value.
 
-  @retval 0 success, 1 failure.
+  @retval 0 success, 1 unknown option or invalid value.
 */
-static int partition_recommend_partitioning(void *ctx, const char *table_name, char **partition_script) {
+static int partition_set_option(void *ctx, const char *name, const char *value) {
   PartitionContext *partition_ctx = (PartitionContext *)ctx;
-  char script[2048];
-  
-  /* Ensure table has been analyzed */
-  if (!partition_ctx->current_table || strcmp(partition_ctx->current_table, table_name) != 0) {
-    if (partition_analyze_table(ctx, table_name) != 0) {
-      return 1;
-    }
+  PartitionTuning *tuning = &partition_ctx->tuning;
+  char *end;
+  double number = strtod(value, &end);
+
+  if (end == value || *end != '\0') {
+    return 1;
   }
-  
-  /* Generate partition script based on analysis */
-  if (strcmp(partition_ctx->partition_type, PARTITION_TYPE_TIME) == 0) {
-    /* Time-based partitioning */
-    snprintf(script, sizeof(script), 
-             "ALTER TABLE %s PARTITION BY RANGE (YEAR(%s)) (\n  PARTITION p2020 VALUES LESS THAN (2021),\n  PARTITION p2021 VALUES LESS THAN (2022),\n  PARTITION p2022 VALUES LESS THAN (2023),\n  PARTITION p2023 VALUES LESS THAN (2024),\n  PARTITION p2024 VALUES LESS THAN (2025),\n  PARTITION pfuture VALUES LESS THAN MAXVALUE\n);", 
-             table_name, partition_ctx->partition_key);
-  } else if (strcmp(partition_ctx->partition_type, PARTITION_TYPE_RANGE) == 0) {
-    /* Range partitioning */
-    int range_size = partition_ctx->row_count / partition_ctx->partition_count;
-    snprintf(script, sizeof(script), 
-             "ALTER TABLE %s PARTITION BY RANGE (%s) (\n  PARTITION p1 VALUES LESS THAN (%d),\n  PARTITION p2 VALUES LESS THAN (%d),\n  PARTITION p3 VALUES LESS THAN (%d),\n  PARTITION p4 VALUES LESS THAN (%d),\n  PARTITION p5 VALUES LESS THAN (%d),\n  PARTITION p6 VALUES LESS THAN (%d),\n  PARTITION p7 VALUES LESS THAN (%d),\n  PARTITION p8 VALUES LESS THAN MAXVALUE\n);", 
-             table_name, partition_ctx->partition_key,
-             range_size, range_size * 2, range_size * 3, range_size * 4,
-             range_size * 5, range_size * 6, range_size * 7);
+
+  if (strcmp(name, "target_partition_bytes") == 0 && number >= 1024 * 1024) {
+    tuning->target_partition_bytes = (long long)number;
+  } else if (strcmp(name, "open_files_limit") == 0 && number >= 0) {
+    tuning->open_files_limit = (long long)number;
+  } else if (strcmp(name, "growth_bytes_per_day") == 0) {
+    /* Negative means derive growth from the time column sketch */
+    tuning->growth_bytes_per_day = number;
+  } else if (strcmp(name, "projection_days") == 0 && number >= 1) {
+    tuning->projection_days = (int)number;
+  } else if (strcmp(name, "max_subpartitions") == 0 && number >= 0 && number <= MAX_SUBPARTITIONS) {
+    /* 0 or 1 keeps recommendations single-level */
+    tuning->max_subpartitions = (int)number;
+  } else if (strcmp(name, "stats_max_age") == 0 && number >= 0) {
+    pthread_mutex_lock(&partition_ctx->catalog->lock);
+    partition_ctx->catalog->max_age = (time_t)number;
+    pthread_mutex_unlock(&partition_ctx->catalog->lock);
   } else {
-    /* Hash partitioning */
-    snprintf(script, sizeof(script), 
-             "ALTER TABLE %s PARTITION BY HASH (%s) PARTITIONS %d;", 
-             table_name, partition_ctx->partition_key, partition_ctx->partition_count);
-  }
-  
-  /* Allocate memory for partition script */
-  *partition_script = strdup(script);
-  if (!*partition_script) {
     return 1;
   }
-  
-  /* Store recommendation */
-  if (partition_ctx->recommendation) {
-    free(partition_ctx->recommendation);
-  }
-  partition_ctx->recommendation = strdup(script);
-  
+
   return 0;
 }
 
@@ -279,26 +4364,78 @@ static int partition_apply_partitioning(void *ctx, const char *partition_script)
 */
 static int partition_estimate_partition_effect(void *ctx, const char *table_name, char **estimation) {
   PartitionContext *partition_ctx = (PartitionContext *)ctx;
-  char estimate[1024];
+  ScriptBuffer estimate = {NULL, 0, 0, 0};
+  PartitionPlan plan;
+  TableStats *stats;
+  int i;
   
   /* Ensure table has been analyzed */
-  if (!partition_ctx->current_table || strcmp(partition_ctx->current_table, table_name) != 0) {
-    if (partition_analyze_table(ctx, table_name) != 0) {
-      return 1;
-    }
+  stats = get_table_stats(partition_ctx, table_name);
+  if (!stats) {
+    return 1;
   }
+  plan_partitioning(stats, &partition_ctx->tuning, &plan);
   
   /* Generate estimation */
-  snprintf(estimate, sizeof(estimate), 
-           "Partitioning Estimation for table %s:\nCurrent status:\n- Rows: %d\n- Data size: %d bytes\n- No partitioning\nAfter partitioning:\n- Partition type: %s\n- Partition key: %s\n- Partition count: %d\n- Estimated query performance improvement: 30-50%%\n- Estimated maintenance time reduction: 40-60%%\n- Estimated storage efficiency: 10-20%%\n",
-           table_name, partition_ctx->row_count, partition_ctx->data_size,
-           partition_ctx->partition_type, partition_ctx->partition_key, partition_ctx->partition_count);
+  script_append(&estimate,
+           "Partitioning Estimation for table %s:\nCurrent status:\n- Rows: %lld\n- Data size: %lld bytes\n- No partitioning\nAfter partitioning:\n- Partition type: %s\n- Partition key: %s\n- Partition count: %d (limited by %s, cap %d)\n",
+           table_name, stats->row_count, stats->data_size,
+           stats->partition_type, stats->partition_key, plan.partition_count, plan.limited_by, plan.partition_cap);
+  if (plan.interval_days > 0) {
+    script_append(&estimate, "- Partition interval: %d days\n", plan.interval_days);
+  }
+  script_append(&estimate,
+           "- Target partition size: %lld bytes\n- Expected partition size: %.0f bytes\n- Growth: %.0f bytes/day\n",
+           partition_ctx->tuning.target_partition_bytes, plan.bytes_per_partition, plan.growth_bytes_per_day);
+  if (plan.subpartition_count >= 2) {
+    script_append(&estimate,
+             "- Subpartitioning: %s (%s) x %d, %d files in total\n- Hot partition: %.0f bytes, busiest subpartition takes %.1f%% of its writes (even split %.1f%%)\n",
+             plan.subpartition_by_key ? PARTITION_TYPE_KEY : PARTITION_TYPE_HASH, plan.subpartition_column,
+             plan.subpartition_count, plan.partition_count * plan.subpartition_count,
+             plan.hot_partition_bytes, plan.hot_file_share * 100, 100.0 / plan.subpartition_count);
+  } else {
+    script_append(&estimate, "- Subpartitioning: none (%s)\n", plan.subpartition_note);
+  }
+  if (plan.days_until_split >= 0) {
+    char date[32];
+    format_epoch((double)time(NULL) + plan.days_until_split * 86400.0, "%Y-%m-%d", date, sizeof(date));
+    script_append(&estimate, "- Layout needs splitting in ~%.0f days (around %s)\n", plan.days_until_split, date);
+  } else {
+    script_append(&estimate, "- No split projected: no growth observed\n");
+  }
+  script_append(&estimate,
+           "- Estimated query performance improvement: 30-50%%\n- Estimated maintenance time reduction: 40-60%%\n- Estimated storage efficiency: 10-20%%\n");
+
+  /* Summarize the incrementally maintained column sketches */
+  if (stats->column_count > 0) {
+    script_append(&estimate, "Column statistics (%lld row changes applied):\n", stats->change_count);
+  }
+  for (i = 0; i < stats->column_count; i++) {
+    const ColumnStats *column = stats->columns[i];
+    const HeavyHitter *top = NULL;
+    int h;
+
+    for (h = 0; h < column->heavy_hitter_count; h++) {
+      if (!top || column->heavy_hitters[h].count > top->count) {
+        top = &column->heavy_hitters[h];
+      }
+    }
+    script_append(&estimate, "- %s: distinct ~%lld", column->column_name, column_distinct_values(column));
+    if (column->quantiles.count > 0) {
+      script_append(&estimate, ", p50 %.6g, p99 %.6g",
+                    quantile_sketch_query(&column->quantiles, 0.5),
+                    quantile_sketch_query(&column->quantiles, 0.99));
+    }
+    script_append(&estimate, ", top value '%s' (~%lld rows)\n", top ? top->value : "", top ? top->count : 0LL);
+  }
+  catalog_release(partition_ctx->catalog, stats);
   
-  /* Allocate memory for estimation */
-  *estimation = strdup(estimate);
-  if (!*estimation) {
+  /* Hand the estimation to the caller */
+  if (estimate.failed) {
+    free(estimate.text);
     return 1;
   }
+  *estimation = estimate.text;
   
   return 0;
 }
@@ -350,8 +4487,11 @@ static int partition_monitor_partition_performance(void *ctx, const char *table_
   @retval 0 success, 1 failure.
 */
 static int partition_plugin_init(void *arg) {
-  /* Initialize any necessary resources */
-  return 0;
+  /* Load the statistics catalog; the plugin keeps it until deinit */
+  if (!g_plugin_catalog) {
+    g_plugin_catalog = catalog_acquire();
+  }
+  return g_plugin_catalog ? 0 : 1;
 }
 
 /**
@@ -362,7 +4502,14 @@ static int partition_plugin_init(void *arg) {
   @retval 0 success, 1 failure.
 */
 static int partition_plugin_deinit(void *arg) {
-  /* Cleanup any resources */
+  /* Persist the statistics catalog; contexts still open keep it until they are destroyed */
+  if (g_plugin_catalog) {
+    if (g_plugin_catalog->dirty) {
+      catalog_save(g_plugin_catalog);
+    }
+    catalog_unref(g_plugin_catalog);
+    g_plugin_catalog = NULL;
+  }
   return 0;
 }
 
@@ -374,7 +4521,14 @@ static st_mysql_intelligent_partition_descriptor partition_descriptor = {
   partition_estimate_partition_effect,
   partition_monitor_partition_performance,
   partition_create_context,
-  partition_destroy_context
+  partition_destroy_context,
+  partition_analyze_schema,
+  partition_recommend_schema,
+  partition_apply_change_stream,
+  partition_replay_workload,
+  partition_set_option,
+  partition_analyze_export,
+  partition_advise_indexes
 };
 
 /* Plugin declaration */
@@ -21,6 +21,24 @@ echo "✓ Supports backup cleanup"
 echo "✓ Supports backup validation"
 echo "✓ Provides backup metadata management"
 echo "✓ Creates structured backup directories"
+echo "✓ Copies data files by FICLONE reflink, or in one read pass that also records their page state"
+echo "✓ Tracks 16KB pages by LSN and CRC32C with a change bitmap per backup"
+echo "✓ Runs backup I/O as a read/compress/checksum/ordered-write pipeline with per-stage throughput"
+echo "✓ Deduplicates full backups into a FastCDC content-addressed chunk store"
+echo "✓ Compresses backup data into independent, seekable zlib frames in parallel"
+echo "✓ Validates backups in parallel against a Merkle-tree manifest of hardware CRC32C block checksums"
+echo "✓ Restores incremental chains as a synthetic full, writing each page once with parallel writers"
+echo "✓ Keeps an append-only backup catalog with a CRC-checked offset index, rebuilt from metadata when stale"
+echo "✓ Archives closed binlogs in the background, indexed by time and GTID range, for point-in-time recovery"
+echo "✓ Throttles backup I/O with token buckets, backing off adaptively when the device is congested"
+echo "✓ Reads data files with O_DIRECT into an aligned buffer pool, dropping newly cached pages on the buffered fallback"
+echo "✓ Resumes interrupted backups from a durable, CRC-checked checkpoint journal"
+echo "✓ Copies only the allocated extents of sparse files (SEEK_DATA/SEEK_HOLE) and restores their holes"
+echo "✓ Applies chain-aware retention policies, unlinking in parallel and collecting unreferenced chunks in the background"
+echo "✓ Tracks dirty files with inotify so incrementals skip untouched files without walking the data directory"
+echo "✓ Stores large non-InnoDB files as rsync-style rolling-checksum deltas against the parent backup"
+echo "✓ Drives pipeline reads and writes through io_uring with registered buffers, falling back to threads"
+echo "✓ Streams a backup as one archive with a trailing index to stdout or a file; restores seek to single tables"
 
 echo "\n3. Test cases for backup operations..."
 echo "   Test 1: Initialize backup context"
@@ -28,19 +46,19 @@ echo "   Input:  Backup directory and name"
 echo "   Expected: Backup directory structure should be created"
 echo "\n   Test 2: Perform full backup"
 echo "   Input:  Full backup operation"
-echo "   Expected: Full backup should be created with metadata"
+echo "   Expected: Every data file should be copied within the configured I/O limits and metadata should record the real size"
 echo "\n   Test 3: Perform incremental backup"
 echo "   Input:  Incremental backup operation"
-echo "   Expected: Incremental backup should be created with reference to full backup"
+echo "   Expected: Only pages whose LSN or checksum changed since the parent backup should be stored"
 echo "\n   Test 4: Restore backup"
 echo "   Input:  Restore from backup"
-echo "   Expected: Backup should be restored successfully"
+echo "   Expected: The newest version of every page across the backup chain should be written once into an empty target, or a single file on request; with restore_time only the binlogs up to that time should be extracted for replay"
 echo "\n   Test 5: List backups"
 echo "   Input:  List all backups in directory"
-echo "   Expected: All backups should be listed"
+echo "   Expected: All backups should be listed oldest first from the catalog index, which is rebuilt if missing or inconsistent"
 echo "\n   Test 6: Validate backup"
 echo "   Input:  Validate backup integrity"
-echo "   Expected: Backup should be validated successfully"
+echo "   Expected: Every block should match its CRC32C and the manifest its Merkle root; root-only, sample and single-file checks should read less"
 echo "\n   Test 7: Cleanup backup"
 echo "   Input:  Cleanup backup files"
 echo "   Expected: Backup files should be removed"
@@ -50,6 +68,23 @@ echo "✓ Plugin name: MY_INCREMENTAL_BACKUP"
 echo "✓ Plugin type: Incremental Backup"
 echo "✓ Installation command: INSTALL PLUGIN MY_INCREMENTAL_BACKUP SONAME 'my_incremental_backup_plugin.so'"
 echo "✓ Configuration: SET GLOBAL backup_directory = '/path/to/backups';"
+echo "✓ Configuration: CALL set_backup_option('datadir', '/var/lib/mysql');"
+echo "✓ Configuration: CALL set_backup_option('parent_backup', 'backup_20240101');"
+echo "✓ Configuration: CALL set_backup_option('read_threads', '8');"
+echo "✓ Configuration: CALL set_backup_option('dedup', '1');"
+echo "✓ Configuration: CALL set_backup_option('compression_level', '6');"
+echo "✓ Configuration: CALL set_backup_option('restore_file', 'shop/orders.ibd');"
+echo "✓ Configuration: CALL set_backup_option('validate_mode', 'sample');"
+echo "✓ Configuration: CALL set_backup_option('binlog_archive', '1');"
+echo "✓ Configuration: CALL set_backup_option('restore_time', '2024-01-01 12:30:00');"
+echo "✓ Configuration: CALL set_backup_option('read_limit_mb', '100');"
+echo "✓ Configuration: CALL set_backup_option('throttle_adaptive', '1');"
+echo "✓ Configuration: CALL set_backup_option('direct_io', '0');"
+echo "✓ Configuration: CALL set_backup_option('checkpoint_interval', '30');"
+echo "✓ Configuration: CALL set_backup_option('retain_fulls', '2');"
+echo "✓ Configuration: CALL set_backup_option('dirty_tracking', '1');"
+echo "✓ Configuration: CALL set_backup_option('io_engine', 'uring');"
+echo "✓ Configuration: CALL set_backup_option('stream', '/backup/streams');"
 echo "✓ Usage: CALL perform_backup('full');"
 echo "✓ Usage: CALL perform_backup('incremental');"
 echo "✓ Uninstallation command: UNINSTALL PLUGIN MY_INCREMENTAL_BACKUP"
@@ -474,6 +509,139 @@ fi
 # Clean up
 rm -f test_backup_functionality test_backup_functionality.c
 
+echo "\n7. Regression checks against the built plugin..."
+PLUGIN_SO="$(pwd)/my_incremental_backup_plugin.so"
+REGRESSION_DIR=$(mktemp -d)
+cat > "$REGRESSION_DIR/backup_regression.c" << 'EOF'
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct plugin {
+  int type;
+  void *descriptor;
+};
+
+typedef struct {
+  int (*init_backup)(void *, const char *, const char *);
+  int (*perform_backup)(void *, int);
+  int (*restore_backup)(void *, const char *, const char *);
+  int (*list_backups)(void *, const char *, char ***, int *);
+  int (*cleanup_backup)(void *, const char *, const char *);
+  int (*validate_backup)(void *, const char *, const char *);
+  void *(*create_context)(void);
+  void (*destroy_context)(void *);
+  int (*set_option)(void *, const char *, const char *);
+} descriptor;
+
+/* Usage: backup_regression plugin.so datadir backup_dir name full|incremental|restore|list [restore_dir] */
+int main(int argc, char **argv) {
+  void *handle = argc >= 6 ? dlopen(argv[1], RTLD_NOW) : NULL;
+  descriptor *d;
+  char **names;
+  void *ctx;
+  int count;
+  int ret;
+  int i;
+
+  if (!handle) {
+    return 2;
+  }
+  d = (descriptor *)((struct plugin *)dlsym(handle, "my_incremental_backup_plugin"))->descriptor;
+  ctx = d->create_context();
+  if (!ctx || d->set_option(ctx, "datadir", argv[2]) != 0 || d->init_backup(ctx, argv[3], argv[4]) != 0) {
+    return 2;
+  }
+  if (strcmp(argv[5], "restore") == 0) {
+    ret = argc < 7 || d->set_option(ctx, "restore_dir", argv[6]) != 0 || d->restore_backup(ctx, argv[3], argv[4]) != 0;
+  } else if (strcmp(argv[5], "list") == 0) {
+    ret = d->list_backups(ctx, argv[3], &names, &count) != 0;
+    for (i = 0; ret == 0 && i < count; i++) {
+      printf("%s\n", names[i]);
+      free(names[i]);
+    }
+    if (ret == 0) {
+      free(names);
+    }
+  } else {
+    ret = d->perform_backup(ctx, strcmp(argv[5], "incremental") == 0) != 0;
+  }
+  d->destroy_context(ctx);
+  return ret;
+}
+EOF
+REGRESSION_FAILED=0
+if gcc -o "$REGRESSION_DIR/backup_regression" "$REGRESSION_DIR/backup_regression.c" -ldl; then
+    cd "$REGRESSION_DIR"
+
+    # A CSV page that repeats bytes 20..23 at its end is still no InnoDB page: shifted rows go to an rsync delta
+    mkdir -p rsync_data/db1
+    python3 -c "
+rows = ''.join('%d,item %d,site\n' % (i, i) for i in range(400000)).encode()
+page = bytearray(rows[:16384 * 300])
+page[16384 * 10 + 20:16384 * 10 + 24] = b',ite'
+page[16384 * 11 - 4:16384 * 11] = b',ite'
+open('rsync_data/db1/t1.CSV', 'wb').write(bytes(page))
+"
+    ./backup_regression "$PLUGIN_SO" rsync_data rsync_backups full0 full > /dev/null
+    python3 -c "
+data = open('rsync_data/db1/t1.CSV', 'rb').read()
+open('rsync_data/db1/t1.CSV', 'wb').write(data[:1000] + b'inserted,row,here\n' + data[1000:])
+"
+    ./backup_regression "$PLUGIN_SO" rsync_data rsync_backups incr1 incremental > /dev/null
+    if [ -f rsync_backups/incr1/data/db1/t1.CSV.rdelta ]; then
+        echo "✓ Insertion-shifted CSV is stored as a rolling-checksum delta"
+    else
+        echo "✗ Insertion-shifted CSV was not stored as a rolling-checksum delta"
+        REGRESSION_FAILED=1
+    fi
+
+    # Space-padded fixed-width rows repeat bytes 20..23 at every page end; an edit must still be backed up
+    mkdir -p padded_data/db1
+    python3 -c "
+rows = b''.join(('%-64d' % i).encode() for i in range(1024))
+open('padded_data/db1/t2.MYD', 'wb').write(rows)
+"
+    ./backup_regression "$PLUGIN_SO" padded_data padded_backups full0 full > /dev/null
+    python3 -c "
+f = open('padded_data/db1/t2.MYD', 'r+b')
+f.seek(16384 + 640)
+f.write(b'edited')
+f.close()
+"
+    ./backup_regression "$PLUGIN_SO" padded_data padded_backups incr1 incremental > /dev/null
+    ./backup_regression "$PLUGIN_SO" padded_data padded_backups incr1 restore "$REGRESSION_DIR/padded_restore" > /dev/null
+    if cmp -s padded_data/db1/t2.MYD padded_restore/db1/t2.MYD; then
+        echo "✓ Edited page of a padded MyISAM file is restored from the incremental"
+    else
+        echo "✗ Edited page of a padded MyISAM file was lost by the incremental"
+        REGRESSION_FAILED=1
+    fi
+
+    # A backup directory removed by hand must drop out of the list even though the catalog still names it
+    mkdir -p list_data/db1
+    echo "1,a" > list_data/db1/t3.CSV
+    ./backup_regression "$PLUGIN_SO" list_data list_backups full0 full > /dev/null
+    ./backup_regression "$PLUGIN_SO" list_data list_backups full1 full > /dev/null
+    rm -rf list_backups/full1
+    if [ "$(./backup_regression "$PLUGIN_SO" list_data list_backups full0 list)" = "full0" ]; then
+        echo "✓ Catalog is rebuilt when a listed backup has vanished"
+    else
+        echo "✗ List still returns a backup whose directory was removed"
+        REGRESSION_FAILED=1
+    fi
+
+    cd - > /dev/null
+else
+    echo "✗ Failed to compile regression harness"
+    REGRESSION_FAILED=1
+fi
+rm -rf "$REGRESSION_DIR"
+if [ $REGRESSION_FAILED -ne 0 ]; then
+    exit 1
+fi
+
 echo "\nTest completed successfully!"
 echo "Incremental backup plugin is ready for use."
 echo "To install the plugin, copy it to MySQL plugin directory and run:"
@@ -21,6 +21,14 @@ echo "✓ Monitors partition performance metrics"
 echo "✓ Supports different partition types (RANGE, LIST, HASH, KEY, TIME)"
 echo "✓ Provides hot/cold partition identification"
 echo "✓ Offers archiving recommendations"
+echo "✓ Caches per-table statistics in a persistent, thread-safe catalog"
+echo "✓ Analyzes whole schemas with a parallel worker pool"
+echo "✓ Maintains per-column quantile, HLL and heavy-hitter sketches from binlog row events"
+echo "✓ Derives partition count from target partition size, open-file limit, growth and workload pruning needs"
+echo "✓ Projects when the partition layout will need splitting"
+echo "✓ Recommends RANGE/time partitions with HASH or KEY subpartitions to spread a hot partition"
+echo "✓ Builds statistics offline from mmap'd CSV/TSV or columnar exports with SIMD scanning on a worker pool"
+echo "✓ Advises index changes for the proposed partitioning (unique keys, redundant indexes, partition-local lookups)"
 
 echo "\n3. Test cases for partition operations..."
 echo "   Test 1: Analyze table for partitioning"
@@ -43,6 +51,30 @@ echo "\n   Test 5: Monitor partition performance"
 echo "   Input:  Table name"
 echo "   Expected: Performance metrics and recommendations"
 
+echo "\n   Test 6: Analyze and recommend a whole schema"
+echo "   Input:  Schema name and table list"
+echo "   Expected: One script per table, stale tables analyzed in parallel, fresh ones served from the catalog"
+
+echo "\n   Test 7: Apply a decoded binlog change stream"
+echo "   Input:  Table name, mysqlbinlog -v output and column names"
+echo "   Expected: Sketches updated from inserted/deleted rows; a second call reads only new events"
+
+echo "\n   Test 8: Replay a query workload and tune partition size"
+echo "   Input:  SQL workload file, target_partition_bytes and growth options"
+echo "   Expected: Partition count/interval follows size, pruning span and file limits; estimate shows split date"
+
+echo "\n   Test 9: Recommend a two-level layout for a multi-tenant time series"
+echo "   Input:  Change stream with a skewed tenant_id column and tenant_id = ? workload"
+echo "   Expected: SUBPARTITION BY HASH (tenant_id) with the smallest count near the best hot-file balance, within the open-file budget"
+
+echo "\n   Test 10: Analyze an offline export"
+echo "   Input:  CSV with header (quoted fields, \\N NULLs) or MCOL columnar dump, 8 threads"
+echo "   Expected: Same sketches as a single-threaded scan; row count from the export; no database access"
+
+echo "\n   Test 11: Advise indexes for the recommended partitioning"
+echo "   Input:  SHOW CREATE TABLE output after a replayed workload"
+echo "   Expected: Unique keys extended with partition columns, prefix/duplicate indexes dropped, (tenant_id, created_at) added, size and depth estimates"
+
 echo "\n4. Plugin configuration and usage..."
 echo "✓ Plugin name: MY_INTELLIGENT_PARTITION"
 echo "✓ Plugin type: Intelligent Partitioning"
@@ -52,12 +84,20 @@ echo "✓ Usage: CALL recommend_partitioning('my_table');"
 echo "✓ Usage: CALL apply_partitioning('ALTER TABLE ...');"
 echo "✓ Usage: CALL estimate_partition_effect('my_table');"
 echo "✓ Usage: CALL monitor_partition_performance('my_table');"
+echo "✓ Usage: CALL analyze_schema('my_schema', 'table1,table2', 8);"
+echo "✓ Usage: CALL recommend_schema('my_schema', 'table1,table2');"
+echo "✓ Usage: CALL apply_change_stream('my_table', '/path/to/rows.txt', 'id,created_at');"
+echo "✓ Usage: CALL replay_workload('my_table', '/path/to/queries.sql');"
+echo "✓ Usage: CALL set_partition_option('target_partition_bytes', '1073741824');"
+echo "✓ Usage: CALL set_partition_option('max_subpartitions', '64');"
+echo "✓ Usage: CALL analyze_export('my_table', '/exports/my_table.csv', NULL, 8);"
+echo "✓ Usage: CALL advise_indexes('my_table', 'PRIMARY KEY (id), KEY idx_tenant (tenant_id)');"
 echo "✓ Uninstallation command: UNINSTALL PLUGIN MY_INTELLIGENT_PARTITION"
 
 echo "\n5. Performance considerations..."
 echo "✓ Minimal overhead for table analysis"
 echo "✓ Intelligent partition key selection"
-echo "✓ Optimized partition count calculation"
+echo "✓ Partition count derived from size, growth and open-file budget"
 echo "✓ Low impact on production systems"
 echo "✓ Scalable for large databases"
 echo "✓ Automated partition maintenance"
@@ -392,6 +432,198 @@ fi
 # Clean up
 rm -f test_partition_functionality test_partition_functionality.c
 
+echo "\n7. Regression checks against the built plugin..."
+PLUGIN_SO="$(pwd)/my_intelligent_partition_plugin.so"
+REGRESSION_DIR=$(mktemp -d)
+cat > "$REGRESSION_DIR/partition_regression.c" << 'EOF'
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct plugin {
+  int type;
+  void *descriptor;
+  const char *name, *author, *description, *license;
+  int (*init)(void *);
+  int (*check_uninstall)(void *);
+  int (*deinit)(void *);
+};
+
+typedef struct {
+  int (*analyze_table)(void *, const char *);
+  int (*recommend_partitioning)(void *, const char *, char **);
+  int (*apply_partitioning)(void *, const char *);
+  int (*estimate_partition_effect)(void *, const char *, char **);
+  int (*monitor_partition_performance)(void *, const char *, char **);
+  void *(*create_context)(void);
+  void (*destroy_context)(void *);
+  int (*analyze_schema)(void *, const char *, const char **, int, int);
+  int (*recommend_schema)(void *, const char *, const char **, int, char **);
+  int (*apply_change_stream)(void *, const char *, const char *, const char *);
+  int (*replay_workload)(void *, const char *, const char *);
+  int (*set_option)(void *, const char *, const char *);
+  int (*analyze_export)(void *, const char *, const char *, const char *, int);
+  int (*advise_indexes)(void *, const char *, const char *, char **);
+} descriptor;
+
+/* Usage: partition_regression plugin.so stream|export|replay|analyze|advise|recommend table file|keys [columns [threads]]
+   PARTITION_TARGET_BYTES sets target_partition_bytes. */
+int main(int argc, char **argv) {
+  void *handle = argc >= 5 ? dlopen(argv[1], RTLD_NOW) : NULL;
+  struct plugin *plugin;
+  descriptor *d;
+  char *estimate = NULL;
+  void *ctx;
+  int ret = 1;
+
+  if (!handle) {
+    return 2;
+  }
+  plugin = (struct plugin *)dlsym(handle, "my_intelligent_partition_plugin");
+  d = (descriptor *)plugin->descriptor;
+  if (plugin->init(NULL) != 0 || !(ctx = d->create_context())) {
+    return 2;
+  }
+  if (getenv("PARTITION_TARGET_BYTES") && d->set_option(ctx, "target_partition_bytes", getenv("PARTITION_TARGET_BYTES")) != 0) {
+    return 2;
+  }
+  if (strcmp(argv[2], "stream") == 0) {
+    ret = d->apply_change_stream(ctx, argv[3], argv[4], argc > 5 ? argv[5] : NULL);
+  } else if (strcmp(argv[2], "export") == 0) {
+    ret = d->analyze_export(ctx, argv[3], argv[4], argc > 5 ? argv[5] : NULL, argc > 6 ? atoi(argv[6]) : 1);
+  } else if (strcmp(argv[2], "replay") == 0) {
+    ret = d->replay_workload(ctx, argv[3], argv[4]);
+  } else if (strcmp(argv[2], "analyze") == 0) {
+    ret = d->analyze_table(ctx, argv[3]);
+  } else if (strcmp(argv[2], "advise") == 0 && (ret = d->advise_indexes(ctx, argv[3], argv[4], &estimate)) == 0) {
+    fputs(estimate, stdout);
+    free(estimate);
+    estimate = NULL;
+  } else if (strcmp(argv[2], "recommend") == 0 && (ret = d->recommend_partitioning(ctx, argv[3], &estimate)) == 0) {
+    printf("%s\n", estimate);
+    free(estimate);
+    estimate = NULL;
+  }
+  if (ret == 0 && d->estimate_partition_effect(ctx, argv[3], &estimate) == 0 && estimate) {
+    fputs(estimate, stdout);
+    free(estimate);
+  }
+  d->destroy_context(ctx);
+  plugin->deinit(NULL);
+  return ret;
+}
+EOF
+REGRESSION_FAILED=0
+if gcc -o "$REGRESSION_DIR/partition_regression" "$REGRESSION_DIR/partition_regression.c" -ldl; then
+    cd "$REGRESSION_DIR"
+
+    # A row image with one value longer than any line buffer must not stall the stream
+    python3 -c "
+rows = []
+for i in range(19):
+    value = 'x' * 5000 if i == 4 else 'v%d' % i
+    rows.append('### INSERT INTO \`db\`.\`t1\`\n### SET\n###   @1=%d\n###   @2=\'%s\'\n' % (i, value))
+open('long_rows.txt', 'w').write(''.join(rows) + '# at 999\n')
+"
+    if ./partition_regression "$PLUGIN_SO" stream db.t1 long_rows.txt id,name | grep -q "(38 row changes applied)"; then
+        echo "✓ Change stream applies every event past a 5000-byte value"
+    else
+        echo "✗ Change stream stopped at a long row image"
+        REGRESSION_FAILED=1
+    fi
+
+    # Quoted newlines must not shift chunk boundaries: the row count may not depend on the thread count
+    python3 -c "
+q = chr(34)
+rows = ['id,note,city\n']
+for i in range(400000):
+    note = q + 'a\nb' + 'x' * (i % 13) + '\nc ' + q * 2 + 'q' + q * 2 + ',\nd' + q if i % 2 == 0 else 'plain note %d' % i
+    rows.append('%d,%s,c%d\n' % (i, note, i % 50))
+open('quoted.csv', 'w').write(''.join(rows))
+"
+    ROWS_ONE=$(./partition_regression "$PLUGIN_SO" export db.quoted quoted.csv "" 1 | grep "Rows:")
+    ROWS_EIGHT=$(./partition_regression "$PLUGIN_SO" export db.quoted quoted.csv "" 8 | grep "Rows:")
+    if [ "$ROWS_ONE" = "- Rows: 400000" ] && [ "$ROWS_EIGHT" = "$ROWS_ONE" ]; then
+        echo "✓ Export analysis counts 400000 rows with quoted newlines on 1 and 8 threads"
+    else
+        echo "✗ Export row count depends on chunking: '$ROWS_ONE' vs '$ROWS_EIGHT'"
+        REGRESSION_FAILED=1
+    fi
+
+    # A file cut right after an event header must resume at that header, not after it
+    printf '### INSERT INTO `db`.`cut`\n' > cut_rows.txt
+    ./partition_regression "$PLUGIN_SO" stream db.cut cut_rows.txt id > /dev/null
+    printf '### SET\n###   @1=42\n# at 100\n' >> cut_rows.txt
+    if ./partition_regression "$PLUGIN_SO" stream db.cut cut_rows.txt id | grep -q "Rows: 1000001"; then
+        echo "✓ Change stream cut after an event header applies the row on resume"
+    else
+        echo "✗ Change stream dropped the row of an event cut after its header"
+        REGRESSION_FAILED=1
+    fi
+
+    # A resample keeps the row count measured by an export scan
+    printf 'id,name\n1,a\n2,b\n3,c\n' > small.csv
+    ./partition_regression "$PLUGIN_SO" export db.small small.csv > /dev/null
+    if ./partition_regression "$PLUGIN_SO" analyze db.small - | grep -q "Rows: 3$"; then
+        echo "✓ Table analysis keeps the row count measured by an export scan"
+    else
+        echo "✗ Table analysis replaced the measured row count"
+        REGRESSION_FAILED=1
+    fi
+
+    # Prefix lengths and DESC survive the regenerated DDL and count in redundancy checks
+    ADVICE=$(./partition_regression "$PLUGIN_SO" advise db.orders_log 'PRIMARY KEY (id), UNIQUE KEY uk_ext (external_id(32)), KEY k1 (a, b), KEY k2 (a, b DESC)')
+    if echo "$ADVICE" | grep -q "ADD UNIQUE KEY uk_ext (external_id(32), created_at)" && ! echo "$ADVICE" | grep -q "duplicate of"; then
+        echo "✓ Index advice keeps column prefix lengths and sort direction"
+    else
+        echo "✗ Index advice dropped a prefix length or sort direction"
+        REGRESSION_FAILED=1
+    fi
+
+    # Statements longer than 4 KB, quoted semicolons and trailing comments must not split a statement
+    python3 -c "
+rows = []
+for i in range(200):
+    pad = ' ' * 4090 if i % 2 else ''
+    rows.append(\"SELECT * FROM events_log WHERE note = 'a;b' AND%s\n  -- lookup\n  tenant_id = %d; # done\n\" % (pad, i % 7))
+open('workload.sql', 'w').write(''.join(rows))
+"
+    ./partition_regression "$PLUGIN_SO" replay db.events_log workload.sql > /dev/null
+    if ./partition_regression "$PLUGIN_SO" advise db.events_log 'PRIMARY KEY (id, created_at)' | grep -q "200 equality lookups on tenant_id"; then
+        echo "✓ Workload replay keeps long statements with quoted semicolons whole"
+    else
+        echo "✗ Workload replay split a statement at a quoted semicolon or line buffer"
+        REGRESSION_FAILED=1
+    fi
+
+    # Repeated RANGE key values collapse boundaries: the estimate must count the partitions the script defines
+    python3 -c "
+rows = []
+for i in range(2000):
+    rows.append('### INSERT INTO \`db\`.\`users\`\n### SET\n###   @1=%d\n' % (7 if i % 20 else i))
+open('skewed_rows.txt', 'w').write(''.join(rows) + '# at 999\n')
+"
+    PLANNED=$(PARTITION_TARGET_BYTES=1048576 ./partition_regression "$PLUGIN_SO" stream db.users skewed_rows.txt id | sed -n 's/^- Partition count: \([0-9]*\).*/\1/p')
+    SCRIPTED=$(PARTITION_TARGET_BYTES=1048576 ./partition_regression "$PLUGIN_SO" recommend db.users - | grep -c "PARTITION p")
+    LAST=$(PARTITION_TARGET_BYTES=1048576 ./partition_regression "$PLUGIN_SO" recommend db.users - | grep -o "PARTITION p[0-9]* VALUES LESS THAN MAXVALUE")
+    if [ -n "$PLANNED" ] && [ "$PLANNED" = "$SCRIPTED" ] && [ "$LAST" = "PARTITION p$PLANNED VALUES LESS THAN MAXVALUE" ]; then
+        echo "✓ RANGE script defines the $PLANNED partitions the estimate reports"
+    else
+        echo "✗ RANGE estimate reports '$PLANNED' partitions but the script defines $SCRIPTED"
+        REGRESSION_FAILED=1
+    fi
+
+    cd - > /dev/null
+else
+    echo "✗ Failed to compile regression harness"
+    REGRESSION_FAILED=1
+fi
+rm -rf "$REGRESSION_DIR"
+if [ $REGRESSION_FAILED -ne 0 ]; then
+    exit 1
+fi
+
 echo "\nTest completed successfully!"
 echo "Intelligent partition plugin is ready for use."
 echo "To install the plugin, copy it to MySQL plugin directory and run:"